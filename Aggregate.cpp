@@ -0,0 +1,364 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "Aggregate.hpp"
+#include "FileTable.hpp"
+#include "ParallelFor.hpp"
+#include "Preorder.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <string_view>
+#include <unordered_map>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace fsdb {
+namespace {
+// Rows handed to a thread at a time.
+constexpr std::size_t kChunkRows = 64 * 1024;
+// Rows per kernel pass: bucket indices for a batch are computed in one
+// loop the compiler can vectorise, then added up in a second.
+constexpr std::size_t kBatchRows = 256;
+constexpr std::uint32_t kNone = static_cast<std::uint32_t>(-1);
+// Extensions longer than this don't count as extensions.
+constexpr std::size_t kMaxExtension = 16;
+
+constexpr std::time_t kDay = 24 * 60 * 60;
+constexpr std::time_t kAgeLimits[] = {
+    0, kDay, 7 * kDay, 30 * kDay, 91 * kDay, 365 * kDay, 730 * kDay,
+    1826 * kDay};
+char const* const kAgeNames[] = {
+    "future",     "< 1 day",   "< 1 week",   "< 1 month", "< 3 months",
+    "< 1 year",   "< 2 years", "< 5 years", ">= 5 years"};
+constexpr std::size_t kAgeBuckets = std::size(kAgeNames);
+constexpr std::size_t kSizeBuckets = 65;
+
+int bit_width(std::uint64_t value) {
+#if defined(__GNUC__)
+  return value ? 64 - __builtin_clzll(value) : 0;
+#elif defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  return _BitScanReverse64(&index, value) ? int(index) + 1 : 0;
+#else
+  int width = 0;
+  for(; value; value >>= 1) {
+    ++width;
+  }
+  return width;
+#endif
+}
+
+// 2^power bytes in the largest whole unit.
+std::string power_of_two(int power) {
+  static char const* const units[] = {"B",   "KiB", "MiB", "GiB",
+                                      "TiB", "PiB", "EiB"};
+  return std::to_string(1u << (power % 10)) + " " + units[power / 10];
+}
+
+std::string size_bucket_name(std::size_t bucket) {
+  if(bucket == 0) {
+    return "0 B";
+  }
+  return power_of_two(int(bucket) - 1) + " - " + power_of_two(int(bucket));
+}
+
+// Totals per group, indexed densely.
+struct Totals {
+  std::vector<std::uint64_t> files;
+  std::vector<std::uint64_t> bytes;
+
+  void resize(std::size_t groups) {
+    files.resize(groups);
+    bytes.resize(groups);
+  }
+
+  void add(Totals const& other) {
+    resize(std::max(files.size(), other.files.size()));
+    for(std::size_t g = 0; g < other.files.size(); ++g) {
+      files[g] += other.files[g];
+      bytes[g] += other.bytes[g];
+    }
+  }
+};
+
+// Hands out chunks of rows to threads, each aggregating into its own
+// Partial, and returns the partials.
+template <typename Partial, typename Kernel>
+std::vector<Partial> run_partials(
+    std::size_t rows, std::size_t threads, Partial const& empty,
+    Kernel const& kernel) {
+  auto chunks = (rows + kChunkRows - 1) / kChunkRows;
+  threads = std::max<std::size_t>(1, std::min(thread_count(threads), chunks));
+  std::vector<Partial> partials(threads, empty);
+  parallel_for_workers(
+      chunks, threads, [&](std::size_t c, std::size_t worker) {
+        kernel(
+            c * kChunkRows, std::min(rows, (c + 1) * kChunkRows),
+            partials[worker]);
+      });
+  return partials;
+}
+
+// Adds up rows [begin, end) into totals by a per row bucket. Directories are
+// masked out rather than branched around.
+template <typename Bucket>
+void add_batches(
+    FileTable const& table, bool directories, std::size_t begin,
+    std::size_t end, Totals& totals, Bucket const& bucket) {
+  auto const* sizes = table.sizes().data();
+  auto const* is_directory = table.directories().data();
+  std::uint8_t buckets[kBatchRows];
+  for(auto first = begin; first < end; first += kBatchRows) {
+    auto n = std::min(kBatchRows, end - first);
+    for(std::size_t i = 0; i < n; ++i) {
+      buckets[i] = bucket(first + i);
+    }
+    for(std::size_t i = 0; i < n; ++i) {
+      std::uint64_t keep = directories | !is_directory[first + i];
+      totals.files[buckets[i]] += keep;
+      totals.bytes[buckets[i]] += keep * sizes[first + i];
+    }
+  }
+}
+
+std::vector<AggregateGroup> bucket_groups(
+    std::vector<Totals> const& partials, std::size_t buckets,
+    std::string (*name)(std::size_t)) {
+  Totals totals;
+  totals.resize(buckets);
+  for(auto&& p : partials) {
+    totals.add(p);
+  }
+  std::vector<AggregateGroup> groups;
+  for(std::size_t b = 0; b < buckets; ++b) {
+    if(totals.files[b]) {
+      groups.push_back({name(b), totals.files[b], totals.bytes[b]});
+    }
+  }
+  return groups;
+}
+
+void largest_first(std::vector<AggregateGroup>& groups) {
+  std::sort(
+      groups.begin(), groups.end(),
+      [](AggregateGroup const& a, AggregateGroup const& b) {
+        return a.bytes != b.bytes ? a.bytes > b.bytes : a.key < b.key;
+      });
+}
+
+std::string_view extension(std::string_view name) {
+  auto dot = name.rfind('.');
+  // Dot files like .bashrc have no extension.
+  if(dot == std::string_view::npos || dot == 0 ||
+     name.size() - dot - 1 > kMaxExtension) {
+    return {};
+  }
+  return name.substr(dot + 1);
+}
+
+// Extensions up to 8 bytes, lower cased and packed into an integer, so the
+// common case hashes a word rather than a string.
+bool pack_extension(std::string_view ext, std::uint64_t& key) {
+  if(ext.size() > 8) {
+    return false;
+  }
+  key = 0;
+  for(std::size_t i = 0; i < ext.size(); ++i) {
+    auto c = static_cast<unsigned char>(ext[i]);
+    c = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    key |= std::uint64_t(c) << (8 * i);
+  }
+  return true;
+}
+
+std::string lower(std::string_view s) {
+  std::string out(s);
+  for(auto& c : out) {
+    c = c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+  }
+  return out;
+}
+
+struct ExtensionTotals {
+  std::unordered_map<std::uint64_t, std::uint32_t> packed;
+  std::unordered_map<std::string, std::uint32_t> long_names;
+  Totals totals;
+  std::uint64_t last_key = 0;
+  std::uint32_t last_group = kNone;
+
+  std::uint32_t group(std::string_view ext) {
+    std::uint64_t key;
+    auto next = static_cast<std::uint32_t>(totals.files.size());
+    std::uint32_t g;
+    if(pack_extension(ext, key)) {
+      // Runs of one extension, no extension above all, are common.
+      if(key == last_key && last_group != kNone) {
+        return last_group;
+      }
+      g = packed.emplace(key, next).first->second;
+      last_key = key;
+      last_group = g;
+    }
+    else {
+      g = long_names.emplace(lower(ext), next).first->second;
+    }
+    if(g == next) {
+      totals.resize(next + 1);
+    }
+    return g;
+  }
+};
+
+std::vector<AggregateGroup> by_extension(
+    FileTable const& table, AggregateOptions const& options,
+    std::size_t threads) {
+  auto partials = run_partials(
+      table.size(), threads, ExtensionTotals(),
+      [&](std::size_t begin, std::size_t end, ExtensionTotals& partial) {
+        auto const& sizes = table.sizes();
+        auto const& directories = table.directories();
+        for(auto r = begin; r < end; ++r) {
+          std::uint64_t keep = options.directories | !directories[r];
+          auto g = partial.group(extension(table.name(r)));
+          partial.totals.files[g] += keep;
+          partial.totals.bytes[g] += keep * sizes[r];
+        }
+      });
+
+  std::unordered_map<std::string, AggregateGroup> merged;
+  for(auto&& p : partials) {
+    auto add = [&](std::string key, std::uint32_t g) {
+      auto& group = merged[key];
+      group.key = std::move(key);
+      group.files += p.totals.files[g];
+      group.bytes += p.totals.bytes[g];
+    };
+    for(auto&& [key, g] : p.packed) {
+      std::string name;
+      for(auto k = key; k; k >>= 8) {
+        name.push_back(static_cast<char>(k & 0xff));
+      }
+      add(std::move(name), g);
+    }
+    for(auto&& [key, g] : p.long_names) {
+      add(key, g);
+    }
+  }
+
+  std::vector<AggregateGroup> groups;
+  for(auto&& m : merged) {
+    if(m.second.files) {
+      groups.push_back(std::move(m.second));
+    }
+  }
+  largest_first(groups);
+  return groups;
+}
+
+std::vector<AggregateGroup> by_subtree(
+    FileTable const& table, AggregateOptions const& options,
+    std::size_t threads) {
+  // Laid out depth first, everything below a position is the slice after
+  // it, so a group at the cut off depth totals its slice of running sums
+  // and a shallower one totals just itself.
+  auto tree = preorder(table, threads);
+  auto rows = table.size();
+  auto const& sizes = table.sizes();
+  auto const& directories = table.directories();
+  std::vector<std::uint64_t> files(rows + 1, 0);
+  std::vector<std::uint64_t> bytes(rows + 1, 0);
+  std::vector<int> depth(rows);
+  for(std::size_t p = 0; p < rows; ++p) {
+    auto r = tree.order[p];
+    std::uint64_t keep = options.directories | !directories[r];
+    files[p + 1] = files[p] + keep;
+    bytes[p + 1] = bytes[p] + keep * sizes[r];
+    auto parent = tree.parents[p];
+    depth[p] = parent == kNoParentRow
+                   ? 0
+                   : std::min(depth[parent], options.depth) + 1;
+  }
+
+  std::vector<AggregateGroup> groups;
+  for(std::size_t p = 0; p < rows; ++p) {
+    if(depth[p] > options.depth) {
+      continue;
+    }
+    std::size_t end = depth[p] == options.depth ? tree.ends[p] : p + 1;
+    if(files[end] == files[p]) {
+      continue;
+    }
+    std::string path(table.name(tree.order[p]));
+    for(auto a = tree.parents[p]; a != kNoParentRow; a = tree.parents[a]) {
+      path.insert(0, std::string(table.name(tree.order[a])) + "/");
+    }
+    groups.push_back(
+        {std::move(path), files[end] - files[p], bytes[end] - bytes[p]});
+  }
+  largest_first(groups);
+  return groups;
+}
+} // namespace
+
+std::vector<AggregateGroup> aggregate(
+    FileTable const& table, AggregateOptions const& options) {
+  auto threads = thread_count(options.threads);
+  switch(options.group_by) {
+    case GroupBy::Extension:
+      return by_extension(table, options, threads);
+    case GroupBy::Subtree:
+      return by_subtree(table, options, threads);
+    case GroupBy::SizeBucket: {
+      Totals empty;
+      empty.resize(kSizeBuckets);
+      auto const* sizes = table.sizes().data();
+      auto partials = run_partials(
+          table.size(), threads, empty,
+          [&](std::size_t begin, std::size_t end, Totals& partial) {
+            add_batches(
+                table, options.directories, begin, end, partial,
+                [&](std::size_t r) { return bit_width(sizes[r]); });
+          });
+      return bucket_groups(partials, kSizeBuckets, size_bucket_name);
+    }
+    case GroupBy::AgeBucket: {
+      Totals empty;
+      empty.resize(kAgeBuckets);
+      auto now = options.now ? options.now : std::time(nullptr);
+      auto const* modified = table.modified().data();
+      auto partials = run_partials(
+          table.size(), threads, empty,
+          [&](std::size_t begin, std::size_t end, Totals& partial) {
+            add_batches(
+                table, options.directories, begin, end, partial,
+                [&](std::size_t r) {
+                  // Counting the limits passed keeps this branch free.
+                  auto age = now - modified[r];
+                  int bucket = 0;
+                  for(auto limit : kAgeLimits) {
+                    bucket += age >= limit;
+                  }
+                  return bucket;
+                });
+          });
+      return bucket_groups(
+          partials, kAgeBuckets,
+          [](std::size_t b) { return std::string(kAgeNames[b]); });
+    }
+  }
+  return {};
+}
+
+} // namespace fsdb
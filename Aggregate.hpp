@@ -0,0 +1,68 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_AGGREGATE_HPP
+#define FSDB_AGGREGATE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+namespace fsdb {
+
+class FileTable;
+
+enum class GroupBy {
+  // Lower cased text after the last dot, "" for none.
+  Extension,
+  // Powers of two: [0], [1], [2, 4), [4, 8) and so on.
+  SizeBucket,
+  // Time since last modified: under a day, week, month, quarter, year, two
+  // years, five years, or older. Times in the future get a bucket too.
+  AgeBucket,
+  // The ancestor at a given depth below the roots.
+  Subtree,
+};
+
+struct AggregateOptions {
+  GroupBy group_by = GroupBy::Extension;
+  // AgeBucket measures back from here; zero means now.
+  std::time_t now = 0;
+  // Subtree groups files under their ancestor this deep, roots being 0.
+  // Shallower files group on their own.
+  int depth = 1;
+  // Count directories as well as files.
+  bool directories = false;
+  // Zero uses one per core.
+  std::size_t threads = 0;
+};
+
+struct AggregateGroup {
+  // The extension, a bucket's range, or a subtree's path.
+  std::string key;
+  std::uint64_t files = 0;
+  std::uint64_t bytes = 0;
+};
+
+// Groups a table's files and totals each group. The table is split into
+// chunks aggregated on a pool of threads, each into its own partial
+// totals, which are merged at the end. Buckets come back in bucket order,
+// extensions and subtrees largest first. Empty groups are left out.
+std::vector<AggregateGroup> aggregate(
+    FileTable const& table, AggregateOptions const& options = {});
+
+} // namespace fsdb
+
+#endif // FSDB_AGGREGATE_HPP
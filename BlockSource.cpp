@@ -0,0 +1,406 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "BlockSource.hpp"
+#include "IoThrottle.hpp"
+
+#include <algorithm>
+#include <boost/throw_exception.hpp>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <boost/nowide/convert.hpp>
+#include <boost/winapi/access_rights.hpp>
+#include <boost/winapi/error_codes.hpp>
+#include <boost/winapi/file_management.hpp>
+#include <boost/winapi/get_last_error.hpp>
+#include <boost/winapi/handles.hpp>
+#include <boost/winapi/overlapped.hpp>
+#else
+#include <aio.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+#endif
+
+namespace fsdb {
+
+AlignedBuffer::AlignedBuffer(std::size_t size) {
+  resize(size);
+}
+
+void AlignedBuffer::resize(std::size_t size) {
+  if(size > capacity_) {
+    data_.reset(static_cast<std::byte*>(
+        ::operator new(size, std::align_val_t(kAlignment))));
+    capacity_ = size;
+  }
+  size_ = size;
+}
+
+void AlignedBuffer::Deleter::operator()(std::byte* p) const {
+  ::operator delete(p, std::align_val_t(kAlignment));
+}
+
+void BlockSource::read(std::uint64_t offset, void* dest, std::size_t size) const {
+  auto const a = alignment();
+  auto begin = offset & ~std::uint64_t(a - 1);
+  auto end = (offset + size + a - 1) & ~std::uint64_t(a - 1);
+  if(begin == offset && end == offset + size &&
+     reinterpret_cast<std::uintptr_t>(dest) % a == 0) {
+    if(read_aligned(offset, dest, size) != size) {
+      BOOST_THROW_EXCEPTION(
+          std::runtime_error("Failed to read correct number of bytes."));
+    }
+    return;
+  }
+
+  AlignedBuffer bounce(end - begin);
+  auto read = read_aligned(begin, bounce.data(), bounce.size());
+  if(read < offset + size - begin) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("Failed to read correct number of bytes."));
+  }
+  std::memcpy(dest, bounce.data() + (offset - begin), size);
+}
+
+namespace {
+class CompletedRead : public BlockSource::PendingRead {
+ public:
+  void wait() override {
+  }
+};
+} // namespace
+
+std::unique_ptr<BlockSource::PendingRead> BlockSource::read_async(
+    std::uint64_t offset, void* dest, std::size_t size) const {
+  read(offset, dest, size);
+  return std::make_unique<CompletedRead>();
+}
+
+MappedRegion BlockSource::map(std::uint64_t, std::size_t) const {
+  return {};
+}
+
+namespace {
+// Reports how long a read took, from start to finish, once it's waited on.
+class ThrottledRead : public BlockSource::PendingRead {
+ public:
+  ThrottledRead(
+      std::unique_ptr<BlockSource::PendingRead> read, IoThrottle& throttle)
+      : read_(std::move(read))
+      , throttle_(&throttle)
+      , start_(std::chrono::steady_clock::now()) {
+  }
+
+  void wait() override {
+    read_->wait();
+    throttle_->completed(std::chrono::steady_clock::now() - start_);
+  }
+
+ private:
+  std::unique_ptr<BlockSource::PendingRead> read_;
+  IoThrottle* throttle_;
+  std::chrono::steady_clock::time_point start_;
+};
+} // namespace
+
+ThrottledBlockSource::ThrottledBlockSource(
+    std::unique_ptr<BlockSource> source, IoThrottle& throttle)
+    : source_(std::move(source))
+    , throttle_(&throttle) {
+}
+
+std::size_t ThrottledBlockSource::alignment() const {
+  return source_->alignment();
+}
+
+std::unique_ptr<BlockSource::PendingRead> ThrottledBlockSource::read_async(
+    std::uint64_t offset, void* dest, std::size_t size) const {
+  throttle_->before_read(size);
+  return std::make_unique<ThrottledRead>(
+      source_->read_async(offset, dest, size), *throttle_);
+}
+
+std::size_t ThrottledBlockSource::read_aligned(
+    std::uint64_t offset, void* dest, std::size_t size) const {
+  throttle_->before_read(size);
+  auto start = std::chrono::steady_clock::now();
+  auto bytes = source_->read_aligned(offset, dest, size);
+  throttle_->completed(std::chrono::steady_clock::now() - start);
+  return bytes;
+}
+
+MappedRegion::MappedRegion(void* base, std::size_t length, std::size_t offset)
+    : base_(base)
+    , length_(length)
+    , offset_(offset) {
+}
+
+MappedRegion::MappedRegion(MappedRegion&& other)
+    : base_(other.base_)
+    , length_(other.length_)
+    , offset_(other.offset_) {
+  other.base_ = nullptr;
+}
+
+MappedRegion& MappedRegion::operator=(MappedRegion&& other) {
+  if(this != &other) {
+    reset();
+    base_ = other.base_;
+    length_ = other.length_;
+    offset_ = other.offset_;
+    other.base_ = nullptr;
+  }
+  return *this;
+}
+
+MappedRegion::~MappedRegion() {
+  reset();
+}
+
+void MappedRegion::reset() {
+#ifndef _WIN32
+  if(base_) {
+    ::munmap(base_, length_);
+  }
+#endif
+  base_ = nullptr;
+  length_ = offset_ = 0;
+}
+
+#ifdef _WIN32
+
+Win32BlockSource::Win32BlockSource(std::wstring const& path) {
+  using namespace boost::winapi;
+  handle_ = CreateFileW(
+      path.c_str(), GENERIC_READ_, FILE_SHARE_READ_ | FILE_SHARE_WRITE_,
+      nullptr, OPEN_EXISTING_, FILE_FLAG_NO_BUFFERING_, nullptr);
+  if(handle_ == INVALID_HANDLE_VALUE_) {
+    handle_ = nullptr;
+    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to open volume"));
+  }
+}
+
+Win32BlockSource::~Win32BlockSource() {
+  if(handle_) {
+    boost::winapi::CloseHandle(handle_);
+  }
+}
+
+std::size_t Win32BlockSource::alignment() const {
+  // FILE_FLAG_NO_BUFFERING needs sector alignment; 4k covers 4Kn drives too.
+  return 4096;
+}
+
+std::size_t Win32BlockSource::read_aligned(
+    std::uint64_t offset, void* dest, std::size_t size) const {
+  // Positional reads through OVERLAPPED so concurrent readers don't race on
+  // the file pointer.
+  std::size_t total = 0;
+  auto out = static_cast<std::byte*>(dest);
+  while(total < size) {
+    boost::winapi::OVERLAPPED_ ov = {};
+    ov.Offset = static_cast<boost::winapi::DWORD_>(offset + total);
+    ov.OffsetHigh = static_cast<boost::winapi::DWORD_>((offset + total) >> 32);
+    boost::winapi::DWORD_ bytes_read = 0;
+    auto chunk = static_cast<boost::winapi::DWORD_>(
+        std::min<std::size_t>(size - total, 1u << 30));
+    if(!boost::winapi::ReadFile(handle_, out + total, chunk, &bytes_read, &ov)) {
+      if(boost::winapi::GetLastError() == boost::winapi::ERROR_HANDLE_EOF_) {
+        break;
+      }
+      BOOST_THROW_EXCEPTION(std::runtime_error("Failed to read volume"));
+    }
+    if(bytes_read == 0) {
+      break;
+    }
+    total += bytes_read;
+  }
+  return total;
+}
+
+std::unique_ptr<BlockSource> open_block_source(
+    std::string const& path, BlockSourceMode) {
+  return std::make_unique<Win32BlockSource>(boost::nowide::widen(path));
+}
+
+#else
+
+PosixBlockSource::PosixBlockSource(
+    std::string const& path, BlockSourceMode mode)
+    : mapped_(mode == BlockSourceMode::Mapped) {
+  bool direct_io = mode == BlockSourceMode::Direct;
+#ifdef O_DIRECT
+  if(direct_io) {
+    fd_ = ::open(path.c_str(), O_RDONLY | O_DIRECT | O_CLOEXEC);
+  }
+#endif
+  if(fd_ == -1) {
+    // Not every filesystem supports O_DIRECT (tmpfs, some FUSE mounts).
+    fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    direct_io = false;
+  }
+
+  if(fd_ == -1) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to open volume"));
+  }
+
+  if(direct_io) {
+    alignment_ = 4096;
+#ifdef BLKSSZGET
+    struct stat s;
+    int sector_size = 0;
+    if(::fstat(fd_, &s) == 0 && S_ISBLK(s.st_mode) &&
+       ::ioctl(fd_, BLKSSZGET, &sector_size) == 0 && sector_size > 0) {
+      alignment_ = sector_size;
+    }
+#endif
+  }
+}
+
+PosixBlockSource::~PosixBlockSource() {
+  if(fd_ != -1) {
+    ::close(fd_);
+  }
+}
+
+std::size_t PosixBlockSource::alignment() const {
+  return alignment_;
+}
+
+std::size_t PosixBlockSource::read_aligned(
+    std::uint64_t offset, void* dest, std::size_t size) const {
+  std::size_t total = 0;
+  auto out = static_cast<std::byte*>(dest);
+  while(total < size) {
+    auto r = ::pread(fd_, out + total, size - total, offset + total);
+    if(r == -1) {
+      if(errno == EINTR) {
+        continue;
+      }
+      BOOST_THROW_EXCEPTION(std::runtime_error("Failed to read volume"));
+    }
+    if(r == 0) {
+      break;
+    }
+    total += r;
+  }
+  return total;
+}
+
+namespace {
+class AioRead : public BlockSource::PendingRead {
+ public:
+  AioRead(PosixBlockSource const& source, int fd) : source_(&source) {
+    cb_.aio_fildes = fd;
+  }
+
+  ~AioRead() {
+    if(!done_ && ::aio_cancel(cb_.aio_fildes, &cb_) == AIO_NOTCANCELED) {
+      suspend();
+    }
+  }
+
+  bool start(std::uint64_t offset, void* dest, std::size_t size) {
+    cb_.aio_offset = offset;
+    cb_.aio_buf = dest;
+    cb_.aio_nbytes = size;
+    if(::aio_read(&cb_) != 0) {
+      done_ = true;
+      return false;
+    }
+    return true;
+  }
+
+  void wait() override {
+    if(done_) {
+      return;
+    }
+    suspend();
+    done_ = true;
+    auto r = ::aio_return(&cb_);
+    if(r < 0) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Failed to read volume"));
+    }
+
+    // Short reads are legal, so finish off whatever is left synchronously.
+    auto done = static_cast<std::size_t>(r);
+    if(done < cb_.aio_nbytes) {
+      source_->read(
+          cb_.aio_offset + done, static_cast<std::byte*>(
+                                     const_cast<void*>(cb_.aio_buf)) + done,
+          cb_.aio_nbytes - done);
+    }
+  }
+
+ private:
+  void suspend() {
+    aiocb const* list[] = {&cb_};
+    while(::aio_error(&cb_) == EINPROGRESS) {
+      ::aio_suspend(list, 1, nullptr);
+    }
+  }
+
+  PosixBlockSource const* source_;
+  aiocb cb_ = {};
+  bool done_ = false;
+};
+} // namespace
+
+std::unique_ptr<BlockSource::PendingRead> PosixBlockSource::read_async(
+    std::uint64_t offset, void* dest, std::size_t size) const {
+  auto const a = alignment_;
+  if(offset % a == 0 && size % a == 0 &&
+     reinterpret_cast<std::uintptr_t>(dest) % a == 0) {
+    auto pending = std::make_unique<AioRead>(*this, fd_);
+    if(pending->start(offset, dest, size)) {
+      return pending;
+    }
+  }
+  return BlockSource::read_async(offset, dest, size);
+}
+
+MappedRegion PosixBlockSource::map(std::uint64_t offset, std::size_t size) const {
+  if(!mapped_ || size == 0) {
+    return {};
+  }
+
+  static std::size_t const page_size = ::sysconf(_SC_PAGESIZE);
+  auto begin = offset & ~std::uint64_t(page_size - 1);
+  auto length = size + (offset - begin);
+  void* base = ::mmap(nullptr, length, PROT_READ, MAP_SHARED, fd_, begin);
+  if(base == MAP_FAILED) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to map volume"));
+  }
+  ::madvise(base, length, MADV_SEQUENTIAL);
+  return MappedRegion(base, length, offset - begin);
+}
+
+std::unique_ptr<BlockSource> open_block_source(
+    std::string const& path, BlockSourceMode mode) {
+  return std::make_unique<PosixBlockSource>(path, mode);
+}
+
+#endif
+
+} // namespace fsdb
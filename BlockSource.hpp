@@ -0,0 +1,218 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_BLOCKSOURCE_HPP
+#define FSDB_BLOCKSOURCE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace fsdb {
+
+class IoThrottle;
+
+// Heap buffer aligned well enough for unbuffered/direct reads.
+class AlignedBuffer {
+ public:
+  static constexpr std::size_t kAlignment = 4096;
+
+  AlignedBuffer() = default;
+  explicit AlignedBuffer(std::size_t size);
+
+  void resize(std::size_t size);
+
+  std::byte* data() {
+    return data_.get();
+  }
+
+  std::byte const* data() const {
+    return data_.get();
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+  std::byte* begin() {
+    return data();
+  }
+
+  std::byte* end() {
+    return data() + size_;
+  }
+
+ private:
+  struct Deleter {
+    void operator()(std::byte* p) const;
+  };
+
+  std::unique_ptr<std::byte[], Deleter> data_;
+  std::size_t size_ = 0;
+  std::size_t capacity_ = 0;
+};
+
+// Read-only memory mapping of part of a source. Empty if the source can't
+// be mapped.
+class MappedRegion {
+ public:
+  MappedRegion() = default;
+  MappedRegion(void* base, std::size_t length, std::size_t offset);
+  MappedRegion(MappedRegion&& other);
+  MappedRegion& operator=(MappedRegion&& other);
+  ~MappedRegion();
+
+  explicit operator bool() const {
+    return base_ != nullptr;
+  }
+
+  std::byte const* data() const {
+    return static_cast<std::byte const*>(base_) + offset_;
+  }
+
+  std::size_t size() const {
+    return length_ - offset_;
+  }
+
+ private:
+  void reset();
+
+  void* base_ = nullptr;
+  std::size_t length_ = 0;
+  std::size_t offset_ = 0;
+};
+
+enum class BlockSourceMode {
+  // Unbuffered reads straight from the device where supported.
+  Direct,
+  // Reads through the OS cache.
+  Buffered,
+  // Like Buffered, but consumers may map ranges instead of reading them,
+  // which avoids the copy entirely when the image is already cached.
+  Mapped,
+};
+
+// Random access, read-only view of a volume, image file or block device.
+// Reads are positional so a single source can be shared between threads.
+class BlockSource {
+ public:
+  // A read started by read_async().
+  class PendingRead {
+   public:
+    virtual ~PendingRead() = default;
+    // Blocks until the read has finished, throwing if it failed. dest must
+    // stay alive until then; destroying an unfinished read cancels it.
+    virtual void wait() = 0;
+  };
+
+  virtual ~BlockSource() = default;
+
+  // Reads exactly size bytes at offset into dest or throws. Requests that
+  // aren't aligned to alignment() are bounced through an aligned buffer.
+  void read(std::uint64_t offset, void* dest, std::size_t size) const;
+
+  // Starts a read of exactly size bytes and returns without waiting for it.
+  // Sources without asynchronous I/O read synchronously here.
+  virtual std::unique_ptr<PendingRead> read_async(
+      std::uint64_t offset, void* dest, std::size_t size) const;
+
+  // Maps a range for sequential access. Returns an empty region unless the
+  // source was opened with BlockSourceMode::Mapped.
+  virtual MappedRegion map(std::uint64_t offset, std::size_t size) const;
+
+  // Offset, size and buffer alignment the device needs for direct reads.
+  virtual std::size_t alignment() const = 0;
+
+ protected:
+  friend class ThrottledBlockSource;
+
+  // Returns the number of bytes read, which is only short at end of file.
+  virtual std::size_t read_aligned(
+      std::uint64_t offset, void* dest, std::size_t size) const = 0;
+};
+
+// Paces another source's reads through a throttle. Mapping is refused so
+// every access goes through a read that can be paced.
+class ThrottledBlockSource : public BlockSource {
+ public:
+  ThrottledBlockSource(
+      std::unique_ptr<BlockSource> source, IoThrottle& throttle);
+
+  std::size_t alignment() const override;
+
+  std::unique_ptr<PendingRead> read_async(
+      std::uint64_t offset, void* dest, std::size_t size) const override;
+
+ protected:
+  std::size_t read_aligned(
+      std::uint64_t offset, void* dest, std::size_t size) const override;
+
+ private:
+  std::unique_ptr<BlockSource> source_;
+  IoThrottle* throttle_;
+};
+
+#ifdef _WIN32
+// A volume or file opened unbuffered with CreateFileW, e.g. \\?\c:
+class Win32BlockSource : public BlockSource {
+ public:
+  explicit Win32BlockSource(std::wstring const& path);
+  ~Win32BlockSource();
+
+  std::size_t alignment() const override;
+
+ protected:
+  std::size_t read_aligned(
+      std::uint64_t offset, void* dest, std::size_t size) const override;
+
+ private:
+  void* handle_ = nullptr;
+};
+#else
+// An image file or block device read with pread(). Direct mode uses O_DIRECT
+// when the underlying filesystem supports it, otherwise falls back to
+// buffered reads.
+class PosixBlockSource : public BlockSource {
+ public:
+  explicit PosixBlockSource(
+      std::string const& path, BlockSourceMode mode = BlockSourceMode::Direct);
+  ~PosixBlockSource();
+
+  std::size_t alignment() const override;
+
+  // POSIX AIO, so several reads can be queued on the device at once.
+  std::unique_ptr<PendingRead> read_async(
+      std::uint64_t offset, void* dest, std::size_t size) const override;
+
+  MappedRegion map(std::uint64_t offset, std::size_t size) const override;
+
+ protected:
+  std::size_t read_aligned(
+      std::uint64_t offset, void* dest, std::size_t size) const override;
+
+ private:
+  int fd_ = -1;
+  std::size_t alignment_ = 1;
+  bool mapped_ = false;
+};
+#endif
+
+// Opens a path with the native source for this platform. Modes the platform
+// doesn't support fall back to Direct.
+std::unique_ptr<BlockSource> open_block_source(
+    std::string const& path, BlockSourceMode mode = BlockSourceMode::Direct);
+
+} // namespace fsdb
+
+#endif // FSDB_BLOCKSOURCE_HPP
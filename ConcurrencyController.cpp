@@ -0,0 +1,169 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "ConcurrencyController.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <ostream>
+
+namespace fsdb {
+namespace {
+// Reversals before settling on the best count, and how many intervals to
+// hold it before probing again.
+constexpr int kSettleReversals = 3;
+constexpr int kHoldIntervals = 25;
+// Weight of the newest sample in the smoothed throughput.
+constexpr double kSmoothing = 0.5;
+} // namespace
+
+ConcurrencyController::ConcurrencyController(
+    ConcurrencyOptions const& options)
+    : options_(options) {
+  options_.min_workers = std::max<std::size_t>(1, options_.min_workers);
+  options_.max_workers = std::max(options_.min_workers, options_.max_workers);
+  active_ = std::clamp(
+      options_.initial_workers, options_.min_workers, options_.max_workers);
+  throughput_.resize(options_.max_workers + 1);
+}
+
+void ConcurrencyController::record(
+    std::size_t operations, std::chrono::nanoseconds latency) {
+  operations_.fetch_add(operations, std::memory_order_relaxed);
+  latency_ns_.fetch_add(latency.count(), std::memory_order_relaxed);
+}
+
+bool ConcurrencyController::wait_for_slot(std::size_t worker) {
+  if(worker < active()) {
+    return true;
+  }
+
+  std::unique_lock<std::mutex> lk(mutex_);
+  changed_.wait(lk, [&] { return worker < active() || stopped_; });
+  return worker < active() && !stopped_;
+}
+
+void ConcurrencyController::run() {
+  auto start = std::chrono::steady_clock::now();
+  auto last = start;
+  std::uint64_t last_operations = 0;
+  std::uint64_t last_latency = 0;
+  std::unique_lock<std::mutex> lk(mutex_);
+  while(!changed_.wait_for(lk, options_.interval, [this] { return stopped_; })) {
+    auto now = std::chrono::steady_clock::now();
+    auto operations = operations_.load(std::memory_order_relaxed);
+    auto latency = latency_ns_.load(std::memory_order_relaxed);
+    auto seconds = std::chrono::duration<double>(now - last).count();
+    auto completed = operations - last_operations;
+
+    ConcurrencySample sample;
+    sample.elapsed =
+        std::chrono::duration_cast<std::chrono::milliseconds>(now - start);
+    sample.workers = active();
+    sample.operations_per_second = completed / seconds;
+    sample.mean_latency_us =
+        completed ? (latency - last_latency) / 1000.0 / completed : 0;
+    last = now;
+    last_operations = operations;
+    last_latency = latency;
+
+    lk.unlock();
+    adjust(sample);
+    samples_.push_back(sample);
+    lk.lock();
+  }
+}
+
+void ConcurrencyController::stop() {
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    stopped_ = true;
+  }
+  changed_.notify_all();
+}
+
+std::size_t ConcurrencyController::best() const {
+  auto best = std::max_element(throughput_.begin(), throughput_.end());
+  if(*best == 0) {
+    return active();
+  }
+  return best - throughput_.begin();
+}
+
+void ConcurrencyController::adjust(ConcurrencySample const& sample) {
+  auto&& smoothed = throughput_[sample.workers];
+  smoothed = smoothed == 0 ? sample.operations_per_second
+                           : kSmoothing * sample.operations_per_second +
+                                 (1 - kSmoothing) * smoothed;
+  if(options_.min_workers == options_.max_workers) {
+    return;
+  }
+
+  if(settled_) {
+    if(++held_ < kHoldIntervals) {
+      return;
+    }
+    settled_ = false;
+    held_ = 0;
+    reversals_ = 0;
+  }
+  else if(!samples_.empty()) {
+    auto&& previous = samples_.back();
+    auto gain = (sample.operations_per_second - previous.operations_per_second) /
+                std::max(previous.operations_per_second, 1.0);
+    bool worse = gain < -options_.min_gain;
+    bool flat = !worse && gain <= options_.min_gain;
+    bool queueing =
+        flat && sample.mean_latency_us >
+                    previous.mean_latency_us * (1 + options_.latency_tolerance);
+    if(worse || (queueing && direction_ > 0)) {
+      direction_ = -direction_;
+      if(++reversals_ >= kSettleReversals) {
+        settled_ = true;
+        set_active(best());
+        return;
+      }
+    }
+  }
+
+  auto next = static_cast<std::ptrdiff_t>(active()) + direction_;
+  if(next < static_cast<std::ptrdiff_t>(options_.min_workers) ||
+     next > static_cast<std::ptrdiff_t>(options_.max_workers)) {
+    direction_ = -direction_;
+    next = static_cast<std::ptrdiff_t>(active()) + direction_;
+  }
+  set_active(next);
+}
+
+void ConcurrencyController::set_active(std::size_t workers) {
+  {
+    std::lock_guard<std::mutex> lk(mutex_);
+    active_ = workers;
+  }
+  changed_.notify_all();
+}
+
+void ConcurrencyController::report(std::ostream& out) const {
+  out << "concurrency: " << samples_.size() << " samples, best "
+      << best() << " workers between " << options_.min_workers << " and "
+      << options_.max_workers << ".\n";
+  for(auto&& s : samples_) {
+    out << std::setw(8) << s.elapsed.count() << "ms " << std::setw(3)
+        << s.workers << " workers " << std::setw(10)
+        << static_cast<std::uint64_t>(s.operations_per_second) << " ops/s "
+        << std::fixed << std::setprecision(1) << std::setw(8)
+        << s.mean_latency_us << "us\n";
+  }
+}
+
+} // namespace fsdb
@@ -0,0 +1,108 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_CONCURRENCYCONTROLLER_HPP
+#define FSDB_CONCURRENCYCONTROLLER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+#include <vector>
+
+namespace fsdb {
+
+struct ConcurrencyOptions {
+  std::size_t min_workers = 1;
+  std::size_t max_workers = 1;
+  // Where the search starts, clamped to the bounds.
+  std::size_t initial_workers = 1;
+  // How long each worker count is measured before the next step.
+  std::chrono::milliseconds interval{200};
+  // Relative change in throughput that counts as real rather than noise.
+  double min_gain = 0.05;
+  // Latency rising by this fraction while throughput stays flat means
+  // extra workers are only queueing on the device.
+  double latency_tolerance = 0.25;
+};
+
+struct ConcurrencySample {
+  std::chrono::milliseconds elapsed;
+  std::size_t workers;
+  double operations_per_second;
+  double mean_latency_us;
+};
+
+// Hill-climbs the number of active workers in a pool. Workers report the
+// operations they complete and the time spent blocked in them; run()
+// samples throughput every interval and moves the active count one step,
+// reversing when a step makes things worse. After a few reversals it
+// settles on the best count seen, then probes again now and then in case
+// the cache warms up or the load on the device changes.
+class ConcurrencyController {
+ public:
+  explicit ConcurrencyController(ConcurrencyOptions const& options);
+
+  // Called by workers as they complete operations.
+  void record(std::size_t operations, std::chrono::nanoseconds latency);
+
+  // Parks worker while it is beyond the active count. Returns false once
+  // the controller is stopped and the worker should exit.
+  bool wait_for_slot(std::size_t worker);
+
+  std::size_t active() const {
+    return active_.load(std::memory_order_relaxed);
+  }
+
+  // Samples and adjusts until stop(). Meant to run on its own thread.
+  void run();
+  void stop();
+
+  // The worker count with the best throughput seen so far.
+  std::size_t best() const;
+
+  // Every sample taken; only safe to read once run() has returned.
+  std::vector<ConcurrencySample> const& samples() const {
+    return samples_;
+  }
+
+  void report(std::ostream& out) const;
+
+ private:
+  void adjust(ConcurrencySample const& sample);
+  void set_active(std::size_t workers);
+
+  ConcurrencyOptions options_;
+  std::atomic<std::uint64_t> operations_{0};
+  std::atomic<std::uint64_t> latency_ns_{0};
+  std::atomic<std::size_t> active_;
+  mutable std::mutex mutex_;
+  std::condition_variable changed_;
+  bool stopped_ = false;
+
+  // Hill climbing state, only touched by run().
+  std::vector<ConcurrencySample> samples_;
+  // Smoothed throughput per worker count.
+  std::vector<double> throughput_;
+  int direction_ = 1;
+  int reversals_ = 0;
+  bool settled_ = false;
+  int held_ = 0;
+};
+
+} // namespace fsdb
+
+#endif // FSDB_CONCURRENCYCONTROLLER_HPP
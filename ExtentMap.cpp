@@ -0,0 +1,104 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "ExtentMap.hpp"
+
+#include <algorithm>
+#include <boost/core/ignore_unused.hpp>
+#include <numeric>
+
+#ifdef __linux__
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#endif
+
+namespace fsdb {
+
+std::vector<std::size_t> plan_read_order(std::vector<FileExtents> const& files) {
+  std::vector<std::size_t> order(files.size());
+  std::iota(order.begin(), order.end(), std::size_t(0));
+  auto start = [&](std::size_t i) {
+    auto&& extents = files[i].extents;
+    return extents.empty() ? 0 : extents.front().physical;
+  };
+  std::stable_sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) {
+    return start(a) < start(b);
+  });
+  return order;
+}
+
+std::uint64_t seek_distance(
+    std::vector<FileExtents> const& files,
+    std::vector<std::size_t> const& order) {
+  std::uint64_t distance = 0;
+  std::uint64_t head = 0;
+  for(auto i : order) {
+    for(auto&& e : files[i].extents) {
+      distance += e.physical > head ? e.physical - head : head - e.physical;
+      head = e.physical + e.length;
+    }
+  }
+  return distance;
+}
+
+#ifndef _WIN32
+std::vector<PhysicalExtent> fiemap_extents(char const* path) {
+  std::vector<PhysicalExtent> extents;
+#ifdef __linux__
+  int fd = ::open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if(fd < 0) {
+    return extents;
+  }
+
+  // Fetched a batch at a time; heavily fragmented files need several calls.
+  constexpr std::uint32_t kExtentsPerCall = 64;
+  std::vector<std::uint8_t> buffer(
+      sizeof(fiemap) + kExtentsPerCall * sizeof(fiemap_extent));
+  auto map = reinterpret_cast<fiemap*>(buffer.data());
+  std::uint64_t start = 0;
+  bool last = false;
+  while(!last) {
+    std::memset(buffer.data(), 0, buffer.size());
+    map->fm_start = start;
+    map->fm_length = FIEMAP_MAX_OFFSET - start;
+    map->fm_extent_count = kExtentsPerCall;
+    if(::ioctl(fd, FS_IOC_FIEMAP, map) != 0 || map->fm_mapped_extents == 0) {
+      break;
+    }
+
+    for(std::uint32_t i = 0; i < map->fm_mapped_extents; ++i) {
+      auto&& e = map->fm_extents[i];
+      // Data without a stable block address can't be planned around.
+      constexpr std::uint32_t kUnplaced = FIEMAP_EXTENT_UNKNOWN |
+                                          FIEMAP_EXTENT_DELALLOC |
+                                          FIEMAP_EXTENT_DATA_INLINE;
+      if(!(e.fe_flags & kUnplaced)) {
+        extents.push_back({e.fe_logical, e.fe_physical, e.fe_length});
+      }
+      start = e.fe_logical + e.fe_length;
+      last = e.fe_flags & FIEMAP_EXTENT_LAST;
+    }
+  }
+  ::close(fd);
+#else
+  boost::ignore_unused(path);
+#endif
+  return extents;
+}
+#endif
+
+} // namespace fsdb
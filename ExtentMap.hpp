@@ -0,0 +1,57 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_EXTENTMAP_HPP
+#define FSDB_EXTENTMAP_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fsdb {
+
+// Where a piece of a file's content lives on its volume.
+struct PhysicalExtent {
+  std::uint64_t logical; // Byte offset within the file.
+  std::uint64_t physical; // Byte offset on the volume.
+  std::uint64_t length;
+};
+
+struct FileExtents {
+  // Whatever identifies the file to the caller: an MFT record number, an
+  // index into a walk.
+  std::uint64_t id = 0;
+  std::vector<PhysicalExtent> extents;
+};
+
+// Orders a batch of file reads so the volume is swept front to back, by the
+// physical offset of each file's first extent. Files with nothing on disk
+// (empty, or stored inline in metadata) cost no seek and come first.
+// Returns indices into files.
+std::vector<std::size_t> plan_read_order(std::vector<FileExtents> const& files);
+
+// Total distance the head travels reading files in order, for comparing
+// plans.
+std::uint64_t seek_distance(
+    std::vector<FileExtents> const& files,
+    std::vector<std::size_t> const& order);
+
+#ifndef _WIN32
+// The physical extents of a file from the FS_IOC_FIEMAP ioctl. Empty when
+// the file can't be opened or the filesystem has no block mapping.
+std::vector<PhysicalExtent> fiemap_extents(char const* path);
+#endif
+
+} // namespace fsdb
+
+#endif // FSDB_EXTENTMAP_HPP
@@ -0,0 +1,61 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "FileTable.hpp"
+#include "MftParser.hpp"
+
+namespace fsdb {
+
+void FileTable::reserve(std::size_t files, std::size_t name_bytes) {
+  ids_.reserve(files);
+  parents_.reserve(files);
+  sizes_.reserve(files);
+  created_.reserve(files);
+  accessed_.reserve(files);
+  modified_.reserve(files);
+  directories_.reserve(files);
+  sequences_.reserve(files);
+  lsns_.reserve(files);
+  name_offsets_.reserve(files + 1);
+  names_.reserve(name_bytes);
+}
+
+void FileTable::clear() {
+  ids_.clear();
+  parents_.clear();
+  sizes_.clear();
+  created_.clear();
+  accessed_.clear();
+  modified_.clear();
+  directories_.clear();
+  sequences_.clear();
+  lsns_.clear();
+  name_offsets_.assign(1, 0);
+  names_.clear();
+}
+
+void FileTable::append(MftFile const& f) {
+  ids_.push_back(f.id);
+  parents_.push_back(f.parent);
+  sizes_.push_back(f.size);
+  created_.push_back(f.created);
+  accessed_.push_back(f.accessed);
+  modified_.push_back(f.modified);
+  directories_.push_back(f.directory);
+  sequences_.push_back(f.sequence);
+  lsns_.push_back(f.lsn);
+  names_ += f.name;
+  name_offsets_.push_back(names_.size());
+}
+
+} // namespace fsdb
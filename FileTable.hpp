@@ -0,0 +1,113 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_FILETABLE_HPP
+#define FSDB_FILETABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fsdb {
+
+struct MftFile;
+
+// Files stored a column per field, so scans over one field touch only that
+// field. Names are packed end to end in a single arena.
+class FileTable {
+ public:
+  void reserve(std::size_t files, std::size_t name_bytes = 0);
+  void clear();
+  void append(MftFile const& f);
+
+  std::size_t size() const {
+    return ids_.size();
+  }
+
+  bool empty() const {
+    return ids_.empty();
+  }
+
+  std::string_view name(std::size_t i) const {
+    return std::string_view(names_).substr(
+        name_offsets_[i], name_offsets_[i + 1] - name_offsets_[i]);
+  }
+
+  std::vector<std::uint64_t> const& ids() const {
+    return ids_;
+  }
+
+  std::vector<std::uint64_t> const& parents() const {
+    return parents_;
+  }
+
+  std::vector<std::uint64_t> const& sizes() const {
+    return sizes_;
+  }
+
+  std::vector<std::time_t> const& created() const {
+    return created_;
+  }
+
+  std::vector<std::time_t> const& accessed() const {
+    return accessed_;
+  }
+
+  std::vector<std::time_t> const& modified() const {
+    return modified_;
+  }
+
+  std::vector<std::uint16_t> const& sequences() const {
+    return sequences_;
+  }
+
+  std::vector<std::uint64_t> const& lsns() const {
+    return lsns_;
+  }
+
+  // 1 for directories, 0 otherwise.
+  std::vector<std::uint8_t> const& directories() const {
+    return directories_;
+  }
+
+  // Every name end to end, for scans that search them all at once. Name i
+  // is names()[name_offsets()[i], name_offsets()[i + 1]).
+  std::string const& names() const {
+    return names_;
+  }
+
+  std::vector<std::uint64_t> const& name_offsets() const {
+    return name_offsets_;
+  }
+
+ private:
+  std::vector<std::uint64_t> ids_;
+  std::vector<std::uint64_t> parents_;
+  std::vector<std::uint64_t> sizes_;
+  std::vector<std::time_t> created_;
+  std::vector<std::time_t> accessed_;
+  std::vector<std::time_t> modified_;
+  std::vector<std::uint8_t> directories_;
+  std::vector<std::uint16_t> sequences_;
+  std::vector<std::uint64_t> lsns_;
+  // Name i is names_[name_offsets_[i], name_offsets_[i + 1]).
+  std::vector<std::uint64_t> name_offsets_ = {0};
+  std::string names_;
+};
+
+} // namespace fsdb
+
+#endif // FSDB_FILETABLE_HPP
@@ -0,0 +1,395 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "IndexProtocol.hpp"
+
+#include <boost/throw_exception.hpp>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fsdb {
+namespace {
+
+void put(std::string& out, std::uint64_t value, int bytes) {
+  for(int i = 0; i < bytes; ++i) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+void put_string(std::string& out, std::string_view s) {
+  if(s.size() > 0xffff) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("String too long to encode."));
+  }
+  put(out, s.size(), 2);
+  out += s;
+}
+
+void put_file(std::string& out, MftFile const& f) {
+  put(out, f.id, 8);
+  put(out, f.parent, 8);
+  put(out, f.size, 8);
+  put(out, f.created, 8);
+  put(out, f.accessed, 8);
+  put(out, f.modified, 8);
+  put(out, f.lsn, 8);
+  put(out, f.sequence, 2);
+  put(out, f.directory, 1);
+  put_string(out, f.name);
+}
+
+// Reserves the length prefix and writes the count, returning where the
+// frame starts so end_frame() can fill the length in.
+std::size_t begin_frame(std::string& frame, std::size_t count) {
+  auto start = frame.size();
+  put(frame, 0, 4);
+  put(frame, count, 4);
+  return start;
+}
+
+void end_frame(std::string& frame, std::size_t start) {
+  auto size = frame.size() - start - 4;
+  if(size > kMaxFrameSize) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Index message too large."));
+  }
+  for(int i = 0; i < 4; ++i) {
+    frame[start + i] = static_cast<char>(size >> (8 * i));
+  }
+}
+
+class Reader {
+ public:
+  explicit Reader(std::string_view data)
+      : data_(data) {
+  }
+
+  std::uint64_t get(int bytes) {
+    need(bytes);
+    std::uint64_t value = 0;
+    for(int i = 0; i < bytes; ++i) {
+      value |= std::uint64_t(std::uint8_t(data_[pos_ + i])) << (8 * i);
+    }
+    pos_ += bytes;
+    return value;
+  }
+
+  std::string get_string() {
+    auto size = get(2);
+    need(size);
+    std::string s(data_.substr(pos_, size));
+    pos_ += size;
+    return s;
+  }
+
+  MftFile get_file() {
+    MftFile f;
+    f.id = get(8);
+    f.parent = get(8);
+    f.size = get(8);
+    f.created = static_cast<std::time_t>(get(8));
+    f.accessed = static_cast<std::time_t>(get(8));
+    f.modified = static_cast<std::time_t>(get(8));
+    f.lsn = get(8);
+    f.sequence = static_cast<std::uint16_t>(get(2));
+    f.directory = get(1) != 0;
+    f.name = get_string();
+    return f;
+  }
+
+  // The count that starts every payload. Each entry takes at least one
+  // byte, which bounds what a corrupt count can make us allocate.
+  std::size_t get_count() {
+    auto count = get(4);
+    need(count);
+    return count;
+  }
+
+  void finish() const {
+    if(pos_ != data_.size()) {
+      BOOST_THROW_EXCEPTION(
+          std::runtime_error("Trailing bytes in index message."));
+    }
+  }
+
+ private:
+  void need(std::size_t bytes) const {
+    if(data_.size() - pos_ < bytes) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Truncated index message."));
+    }
+  }
+
+  std::string_view data_;
+  std::size_t pos_ = 0;
+};
+
+QueryOp to_op(std::uint64_t value) {
+  auto op = static_cast<QueryOp>(value);
+  if(op != QueryOp::Stat && op != QueryOp::SubtreeSize &&
+     op != QueryOp::Search && op != QueryOp::Range) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unknown index query."));
+  }
+  return op;
+}
+
+IndexedColumn to_column(std::uint64_t value) {
+  auto column = static_cast<IndexedColumn>(value);
+  if(column != IndexedColumn::Modified && column != IndexedColumn::Size) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Unknown index column."));
+  }
+  return column;
+}
+
+void throw_errno(char const* what) {
+  BOOST_THROW_EXCEPTION(
+      std::runtime_error(std::string(what) + ": " + std::strerror(errno)));
+}
+
+// Reads exactly size bytes. Returns false on end of stream before the first
+// byte; end of stream after it is an error.
+bool read_exact(int fd, char* dest, std::size_t size) {
+  std::size_t done = 0;
+  while(done < size) {
+    auto got = ::recv(fd, dest + done, size - done, 0);
+    if(got < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      throw_errno("Index socket read failed");
+    }
+    if(got == 0) {
+      if(done == 0) {
+        return false;
+      }
+      BOOST_THROW_EXCEPTION(
+          std::runtime_error("Index connection closed mid message."));
+    }
+    done += got;
+  }
+  return true;
+}
+
+} // namespace
+
+std::size_t encoded_size(MftFile const& file) {
+  // Seven 64 bit fields, sequence, directory and the name's length.
+  return 7 * 8 + 2 + 1 + 2 + file.name.size();
+}
+
+std::size_t encoded_size(QueryResult const& result) {
+  std::size_t size = 2;
+  if(result.status != QueryStatus::Ok) {
+    return size;
+  }
+  switch(result.op) {
+    case QueryOp::Stat:
+      return size + encoded_size(result.files.at(0));
+    case QueryOp::SubtreeSize:
+      return size + 16;
+    case QueryOp::Search:
+    case QueryOp::Range:
+      size += 4;
+      for(auto&& f : result.files) {
+        size += encoded_size(f);
+      }
+      return size;
+  }
+  return size;
+}
+
+void encode_queries(std::vector<Query> const& queries, std::string& frame) {
+  auto start = begin_frame(frame, queries.size());
+  for(auto&& q : queries) {
+    put(frame, static_cast<std::uint8_t>(q.op), 1);
+    if(q.op == QueryOp::Search) {
+      put(frame, q.limit, 4);
+      put_string(frame, q.pattern);
+    }
+    else if(q.op == QueryOp::Range) {
+      put(frame, static_cast<std::uint8_t>(q.column), 1);
+      put(frame, q.low, 8);
+      put(frame, q.high, 8);
+      put(frame, q.id, 8);
+      put(frame, q.limit, 4);
+    }
+    else {
+      put(frame, q.id, 8);
+    }
+  }
+  end_frame(frame, start);
+}
+
+void encode_results(
+    std::vector<QueryResult> const& results, std::string& frame) {
+  auto start = begin_frame(frame, results.size());
+  for(auto&& r : results) {
+    put(frame, static_cast<std::uint8_t>(r.op), 1);
+    put(frame, static_cast<std::uint8_t>(r.status), 1);
+    if(r.status != QueryStatus::Ok) {
+      continue;
+    }
+    switch(r.op) {
+      case QueryOp::Stat:
+        put_file(frame, r.files.at(0));
+        break;
+      case QueryOp::SubtreeSize:
+        put(frame, r.bytes, 8);
+        put(frame, r.count, 8);
+        break;
+      case QueryOp::Search:
+      case QueryOp::Range:
+        put(frame, r.files.size(), 4);
+        for(auto&& f : r.files) {
+          put_file(frame, f);
+        }
+        break;
+    }
+  }
+  end_frame(frame, start);
+}
+
+std::vector<Query> decode_queries(std::string_view payload) {
+  Reader in(payload);
+  std::vector<Query> queries(in.get_count());
+  for(auto&& q : queries) {
+    q.op = to_op(in.get(1));
+    if(q.op == QueryOp::Search) {
+      q.limit = static_cast<std::uint32_t>(in.get(4));
+      q.pattern = in.get_string();
+    }
+    else if(q.op == QueryOp::Range) {
+      q.column = to_column(in.get(1));
+      q.low = in.get(8);
+      q.high = in.get(8);
+      q.id = in.get(8);
+      q.limit = static_cast<std::uint32_t>(in.get(4));
+    }
+    else {
+      q.id = in.get(8);
+    }
+  }
+  in.finish();
+  return queries;
+}
+
+std::vector<QueryResult> decode_results(std::string_view payload) {
+  Reader in(payload);
+  std::vector<QueryResult> results(in.get_count());
+  for(auto&& r : results) {
+    r.op = to_op(in.get(1));
+    r.status = static_cast<QueryStatus>(in.get(1));
+    if(r.status != QueryStatus::Ok) {
+      continue;
+    }
+    switch(r.op) {
+      case QueryOp::Stat:
+        r.files.push_back(in.get_file());
+        break;
+      case QueryOp::SubtreeSize:
+        r.bytes = in.get(8);
+        r.count = in.get(8);
+        break;
+      case QueryOp::Search:
+      case QueryOp::Range:
+        r.files.resize(in.get_count());
+        for(auto&& f : r.files) {
+          f = in.get_file();
+        }
+        break;
+    }
+  }
+  in.finish();
+  return results;
+}
+
+bool read_frame(int fd, std::string& payload) {
+  char prefix[4];
+  if(!read_exact(fd, prefix, sizeof(prefix))) {
+    return false;
+  }
+  std::uint32_t size = 0;
+  for(int i = 0; i < 4; ++i) {
+    size |= std::uint32_t(std::uint8_t(prefix[i])) << (8 * i);
+  }
+  if(size > kMaxFrameSize) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Index message too large."));
+  }
+  payload.resize(size);
+  if(size && !read_exact(fd, payload.data(), size)) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("Index connection closed mid message."));
+  }
+  return true;
+}
+
+void write_frame(int fd, std::string_view frame) {
+#ifdef MSG_NOSIGNAL
+  int const flags = MSG_NOSIGNAL;
+#else
+  int const flags = 0;
+#endif
+  while(!frame.empty()) {
+    auto sent = ::send(fd, frame.data(), frame.size(), flags);
+    if(sent < 0) {
+      if(errno == EINTR) {
+        continue;
+      }
+      throw_errno("Index socket write failed");
+    }
+    frame.remove_prefix(sent);
+  }
+}
+
+IndexClient::IndexClient(std::string const& socket_path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if(socket_path.size() >= sizeof(address.sun_path)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Socket path too long."));
+  }
+  std::memcpy(address.sun_path, socket_path.data(), socket_path.size());
+  fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd_ < 0) {
+    throw_errno("Failed to create socket");
+  }
+  if(::connect(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) <
+     0) {
+    auto error = errno;
+    ::close(fd_);
+    errno = error;
+    throw_errno(("Failed to connect to " + socket_path).c_str());
+  }
+}
+
+IndexClient::~IndexClient() {
+  ::close(fd_);
+}
+
+std::vector<QueryResult> IndexClient::query(std::vector<Query> const& queries) {
+  buffer_.clear();
+  encode_queries(queries, buffer_);
+  write_frame(fd_, buffer_);
+  if(!read_frame(fd_, buffer_)) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("Index daemon closed the connection."));
+  }
+  auto results = decode_results(buffer_);
+  if(results.size() != queries.size()) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("Index daemon answered the wrong batch."));
+  }
+  return results;
+}
+
+} // namespace fsdb
@@ -0,0 +1,119 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_INDEXPROTOCOL_HPP
+#define FSDB_INDEXPROTOCOL_HPP
+
+#include "MftParser.hpp"
+#include "SortedIndex.hpp"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace fsdb {
+
+// The index daemon's wire format. Every message is a frame: a little-endian
+// 32 bit payload length, then the payload. A payload is a 32 bit count and
+// that many queries, or that many results in the same order.
+
+enum class QueryOp : std::uint8_t {
+  // The file with the given id.
+  Stat = 1,
+  // Total size and file count of everything below a directory.
+  SubtreeSize = 2,
+  // Files whose name contains a pattern.
+  Search = 3,
+  // Files whose modified time or size lies in a range, optionally only
+  // those below a directory.
+  Range = 4,
+};
+
+// A Range query's id when it isn't limited to a subtree.
+constexpr std::uint64_t kAnySubtree = static_cast<std::uint64_t>(-1);
+
+enum class QueryStatus : std::uint8_t {
+  Ok = 0,
+  NotFound = 1,
+  BadRequest = 2,
+};
+
+struct Query {
+  QueryOp op = QueryOp::Stat;
+  // For Stat and SubtreeSize, and the directory to search below for Range.
+  std::uint64_t id = 0;
+  // For Search. Matching is a case sensitive substring test on the UTF-8
+  // name.
+  std::string pattern;
+  // For Range, the column and the inclusive bounds: times for Modified,
+  // cast to unsigned, or sizes. Files come back in column order.
+  IndexedColumn column = IndexedColumn::Modified;
+  std::uint64_t low = 0;
+  std::uint64_t high = 0;
+  // For Search and Range: at most limit files come back, zero meaning no
+  // limit.
+  std::uint32_t limit = 0;
+};
+
+struct QueryResult {
+  // The query's op, echoed back.
+  QueryOp op = QueryOp::Stat;
+  QueryStatus status = QueryStatus::Ok;
+  // The file for Stat, the matches for Search and Range. Matches that
+  // wouldn't fit in a frame make the query a BadRequest.
+  std::vector<MftFile> files;
+  // For SubtreeSize, the directory itself included.
+  std::uint64_t bytes = 0;
+  std::uint64_t count = 0;
+};
+
+// Frames larger than this are refused.
+constexpr std::uint32_t kMaxFrameSize = 64 * 1024 * 1024;
+
+// Bytes a file or a result takes up in a payload.
+std::size_t encoded_size(MftFile const& file);
+std::size_t encoded_size(QueryResult const& result);
+
+// Append a whole frame, length prefix included, to frame.
+void encode_queries(std::vector<Query> const& queries, std::string& frame);
+void encode_results(
+    std::vector<QueryResult> const& results, std::string& frame);
+
+// Decode a payload without its length prefix. Malformed payloads throw.
+std::vector<Query> decode_queries(std::string_view payload);
+std::vector<QueryResult> decode_results(std::string_view payload);
+
+// Blocking frame I/O on a stream socket. read_frame returns false if the
+// peer closed the connection between frames.
+bool read_frame(int fd, std::string& payload);
+void write_frame(int fd, std::string_view frame);
+
+// A connection to a running index daemon.
+class IndexClient {
+ public:
+  explicit IndexClient(std::string const& socket_path);
+  ~IndexClient();
+  IndexClient(IndexClient const&) = delete;
+  IndexClient& operator=(IndexClient const&) = delete;
+
+  // Sends the queries as one batch and waits for the answers.
+  std::vector<QueryResult> query(std::vector<Query> const& queries);
+
+ private:
+  int fd_ = -1;
+  std::string buffer_;
+};
+
+} // namespace fsdb
+
+#endif // FSDB_INDEXPROTOCOL_HPP
@@ -0,0 +1,445 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "IndexServer.hpp"
+
+#include <algorithm>
+#include <boost/throw_exception.hpp>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fsdb {
+namespace {
+constexpr std::uint32_t kNoRow = static_cast<std::uint32_t>(-1);
+
+void throw_errno(std::string const& what) {
+  BOOST_THROW_EXCEPTION(std::runtime_error(what + ": " + std::strerror(errno)));
+}
+} // namespace
+
+FileIndex::FileIndex(FileTable table)
+    : FileIndex(
+          std::move(table), SortedIndex(IndexedColumn::Modified),
+          SortedIndex(IndexedColumn::Size)) {
+  by_modified_ = SortedIndex(IndexedColumn::Modified, table_);
+  by_size_ = SortedIndex(IndexedColumn::Size, table_);
+}
+
+FileIndex::FileIndex(
+    FileTable table, SortedIndex by_modified, SortedIndex by_size)
+    : table_(std::move(table))
+    , by_modified_(std::move(by_modified))
+    , by_size_(std::move(by_size))
+    , intervals_(table_) {
+  auto const& ids = table_.ids();
+  auto const& parents = table_.parents();
+  auto rows = table_.size();
+  if(rows >= kNoRow) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Too many files to index."));
+  }
+  std::uint64_t max_id = 0;
+  for(auto id : ids) {
+    max_id = std::max(max_id, id);
+  }
+  rows_.assign(rows ? max_id + 1 : 0, kNoRow);
+  for(std::uint32_t i = 0; i < rows; ++i) {
+    rows_[ids[i]] = i;
+  }
+
+  // Children of each row, laid out contiguously by parent.
+  std::vector<std::uint32_t> parent_rows(rows);
+  std::vector<std::uint32_t> child_begin(rows + 1, 0);
+  for(std::size_t i = 0; i < rows; ++i) {
+    auto p = find(parents[i]);
+    parent_rows[i] = p == npos || p == i ? kNoRow : std::uint32_t(p);
+    if(parent_rows[i] != kNoRow) {
+      ++child_begin[parent_rows[i] + 1];
+    }
+  }
+  for(std::size_t i = 0; i < rows; ++i) {
+    child_begin[i + 1] += child_begin[i];
+  }
+  std::vector<std::uint32_t> children(child_begin.back());
+  auto fill = child_begin;
+  for(std::uint32_t i = 0; i < rows; ++i) {
+    if(parent_rows[i] != kNoRow) {
+      children[fill[parent_rows[i]]++] = i;
+    }
+  }
+
+  // Breadth first from the roots puts every parent ahead of its children,
+  // so walking the order backwards sums each subtree before its parent
+  // needs it.
+  std::vector<std::uint32_t> order;
+  order.reserve(rows);
+  for(std::uint32_t i = 0; i < rows; ++i) {
+    if(parent_rows[i] == kNoRow) {
+      order.push_back(i);
+    }
+  }
+  for(std::size_t next = 0; next < order.size(); ++next) {
+    auto r = order[next];
+    order.insert(
+        order.end(), children.begin() + child_begin[r],
+        children.begin() + child_begin[r + 1]);
+  }
+
+  subtree_bytes_ = table_.sizes();
+  subtree_counts_.assign(rows, 1);
+  for(auto it = order.rbegin(); it != order.rend(); ++it) {
+    auto p = parent_rows[*it];
+    if(p != kNoRow) {
+      subtree_bytes_[p] += subtree_bytes_[*it];
+      subtree_counts_[p] += subtree_counts_[*it];
+    }
+  }
+}
+
+std::size_t FileIndex::find(std::uint64_t id) const {
+  if(id >= rows_.size() || rows_[id] == kNoRow) {
+    return npos;
+  }
+  return rows_[id];
+}
+
+MftFile FileIndex::file(std::size_t row) const {
+  MftFile f;
+  f.id = table_.ids()[row];
+  f.parent = table_.parents()[row];
+  f.created = table_.created()[row];
+  f.accessed = table_.accessed()[row];
+  f.modified = table_.modified()[row];
+  f.size = table_.sizes()[row];
+  f.name = table_.name(row);
+  f.directory = table_.directories()[row] != 0;
+  f.sequence = table_.sequences()[row];
+  f.lsn = table_.lsns()[row];
+  return f;
+}
+
+QueryResult FileIndex::answer(Query const& query) const {
+  QueryResult result;
+  result.op = query.op;
+  if(query.op == QueryOp::Search) {
+    search(query, result);
+    return result;
+  }
+  if(query.op == QueryOp::Range) {
+    range(query, result);
+    return result;
+  }
+
+  auto row = find(query.id);
+  if(row == npos) {
+    result.status = QueryStatus::NotFound;
+  }
+  else if(query.op == QueryOp::Stat) {
+    result.files.push_back(file(row));
+  }
+  else {
+    result.bytes = subtree_bytes_[row];
+    result.count = subtree_counts_[row];
+  }
+  return result;
+}
+
+bool FileIndex::collect(
+    std::size_t row, QueryResult& result, std::size_t& bytes) const {
+  result.files.push_back(file(row));
+  bytes += encoded_size(result.files.back());
+  if(bytes > kMaxFrameSize) {
+    result.status = QueryStatus::BadRequest;
+    result.files = {};
+    return false;
+  }
+  return true;
+}
+
+void FileIndex::search(Query const& query, QueryResult& result) const {
+  std::size_t limit = query.limit ? query.limit : table_.size();
+  std::size_t bytes = 0;
+  if(query.pattern.empty()) {
+    for(std::size_t i = 0; i < std::min(limit, table_.size()); ++i) {
+      if(!collect(i, result, bytes)) {
+        return;
+      }
+    }
+    return;
+  }
+
+  // Search the whole arena in one pass and work out which name each hit
+  // landed in, rather than testing names one at a time.
+  std::string_view names = table_.names();
+  auto const& offsets = table_.name_offsets();
+  std::size_t pos = 0;
+  while(result.files.size() < limit &&
+        (pos = names.find(query.pattern, pos)) != std::string_view::npos) {
+    std::size_t row =
+        std::upper_bound(offsets.begin(), offsets.end(), pos) -
+        offsets.begin() - 1;
+    // Hits that run on into the next name don't count.
+    if(pos + query.pattern.size() <= offsets[row + 1] &&
+       !collect(row, result, bytes)) {
+      return;
+    }
+    pos = offsets[row + 1];
+  }
+}
+
+void FileIndex::range(Query const& query, QueryResult& result) const {
+  std::size_t limit = query.limit ? query.limit : table_.size();
+  auto const& index =
+      query.column == IndexedColumn::Modified ? by_modified_ : by_size_;
+  auto low = query.low;
+  auto high = query.high;
+  if(query.column == IndexedColumn::Modified) {
+    low = SortedIndex::time_key(static_cast<std::time_t>(low));
+    high = SortedIndex::time_key(static_cast<std::time_t>(high));
+  }
+  bool anywhere = query.id == kAnySubtree;
+  SubtreeIntervals::Interval within;
+  if(!anywhere) {
+    if(find(query.id) == npos) {
+      result.status = QueryStatus::NotFound;
+      return;
+    }
+    within = intervals_.interval(query.id);
+  }
+  std::size_t bytes = 0;
+  index.range(low, high, [&](SortedIndex::Entry const& e) {
+    if(!anywhere && !within.contains(intervals_.interval(e.id))) {
+      return true;
+    }
+    return collect(find(e.id), result, bytes) && result.files.size() < limit;
+  });
+}
+
+IndexServer::IndexServer(std::string volume, IndexServerOptions const& options)
+    : volume_(std::move(volume))
+    , options_(options) {
+  MftParser parser;
+  parser.open(volume_, options_.mode);
+  FileTable table;
+  table.reserve(parser.count());
+  MftReader(parser).read(table);
+  index_ = std::make_shared<FileIndex const>(std::move(table));
+}
+
+IndexServer::~IndexServer() {
+  if(listen_fd_ >= 0) {
+    ::close(listen_fd_);
+    ::unlink(socket_path_.c_str());
+  }
+}
+
+void IndexServer::listen(std::string const& socket_path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if(socket_path.size() >= sizeof(address.sun_path)) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Socket path too long."));
+  }
+  std::memcpy(address.sun_path, socket_path.data(), socket_path.size());
+  listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listen_fd_ < 0) {
+    throw_errno("Failed to create socket");
+  }
+  ::unlink(socket_path.c_str());
+  if(::bind(
+         listen_fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) <
+     0) {
+    throw_errno("Failed to bind " + socket_path);
+  }
+  socket_path_ = socket_path;
+  if(::listen(listen_fd_, SOMAXCONN) < 0) {
+    throw_errno("Failed to listen on " + socket_path);
+  }
+}
+
+void IndexServer::run() {
+  std::thread refresher;
+  if(options_.refresh_interval.count() > 0) {
+    refresher = std::thread([this] { refresh_loop(); });
+  }
+
+  while(!stopping_) {
+    int fd = ::accept(listen_fd_, nullptr, nullptr);
+    if(fd < 0) {
+      if(stopping_) {
+        break;
+      }
+      if(errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      auto error = errno;
+      stop();
+      if(refresher.joinable()) {
+        refresher.join();
+      }
+      reap(true);
+      errno = error;
+      throw_errno("Failed to accept on " + socket_path_);
+    }
+
+    reap(false);
+    std::lock_guard<std::mutex> lk(connections_mutex_);
+    auto& c = connections_.emplace_back();
+    c.fd = fd;
+    if(stopping_) {
+      ::shutdown(fd, SHUT_RDWR);
+    }
+    c.thread = std::thread([this, &c] { serve(c); });
+  }
+
+  if(refresher.joinable()) {
+    refresher.join();
+  }
+  reap(true);
+}
+
+void IndexServer::stop() {
+  {
+    std::lock_guard<std::mutex> lk(stop_mutex_);
+    stopping_ = true;
+  }
+  stop_changed_.notify_all();
+  // Wakes accept() and every reader blocked in recv().
+  if(listen_fd_ >= 0) {
+    ::shutdown(listen_fd_, SHUT_RDWR);
+  }
+  std::lock_guard<std::mutex> lk(connections_mutex_);
+  for(auto&& c : connections_) {
+    ::shutdown(c.fd, SHUT_RDWR);
+  }
+}
+
+void IndexServer::reap(bool all) {
+  std::list<Connection> finished;
+  {
+    std::lock_guard<std::mutex> lk(connections_mutex_);
+    for(auto it = connections_.begin(); it != connections_.end();) {
+      auto next = std::next(it);
+      if(all || it->done) {
+        finished.splice(finished.end(), connections_, it);
+      }
+      it = next;
+    }
+  }
+  for(auto&& c : finished) {
+    c.thread.join();
+    ::close(c.fd);
+  }
+}
+
+void IndexServer::serve(Connection& connection) {
+  std::string request;
+  std::string response;
+  try {
+    while(read_frame(connection.fd, request)) {
+      auto queries = decode_queries(request);
+      // One snapshot per batch, so a batch never straddles a refresh.
+      auto current = index();
+      std::vector<QueryResult> results;
+      results.reserve(queries.size());
+      // Results that would take the response past the frame limit are
+      // refused one by one rather than failing the whole batch.
+      std::size_t bytes = 4;
+      for(auto&& q : queries) {
+        results.push_back(current->answer(q));
+        auto size = encoded_size(results.back());
+        if(bytes + size > kMaxFrameSize) {
+          results.back().status = QueryStatus::BadRequest;
+          results.back().files = {};
+          size = encoded_size(results.back());
+        }
+        bytes += size;
+      }
+      response.clear();
+      encode_results(results, response);
+      write_frame(connection.fd, response);
+    }
+  }
+  catch(std::exception const&) {
+    // A client that breaks the protocol or goes away loses its connection
+    // and nothing else. Shut it down now so the peer sees end of stream
+    // rather than waiting for the connection to be reaped.
+    ::shutdown(connection.fd, SHUT_RDWR);
+  }
+  connection.done = true;
+}
+
+void IndexServer::refresh_loop() {
+  std::unique_lock<std::mutex> lk(stop_mutex_);
+  while(!stop_changed_.wait_for(
+      lk, options_.refresh_interval, [this] { return stopping_.load(); })) {
+    lk.unlock();
+    try {
+      auto changes = refresh();
+      if(options_.on_refresh) {
+        options_.on_refresh(changes);
+      }
+    }
+    catch(std::exception const& e) {
+      // Keep serving the last good index.
+      if(options_.on_error) {
+        options_.on_error(e);
+      }
+    }
+    lk.lock();
+  }
+}
+
+MftChanges IndexServer::refresh() {
+  std::lock_guard<std::mutex> refresh_lk(refresh_mutex_);
+  std::vector<MftFile> previous;
+  {
+    auto current = index();
+    previous.reserve(current->table().size());
+    for(std::size_t i = 0; i < current->table().size(); ++i) {
+      previous.push_back(current->file(i));
+    }
+  }
+
+  MftParser parser;
+  parser.open(volume_, options_.mode);
+  auto changes = MftReader(parser).read_changes(std::move(previous));
+  if(!changes.added.empty() || !changes.modified.empty() ||
+     !changes.recreated.empty() || !changes.deleted.empty()) {
+    FileTable table;
+    table.reserve(changes.files.size());
+    for(auto&& f : changes.files) {
+      table.append(f);
+    }
+    auto current = index();
+    auto by_modified = current->by_modified();
+    auto by_size = current->by_size();
+    by_modified.update(changes, current->table(), table);
+    by_size.update(changes, current->table(), table);
+    auto next = std::make_shared<FileIndex const>(
+        std::move(table), std::move(by_modified), std::move(by_size));
+    std::lock_guard<std::mutex> lk(index_mutex_);
+    index_ = std::move(next);
+  }
+  changes.files = {};
+  return changes;
+}
+
+std::shared_ptr<FileIndex const> IndexServer::index() const {
+  std::lock_guard<std::mutex> lk(index_mutex_);
+  return index_;
+}
+
+} // namespace fsdb
@@ -0,0 +1,147 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_INDEXSERVER_HPP
+#define FSDB_INDEXSERVER_HPP
+
+#include "FileTable.hpp"
+#include "IndexProtocol.hpp"
+#include "MftParser.hpp"
+#include "SortedIndex.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fsdb {
+
+// A file table plus the lookups queries need, built once and then only
+// read, so any number of threads can answer from it.
+class FileIndex {
+ public:
+  static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+  // The table must be in id order.
+  explicit FileIndex(FileTable table);
+  // Takes sorted indexes already brought up to date with table.
+  FileIndex(FileTable table, SortedIndex by_modified, SortedIndex by_size);
+
+  FileTable const& table() const {
+    return table_;
+  }
+
+  SortedIndex const& by_modified() const {
+    return by_modified_;
+  }
+
+  SortedIndex const& by_size() const {
+    return by_size_;
+  }
+
+  // The row holding id, or npos.
+  std::size_t find(std::uint64_t id) const;
+  MftFile file(std::size_t row) const;
+  QueryResult answer(Query const& query) const;
+
+ private:
+  // Adds row's file to result unless that takes it past what a frame can
+  // hold, in which case result becomes a BadRequest and false comes back.
+  bool collect(std::size_t row, QueryResult& result, std::size_t& bytes) const;
+  void search(Query const& query, QueryResult& result) const;
+  void range(Query const& query, QueryResult& result) const;
+
+  FileTable table_;
+  // Row of each id, kNoRow where there's none.
+  std::vector<std::uint32_t> rows_;
+  // Totals over each row and everything below it. Rows caught in a parent
+  // cycle only count themselves.
+  std::vector<std::uint64_t> subtree_bytes_;
+  std::vector<std::uint64_t> subtree_counts_;
+  SortedIndex by_modified_;
+  SortedIndex by_size_;
+  SubtreeIntervals intervals_;
+};
+
+struct IndexServerOptions {
+  // How often to rescan the volume for changes; zero never does.
+  std::chrono::milliseconds refresh_interval = std::chrono::seconds(10);
+  BlockSourceMode mode = BlockSourceMode::Direct;
+  // Called from the refresh thread after each rescan, with files left
+  // empty, or with the error that stopped it.
+  std::function<void(MftChanges const&)> on_refresh;
+  std::function<void(std::exception const&)> on_error;
+};
+
+// Serves a volume's file table over a Unix domain socket. Queries are
+// answered from memory. Rescans build a new index on the side and swap it
+// in whole, so queries never wait for one. The sorted indexes are carried
+// over and patched with what changed rather than rebuilt.
+class IndexServer {
+ public:
+  // Scans the volume before returning.
+  explicit IndexServer(
+      std::string volume, IndexServerOptions const& options = {});
+  ~IndexServer();
+  IndexServer(IndexServer const&) = delete;
+  IndexServer& operator=(IndexServer const&) = delete;
+
+  // Binds the socket, replacing whatever is left at the path.
+  void listen(std::string const& socket_path);
+  // Serves connections, each on its own thread, and refreshes the index
+  // until stop() is called.
+  void run();
+  // Makes run() return. Not async-signal-safe.
+  void stop();
+
+  // Rescans the volume now and swaps in the result. Returns what changed,
+  // with files left empty.
+  MftChanges refresh();
+  std::shared_ptr<FileIndex const> index() const;
+
+ private:
+  struct Connection {
+    int fd;
+    std::thread thread;
+    std::atomic<bool> done{false};
+  };
+
+  void serve(Connection& connection);
+  void refresh_loop();
+  void reap(bool all);
+
+  std::string volume_;
+  IndexServerOptions options_;
+  std::string socket_path_;
+  int listen_fd_ = -1;
+  std::atomic<bool> stopping_{false};
+  mutable std::mutex index_mutex_;
+  std::shared_ptr<FileIndex const> index_;
+  // Serialises rescans.
+  std::mutex refresh_mutex_;
+  std::mutex stop_mutex_;
+  std::condition_variable stop_changed_;
+  std::mutex connections_mutex_;
+  std::list<Connection> connections_;
+};
+
+} // namespace fsdb
+
+#endif // FSDB_INDEXSERVER_HPP
@@ -0,0 +1,168 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "IoThrottle.hpp"
+
+#include <algorithm>
+#include <ostream>
+#include <thread>
+
+#ifdef _WIN32
+#  define NOMINMAX 1
+#  define WIN32_LEAN_AND_MEAN 1
+#  include <windows.h>
+#elif defined(__linux__)
+#  include <sched.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+namespace fsdb {
+namespace {
+// Operations per latency window, and windows spent learning the normal
+// latency before backing off.
+constexpr std::uint64_t kWindow = 64;
+constexpr int kWarmupWindows = 16;
+// Weights of the newest window in the short and long term latency.
+constexpr double kShortWeight = 0.25;
+constexpr double kLongWeight = 0.02;
+// While backing off, each operation is followed by a pause of up to this
+// many times its own latency.
+constexpr double kMaxDuty = 8;
+// A bucket holds a tenth of a second's worth of tokens.
+constexpr double kBurstSeconds = 0.1;
+// Shorter sleeps overshoot badly, so smaller delays are carried over
+// until they add up to this.
+constexpr std::chrono::nanoseconds kMinSleep = std::chrono::milliseconds(1);
+
+// Pause this thread owes but hasn't slept off yet.
+thread_local std::chrono::nanoseconds owed_pause{0};
+
+#ifdef __linux__
+// From linux/ioprio.h, which glibc doesn't wrap.
+constexpr int kIoprioWhoProcess = 1;
+constexpr int kIoprioClassIdle = 3;
+constexpr int kIoprioClassShift = 13;
+#endif
+} // namespace
+
+bool enter_background_priority() {
+#ifdef _WIN32
+  // Lowers I/O and memory priority as well as CPU.
+  return SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+#elif defined(__linux__)
+  bool ok = ::syscall(
+                SYS_ioprio_set, kIoprioWhoProcess, 0,
+                kIoprioClassIdle << kIoprioClassShift) == 0;
+  sched_param param = {};
+  ok = ::sched_setscheduler(0, SCHED_IDLE, &param) == 0 && ok;
+  return ok;
+#else
+  return false;
+#endif
+}
+
+TokenBucket::TokenBucket(double rate)
+    : rate_(rate)
+    , burst_(rate * kBurstSeconds)
+    , tokens_(burst_)
+    , last_(std::chrono::steady_clock::now()) {
+}
+
+std::chrono::nanoseconds TokenBucket::take(double n) {
+  if(rate_ <= 0) {
+    return {};
+  }
+
+  std::lock_guard<std::mutex> lk(mutex_);
+  auto now = std::chrono::steady_clock::now();
+  tokens_ = std::min(
+      burst_,
+      tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+  last_ = now;
+  tokens_ -= n;
+  if(tokens_ >= 0) {
+    return {};
+  }
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double>(-tokens_ / rate_));
+}
+
+IoThrottle::IoThrottle(ThrottleOptions const& options)
+    : options_(options)
+    , operations_(options.operations_per_second)
+    , bytes_(options.bytes_per_second) {
+}
+
+void IoThrottle::before_operation() {
+  wait(operations_.take(1));
+}
+
+void IoThrottle::before_read(std::size_t bytes) {
+  wait(operations_.take(1) + bytes_.take(static_cast<double>(bytes)));
+}
+
+void IoThrottle::wait(std::chrono::nanoseconds delay) {
+  // A bucket's delay is the time until the tokens are there, which keeps
+  // growing while they aren't, so only the pause accumulates.
+  owed_pause +=
+      std::chrono::nanoseconds(pause_ns_.load(std::memory_order_relaxed));
+  delay += owed_pause;
+  if(delay < kMinSleep) {
+    return;
+  }
+  owed_pause = {};
+  waited_ns_.fetch_add(delay.count(), std::memory_order_relaxed);
+  std::this_thread::sleep_for(delay);
+}
+
+void IoThrottle::completed(std::chrono::nanoseconds latency) {
+  completed_.fetch_add(1, std::memory_order_relaxed);
+  window_latency_ns_.fetch_add(latency.count(), std::memory_order_relaxed);
+  if(window_count_.fetch_add(1, std::memory_order_relaxed) + 1 == kWindow) {
+    update_backoff();
+  }
+}
+
+void IoThrottle::update_backoff() {
+  std::lock_guard<std::mutex> lk(backoff_mutex_);
+  auto count = window_count_.exchange(0);
+  auto latency = window_latency_ns_.exchange(0);
+  auto mean_ns =
+      static_cast<double>(latency) / std::max<std::uint64_t>(count, 1);
+  if(windows_++ == 0) {
+    short_ns_ = long_ns_ = mean_ns;
+  }
+  short_ns_ += kShortWeight * (mean_ns - short_ns_);
+  long_ns_ += kLongWeight * (mean_ns - long_ns_);
+
+  // Double the pause, relative to the latency, while latency runs high and
+  // halve it once it recovers.
+  if(windows_ > kWarmupWindows &&
+     short_ns_ > long_ns_ * options_.latency_backoff) {
+    duty_ = std::clamp(duty_ * 2, 1.0, kMaxDuty);
+    ++backoffs_;
+  }
+  else {
+    duty_ = duty_ / 2 < 1 ? 0 : duty_ / 2;
+  }
+  pause_ns_ = static_cast<std::int64_t>(duty_ * short_ns_);
+}
+
+void IoThrottle::report(std::ostream& out) const {
+  out << "throttle: " << completed_ << " operations, waited "
+      << waited_ns_ / 1000000 << "ms, backed off " << backoffs_ << " times."
+      << std::endl;
+}
+
+} // namespace fsdb
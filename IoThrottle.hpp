@@ -0,0 +1,99 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_IOTHROTTLE_HPP
+#define FSDB_IOTHROTTLE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <mutex>
+
+namespace fsdb {
+
+// Drops the calling thread to idle I/O and CPU priority, so the scan only
+// gets the device and the processors when nobody else wants them. Threads
+// created afterwards inherit it. Returns false if the platform refused.
+bool enter_background_priority();
+
+// A rate limit shared between threads. Callers that take more than is
+// available go into debt and wait it off, so waiters are served in order.
+class TokenBucket {
+ public:
+  // rate is in tokens per second; zero means unlimited.
+  explicit TokenBucket(double rate);
+
+  // Takes n tokens and returns how long the caller must wait before using
+  // them.
+  std::chrono::nanoseconds take(double n);
+
+ private:
+  double rate_;
+  double burst_;
+  double tokens_;
+  std::chrono::steady_clock::time_point last_;
+  std::mutex mutex_;
+};
+
+struct ThrottleOptions {
+  // Zero leaves the limit off.
+  double operations_per_second = 0;
+  double bytes_per_second = 0;
+  // Back off when recent latency exceeds the long term average by this
+  // factor.
+  double latency_backoff = 2;
+};
+
+// Paces a scan's metadata operations and reads across all its threads and
+// backs off when the scan's own latency says the device is busy.
+class IoThrottle {
+ public:
+  explicit IoThrottle(ThrottleOptions const& options);
+
+  // Call before each metadata operation and each read. Both may sleep.
+  void before_operation();
+  void before_read(std::size_t bytes);
+
+  // Call after each operation or read with the time it took.
+  void completed(std::chrono::nanoseconds latency);
+
+  void report(std::ostream& out) const;
+
+ private:
+  void wait(std::chrono::nanoseconds delay);
+  void update_backoff();
+
+  ThrottleOptions options_;
+  TokenBucket operations_;
+  TokenBucket bytes_;
+  // Extra delay added to every operation while backing off.
+  std::atomic<std::int64_t> pause_ns_{0};
+  std::atomic<std::uint64_t> window_count_{0};
+  std::atomic<std::uint64_t> window_latency_ns_{0};
+  std::mutex backoff_mutex_;
+  // Smoothed latency over recent and over many windows.
+  int windows_ = 0;
+  double short_ns_ = 0;
+  double long_ns_ = 0;
+  double duty_ = 0;
+  // Totals for report().
+  std::atomic<std::uint64_t> completed_{0};
+  std::atomic<std::uint64_t> waited_ns_{0};
+  std::atomic<std::uint64_t> backoffs_{0};
+};
+
+} // namespace fsdb
+
+#endif // FSDB_IOTHROTTLE_HPP
@@ -12,400 +12,88 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 #include "MftParser.hpp"
+#include "FileTable.hpp"
+#include "NtfsFormat.hpp"
+#include "ParallelFor.hpp"
+#include "Utf16.hpp"
 
+#include <algorithm>
 #include <boost/assert.hpp>
-#include <boost/core/ignore_unused.hpp>
-#include <boost/nowide/convert.hpp>
 #include <boost/throw_exception.hpp>
-#include <boost/winapi/access_rights.hpp>
-#include <boost/winapi/config.hpp>
-#include <boost/winapi/file_management.hpp>
+#include <condition_variable>
 #include <cstddef>
-#include <exception>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <mutex>
 #include <stdexcept>
 #include <vector>
 
-extern "C" {
-BOOST_WINAPI_IMPORT boost::winapi::BOOL_ BOOST_WINAPI_WINAPI_CC SetFilePointerEx(
-    boost::winapi::HANDLE_ hFile,
-    boost::winapi::LARGE_INTEGER_ liDistanceToMove,
-    boost::winapi::PLARGE_INTEGER_ lpNewFilePointer,
-    boost::winapi::DWORD_ dwMoveMethod);
-}
-
-namespace boost { namespace winapi {
-using ::SetFilePointerEx;
-}} // namespace boost::winapi
-
 namespace fsdb {
 
-template <typename Enum>
-class EnumFlags {
- public:
-  using StorageType = std::underlying_type_t<Enum>;
-
-  static_assert(std::is_enum_v<Enum>, "Enum must be an enum type");
-  explicit EnumFlags(Enum e)
-      : bits_(static_cast<StorageType>(e)) {
-  }
-
-  EnumFlags& operator=(EnumFlags e) {
-    bits_ = static_cast<StorageType>(e);
-    return *this;
-  }
-
-  EnumFlags& operator&=(EnumFlags e) {
-    bits_ &= e.bits_;
-    return *this;
-  }
-
-  EnumFlags& operator&=(Enum e) {
-    bits_ &= static_cast<StorageType>(e);
-    return *this;
-  }
-
-  EnumFlags& operator|=(EnumFlags e) {
-    bits_ |= e.bits_;
-    return *this;
-  }
-
-  EnumFlags& operator|=(Enum e) {
-    bits_ |= static_cast<StorageType>(e);
-    return *this;
-  }
-
-  operator bool() const {
-    return bits_ != 0;
-  }
-
-  friend EnumFlags operator&(EnumFlags a, EnumFlags b) {
-    return EnumFlags(a.bits_ & b.bits_, 0);
-  }
-
-  friend EnumFlags operator&(Enum a, EnumFlags b) {
-    return EnumFlags(static_cast<StorageType>(a) & b.bits_, 0);
-  }
-
-  friend EnumFlags operator&(EnumFlags a, Enum b) {
-    return EnumFlags(a.bits_ & static_cast<StorageType>(b), 0);
-  }
-
-  friend EnumFlags operator|(EnumFlags a, EnumFlags b) {
-    return EnumFlags(a.bits_ | b.bits_, 0);
-  }
-
-  friend EnumFlags operator|(Enum a, EnumFlags b) {
-    return EnumFlags(static_cast<StorageType>(a) | b.bits_, 0);
-  }
-
-  friend EnumFlags operator|(EnumFlags a, Enum b) {
-    return EnumFlags(a.bits_ | static_cast<StorageType>(b), 0);
-  }
-
- private:
-  EnumFlags(StorageType bits, int)
-      : bits_(bits) {
-  }
-
-  StorageType bits_;
-};
-
-#pragma pack(push, 1)
-struct BootBlock {
-  std::uint8_t Jump[3];
-  std::uint8_t Format[8];
-  std::uint16_t BytesPerSector;
-  std::uint8_t SectorsPerCluster;
-  std::uint16_t BootSectors;
-  std::uint8_t Mbz1;
-  std::uint16_t Mbz2;
-  std::uint16_t Reserved1;
-  std::uint8_t MediaType;
-  std::uint16_t Mbz3;
-  std::uint16_t SectorsPerTrack;
-  std::uint16_t NumberOfHeads;
-  std::uint32_t PartitionOffset;
-  std::uint32_t Rserved2[2];
-  std::uint64_t TotalSectors;
-  std::uint64_t MftStartLcn;
-  std::uint64_t Mft2StartLcn;
-  std::uint32_t ClustersPerFileRecord;
-  std::uint32_t ClustersPerIndexBlock;
-  std::uint64_t VolumeSerialNumber;
-  std::uint8_t Code[0x1AE];
-  std::uint16_t BootSignature;
-};
-#pragma pack(pop)
-
-// All ntfs spec information taken from
-// https://flatcap.org/linux-ntfs/ntfs/
-
-// Additional functional information taken from
-// http://www.kcall.co.uk/ntfs/index.html
-
-// https://flatcap.org/linux-ntfs/ntfs/concepts/file_record.html
-struct NtfsFileRecord {
-  enum class Flag : std::uint16_t { None = 0, InUse = 1, Directory = 2 };
-  std::uint32_t Type; // Magic int 'FILE', or 'ELIF' in little endian.
-  std::uint16_t UsaOffset;
-  std::uint16_t UsaCount;
-  std::uint64_t Usn;
-  std::uint16_t SequenceNumber;
-  std::uint16_t LinkCount;
-  std::uint16_t AttributesOffset;
-  EnumFlags<Flag> Flags;
-  std::uint32_t BytesInUse;
-  std::uint32_t BytesAllocated;
-  std::uint64_t BaseFileRecord;
-  std::uint16_t NextAttributeNumber;
-  std::uint16_t unused;
-  std::uint32_t RecordId;
-};
-
-// https://flatcap.org/linux-ntfs/ntfs/attributes/index.html
-enum class NtfsAttributeType : std::uint32_t {
-  StandardInformation = 0x10,
-  AttributeList = 0x20,
-  FileName = 0x30,
-  ObjectId = 0x40,
-  SecurityDescripter = 0x50,
-  VolumeName = 0x60,
-  VolumeInformation = 0x70,
-  Data = 0x80,
-  IndexRoot = 0x90,
-  IndexAllocation = 0xA0,
-  Bitmap = 0xB0,
-  ReparsePoint = 0xC0,
-  EAInformation = 0xD0,
-  EA = 0xE0,
-  PropertySet = 0xF0,
-  LoggedUtilityStream = 0x100,
-  Terminator = 0xFFFFFFFF,
-  FirstAttribute = StandardInformation,
-  LastAttribute = LoggedUtilityStream,
-};
-
-// https://flatcap.org/linux-ntfs/ntfs/concepts/attribute_header.html
-struct NtfsAttributeHeader {
-  enum class Flag : std::uint16_t {
-    None = 0,
-    Compressed = 1,
-  };
-
-  NtfsAttributeType Type;
-  std::uint32_t Length;
-  std::uint8_t Nonresident;
-  std::uint8_t NameLength;
-  std::uint16_t NameOffset;
-  EnumFlags<Flag> Flags;
-  std::uint16_t AttributeNumber;
-};
-
-struct NtfsResidentAttributeHeader : NtfsAttributeHeader {
-  enum class Flag : std::uint16_t {
-    None = 0,
-    Indexed = 1,
-  };
-
-  std::uint32_t ValueLength;
-  std::uint16_t ValueOffset;
-  EnumFlags<Flag> Flags;
-};
-
-struct NtfsNonResidentAttributeHeader : NtfsAttributeHeader {
-  std::uint64_t FirstVcn;
-  std::uint64_t LastVcn;
-  std::uint16_t RunArrayOffset;
-  std::uint16_t CompressionUnit;
-  std::uint8_t Pad_[4];
-  std::uint64_t AllocatedSize;
-  std::uint64_t DataSize;
-  std::uint64_t InitializedSize;
-  std::uint64_t CompressedSize;
-};
-
-// https://flatcap.org/linux-ntfs/ntfs/attributes/file_name.html
-struct NtfsFilenameAttribute {
-  enum class Flag : std::uint32_t {
-    ReadOnly = 0x1,
-    Hidden = 0x2,
-    System = 0x4,
-    Archive = 0x20,
-    Device = 0x40,
-    Normal = 0x80,
-    Temporary = 0x100,
-    Sparse = 0x200,
-    Reparse = 0x400,
-    Compressed = 0x800,
-    Offline = 0x1000,
-    NotContentIndexed = 0x2000,
-    Encrypted = 0x4000,
-    Directory = 0x10000000,
-    IndexView = 0x20000000,
-  };
-
-  enum class NameType : std::uint8_t {
-    Posix = 0,
-    Win32 = 1,
-    DOS = 2,
-  };
-
-  std::uint64_t DirectoryRecordId; // points to a MFT Index of a directory
-  std::int64_t CreationTime; // saved on creation, changed when filename changes
-  std::int64_t ChangeTime;
-  std::int64_t LastWriteTime;
-  std::int64_t LastAccessTime;
-  std::uint64_t AllocatedSize;
-  std::uint64_t DataSize;
-  EnumFlags<Flag> Flags;
-  std::uint32_t AligmentOrReserved;
-  std::uint8_t NameLength;
-  EnumFlags<NameType> NameTypes;
-  boost::winapi::WCHAR_ Name[1];
-};
-
 namespace {
 
-using DWORD = boost::winapi::DWORD_;
-
-DWORD constexpr GENERIC_READ = boost::winapi::GENERIC_READ_;
-DWORD constexpr FILE_SHARE_READ = boost::winapi::FILE_SHARE_READ_;
-DWORD constexpr FILE_SHARE_WRITE = boost::winapi::FILE_SHARE_WRITE_;
-DWORD constexpr OPEN_EXISTING = boost::winapi::OPEN_EXISTING_;
-DWORD constexpr FILE_FLAG_NO_BUFFERING = boost::winapi::FILE_FLAG_NO_BUFFERING_;
-DWORD constexpr FILE_BEGIN = boost::winapi::FILE_BEGIN_;
-const boost::winapi::HANDLE_ INVALID_HANDLE_VALUE = boost::winapi::INVALID_HANDLE_VALUE_;
-
-template <typename Destination, typename Source>
-Destination const* offset_cast(Source const* s, std::size_t offset) {
-  return reinterpret_cast<Destination const*>(
-      reinterpret_cast<std::byte const*>(s) + offset);
-}
-
-template <typename Destination, typename Source>
-Destination* offset_cast(Source* s, std::size_t offset) {
-  return reinterpret_cast<Destination*>(reinterpret_cast<std::byte*>(s) + offset);
-}
-
-NtfsResidentAttributeHeader const* to_resident(NtfsAttributeHeader const* attr) {
-  if(attr->Nonresident) {
-    return nullptr;
-  }
-  return reinterpret_cast<NtfsResidentAttributeHeader const*>(attr);
-}
-
-NtfsNonResidentAttributeHeader const* to_nonresident(NtfsAttributeHeader const* attr) {
-  if(!attr->Nonresident) {
-    return nullptr;
+// Runs of unused records shorter than this are read through rather than
+// split into separate requests.
+constexpr std::uint64_t kMinSkipBytes = 256 * 1024;
+
+// Largest single read issued for a batch of record lookups.
+constexpr std::uint64_t kMaxBatchBytes = 1024 * 1024;
+
+// Fixups only touch the last word of each sector. A read-only (mapped)
+// record whose used bytes end before the first of those is usable as is;
+// anything else is copied to scratch and fixed there.
+NtfsFileRecord const* file_record_from_mapping(
+    std::byte const* data, std::byte* scratch, std::size_t record_size) {
+  auto file = reinterpret_cast<NtfsFileRecord const*>(data);
+  if(file->BytesInUse <= 512 - sizeof(std::uint16_t)) {
+    return file;
   }
-  return reinterpret_cast<NtfsNonResidentAttributeHeader const*>(attr);
+  std::memcpy(scratch, data, record_size);
+  return file_record_from_buffer(scratch);
 }
 
-template <typename T>
-T const* attribute_cast(NtfsResidentAttributeHeader const* attr) {
-  if(attr->ValueLength < sizeof(T)) {
-    return nullptr;
-  }
-
-  return offset_cast<T>(attr, attr->ValueOffset);
-}
-
-class AttributeList {
- public:
-  AttributeList(NtfsFileRecord const& file)
-      : record_(&file)
-      , current_(offset_cast<NtfsAttributeHeader>(&file, file.AttributesOffset)) {
+// Restores the last word of each sector of a multi-sector structure from
+// its update sequence array. Fails if the structure is torn or malformed.
+bool apply_fixups(
+    std::byte* data, std::size_t size, std::uint16_t usa_offset,
+    std::uint16_t usa_count) {
+  if(usa_count == 0 || (usa_count - 1) * std::size_t(512) > size ||
+     usa_offset + usa_count * sizeof(std::uint16_t) > size) {
+    return false;
   }
 
-  NtfsAttributeHeader const* next() {
-    if(current_->Length > 0 && current_->Length < record_->BytesInUse) {
-      current_ = offset_cast<NtfsAttributeHeader>(current_, current_->Length);
+  auto usa = reinterpret_cast<std::uint16_t*>(data + usa_offset);
+  for(std::uint32_t i = 1; i < usa_count; ++i) {
+    auto word = reinterpret_cast<std::uint16_t*>(data + i * 512 - 2);
+    if(*word != usa[0]) {
+      return false;
     }
-    else if(current_->Nonresident) {
-      current_ = offset_cast<NtfsAttributeHeader>(
-          current_, sizeof(NtfsNonResidentAttributeHeader));
-    }
-
-    if(current_->Type == NtfsAttributeType::Terminator) {
-      current_ = nullptr;
-    }
-
-    return current();
-  }
-
-  NtfsAttributeHeader const* current() const {
-    return current_;
+    *word = usa[i];
   }
-
- private:
-  NtfsFileRecord const* record_;
-  NtfsAttributeHeader const* current_;
-};
-
-bool fix_file_record(NtfsFileRecord* file) {
-  std::uint16_t* usa = reinterpret_cast<std::uint16_t*>(
-      reinterpret_cast<std::byte*>(file) + file->UsaOffset);
-  std::uint16_t* sector = reinterpret_cast<std::uint16_t*>(file);
-
-  if(file->UsaCount > 4) {
-    return false;
-  }
-  for(std::uint32_t i = 1; i < file->UsaCount; i++) {
-    sector[255] = usa[i];
-    sector += 256;
-  }
-
   return true;
 }
 
-std::time_t to_time_t(std::int64_t t) {
-#if !defined(BOOST_MSVC) || BOOST_MSVC > 1300 // > VC++ 7.0
-  if(t == 0) {
-    return {};
-  }
-  t -= 116444736000000000LL;
-#else
-  t -= 116444736000000000;
-#endif
-  t /= 10000000;
-  if(t < 0) {
-    t = 0;
-  }
-  return static_cast<std::time_t>(t);
-}
-
-NtfsAttributeHeader const* find_attribute(
-    NtfsFileRecord const* file, NtfsAttributeType type) {
-  auto attribute = offset_cast<NtfsAttributeHeader>(file, file->AttributesOffset);
-  int stop = std::min<int>(8, file->NextAttributeNumber);
-  for(int i = 0; i < stop; ++i) {
-    if(attribute->Type == type) {
-      return attribute;
-    }
-
-    if(attribute->Type < NtfsAttributeType::FirstAttribute) {
-      break;
-    }
-
-    if(attribute->Type > NtfsAttributeType::LastAttribute) {
-      break;
-    }
+// A directory's index allocation read into memory, which index nodes are
+// loaded from as the tree is walked.
+struct IndexAllocation {
+  std::byte* data;
+  std::uint64_t size;
+  std::uint32_t bytes_per_block;
+  // Child vcns count clusters, or sectors when blocks are smaller than a
+  // cluster.
+  std::uint32_t bytes_per_vcn;
+};
 
-    if(attribute->Length > 0 && attribute->Length < file->BytesInUse) {
-      attribute = offset_cast<NtfsAttributeHeader>(attribute, attribute->Length);
-    }
-    else if(attribute->Nonresident) {
-      attribute = offset_cast<NtfsAttributeHeader>(
-          attribute, sizeof(NtfsNonResidentAttributeHeader));
-    }
-  }
-  return nullptr;
-}
+// Nodes deeper than this mean a corrupt (possibly cyclic) index.
+constexpr int kMaxIndexDepth = 32;
 
-NtfsFileRecord const* file_record_from_buffer(std::byte* data) {
-  auto file = reinterpret_cast<NtfsFileRecord*>(data);
-  fix_file_record(file);
-  return file;
+// Attributes too fragmented for one record continue in extension records,
+// which aren't followed; the base record's runs then end early.
+bool runs_cover(
+    NtfsNonResidentAttributeHeader const* attrib,
+    std::uint32_t bytes_per_cluster) {
+  return attrib->DataSize <= (attrib->LastVcn + 1) * bytes_per_cluster;
 }
 
 } // namespace
@@ -419,20 +107,21 @@ MftParser::~MftParser() {
   close();
 }
 
-void MftParser::open(std::wstring volume) {
-  using namespace boost::winapi;
-  volume_ = boost::winapi::CreateFileW(
-      volume.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
-      OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, nullptr);
+void MftParser::open(std::string const& path, BlockSourceMode mode) {
+  open(open_block_source(path, mode));
+}
 
-  if(volume_ == INVALID_HANDLE_VALUE) {
-    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to open volume"));
-  }
+#ifdef _WIN32
+void MftParser::open(std::wstring const& volume) {
+  open(std::make_unique<Win32BlockSource>(volume));
+}
+#endif
 
+void MftParser::open(std::unique_ptr<BlockSource> source) {
+  source_ = std::move(source);
   try {
     load_boot_sector();
     load_mft();
-    volume_name_ = std::move(volume);
   }
   catch(...) {
     close();
@@ -441,10 +130,7 @@ void MftParser::open(std::wstring volume) {
 }
 
 void MftParser::close() {
-  if(volume_) {
-    boost::winapi::CloseHandle(volume_);
-    volume_ = nullptr;
-  }
+  source_.reset();
 }
 
 std::uint64_t MftParser::count() const {
@@ -459,16 +145,185 @@ std::vector<MftFile> MftParser::read_all() const {
   return ret;
 }
 
-void MftParser::load_boot_sector() {
-  BootBlock boot_sector;
-  DWORD read_size = 0;
-  if(!boost::winapi::ReadFile(
-         volume_, &boot_sector, sizeof(boot_sector), &read_size, nullptr)) {
+std::vector<MftFile> MftParser::read_all_parallel(
+    std::size_t threads, std::uint64_t records_per_chunk) const {
+  auto chunks = plan_mft_chunks(records_per_chunk);
+  std::vector<std::vector<MftFile>> results(chunks.size());
+
+  // One read buffer per thread, reused across its chunks.
+  threads = std::max<std::size_t>(
+      1, std::min(thread_count(threads), chunks.size()));
+  std::vector<AlignedBuffer> buffers(threads);
+  parallel_for_workers(
+      chunks.size(), threads, [&](std::size_t c, std::size_t worker) {
+        results[c].reserve(chunks[c].size / bytes_per_file_record_);
+        read_chunk(chunks[c], buffers[worker], results[c]);
+      });
+
+  std::size_t total = 0;
+  for(auto&& r : results) {
+    total += r.size();
   }
 
-  if(read_size != sizeof(boot_sector)) {
-    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to read boot sector."));
+  std::vector<MftFile> ret;
+  ret.reserve(total);
+  for(auto&& r : results) {
+    std::move(r.begin(), r.end(), std::back_inserter(ret));
+    r = {};
   }
+  return ret;
+}
+
+void MftParser::read_all_parallel(
+    MftSink const& sink, std::size_t threads,
+    std::uint64_t records_per_chunk) const {
+  auto chunks = plan_mft_chunks(records_per_chunk);
+
+  // Each thread decodes into its own buffers, then waits for the chunks
+  // before its own to be delivered. Chunks are handed out in order, so the
+  // ones being waited for are always in progress.
+  threads = std::max<std::size_t>(
+      1, std::min(thread_count(threads), chunks.size()));
+  std::vector<AlignedBuffer> buffers(threads);
+  std::vector<std::vector<MftFile>> results(threads);
+  std::mutex mutex;
+  std::condition_variable delivered;
+  std::size_t next = 0;
+  bool failed = false;
+  parallel_for_workers(
+      chunks.size(), threads, [&](std::size_t c, std::size_t worker) {
+        auto& result = results[worker];
+        try {
+          result.clear();
+          read_chunk(chunks[c], buffers[worker], result);
+          std::unique_lock<std::mutex> lk(mutex);
+          delivered.wait(lk, [&] { return next == c || failed; });
+          if(failed) {
+            return;
+          }
+          if(!result.empty()) {
+            sink(MftFileSpan(result.data(), result.size()));
+          }
+          ++next;
+        }
+        catch(...) {
+          std::lock_guard<std::mutex> lk(mutex);
+          failed = true;
+          delivered.notify_all();
+          throw;
+        }
+        delivered.notify_all();
+      });
+}
+
+std::vector<MftParser::Extent> MftParser::plan_mft_chunks(
+    std::uint64_t records_per_chunk) const {
+  // Chunks are whole clusters so every read stays aligned.
+  return plan_mft_reads(std::max<std::uint64_t>(
+      bytes_per_cluster_,
+      records_per_chunk * bytes_per_file_record_ / bytes_per_cluster_ *
+          bytes_per_cluster_));
+}
+
+void MftParser::read_chunk(
+    Extent const& chunk, AlignedBuffer& buffer,
+    std::vector<MftFile>& dest) const {
+  if(chunk.split) {
+    buffer.resize(chunk.size);
+    read_runs(mft_runs_, chunk.offset, buffer.data(), buffer.size());
+    process_mft_read_buffer(buffer, dest);
+    return;
+  }
+  if(auto region = source_->map(chunk.offset, chunk.size)) {
+    process_mft_mapping(region, dest);
+    return;
+  }
+  buffer.resize(chunk.size);
+  source_->read(chunk.offset, buffer.data(), buffer.size());
+  process_mft_read_buffer(buffer, dest);
+}
+
+bool MftParser::any_record_in_use(
+    std::uint64_t first, std::uint64_t count) const {
+  if(mft_bitmap_.empty()) {
+    return true;
+  }
+
+  // Records past the end of the bitmap were never allocated.
+  auto last = std::min<std::uint64_t>(first + count, mft_bitmap_.size() * 8);
+  for(auto i = first; i < last; ++i) {
+    if(mft_bitmap_[i / 8] & (1u << (i % 8))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::vector<MftParser::Extent> MftParser::plan_mft_reads(
+    std::uint64_t max_read_size) const {
+  // Step a cluster at a time, or a record if those are larger, so every read
+  // stays aligned and never splits a record.
+  auto records_per_step = std::max<std::uint64_t>(1, records_per_cluster_);
+  auto bytes_per_step = records_per_step * bytes_per_file_record_;
+  max_read_size = std::max(
+      bytes_per_step, max_read_size / bytes_per_step * bytes_per_step);
+
+  std::vector<Extent> reads;
+  // Where the run starts within the $MFT.
+  std::uint64_t run_start = 0;
+  for(auto&& run : mft_runs_) {
+    if(run_start >= mft_size_) {
+      break;
+    }
+    auto run_end =
+        std::min(run_start + run.clusters * bytes_per_cluster_, mft_size_);
+    bool open = false;
+    std::uint64_t gap = 0;
+    // A record that started in the previous run was planned there.
+    auto record = (run_start + bytes_per_file_record_ - 1) /
+                  bytes_per_file_record_;
+    for(auto start = record * bytes_per_file_record_; start < run_end;
+        start += bytes_per_step, record += records_per_step) {
+      // Records larger than clusters can run on into the next run, which
+      // is anywhere on the volume, so they're read on their own.
+      if(start + bytes_per_file_record_ > run_end) {
+        if(any_record_in_use(record, 1)) {
+          reads.push_back({start, bytes_per_file_record_, true});
+        }
+        break;
+      }
+      // Sparse runs have no clusters on disk, and no records either.
+      if(run.lcn == 0) {
+        continue;
+      }
+
+      auto step = std::min(bytes_per_step, run_end - start);
+      if(!any_record_in_use(record, step / bytes_per_file_record_)) {
+        gap += step;
+        continue;
+      }
+
+      // Reading through a short gap is cheaper than another request.
+      if(open && gap < kMinSkipBytes &&
+         reads.back().size + gap + step <= max_read_size) {
+        reads.back().size += gap + step;
+      }
+      else {
+        reads.push_back(
+            {run.lcn * bytes_per_cluster_ + start - run_start, step});
+        open = true;
+      }
+      gap = 0;
+    }
+    run_start += run.clusters * bytes_per_cluster_;
+  }
+  return reads;
+}
+
+void MftParser::load_boot_sector() {
+  BootBlock boot_sector;
+  static_assert(sizeof(boot_sector) == 512, "Boot sector must be one sector");
+  source_->read(0, &boot_sector, sizeof(boot_sector));
 
   if(std::memcmp("NTFS", boot_sector.Format, 4)) {
     BOOST_THROW_EXCEPTION(std::runtime_error("Volume is not an NTFS drive"));
@@ -485,26 +340,18 @@ void MftParser::load_boot_sector() {
   }
 
   mft_location_ = boot_sector.MftStartLcn * bytes_per_cluster_;
+  volume_clusters_ = boot_sector.TotalSectors / boot_sector.SectorsPerCluster;
 }
 
 void MftParser::load_mft() {
-  boost::winapi::LARGE_INTEGER_ offset;
-  offset.QuadPart = mft_location_;
-  boost::winapi::SetFilePointerEx(volume_, offset, nullptr, FILE_BEGIN);
-  mft_buffer_.resize(bytes_per_cluster_);
-  DWORD read_size = 0;
-  if(!boost::winapi::ReadFile(
-         volume_, mft_buffer_.data(), bytes_per_cluster_, &read_size, NULL)) {
-    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to read MFT"));
-  }
-
-  if(read_size < sizeof(NtfsFileRecord)) {
-    BOOST_THROW_EXCEPTION(
-        std::runtime_error("Failed to read MFT file record header"));
-  }
-
-  auto file = file_record_from_buffer(mft_buffer_.data());
-  if(file->Type != 'ELIF') {
+  // Small cluster sizes can have file records spanning several clusters.
+  auto clusters_per_record =
+      (bytes_per_file_record_ + bytes_per_cluster_ - 1) / bytes_per_cluster_;
+  AlignedBuffer buffer(clusters_per_record * bytes_per_cluster_);
+  source_->read(mft_location_, buffer.data(), buffer.size());
+
+  auto file = file_record_from_buffer(buffer.data());
+  if(file->Type != NtfsFileRecord::kMagic) {
     BOOST_THROW_EXCEPTION(
         std::runtime_error("Failed to read MFT as Ntfs file"));
   }
@@ -516,82 +363,188 @@ void MftParser::load_mft() {
         std::runtime_error("Failed to find applicable attributes."));
   }
 
-  mft_ = to_nonresident(data_attrib);
-  mft_size_ = mft_->DataSize;
+  auto mft = to_nonresident(data_attrib);
+  if(!mft) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("MFT $DATA is resident."));
+  }
+
+  mft_runs_ = decode_runs(mft, volume_clusters_);
+  if(!runs_cover(mft, bytes_per_cluster_)) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("MFT continues in an extension record."));
+  }
+  mft_size_ = mft->DataSize;
   BOOST_ASSERT(mft_size_ % bytes_per_file_record_ == 0);
   mft_record_count_ = mft_size_ / bytes_per_file_record_;
-  BOOST_ASSERT(bytes_per_cluster_ % bytes_per_file_record_ == 0);
+  // Zero when records are larger than clusters, as with 1 KiB records on
+  // 512 byte clusters.
   records_per_cluster_ = bytes_per_cluster_ / bytes_per_file_record_;
+  load_mft_bitmap(bitmap_attrib);
 }
 
-void MftParser::read_data_run(
-    std::uint64_t cluster, std::uint64_t count, std::vector<MftFile>& dest) const {
-  boost::winapi::LARGE_INTEGER_ offset;
-  offset.QuadPart = cluster * bytes_per_cluster_;
-  boost::winapi::SetFilePointerEx(volume_, offset, nullptr, FILE_BEGIN);
-
-  std::uint32_t clusters_per_read = 1024;
-  auto read_count = count / clusters_per_read;
-  auto bytes_per_read = clusters_per_read * bytes_per_cluster_;
-  std::vector<std::byte> buffer(bytes_per_read);
+void MftParser::load_mft_bitmap(NtfsAttributeHeader const* bitmap) {
+  mft_bitmap_.clear();
+  if(auto resident = to_resident(bitmap)) {
+    auto value = offset_cast<std::uint8_t>(resident, resident->ValueOffset);
+    mft_bitmap_.assign(value, value + resident->ValueLength);
+    return;
+  }
 
-  for(int i = 0; i < read_count; ++i) {
-    DWORD bytes_read = 0;
-    if(!boost::winapi::ReadFile(
-           volume_, buffer.data(), bytes_per_read, &bytes_read, nullptr)) {
-      BOOST_THROW_EXCEPTION(std::runtime_error("Failed to read MFT"));
+  // Large MFTs keep the bitmap in its own runs.
+  auto attrib = to_nonresident(bitmap);
+  if(!runs_cover(attrib, bytes_per_cluster_)) {
+    // Without the whole bitmap every record has to be read.
+    return;
+  }
+  mft_bitmap_.reserve(attrib->DataSize);
+  AlignedBuffer buffer;
+  for(auto&& run : decode_runs(attrib, volume_clusters_)) {
+    if(mft_bitmap_.size() == attrib->DataSize) {
+      break;
     }
-
-    if(bytes_read != buffer.size()) {
-      BOOST_THROW_EXCEPTION(
-          std::runtime_error("Failed to read correct number of bytes."));
+    auto run_bytes = std::min<std::uint64_t>(
+        run.clusters * bytes_per_cluster_,
+        attrib->DataSize - mft_bitmap_.size());
+    if(run.lcn == 0) {
+      mft_bitmap_.resize(mft_bitmap_.size() + run_bytes);
+    }
+    else {
+      buffer.resize(run.clusters * bytes_per_cluster_);
+      source_->read(
+          run.lcn * bytes_per_cluster_, buffer.data(), buffer.size());
+      auto data = reinterpret_cast<std::uint8_t const*>(buffer.data());
+      mft_bitmap_.insert(mft_bitmap_.end(), data, data + run_bytes);
     }
+  }
+}
 
-    process_mft_read_buffer(buffer, dest);
+// https://flatcap.org/linux-ntfs/ntfs/concepts/data_runs.html
+std::vector<DataRun> decode_runs(
+    NtfsNonResidentAttributeHeader const* attrib,
+    std::uint64_t volume_clusters) {
+  if(attrib->RunArrayOffset >= attrib->Length || attrib->FirstVcn != 0 ||
+     attrib->LastVcn < attrib->FirstVcn) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Malformed run list."));
   }
 
-  auto remaining_clusters = static_cast<DWORD>(count % clusters_per_read);
-  if(remaining_clusters != 0) {
-    DWORD bytes_read = 0;
-    if(!boost::winapi::ReadFile(
-           volume_, buffer.data(), bytes_per_read, &bytes_read, nullptr)) {
-      BOOST_THROW_EXCEPTION(std::runtime_error("Failed to read MFT"));
+  auto run = offset_cast<std::uint8_t>(attrib, attrib->RunArrayOffset);
+  auto end = offset_cast<std::uint8_t>(attrib, attrib->Length);
+  std::vector<DataRun> runs;
+  std::uint64_t vcn = 0;
+  std::int64_t lcn = 0;
+  while(run < end && *run != 0) {
+    std::uint8_t length_length = *run & 0xf;
+    std::uint8_t offset_length = (*run >> 4) & 0xf;
+    ++run;
+    if(length_length == 0 || length_length > 8 || offset_length > 8 ||
+       end - run < length_length + offset_length) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Malformed data run."));
     }
 
-    if(bytes_read != buffer.size()) {
-      BOOST_THROW_EXCEPTION(
-          std::runtime_error("Failed to read correct number of bytes."));
+    std::uint64_t length = 0;
+    for(int i = 0; i < length_length; ++i) {
+      length |= std::uint64_t(*run++) << (8 * i);
     }
 
-    buffer.resize(remaining_clusters * bytes_per_cluster_);
-    process_mft_read_buffer(buffer, dest);
+    // Offsets are signed and relative to the previous run. No offset at all
+    // marks a sparse run.
+    std::uint64_t cluster = 0;
+    if(offset_length) {
+      std::uint64_t delta = 0;
+      for(int i = 0; i < offset_length; ++i) {
+        delta |= std::uint64_t(*run++) << (8 * i);
+      }
+      if(offset_length < 8 && (delta >> (8 * offset_length - 1)) & 1) {
+        delta |= ~std::uint64_t(0) << (8 * offset_length);
+      }
+      lcn += static_cast<std::int64_t>(delta);
+      cluster = lcn;
+      bool outside = volume_clusters && (cluster > volume_clusters ||
+                                          length > volume_clusters - cluster);
+      if(lcn <= 0 || outside) {
+        BOOST_THROW_EXCEPTION(
+            std::runtime_error("Data run lies outside the volume."));
+      }
+    }
+
+    if(length == 0) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Empty data run."));
+    }
+    runs.push_back({vcn, cluster, length});
+    vcn += length;
+  }
+
+  if(vcn != attrib->LastVcn + 1) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("Data runs don't cover the attribute."));
   }
+  return runs;
+}
+
+void MftParser::read_runs(
+    std::vector<DataRun> const& runs, std::uint64_t position,
+    std::byte* dest, std::uint64_t size) const {
+  while(size) {
+    auto vcn = position / bytes_per_cluster_;
+    auto run = std::upper_bound(
+        runs.begin(), runs.end(), vcn,
+        [](std::uint64_t v, DataRun const& r) { return v < r.vcn; });
+    BOOST_ASSERT(run != runs.begin());
+    --run;
+    auto run_start = run->vcn * bytes_per_cluster_;
+    auto run_end = run_start + run->clusters * bytes_per_cluster_;
+    BOOST_ASSERT(position < run_end);
+    auto bytes = std::min(size, run_end - position);
+    if(run->lcn == 0) {
+      std::memset(dest, 0, bytes);
+    }
+    else {
+      source_->read(
+          run->lcn * bytes_per_cluster_ + position - run_start, dest, bytes);
+    }
+    position += bytes;
+    dest += bytes;
+    size -= bytes;
+  }
+}
+
+namespace {
+// A DOS-only name is the 8.3 alias of a long name stored in another
+// attribute, so it only wins when the record has nothing else.
+bool is_dos_only_name(NtfsFilenameAttribute const* na) {
+  return (na->NameTypes & NtfsFilenameAttribute::NameType::DOS) &&
+         !(na->NameTypes & NtfsFilenameAttribute::NameType::Win32);
+}
+
+// Copies what a $FILE_NAME value records about its file into f, transcoding
+// the name straight into f's own buffer.
+void assign_file_name(NtfsFilenameAttribute const& name, MftFile& f) {
+  f.parent = name.DirectoryRecordId & 0x0000ffffffffffff;
+  f.name.resize(utf8_capacity(name.NameLength));
+  f.name.resize(utf16_to_utf8(name.Name, name.NameLength, f.name.data()));
+  f.size = name.DataSize;
+  f.modified = to_time_t(name.LastWriteTime);
+  f.created = to_time_t(name.CreationTime);
+  f.accessed = to_time_t(name.LastAccessTime);
 }
 
-MftFile file_record_to_mft_file(NtfsFileRecord const& record) {
-  MftFile f;
+} // namespace
+
+bool file_record_to_mft_file(NtfsFileRecord const& record, MftFile& f) {
+  NtfsFilenameAttribute const* name = nullptr;
+  std::uint64_t const* data_size = nullptr;
   for(AttributeList attributes(record); attributes.current(); attributes.next()) {
     auto attrib = attributes.current();
     switch(attrib->Type) {
       case NtfsAttributeType::FileName: {
         auto na = attribute_cast<NtfsFilenameAttribute>(to_resident(attrib));
-        if(!na) {
-          continue;
+        if(na && (!name || is_dos_only_name(name))) {
+          name = na;
         }
-
-        f.id = record.RecordId;
-        f.parent = na->DirectoryRecordId & 0x0000ffffffffffff;
-        f.name = boost::nowide::narrow(na->Name, na->NameLength);
-        f.size = na->DataSize;
-        f.modified = to_time_t(na->LastWriteTime);
-        f.created = to_time_t(na->CreationTime);
-        f.accessed = to_time_t(na->LastAccessTime);
-        f.directory = record.Flags & NtfsFileRecord::Flag::Directory;
-
       } break;
       case NtfsAttributeType::Data: {
         if(auto data_attribute = to_nonresident(attrib)) {
-          f.size = data_attribute->DataSize;
+          data_size = &data_attribute->DataSize;
         }
       } break;
       // Silence warning
@@ -599,165 +552,565 @@ MftFile file_record_to_mft_file(NtfsFileRecord const& record) {
         break;
     }
   }
-  return f;
+
+  if(!name) {
+    return false;
+  }
+
+  f.id = record.RecordId;
+  f.sequence = record.SequenceNumber;
+  f.lsn = record.Usn;
+  assign_file_name(*name, f);
+  if(data_size) {
+    f.size = *data_size;
+  }
+  f.directory = record.Flags & NtfsFileRecord::Flag::Directory;
+  return true;
+}
+
+namespace {
+
+// Appends the entries of an index node and its children in collation
+// order. node_size bounds the node from the start of its header.
+void walk_index_node(
+    IndexAllocation const& allocation, NtfsIndexHeader const* node,
+    std::uint64_t node_size, int depth, std::vector<MftFile>& dest) {
+  if(depth > kMaxIndexDepth) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Index is too deep."));
+  }
+
+  auto base = reinterpret_cast<std::byte const*>(node);
+  auto end = base + std::min<std::uint64_t>(node->IndexLength, node_size);
+  auto entry = offset_cast<NtfsIndexEntry>(node, node->EntriesOffset);
+  while(reinterpret_cast<std::byte const*>(entry) + sizeof(NtfsIndexEntry) <=
+        end) {
+    auto entry_end = reinterpret_cast<std::byte const*>(entry) + entry->Length;
+    if(entry->Length < sizeof(NtfsIndexEntry) || entry_end > end) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Malformed index entry."));
+    }
+
+    if(entry->Flags & NtfsIndexEntry::Flag::HasSubnode) {
+      std::uint64_t vcn;
+      std::memcpy(&vcn, entry_end - sizeof(vcn), sizeof(vcn));
+      auto offset = vcn * allocation.bytes_per_vcn;
+      if(offset >= allocation.size ||
+         allocation.size - offset < allocation.bytes_per_block) {
+        BOOST_THROW_EXCEPTION(
+            std::runtime_error("Index node lies outside the allocation."));
+      }
+
+      auto block = allocation.data + offset;
+      auto record = reinterpret_cast<NtfsIndexRecord*>(block);
+      if(record->Type != NtfsIndexRecord::kMagic ||
+         !apply_fixups(
+             block, allocation.bytes_per_block, record->UsaOffset,
+             record->UsaCount)) {
+        BOOST_THROW_EXCEPTION(std::runtime_error("Corrupt index node."));
+      }
+      walk_index_node(
+          allocation, &record->Header,
+          allocation.bytes_per_block - offsetof(NtfsIndexRecord, Header),
+          depth + 1, dest);
+    }
+
+    if(entry->Flags & NtfsIndexEntry::Flag::Last) {
+      break;
+    }
+
+    auto key = offset_cast<NtfsFilenameAttribute>(entry, sizeof(NtfsIndexEntry));
+    auto key_size = offsetof(NtfsFilenameAttribute, Name);
+    if(entry->KeyLength < key_size ||
+       entry->KeyLength < key_size + key->NameLength * sizeof(char16_t) ||
+       sizeof(NtfsIndexEntry) + entry->KeyLength > entry->Length) {
+      BOOST_THROW_EXCEPTION(std::runtime_error("Malformed index key."));
+    }
+
+    // Files with a long name are indexed under their 8.3 alias too.
+    if(!is_dos_only_name(key)) {
+      dest.emplace_back();
+      MftFile& f = dest.back();
+      f.id = entry->FileReference & 0x0000ffffffffffff;
+      f.sequence = static_cast<std::uint16_t>(entry->FileReference >> 48);
+      assign_file_name(*key, f);
+      f.directory = key->Flags & NtfsFilenameAttribute::Flag::Directory;
+    }
+    entry = offset_cast<NtfsIndexEntry>(entry, entry->Length);
+  }
+}
+} // namespace
+
+std::optional<MftFile> MftParser::read_record(std::uint64_t id) const {
+  auto files = read_records({id});
+  if(files.empty()) {
+    return std::nullopt;
+  }
+  return std::move(files.front());
+}
+
+std::vector<MftFile> MftParser::read_records(
+    std::vector<std::uint64_t> ids) const {
+  std::vector<MftFile> files;
+  for_each_record(std::move(ids), [&](NtfsFileRecord const& record) {
+    files.emplace_back();
+    if(!file_record_to_mft_file(record, files.back())) {
+      files.pop_back();
+    }
+  });
+  return files;
+}
+
+std::vector<FileExtents> MftParser::read_extents(
+    std::vector<std::uint64_t> ids) const {
+  std::vector<FileExtents> files;
+  for_each_record(std::move(ids), [&](NtfsFileRecord const& record) {
+    FileExtents file;
+    file.id = record.RecordId;
+    for(AttributeList attributes(record); attributes.current();
+        attributes.next()) {
+      auto attrib = to_nonresident(attributes.current());
+      // Named $DATA attributes are alternate streams.
+      if(!attrib || attrib->Type != NtfsAttributeType::Data ||
+         attrib->NameLength != 0) {
+        continue;
+      }
+
+      auto bytes_on_disk = std::min(
+          attrib->InitializedSize, (attrib->LastVcn + 1) * bytes_per_cluster_);
+      for(auto&& run : decode_runs(attrib, volume_clusters_)) {
+        auto logical = run.vcn * bytes_per_cluster_;
+        if(logical >= bytes_on_disk) {
+          break;
+        }
+
+        // Sparse runs read back as zeros without touching the disk.
+        if(run.lcn != 0) {
+          file.extents.push_back(
+              {logical, run.lcn * bytes_per_cluster_,
+               std::min(run.clusters * bytes_per_cluster_,
+                        bytes_on_disk - logical)});
+        }
+      }
+      break;
+    }
+    files.push_back(std::move(file));
+  });
+  return files;
+}
+
+void MftParser::for_each_record(
+    std::vector<std::uint64_t> ids,
+    std::function<void(NtfsFileRecord const&)> const& visit) const {
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  ids.erase(
+      std::lower_bound(ids.begin(), ids.end(), mft_record_count_), ids.end());
+
+  // Ids within a cluster of each other share a read, up to kMaxBatchBytes.
+  auto max_gap = std::max<std::uint64_t>(1, records_per_cluster_);
+  auto max_batch = kMaxBatchBytes / bytes_per_file_record_;
+  AlignedBuffer buffer;
+  for(auto first = ids.begin(); first != ids.end();) {
+    auto last = first + 1;
+    while(last != ids.end() && *last - *(last - 1) <= max_gap &&
+          *last - *first < max_batch) {
+      ++last;
+    }
+
+    auto count = *(last - 1) - *first + 1;
+    buffer.resize(count * bytes_per_file_record_);
+    read_runs(
+        mft_runs_, *first * bytes_per_file_record_, buffer.data(),
+        buffer.size());
+    for(auto id = first; id != last; ++id) {
+      auto data = buffer.data() + (*id - *first) * bytes_per_file_record_;
+      auto header = reinterpret_cast<NtfsFileRecord const*>(data);
+      if(header->Type != NtfsFileRecord::kMagic || !record_in_use(data)) {
+        continue;
+      }
+      visit(*file_record_from_buffer(data));
+    }
+    first = last;
+  }
+}
+
+NtfsFileRecord const* MftParser::load_record(
+    std::uint64_t id, AlignedBuffer& buffer) const {
+  if(id >= mft_record_count_) {
+    return nullptr;
+  }
+
+  buffer.resize(bytes_per_file_record_);
+  read_runs(
+      mft_runs_, id * bytes_per_file_record_, buffer.data(), buffer.size());
+  auto header = reinterpret_cast<NtfsFileRecord const*>(buffer.data());
+  if(header->Type != NtfsFileRecord::kMagic || !record_in_use(buffer.data())) {
+    return nullptr;
+  }
+  return file_record_from_buffer(buffer.data());
+}
+
+std::vector<MftFile> MftParser::list_directory(std::uint64_t id) const {
+  AlignedBuffer buffer;
+  auto record = load_record(id, buffer);
+  if(!record || !(record->Flags & NtfsFileRecord::Flag::Directory)) {
+    return {};
+  }
+
+  NtfsResidentAttributeHeader const* root_attribute = nullptr;
+  NtfsNonResidentAttributeHeader const* allocation_attribute = nullptr;
+  for(AttributeList attributes(*record); attributes.current();
+      attributes.next()) {
+    auto attrib = attributes.current();
+    if(attrib->Type == NtfsAttributeType::IndexRoot) {
+      root_attribute = to_resident(attrib);
+    }
+    else if(attrib->Type == NtfsAttributeType::IndexAllocation) {
+      allocation_attribute = to_nonresident(attrib);
+    }
+  }
+
+  auto root = attribute_cast<NtfsIndexRoot>(root_attribute);
+  if(!root || root->Type != NtfsAttributeType::FileName) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("Directory has no $I30 index root."));
+  }
+
+  // Small directories fit entirely in the root. Larger ones keep the rest
+  // of the tree in index blocks, which are read in one go.
+  AlignedBuffer blocks;
+  IndexAllocation allocation = {};
+  if(root->Header.Flags & NtfsIndexHeader::Flag::HasChildren) {
+    if(!allocation_attribute) {
+      BOOST_THROW_EXCEPTION(
+          std::runtime_error("Directory has no $I30 index allocation."));
+    }
+
+    if(!runs_cover(allocation_attribute, bytes_per_cluster_)) {
+      BOOST_THROW_EXCEPTION(std::runtime_error(
+          "$I30 index allocation continues in an extension record."));
+    }
+
+    blocks.resize(allocation_attribute->DataSize);
+    auto runs = decode_runs(allocation_attribute, volume_clusters_);
+    read_runs(runs, 0, blocks.data(), blocks.size());
+    allocation.data = blocks.data();
+    allocation.size = blocks.size();
+    allocation.bytes_per_block = root->BytesPerIndexRecord;
+    allocation.bytes_per_vcn =
+        root->BytesPerIndexRecord < bytes_per_cluster_ ? 512
+                                                       : bytes_per_cluster_;
+  }
+
+  std::vector<MftFile> files;
+  walk_index_node(
+      allocation, &root->Header,
+      root_attribute->ValueLength - offsetof(NtfsIndexRoot, Header), 0,
+      files);
+  return files;
+}
+
+std::vector<MftFile> MftParser::list_subtree(std::uint64_t id) const {
+  std::vector<MftFile> files;
+  std::vector<std::uint64_t> pending = {id};
+  while(!pending.empty()) {
+    auto directory = pending.back();
+    pending.pop_back();
+    for(auto&& f : list_directory(directory)) {
+      // The root lists itself as ".".
+      if(f.id == directory) {
+        continue;
+      }
+
+      if(f.directory) {
+        pending.push_back(f.id);
+      }
+      files.push_back(std::move(f));
+    }
+  }
+  return files;
 }
 
 void MftParser::process_mft_read_buffer(
-    std::vector<std::byte>& buffer, std::vector<MftFile>& dest) const {
+    AlignedBuffer& buffer, std::vector<MftFile>& dest) const {
   for(auto i = buffer.begin(), e = buffer.end(); i != e;
       i += bytes_per_file_record_) {
-    NtfsFileRecord const* record = file_record_from_buffer(&*i);
-    if(!(record->Flags & NtfsFileRecord::Flag::InUse)) {
+    if(!record_in_use(i)) {
       continue;
     }
 
+    NtfsFileRecord const* record = file_record_from_buffer(i);
     dest.emplace_back();
-    MftFile& f = dest.back();
-    f = file_record_to_mft_file(*record);
-    if(f.name.empty()) {
+    if(!file_record_to_mft_file(*record, dest.back())) {
       dest.pop_back();
     }
   }
 }
 
-MftReader::MftReader(MftParser const& parser)
-    : run_(parser.mft_)
-    , run_reader_(parser)
-    , clusters_remaining_(parser.mft_->LastVcn + 1) {
-  run_reader_.begin(run_);
-}
+void MftParser::process_mft_mapping(
+    MappedRegion const& region, std::vector<MftFile>& dest) const {
+  AlignedBuffer scratch(bytes_per_file_record_);
+  for(auto i = region.data(), e = region.data() + region.size(); i != e;
+      i += bytes_per_file_record_) {
+    if(!record_in_use(i)) {
+      continue;
+    }
 
-OpStatus MftReader::read(std::vector<MftFile>& dest) {
-  while(true) {
-    if(clusters_remaining_ == 0) {
-      return OpStatus::Finished;
+    NtfsFileRecord const* record =
+        file_record_from_mapping(i, scratch.data(), bytes_per_file_record_);
+    dest.emplace_back();
+    if(!file_record_to_mft_file(*record, dest.back())) {
+      dest.pop_back();
     }
+  }
+}
 
-    if(run_.size() == 0 || run_.logical_cluster() == 0) {
-      run_ = run_.next();
-      run_reader_.begin(run_);
+MftReader::MftReader(MftParser const& parser, MftReadOptions const& options)
+    : extents_(parser.plan_mft_reads(
+          std::numeric_limits<std::uint64_t>::max()))
+    , extent_reader_(parser, options) {
+}
+
+OpStatus MftReader::read(std::vector<MftFile>& dest) {
+  while(auto record = next_record()) {
+    dest.emplace_back();
+    if(!file_record_to_mft_file(*record, dest.back())) {
+      dest.pop_back();
       continue;
     }
 
-    while(auto record = run_reader_.next_record()) {
-      dest.emplace_back();
-      MftFile& f = dest.back();
-      f = file_record_to_mft_file(*record);
-      if(f.name.empty()) {
-        dest.pop_back();
-      }
+    if(dest.size() == dest.capacity()) {
+      return OpStatus::NotFinished;
+    }
+  }
+  return OpStatus::Finished;
+}
 
-      if(dest.size() == dest.capacity()) {
-        return OpStatus::NotFinished;
-      }
+void MftReader::read(MftSink const& sink, std::size_t batch_size) {
+  batch_.resize(std::max<std::size_t>(1, batch_size));
+  std::size_t count = 0;
+  while(auto record = next_record()) {
+    if(!file_record_to_mft_file(*record, batch_[count])) {
+      continue;
     }
 
-    clusters_remaining_ -= run_.size();
-    if(clusters_remaining_) {
-      run_ = run_.next();
-      run_reader_.begin(run_);
+    if(++count == batch_.size()) {
+      sink(MftFileSpan(batch_.data(), count));
+      count = 0;
     }
   }
-}
 
-MftReader::DataRun::DataRun(NtfsNonResidentAttributeHeader const* mft)
-    : DataRun(offset_cast<std::uint8_t>(mft, mft->RunArrayOffset), 0) {
+  if(count) {
+    sink(MftFileSpan(batch_.data(), count));
+  }
 }
 
-std::uint64_t MftReader::DataRun::size() const {
-  return length_;
+void MftReader::read(FileTable& table) {
+  batch_.resize(1);
+  while(auto record = next_record()) {
+    if(file_record_to_mft_file(*record, batch_.front())) {
+      table.append(batch_.front());
+    }
+  }
 }
 
-std::uint64_t MftReader::DataRun::logical_cluster() const {
-  return offset_;
-}
+MftChanges MftReader::read_changes(std::vector<MftFile> previous) {
+  MftChanges changes;
+  changes.files.reserve(previous.size());
+  auto prev = previous.begin();
+  while(auto data = next_in_use()) {
+    // The sequence number and LSN sit ahead of any fixup, so unchanged
+    // records are recognised without fixing or decoding them.
+    auto header = reinterpret_cast<NtfsFileRecord const*>(data);
+    std::uint64_t id = header->RecordId;
+    for(; prev != previous.end() && prev->id < id; ++prev) {
+      changes.deleted.push_back(prev->id);
+    }
 
-MftReader::DataRun MftReader::DataRun::next() const {
-  return DataRun(run_, offset_);
-}
+    MftFile* old = nullptr;
+    if(prev != previous.end() && prev->id == id) {
+      old = &*prev++;
+      if(old->sequence == header->SequenceNumber && old->lsn == header->Usn) {
+        changes.files.push_back(std::move(*old));
+        continue;
+      }
+    }
+
+    ++changes.decoded;
+    changes.files.emplace_back();
+    auto record = extent_reader_.fix(data);
+    if(!file_record_to_mft_file(*record, changes.files.back())) {
+      changes.files.pop_back();
+      if(old) {
+        changes.deleted.push_back(id);
+      }
+      continue;
+    }
 
-MftReader::DataRun::DataRun(std::uint8_t const* run, std::uint64_t offset)
-    : run_(run) {
-  std::uint8_t length_length = (*run_) & 0xf;
-  std::uint8_t offset_length = ((*run_) >> 4) & 0xf;
-  ++run_;
+    if(!old) {
+      changes.added.push_back(id);
+    }
+    else if(old->sequence != header->SequenceNumber) {
+      // The slot was freed and handed to a new file.
+      changes.recreated.push_back(id);
+    }
+    else {
+      changes.modified.push_back(id);
+    }
+  }
 
-  for(int i = 0; i < length_length; ++i) {
-    length_ |= std::uint64_t(*run_) << (8 * i);
-    ++run_;
+  for(; prev != previous.end(); ++prev) {
+    changes.deleted.push_back(prev->id);
   }
+  return changes;
+}
 
-  // Write one byte to extract the sign.
-  offset_ = std::int8_t(run_[offset_length - 1]);
-  offset_ <<= 8 * (offset_length - 1);
-  // Can or in the remainder of the bites
-  for(int i = 0; i < offset_length - 1; ++i) {
-    offset_ |= std::uint64_t(*run_) << (8 * i);
-    ++run_;
+NtfsFileRecord const* MftReader::next_record() {
+  auto data = next_in_use();
+  return data ? extent_reader_.fix(data) : nullptr;
+}
+
+std::byte const* MftReader::next_in_use() {
+  while(true) {
+    if(auto data = extent_reader_.next_in_use()) {
+      return data;
+    }
+
+    if(next_extent_ == extents_.size()) {
+      return nullptr;
+    }
+    extent_reader_.begin(extents_[next_extent_++]);
   }
-  // And one more for the byte we extracted first.
-  ++run_;
+}
 
-  offset_ += offset;
+// Reads are whole clusters and whole records, so each buffer starts and
+// ends on a record boundary.
+std::uint32_t MftReader::ExtentReader::read_size(
+    MftReadOptions const& options, MftParser const& parser) {
+  std::uint64_t unit = std::max<std::uint64_t>(
+      parser.bytes_per_cluster_, parser.bytes_per_file_record_);
+  std::uint64_t bytes =
+      std::max<std::uint64_t>(1, options.clusters_per_read) *
+      parser.bytes_per_cluster_;
+  return static_cast<std::uint32_t>((bytes + unit - 1) / unit * unit);
 }
 
-MftReader::DataRunReader::DataRunReader(MftParser const& parser)
-    : parser_(&parser) {
+MftReader::ExtentReader::ExtentReader(
+    MftParser const& parser, MftReadOptions const& options)
+    : parser_(&parser)
+    , slots_(std::max<std::size_t>(1, options.queue_depth))
+    , scratch_(parser.bytes_per_file_record_)
+    , bytes_per_read_(read_size(options, parser))
+    , bytes_per_file_record_(parser.bytes_per_file_record_) {
 }
 
-void MftReader::DataRunReader::begin(DataRun const& run) {
-  boost::winapi::LARGE_INTEGER_ offset;
-  offset.QuadPart = run.logical_cluster() * parser_->bytes_per_cluster_;
-  boost::winapi::SetFilePointerEx(parser_->volume_, offset, nullptr, FILE_BEGIN);
+MftReader::ExtentReader::~ExtentReader() {
+  drain();
+}
 
-  std::uint32_t clusters_per_read = 1024;
-  bytes_per_read_ = clusters_per_read * parser_->bytes_per_cluster_;
-  bytes_per_file_record_ = parser_->bytes_per_file_record_;
-  run_bytes_remaining_ = run.size() * parser_->bytes_per_cluster_;
+void MftReader::ExtentReader::begin(MftParser::Extent const& extent) {
+  drain();
+  if(extent.split) {
+    // Pieced together from both runs, outside the read queue.
+    region_ = MappedRegion();
+    split_.resize(extent.size);
+    parser_->read_runs(
+        parser_->mft_runs_, extent.offset, split_.data(), split_.size());
+    cursor_ = split_.data();
+    end_ = cursor_ + split_.size();
+    bytes_unread_ = extent_bytes_remaining_ = 0;
+    return;
+  }
+  read_offset_ = extent.offset;
+  bytes_unread_ = extent.size;
+  extent_bytes_remaining_ = bytes_unread_;
+  // Image files can be parsed straight out of the page cache.
+  region_ = parser_->source_->map(read_offset_, bytes_unread_);
+  if(region_) {
+    cursor_ = region_.data();
+    end_ = cursor_ + region_.size();
+    bytes_unread_ = extent_bytes_remaining_ = 0;
+    return;
+  }
   next_buffer();
 }
 
-NtfsFileRecord const* MftReader::DataRunReader::next_record() {
-  auto e = buffer_.end();
+std::byte const* MftReader::ExtentReader::next_in_use() {
   while(true) {
-    if(cursor_ == e) {
-      if(run_bytes_remaining_) {
+    // Buffers hold whole records; a short tail is never stepped into.
+    if(bytes_left() < bytes_per_file_record_) {
+      if(extent_bytes_remaining_) {
         next_buffer();
-        e = buffer_.end();
       }
       else {
         return nullptr;
       }
     }
 
-    while(cursor_ != e) {
-      NtfsFileRecord const* record = file_record_from_buffer(&*cursor_);
+    while(bytes_left() >= bytes_per_file_record_) {
+      auto data = cursor_;
       cursor_ += bytes_per_file_record_;
-      if(!(record->Flags & NtfsFileRecord::Flag::InUse)) {
-        continue;
+      if(record_in_use(data)) {
+        return data;
       }
-      return record;
     }
   }
 }
 
-void MftReader::DataRunReader::next_buffer() {
-  auto read_size = std::min<std::uint64_t>(bytes_per_read_, run_bytes_remaining_);
-  buffer_.resize(read_size);
-  DWORD bytes_read = 0;
-  if(!boost::winapi::ReadFile(
-         parser_->volume_, buffer_.data(), (DWORD)buffer_.size(), &bytes_read,
-         nullptr)) {
-    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to read MFT"));
+NtfsFileRecord const* MftReader::ExtentReader::fix(std::byte const* data) {
+  if(region_) {
+    return file_record_from_mapping(
+        data, scratch_.data(), bytes_per_file_record_);
   }
+  // Read buffers are ours, so fix them up in place.
+  return file_record_from_buffer(const_cast<std::byte*>(data));
+}
 
-  if(bytes_read != buffer_.size()) {
-    BOOST_THROW_EXCEPTION(
-        std::runtime_error("Failed to read correct number of bytes."));
+void MftReader::ExtentReader::next_buffer() {
+  if(consuming_) {
+    head_ = (head_ + 1) % slots_.size();
+    --in_flight_;
+    consuming_ = false;
+  }
+
+  fill();
+  if(in_flight_ == 0) {
+    cursor_ = end_ = nullptr;
+    return;
+  }
+
+  Slot& slot = slots_[head_];
+  slot.pending->wait();
+  slot.pending.reset();
+  consuming_ = true;
+  cursor_ = slot.buffer.begin();
+  end_ = slot.buffer.end();
+  extent_bytes_remaining_ -= slot.buffer.size();
+}
+
+// Queue reads into every free slot.
+void MftReader::ExtentReader::fill() {
+  while(in_flight_ < slots_.size() && bytes_unread_) {
+    Slot& slot = slots_[(head_ + in_flight_) % slots_.size()];
+    auto read_size = std::min<std::uint64_t>(bytes_per_read_, bytes_unread_);
+    slot.buffer.resize(read_size);
+    slot.pending = parser_->source_->read_async(
+        read_offset_, slot.buffer.data(), slot.buffer.size());
+    read_offset_ += read_size;
+    bytes_unread_ -= read_size;
+    ++in_flight_;
   }
+}
 
-  cursor_ = buffer_.begin();
-  run_bytes_remaining_ -= read_size;
+// Cancel or wait out anything still in flight before the buffers go away.
+void MftReader::ExtentReader::drain() {
+  for(auto&& slot : slots_) {
+    slot.pending.reset();
+  }
+  head_ = 0;
+  in_flight_ = 0;
+  consuming_ = false;
+  cursor_ = end_ = nullptr;
+  region_ = {};
 }
 
 } // namespace fsdb
\ No newline at end of file
@@ -14,9 +14,15 @@
 #ifndef FSDB_MFTPARSER_HPP
 #define FSDB_MFTPARSER_HPP
 
-#include <boost/winapi/handles.hpp>
+#include "BlockSource.hpp"
+#include "ExtentMap.hpp"
+
 #include <cstddef>
+#include <cstdint>
 #include <ctime>
+#include <functional>
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -31,38 +37,178 @@ struct MftFile {
   std::uint64_t size = 0;
   std::string name;
   bool directory = false;
+  // Bumped each time the record slot is reused for a new file.
+  std::uint16_t sequence = 0;
+  // Log sequence number of the last change to the record.
+  std::uint64_t lsn = 0;
+};
+
+// A decoded data run: clusters starting at vcn live at lcn on the volume,
+// or nowhere when lcn is 0 (sparse).
+struct DataRun {
+  std::uint64_t vcn;
+  std::uint64_t lcn;
+  std::uint64_t clusters;
 };
 
+// A run of consecutive decoded records.
+class MftFileSpan {
+ public:
+  MftFileSpan(MftFile const* first, std::size_t count)
+      : first_(first)
+      , count_(count) {
+  }
+
+  MftFile const* begin() const {
+    return first_;
+  }
+
+  MftFile const* end() const {
+    return first_ + count_;
+  }
+
+  std::size_t size() const {
+    return count_;
+  }
+
+  MftFile const& operator[](std::size_t i) const {
+    return first_[i];
+  }
+
+ private:
+  MftFile const* first_;
+  std::size_t count_;
+};
+
+// The result of re-reading the MFT against a previous index.
+struct MftChanges {
+  // The refreshed index, in id order.
+  std::vector<MftFile> files;
+  // Ids that weren't in the previous index.
+  std::vector<std::uint64_t> added;
+  // Ids whose record changed in place.
+  std::vector<std::uint64_t> modified;
+  // Ids whose slot now holds a different file: the old one was deleted and
+  // a new one created in its place.
+  std::vector<std::uint64_t> recreated;
+  // Ids that are gone.
+  std::vector<std::uint64_t> deleted;
+  // Number of records that had to be decoded.
+  std::uint64_t decoded = 0;
+};
+
+// Receives batches of records. The records are only valid for the duration
+// of the call; their storage is reused for the next batch.
+using MftSink = std::function<void(MftFileSpan)>;
+
+class FileTable;
+
 class MftParser {
  public:
   MftParser();
   ~MftParser();
 
-  void open(std::wstring volume);
+  // Opens a live volume (\\?\c: on Windows), an NTFS image file or a
+  // block device.
+  void open(
+      std::string const& path, BlockSourceMode mode = BlockSourceMode::Direct);
+#ifdef _WIN32
+  void open(std::wstring const& volume);
+#endif
+  void open(std::unique_ptr<BlockSource> source);
   void close();
   std::uint64_t count() const;
   std::vector<MftFile> read_all() const;
 
+  // Reads and decodes the MFT on a pool of threads. The planned reads are
+  // split into chunks of records_per_chunk records that are decoded
+  // independently and concatenated in record order. threads == 0 uses one
+  // per core.
+  std::vector<MftFile> read_all_parallel(
+      std::size_t threads = 0,
+      std::uint64_t records_per_chunk = 16 * 1024) const;
+  // As above, handing each decoded chunk to sink in record order instead of
+  // collecting them. sink is called by one thread at a time.
+  void read_all_parallel(
+      MftSink const& sink, std::size_t threads = 0,
+      std::uint64_t records_per_chunk = 16 * 1024) const;
+
+  // Random access to single records, for resolving parents or refreshing
+  // known entries without a full scan. Records that are out of range, not in
+  // use or unnamed are left out.
+  std::optional<MftFile> read_record(std::uint64_t id) const;
+  // As above for many ids at once, returned in id order. Ids close enough to
+  // share a read are fetched together.
+  std::vector<MftFile> read_records(std::vector<std::uint64_t> ids) const;
+
+  // Where each file's unnamed $DATA lives on the volume, for ordering bulk
+  // content reads with plan_read_order(). Resident data has no extents.
+  // Runs continued in extension records aren't followed.
+  std::vector<FileExtents> read_extents(std::vector<std::uint64_t> ids) const;
+
+  // Lists a directory from its $I30 index, touching only the directory's
+  // record and index blocks. Entries come in index (collation) order and
+  // carry what the index stores: no LSN, and sizes as of the last name
+  // change.
+  std::vector<MftFile> list_directory(std::uint64_t id) const;
+  // Lists everything below a directory, a directory at a time.
+  std::vector<MftFile> list_subtree(std::uint64_t id) const;
+
  private:
   friend class MftReader;
-  friend class DataRunReader;
+  friend class ExtentReader;
+
+  // A contiguous byte range of the MFT on the volume.
+  struct Extent {
+    std::uint64_t offset;
+    std::uint64_t size;
+    // A single record split across two runs. offset is then its position
+    // within the $MFT, to be read with read_runs().
+    bool split = false;
+  };
+
   void load_boot_sector();
   void load_mft();
-  void read_data_run(
-      std::uint64_t cluster, std::uint64_t count, std::vector<MftFile>& dest) const;
+  void load_mft_bitmap(struct NtfsAttributeHeader const* bitmap);
+  // Reads size bytes of an attribute stored in runs, from position on.
+  void read_runs(
+      std::vector<DataRun> const& runs, std::uint64_t position,
+      std::byte* dest, std::uint64_t size) const;
+  // Reads the in-use records among ids, batching neighbours, and hands each
+  // one fixed up to visit in id order.
+  void for_each_record(
+      std::vector<std::uint64_t> ids,
+      std::function<void(struct NtfsFileRecord const&)> const& visit) const;
+  // Reads and fixes up one record, or returns null if it isn't in use.
+  struct NtfsFileRecord const* load_record(
+      std::uint64_t id, AlignedBuffer& buffer) const;
+  bool any_record_in_use(std::uint64_t first, std::uint64_t count) const;
+  // The byte ranges of the MFT worth reading, in record order. Spans of
+  // unused records are skipped when long enough to be worth a seek, the rest
+  // are coalesced into reads of up to max_read_size bytes.
+  std::vector<Extent> plan_mft_reads(std::uint64_t max_read_size) const;
+  std::vector<Extent> plan_mft_chunks(std::uint64_t records_per_chunk) const;
+  void read_chunk(
+      Extent const& chunk, AlignedBuffer& buffer,
+      std::vector<MftFile>& dest) const;
   void process_mft_read_buffer(
-      std::vector<std::byte>& buffer, std::vector<MftFile>& dest) const;
+      AlignedBuffer& buffer, std::vector<MftFile>& dest) const;
+  void process_mft_mapping(
+      MappedRegion const& region, std::vector<MftFile>& dest) const;
 
-  std::wstring volume_name_;
-  boost::winapi::HANDLE_ volume_ = nullptr;
+  std::unique_ptr<BlockSource> source_;
   std::uint32_t bytes_per_cluster_ = 0;
   std::uint64_t bytes_per_file_record_ = 0;
+  // Zero when a record spans several clusters.
   std::uint32_t records_per_cluster_ = 0;
-  std::vector<std::byte> mft_buffer_;
-  struct NtfsNonResidentAttributeHeader const* mft_;
+  std::uint64_t volume_clusters_ = 0;
+  // The $MFT $DATA runs, in vcn order.
+  std::vector<DataRun> mft_runs_;
   std::uint64_t mft_location_ = 0;
   std::uint64_t mft_size_ = 0;
   std::uint64_t mft_record_count_ = 0;
+  // One bit per record, set when in use. Empty means assume all are.
+  std::vector<std::uint8_t> mft_bitmap_;
 };
 
 enum class OpStatus {
@@ -70,46 +216,83 @@ enum class OpStatus {
   Finished,
 };
 
+struct MftReadOptions {
+  // Size of each read issued against the volume.
+  std::uint32_t clusters_per_read = 1024;
+  // Number of reads kept in flight ahead of the record parser.
+  std::size_t queue_depth = 2;
+};
+
 class MftReader {
  public:
-  MftReader(MftParser const& parser);
+  MftReader(MftParser const& parser, MftReadOptions const& options = {});
   OpStatus read(std::vector<MftFile>& dest);
+  // Streams every remaining record to sink in batches of up to batch_size.
+  // The batch is decoded in place over the previous one, so memory stays
+  // proportional to batch_size and names reuse their buffers.
+  void read(MftSink const& sink, std::size_t batch_size = 4096);
+  // Appends every remaining record straight to table.
+  void read(FileTable& table);
+  // Rebuilds an index from previous, which must be sorted by id as read()
+  // produces it. Records whose sequence number and LSN match are moved over
+  // from previous without being decoded.
+  MftChanges read_changes(std::vector<MftFile> previous);
 
  private:
-  class DataRun {
+  // Streams the records of one planned extent. Reads are issued ahead into
+  // a ring of buffers so the next ones are being filled while the current
+  // one is parsed.
+  class ExtentReader {
    public:
-    DataRun(struct NtfsNonResidentAttributeHeader const* mft);
-    std::uint64_t size() const;
-    std::uint64_t logical_cluster() const;
-    DataRun next() const;
+    ExtentReader(MftParser const& parser, MftReadOptions const& options);
+    ~ExtentReader();
+    void begin(MftParser::Extent const& extent);
+    // The next record marked in use, before fixups.
+    std::byte const* next_in_use();
+    struct NtfsFileRecord const* fix(std::byte const* data);
 
    private:
-    DataRun(std::uint8_t const* run, std::uint64_t offset);
-    std::uint64_t length_ = 0;
-    std::int64_t offset_ = 0;
-    std::uint8_t const* run_ = nullptr;
-  };
+    struct Slot {
+      AlignedBuffer buffer;
+      std::unique_ptr<BlockSource::PendingRead> pending;
+    };
 
-  class DataRunReader {
-   public:
-    DataRunReader(
-        MftParser const& parser);
-    void begin(DataRun const& run);
-    struct NtfsFileRecord const* next_record();
-
-   private:
+    static std::uint32_t read_size(
+        MftReadOptions const& options, MftParser const& parser);
+    std::uint64_t bytes_left() const {
+      return static_cast<std::uint64_t>(end_ - cursor_);
+    }
     void next_buffer();
+    void fill();
+    void drain();
     MftParser const* parser_ = nullptr;
-    std::vector<std::byte> buffer_;
-    std::vector<std::byte>::iterator cursor_;
+    std::vector<Slot> slots_;
+    // The oldest slot in flight, which is the one being parsed once
+    // consuming_ is set.
+    std::size_t head_ = 0;
+    std::size_t in_flight_ = 0;
+    bool consuming_ = false;
+    // Set instead of slots_ when the source can be mapped.
+    MappedRegion region_;
+    // Holds a record read from the two runs it's split across.
+    AlignedBuffer split_;
+    AlignedBuffer scratch_;
+    std::byte const* cursor_ = nullptr;
+    std::byte const* end_ = nullptr;
+    std::uint64_t read_offset_ = 0;
     std::uint32_t bytes_per_read_ = 0;
-    std::uint64_t run_bytes_remaining_ = 0;
+    std::uint64_t bytes_unread_ = 0;
+    std::uint64_t extent_bytes_remaining_ = 0;
     std::uint64_t bytes_per_file_record_ = 0;
   };
 
-  DataRun run_;
-  DataRunReader run_reader_;
-  std::uint64_t clusters_remaining_ = 0;
+  struct NtfsFileRecord const* next_record();
+  std::byte const* next_in_use();
+
+  std::vector<MftParser::Extent> extents_;
+  std::size_t next_extent_ = 0;
+  ExtentReader extent_reader_;
+  std::vector<MftFile> batch_;
 };
 
 } // namespace fsdb
@@ -0,0 +1,545 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "NtfsBuilder.hpp"
+#include "NtfsFormat.hpp"
+
+#include <algorithm>
+#include <boost/throw_exception.hpp>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+namespace fsdb {
+namespace {
+
+constexpr std::size_t kSectorSize = 512;
+constexpr std::size_t kStandardInformationSize = 0x48;
+constexpr std::size_t kAttributeListEntrySize = 0x20;
+
+std::size_t align8(std::size_t n) {
+  return (n + 7) & ~std::size_t(7);
+}
+
+// Appends attributes to a record, tracking the space left.
+class RecordWriter {
+ public:
+  RecordWriter(std::byte* record, std::size_t size, std::size_t offset)
+      : record_(record)
+      , size_(size)
+      , offset_(offset) {
+  }
+
+  // Named attributes carry the name between the header and the value.
+  std::byte* resident(
+      NtfsAttributeType type, std::size_t value_size,
+      std::u16string const& name = {}) {
+    auto name_offset = sizeof(NtfsResidentAttributeHeader);
+    auto header_size = align8(name_offset + name.size() * sizeof(char16_t));
+    auto length = align8(header_size + value_size);
+    auto attr = reinterpret_cast<NtfsResidentAttributeHeader*>(
+        allocate(length));
+    set_name(attr, name_offset, name);
+    attr->Type = type;
+    attr->Length = static_cast<std::uint32_t>(length);
+    attr->AttributeNumber = next_number_++;
+    attr->ValueLength = static_cast<std::uint32_t>(value_size);
+    attr->ValueOffset = static_cast<std::uint16_t>(header_size);
+    return reinterpret_cast<std::byte*>(attr) + header_size;
+  }
+
+  void nonresident(
+      NtfsAttributeType type, std::vector<DataRun> const& runs,
+      std::uint64_t size, std::uint32_t bytes_per_cluster,
+      std::u16string const& name = {}) {
+    auto encoded = encode_runs(runs);
+    auto name_offset = sizeof(NtfsNonResidentAttributeHeader);
+    auto header_size = align8(name_offset + name.size() * sizeof(char16_t));
+    auto length = align8(header_size + encoded.size());
+    auto attr = reinterpret_cast<NtfsNonResidentAttributeHeader*>(
+        allocate(length));
+    set_name(attr, name_offset, name);
+    std::uint64_t clusters = 0;
+    for(auto&& run : runs) {
+      clusters += run.clusters;
+    }
+    attr->Type = type;
+    attr->Length = static_cast<std::uint32_t>(length);
+    attr->Nonresident = 1;
+    attr->AttributeNumber = next_number_++;
+    attr->FirstVcn = 0;
+    attr->LastVcn = clusters - 1;
+    attr->RunArrayOffset = static_cast<std::uint16_t>(header_size);
+    attr->AllocatedSize = clusters * bytes_per_cluster;
+    attr->DataSize = size;
+    attr->InitializedSize = size;
+    std::memcpy(
+        reinterpret_cast<std::byte*>(attr) + header_size, encoded.data(),
+        encoded.size());
+  }
+
+  // Closes the attribute list and returns the bytes in use.
+  std::size_t finish() {
+    auto end = allocate(8);
+    std::uint32_t terminator = 0xffffffff;
+    std::memcpy(end, &terminator, sizeof(terminator));
+    return offset_;
+  }
+
+  std::uint16_t next_number() const {
+    return next_number_;
+  }
+
+ private:
+  static void set_name(
+      NtfsAttributeHeader* attr, std::size_t offset,
+      std::u16string const& name) {
+    attr->NameLength = static_cast<std::uint8_t>(name.size());
+    attr->NameOffset = static_cast<std::uint16_t>(offset);
+    std::memcpy(
+        reinterpret_cast<std::byte*>(attr) + offset, name.data(),
+        name.size() * sizeof(char16_t));
+  }
+
+  std::byte* allocate(std::size_t length) {
+    if(offset_ + length > size_) {
+      BOOST_THROW_EXCEPTION(
+          std::runtime_error("Attributes don't fit in the file record."));
+    }
+    auto p = record_ + offset_;
+    offset_ += length;
+    return p;
+  }
+
+  std::byte* record_;
+  std::size_t size_;
+  std::size_t offset_;
+  std::uint16_t next_number_ = 0;
+};
+
+std::size_t file_name_size(std::u16string const& name) {
+  return offsetof(NtfsFilenameAttribute, Name) + name.size() * sizeof(char16_t);
+}
+
+IndexEntrySpec name_entry(
+    RecordSpec const& spec, std::u16string const& name, bool dos) {
+  IndexEntrySpec entry;
+  entry.id = spec.id;
+  entry.sequence = spec.sequence;
+  entry.parent = spec.parent;
+  entry.name = name;
+  entry.dos = dos;
+  entry.directory = spec.directory;
+  entry.time = spec.time;
+  entry.size = spec.size;
+  return entry;
+}
+
+// Writes a $FILE_NAME value, as the record holds it and as its parent's
+// index keys it.
+void fill_file_name(IndexEntrySpec const& entry, std::byte* dest) {
+  auto fn = reinterpret_cast<NtfsFilenameAttribute*>(dest);
+  fn->DirectoryRecordId = entry.parent | (std::uint64_t(1) << 48);
+  fn->CreationTime = entry.time;
+  fn->ChangeTime = entry.time;
+  fn->LastWriteTime = entry.time;
+  fn->LastAccessTime = entry.time;
+  fn->AllocatedSize = entry.size;
+  fn->DataSize = entry.size;
+  fn->Flags = entry.directory ? EnumFlags<NtfsFilenameAttribute::Flag>(
+                                    NtfsFilenameAttribute::Flag::Directory)
+                              : EnumFlags<NtfsFilenameAttribute::Flag>(
+                                    NtfsFilenameAttribute::Flag::Archive);
+  fn->NameLength = static_cast<std::uint8_t>(entry.name.size());
+  fn->NameTypes = EnumFlags<NtfsFilenameAttribute::NameType>(
+      entry.dos ? NtfsFilenameAttribute::NameType::DOS
+                : NtfsFilenameAttribute::NameType::Win32);
+  std::memcpy(
+      fn->Name, entry.name.data(), entry.name.size() * sizeof(char16_t));
+}
+
+void write_file_name(
+    RecordWriter& writer, RecordSpec const& spec, std::u16string const& name,
+    bool dos) {
+  fill_file_name(
+      name_entry(spec, name, dos),
+      writer.resident(NtfsAttributeType::FileName, file_name_size(name)));
+}
+
+// Swaps the last word of each sector for the update sequence number, as a
+// write to disk would.
+void apply_update_sequence(
+    std::byte* dest, std::size_t usa_offset, std::size_t usa_count,
+    std::uint16_t usn) {
+  auto usa = reinterpret_cast<std::uint16_t*>(dest + usa_offset);
+  usa[0] = usn;
+  for(std::size_t i = 1; i < usa_count; ++i) {
+    auto word = reinterpret_cast<std::uint16_t*>(dest + i * kSectorSize - 2);
+    usa[i] = *word;
+    *word = usa[0];
+  }
+}
+
+// Case folding for the ranges the image generator draws names from; a real
+// volume's $UpCase covers far more.
+char16_t upcase(char16_t c) {
+  if((c >= u'a' && c <= u'z') || (c >= 0x3b1 && c <= 0x3c9 && c != 0x3c2) ||
+     (c >= 0x430 && c <= 0x44f)) {
+    return static_cast<char16_t>(c - 0x20);
+  }
+  return c;
+}
+
+// Marks an index entry without a subnode.
+constexpr std::uint64_t kNoNode = static_cast<std::uint64_t>(-1);
+// The closing entry, with room for a subnode.
+constexpr std::size_t kLastEntrySize = sizeof(NtfsIndexEntry) + 8;
+
+// An index entry being laid out: a key, or the closing entry when null,
+// and the block holding the keys before it.
+struct IndexItem {
+  IndexEntrySpec const* key;
+  std::uint64_t node;
+};
+
+std::size_t entry_size(IndexItem const& item) {
+  auto size = sizeof(NtfsIndexEntry);
+  if(item.key) {
+    size = align8(size + file_name_size(item.key->name));
+  }
+  return size + (item.node != kNoNode ? 8 : 0);
+}
+
+// Writes a node's entries and its closing entry to dest, returning the
+// bytes used. Subnode block numbers become vcns.
+std::size_t write_entries(
+    IndexItem const* first, IndexItem const* last, std::uint64_t last_node,
+    std::uint64_t vcns_per_block, std::byte* dest) {
+  std::size_t used = 0;
+  auto write = [&](IndexItem const& item) {
+    auto size = entry_size(item);
+    auto entry = reinterpret_cast<NtfsIndexEntry*>(dest + used);
+    entry->Length = static_cast<std::uint16_t>(size);
+    auto flags = EnumFlags<NtfsIndexEntry::Flag>(NtfsIndexEntry::Flag::None);
+    if(item.key) {
+      entry->FileReference =
+          item.key->id | (std::uint64_t(item.key->sequence) << 48);
+      entry->KeyLength =
+          static_cast<std::uint16_t>(file_name_size(item.key->name));
+      fill_file_name(*item.key, dest + used + sizeof(NtfsIndexEntry));
+    }
+    else {
+      flags |= NtfsIndexEntry::Flag::Last;
+    }
+    if(item.node != kNoNode) {
+      flags |= NtfsIndexEntry::Flag::HasSubnode;
+      std::uint64_t vcn = item.node * vcns_per_block;
+      std::memcpy(dest + used + size - sizeof(vcn), &vcn, sizeof(vcn));
+    }
+    entry->Flags = flags;
+    used += size;
+  };
+  for(auto item = first; item != last; ++item) {
+    write(*item);
+  }
+  write({nullptr, last_node});
+  return used;
+}
+
+void set_node_header(
+    NtfsIndexHeader& header, std::size_t entries_offset, std::size_t length,
+    std::size_t allocated, bool children) {
+  header.EntriesOffset = static_cast<std::uint32_t>(entries_offset);
+  header.IndexLength = static_cast<std::uint32_t>(length);
+  header.AllocatedSize = static_cast<std::uint32_t>(allocated);
+  header.Flags = children ? EnumFlags<NtfsIndexHeader::Flag>(
+                                NtfsIndexHeader::Flag::HasChildren)
+                          : EnumFlags<NtfsIndexHeader::Flag>(
+                                NtfsIndexHeader::Flag::None);
+}
+
+} // namespace
+
+std::vector<std::uint8_t> encode_runs(std::vector<DataRun> const& runs) {
+  std::vector<std::uint8_t> encoded;
+  std::int64_t previous = 0;
+  for(auto&& run : runs) {
+    std::uint8_t length_bytes[8];
+    int length_length = 0;
+    for(auto length = run.clusters; length; length >>= 8) {
+      length_bytes[length_length++] = static_cast<std::uint8_t>(length);
+    }
+
+    // Sparse runs carry no offset. Others are signed deltas from the last
+    // allocated run, in as few bytes as keep the sign.
+    std::uint8_t offset_bytes[8];
+    int offset_length = 0;
+    if(run.lcn != 0) {
+      auto delta = static_cast<std::int64_t>(run.lcn) - previous;
+      previous = static_cast<std::int64_t>(run.lcn);
+      do {
+        offset_bytes[offset_length++] = static_cast<std::uint8_t>(delta);
+        delta >>= 8;
+      } while(offset_length < 8 &&
+              !((delta == 0 && !(offset_bytes[offset_length - 1] & 0x80)) ||
+                (delta == -1 && (offset_bytes[offset_length - 1] & 0x80))));
+    }
+
+    encoded.push_back(
+        static_cast<std::uint8_t>(length_length | (offset_length << 4)));
+    encoded.insert(encoded.end(), length_bytes, length_bytes + length_length);
+    encoded.insert(encoded.end(), offset_bytes, offset_bytes + offset_length);
+  }
+  encoded.push_back(0);
+  return encoded;
+}
+
+void add_index_entries(
+    RecordSpec const& spec, std::vector<IndexEntrySpec>& entries) {
+  entries.push_back(name_entry(spec, spec.name, false));
+  if(!spec.dos_name.empty()) {
+    entries.push_back(name_entry(spec, spec.dos_name, true));
+  }
+}
+
+DirectoryIndex build_index(
+    std::vector<IndexEntrySpec> entries, std::size_t root_size,
+    std::uint32_t block_size, std::uint32_t bytes_per_vcn) {
+  auto less = [](char16_t a, char16_t b) { return upcase(a) < upcase(b); };
+  std::sort(
+      entries.begin(), entries.end(),
+      [&](IndexEntrySpec const& a, IndexEntrySpec const& b) {
+        if(std::lexicographical_compare(
+               a.name.begin(), a.name.end(), b.name.begin(), b.name.end(),
+               less)) {
+          return true;
+        }
+        if(std::lexicographical_compare(
+               b.name.begin(), b.name.end(), a.name.begin(), a.name.end(),
+               less)) {
+          return false;
+        }
+        return a.name != b.name ? a.name < b.name : a.id < b.id;
+      });
+
+  DirectoryIndex index;
+  std::uint64_t vcns_per_block = block_size / bytes_per_vcn;
+  auto usa_count = block_size / kSectorSize + 1;
+  auto entries_offset = align8(sizeof(NtfsIndexRecord) + usa_count * 2);
+  auto header_offset = offsetof(NtfsIndexRecord, Header);
+  auto add_block = [&](IndexItem const* first, IndexItem const* last,
+                       std::uint64_t last_node) {
+    auto node = index.blocks.size() / block_size;
+    index.blocks.resize(index.blocks.size() + block_size);
+    auto dest = &index.blocks[node * block_size];
+    auto record = reinterpret_cast<NtfsIndexRecord*>(dest);
+    record->Type = NtfsIndexRecord::kMagic;
+    record->UsaOffset = static_cast<std::uint16_t>(sizeof(NtfsIndexRecord));
+    record->UsaCount = static_cast<std::uint16_t>(usa_count);
+    record->Vcn = node * vcns_per_block;
+    auto used = write_entries(
+        first, last, last_node, vcns_per_block, dest + entries_offset);
+    set_node_header(
+        record->Header, entries_offset - header_offset,
+        entries_offset + used - header_offset, block_size - header_offset,
+        last_node != kNoNode);
+    apply_update_sequence(dest, sizeof(NtfsIndexRecord), usa_count, 1);
+    return node;
+  };
+
+  // Bottom up: pack a level's entries into blocks, each block's closing
+  // entry taking the subnode of the entry that didn't fit, which moves up a
+  // level pointing at the block. Stop once a level fits in the root.
+  std::vector<IndexItem> items;
+  items.reserve(entries.size());
+  for(auto&& e : entries) {
+    items.push_back({&e, kNoNode});
+  }
+  std::uint64_t last_node = kNoNode;
+  auto root_capacity = root_size - sizeof(NtfsIndexRoot);
+  auto block_capacity = block_size - entries_offset;
+  auto fits = [&](std::size_t capacity) {
+    std::size_t used = entry_size({nullptr, last_node});
+    for(auto&& item : items) {
+      used += entry_size(item);
+      if(used > capacity) {
+        return false;
+      }
+    }
+    return true;
+  };
+  while(!fits(root_capacity)) {
+    std::vector<IndexItem> parents;
+    for(std::size_t begin = 0;;) {
+      std::size_t used = kLastEntrySize;
+      auto end = begin;
+      while(end < items.size() &&
+            used + entry_size(items[end]) <= block_capacity) {
+        used += entry_size(items[end++]);
+      }
+      if(end == items.size()) {
+        last_node =
+            add_block(items.data() + begin, items.data() + end, last_node);
+        break;
+      }
+      if(end == begin) {
+        BOOST_THROW_EXCEPTION(
+            std::runtime_error("Index entry doesn't fit in a block."));
+      }
+      auto node = add_block(
+          items.data() + begin, items.data() + end, items[end].node);
+      parents.push_back({items[end].key, node});
+      begin = end + 1;
+    }
+    items.swap(parents);
+  }
+
+  std::vector<std::byte> entries_bytes(root_capacity);
+  auto used = write_entries(
+      items.data(), items.data() + items.size(), last_node, vcns_per_block,
+      entries_bytes.data());
+  index.root.resize(sizeof(NtfsIndexRoot) + used);
+  auto root = reinterpret_cast<NtfsIndexRoot*>(index.root.data());
+  root->Type = NtfsAttributeType::FileName;
+  // COLLATION_FILE_NAME.
+  root->CollationRule = 1;
+  root->BytesPerIndexRecord = block_size;
+  root->ClustersPerIndexRecord = static_cast<std::uint8_t>(vcns_per_block);
+  set_node_header(
+      root->Header, sizeof(NtfsIndexHeader), sizeof(NtfsIndexHeader) + used,
+      sizeof(NtfsIndexHeader) + used, last_node != kNoNode);
+  std::memcpy(
+      index.root.data() + sizeof(NtfsIndexRoot), entries_bytes.data(), used);
+  return index;
+}
+
+void build_file_record(
+    RecordSpec const& spec, std::byte* dest, std::size_t record_size) {
+  std::memset(dest, 0, record_size);
+  auto record = reinterpret_cast<NtfsFileRecord*>(dest);
+  auto usa_count = record_size / kSectorSize + 1;
+  auto usa_offset = sizeof(NtfsFileRecord);
+  record->Type = NtfsFileRecord::kMagic;
+  record->UsaOffset = static_cast<std::uint16_t>(usa_offset);
+  record->UsaCount = static_cast<std::uint16_t>(usa_count);
+  record->Usn = spec.lsn;
+  record->SequenceNumber = spec.sequence;
+  record->LinkCount = spec.dos_name.empty() ? 1 : 2;
+  record->AttributesOffset =
+      static_cast<std::uint16_t>(align8(usa_offset + usa_count * 2));
+  auto flags = EnumFlags<NtfsFileRecord::Flag>(NtfsFileRecord::Flag::None);
+  if(spec.in_use) {
+    flags |= NtfsFileRecord::Flag::InUse;
+  }
+  if(spec.directory) {
+    flags |= NtfsFileRecord::Flag::Directory;
+  }
+  record->Flags = flags;
+  record->BytesAllocated = static_cast<std::uint32_t>(record_size);
+  record->RecordId = spec.id;
+
+  RecordWriter writer(dest, record_size, record->AttributesOffset);
+  auto info = writer.resident(
+      NtfsAttributeType::StandardInformation, kStandardInformationSize);
+  for(int i = 0; i < 4; ++i) {
+    std::memcpy(info + i * 8, &spec.time, sizeof(spec.time));
+  }
+
+  // The list names every other attribute: its own entries are filled in
+  // once they've been written.
+  std::vector<NtfsAttributeType> listed = {
+      NtfsAttributeType::StandardInformation, NtfsAttributeType::FileName};
+  if(!spec.dos_name.empty()) {
+    listed.push_back(NtfsAttributeType::FileName);
+  }
+  if(!spec.directory) {
+    listed.push_back(NtfsAttributeType::Data);
+  }
+  if(!spec.index_root.empty()) {
+    listed.push_back(NtfsAttributeType::IndexRoot);
+  }
+  if(!spec.index_runs.empty()) {
+    listed.push_back(NtfsAttributeType::IndexAllocation);
+    listed.push_back(NtfsAttributeType::Bitmap);
+  }
+  std::byte* list = nullptr;
+  if(spec.attribute_list) {
+    list = writer.resident(
+        NtfsAttributeType::AttributeList,
+        listed.size() * kAttributeListEntrySize);
+  }
+
+  if(!spec.dos_name.empty()) {
+    write_file_name(writer, spec, spec.dos_name, true);
+  }
+  write_file_name(writer, spec, spec.name, false);
+
+  if(!spec.directory) {
+    if(spec.runs.empty()) {
+      auto data = writer.resident(NtfsAttributeType::Data, spec.size);
+      std::memset(data, 'x', spec.size);
+    }
+    else {
+      writer.nonresident(
+          NtfsAttributeType::Data, spec.runs, spec.size,
+          spec.bytes_per_cluster);
+    }
+  }
+
+  if(!spec.index_root.empty()) {
+    static std::u16string const kI30 = u"$I30";
+    auto root = writer.resident(
+        NtfsAttributeType::IndexRoot, spec.index_root.size(), kI30);
+    std::memcpy(root, spec.index_root.data(), spec.index_root.size());
+    if(!spec.index_runs.empty()) {
+      writer.nonresident(
+          NtfsAttributeType::IndexAllocation, spec.index_runs,
+          spec.index_size, spec.bytes_per_cluster, kI30);
+      // One bit per block in use, in whole 8 byte words.
+      auto bitmap_size = align8((spec.index_blocks + 7) / 8);
+      auto bitmap =
+          writer.resident(NtfsAttributeType::Bitmap, bitmap_size, kI30);
+      for(std::uint64_t b = 0; b < spec.index_blocks; ++b) {
+        bitmap[b / 8] |= std::byte(1u << (b % 8));
+      }
+    }
+  }
+
+  if(!spec.bitmap_runs.empty()) {
+    writer.nonresident(
+        NtfsAttributeType::Bitmap, spec.bitmap_runs, spec.bitmap_size,
+        spec.bytes_per_cluster);
+  }
+
+  if(list) {
+    for(std::size_t i = 0; i < listed.size(); ++i) {
+      auto entry = list + i * kAttributeListEntrySize;
+      // Type, entry length, then the base record reference at 0x10.
+      auto type = listed[i];
+      std::uint16_t length = kAttributeListEntrySize;
+      std::uint64_t reference = spec.id | (std::uint64_t(spec.sequence) << 48);
+      std::memcpy(entry, &type, sizeof(type));
+      std::memcpy(entry + 4, &length, sizeof(length));
+      std::memcpy(entry + 0x10, &reference, sizeof(reference));
+    }
+  }
+
+  record->NextAttributeNumber = writer.next_number();
+  record->BytesInUse = static_cast<std::uint32_t>(writer.finish());
+
+  apply_update_sequence(
+      dest, usa_offset, usa_count,
+      static_cast<std::uint16_t>(spec.sequence | 1));
+}
+
+} // namespace fsdb
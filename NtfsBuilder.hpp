@@ -0,0 +1,105 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_NTFSBUILDER_HPP
+#define FSDB_NTFSBUILDER_HPP
+
+#include "MftParser.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace fsdb {
+
+// Synthetic volumes use 4 KiB clusters unless asked otherwise.
+constexpr std::uint32_t kSyntheticClusterSize = 4096;
+
+// Describes one file record to synthesise.
+struct RecordSpec {
+  std::uint32_t id = 0;
+  std::uint16_t sequence = 1;
+  std::uint64_t lsn = 0;
+  bool in_use = true;
+  bool directory = false;
+  std::uint64_t parent = 5;
+  std::u16string name;
+  // Adds a second, DOS-only, $FILE_NAME when not empty.
+  std::u16string dos_name;
+  std::int64_t time = 0; // NT time: 100ns ticks since 1601.
+  std::uint64_t size = 0;
+  // $DATA is resident, holding size bytes, when runs is empty.
+  std::vector<DataRun> runs;
+  // Adds a non-resident $BITMAP of bitmap_size bytes, as $MFT has.
+  std::vector<DataRun> bitmap_runs;
+  std::uint64_t bitmap_size = 0;
+  // Adds an $ATTRIBUTE_LIST naming the record's other attributes.
+  bool attribute_list = false;
+  // Cluster size for the non-resident attributes' allocated sizes.
+  std::uint32_t bytes_per_cluster = kSyntheticClusterSize;
+  // A directory's $I30 index from build_index: the $INDEX_ROOT value, and
+  // the runs holding index_blocks blocks of $INDEX_ALLOCATION. No root
+  // means no index.
+  std::vector<std::byte> index_root;
+  std::vector<DataRun> index_runs;
+  std::uint64_t index_size = 0;
+  std::uint64_t index_blocks = 0;
+};
+
+// A file as its directory's $I30 index holds it, keyed by a copy of one of
+// its $FILE_NAMEs.
+struct IndexEntrySpec {
+  std::uint64_t id = 0;
+  std::uint16_t sequence = 1;
+  std::uint64_t parent = 5;
+  std::u16string name;
+  // The DOS-only alias of a file that also has a long name.
+  bool dos = false;
+  bool directory = false;
+  std::int64_t time = 0;
+  std::uint64_t size = 0;
+};
+
+// A directory's $I30 index in its on-disk form.
+struct DirectoryIndex {
+  // The $INDEX_ROOT value.
+  std::vector<std::byte> root;
+  // $INDEX_ALLOCATION's INDX blocks with their update sequences applied;
+  // empty when every entry fits in the root.
+  std::vector<std::byte> blocks;
+};
+
+// Encodes runs as an NTFS run list, terminator included.
+std::vector<std::uint8_t> encode_runs(std::vector<DataRun> const& runs);
+
+// Appends the entries spec's names get in its parent's index.
+void add_index_entries(
+    RecordSpec const& spec, std::vector<IndexEntrySpec>& entries);
+
+// Sorts entries by upper cased name, as $I30 collates, and lays them out as
+// a B-tree: all in a root of up to root_size bytes if they fit, else in
+// block_size byte INDX blocks below a root that does. Child nodes are
+// addressed in units of bytes_per_vcn.
+DirectoryIndex build_index(
+    std::vector<IndexEntrySpec> entries, std::size_t root_size,
+    std::uint32_t block_size, std::uint32_t bytes_per_vcn);
+
+// Writes spec as a record_size byte file record in its on-disk form, with
+// the update sequence applied. Throws if the attributes don't fit.
+void build_file_record(
+    RecordSpec const& spec, std::byte* dest, std::size_t record_size);
+
+} // namespace fsdb
+
+#endif // FSDB_NTFSBUILDER_HPP
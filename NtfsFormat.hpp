@@ -0,0 +1,477 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_NTFSFORMAT_HPP
+#define FSDB_NTFSFORMAT_HPP
+
+// On-disk NTFS structures and the primitives that decode them. Private to
+// the parser, and shared with the tools and benchmarks that exercise it.
+
+#include "MftParser.hpp"
+
+#include <algorithm>
+#include <boost/config.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <type_traits>
+#include <vector>
+
+namespace fsdb {
+
+template <typename Enum>
+class EnumFlags {
+ public:
+  using StorageType = std::underlying_type_t<Enum>;
+
+  static_assert(std::is_enum_v<Enum>, "Enum must be an enum type");
+  explicit EnumFlags(Enum e)
+      : bits_(static_cast<StorageType>(e)) {
+  }
+
+  EnumFlags& operator=(EnumFlags e) {
+    bits_ = e.bits_;
+    return *this;
+  }
+
+  EnumFlags& operator&=(EnumFlags e) {
+    bits_ &= e.bits_;
+    return *this;
+  }
+
+  EnumFlags& operator&=(Enum e) {
+    bits_ &= static_cast<StorageType>(e);
+    return *this;
+  }
+
+  EnumFlags& operator|=(EnumFlags e) {
+    bits_ |= e.bits_;
+    return *this;
+  }
+
+  EnumFlags& operator|=(Enum e) {
+    bits_ |= static_cast<StorageType>(e);
+    return *this;
+  }
+
+  operator bool() const {
+    return bits_ != 0;
+  }
+
+  friend EnumFlags operator&(EnumFlags a, EnumFlags b) {
+    return EnumFlags(a.bits_ & b.bits_, 0);
+  }
+
+  friend EnumFlags operator&(Enum a, EnumFlags b) {
+    return EnumFlags(static_cast<StorageType>(a) & b.bits_, 0);
+  }
+
+  friend EnumFlags operator&(EnumFlags a, Enum b) {
+    return EnumFlags(a.bits_ & static_cast<StorageType>(b), 0);
+  }
+
+  friend EnumFlags operator|(EnumFlags a, EnumFlags b) {
+    return EnumFlags(a.bits_ | b.bits_, 0);
+  }
+
+  friend EnumFlags operator|(Enum a, EnumFlags b) {
+    return EnumFlags(static_cast<StorageType>(a) | b.bits_, 0);
+  }
+
+  friend EnumFlags operator|(EnumFlags a, Enum b) {
+    return EnumFlags(a.bits_ | static_cast<StorageType>(b), 0);
+  }
+
+ private:
+  EnumFlags(StorageType bits, int)
+      : bits_(bits) {
+  }
+
+  StorageType bits_;
+};
+
+#pragma pack(push, 1)
+struct BootBlock {
+  std::uint8_t Jump[3];
+  std::uint8_t Format[8];
+  std::uint16_t BytesPerSector;
+  std::uint8_t SectorsPerCluster;
+  std::uint16_t BootSectors;
+  std::uint8_t Mbz1;
+  std::uint16_t Mbz2;
+  std::uint16_t Reserved1;
+  std::uint8_t MediaType;
+  std::uint16_t Mbz3;
+  std::uint16_t SectorsPerTrack;
+  std::uint16_t NumberOfHeads;
+  std::uint32_t PartitionOffset;
+  std::uint32_t Rserved2[2];
+  std::uint64_t TotalSectors;
+  std::uint64_t MftStartLcn;
+  std::uint64_t Mft2StartLcn;
+  std::uint32_t ClustersPerFileRecord;
+  std::uint32_t ClustersPerIndexBlock;
+  std::uint64_t VolumeSerialNumber;
+  std::uint8_t Code[0x1AE];
+  std::uint16_t BootSignature;
+};
+#pragma pack(pop)
+
+// All ntfs spec information taken from
+// https://flatcap.org/linux-ntfs/ntfs/
+
+// Additional functional information taken from
+// http://www.kcall.co.uk/ntfs/index.html
+
+// https://flatcap.org/linux-ntfs/ntfs/concepts/file_record.html
+struct NtfsFileRecord {
+  enum class Flag : std::uint16_t { None = 0, InUse = 1, Directory = 2 };
+  // Magic int 'FILE', or 'ELIF' in little endian.
+  static constexpr std::uint32_t kMagic = 0x454c4946;
+  std::uint32_t Type;
+  std::uint16_t UsaOffset;
+  std::uint16_t UsaCount;
+  std::uint64_t Usn;
+  std::uint16_t SequenceNumber;
+  std::uint16_t LinkCount;
+  std::uint16_t AttributesOffset;
+  EnumFlags<Flag> Flags;
+  std::uint32_t BytesInUse;
+  std::uint32_t BytesAllocated;
+  std::uint64_t BaseFileRecord;
+  std::uint16_t NextAttributeNumber;
+  std::uint16_t unused;
+  std::uint32_t RecordId;
+};
+
+// https://flatcap.org/linux-ntfs/ntfs/attributes/index.html
+enum class NtfsAttributeType : std::uint32_t {
+  StandardInformation = 0x10,
+  AttributeList = 0x20,
+  FileName = 0x30,
+  ObjectId = 0x40,
+  SecurityDescripter = 0x50,
+  VolumeName = 0x60,
+  VolumeInformation = 0x70,
+  Data = 0x80,
+  IndexRoot = 0x90,
+  IndexAllocation = 0xA0,
+  Bitmap = 0xB0,
+  ReparsePoint = 0xC0,
+  EAInformation = 0xD0,
+  EA = 0xE0,
+  PropertySet = 0xF0,
+  LoggedUtilityStream = 0x100,
+  Terminator = 0xFFFFFFFF,
+  FirstAttribute = StandardInformation,
+  LastAttribute = LoggedUtilityStream,
+};
+
+// https://flatcap.org/linux-ntfs/ntfs/concepts/attribute_header.html
+struct NtfsAttributeHeader {
+  enum class Flag : std::uint16_t {
+    None = 0,
+    Compressed = 1,
+  };
+
+  NtfsAttributeType Type;
+  std::uint32_t Length;
+  std::uint8_t Nonresident;
+  std::uint8_t NameLength;
+  std::uint16_t NameOffset;
+  EnumFlags<Flag> Flags;
+  std::uint16_t AttributeNumber;
+};
+
+struct NtfsResidentAttributeHeader : NtfsAttributeHeader {
+  enum class Flag : std::uint16_t {
+    None = 0,
+    Indexed = 1,
+  };
+
+  std::uint32_t ValueLength;
+  std::uint16_t ValueOffset;
+  EnumFlags<Flag> Flags;
+};
+
+struct NtfsNonResidentAttributeHeader : NtfsAttributeHeader {
+  std::uint64_t FirstVcn;
+  std::uint64_t LastVcn;
+  std::uint16_t RunArrayOffset;
+  std::uint16_t CompressionUnit;
+  std::uint8_t Pad_[4];
+  std::uint64_t AllocatedSize;
+  std::uint64_t DataSize;
+  std::uint64_t InitializedSize;
+  std::uint64_t CompressedSize;
+};
+
+// https://flatcap.org/linux-ntfs/ntfs/attributes/file_name.html
+struct NtfsFilenameAttribute {
+  enum class Flag : std::uint32_t {
+    ReadOnly = 0x1,
+    Hidden = 0x2,
+    System = 0x4,
+    Archive = 0x20,
+    Device = 0x40,
+    Normal = 0x80,
+    Temporary = 0x100,
+    Sparse = 0x200,
+    Reparse = 0x400,
+    Compressed = 0x800,
+    Offline = 0x1000,
+    NotContentIndexed = 0x2000,
+    Encrypted = 0x4000,
+    Directory = 0x10000000,
+    IndexView = 0x20000000,
+  };
+
+  enum class NameType : std::uint8_t {
+    Posix = 0,
+    Win32 = 1,
+    DOS = 2,
+  };
+
+  std::uint64_t DirectoryRecordId; // points to a MFT Index of a directory
+  std::int64_t CreationTime; // saved on creation, changed when filename changes
+  std::int64_t ChangeTime;
+  std::int64_t LastWriteTime;
+  std::int64_t LastAccessTime;
+  std::uint64_t AllocatedSize;
+  std::uint64_t DataSize;
+  EnumFlags<Flag> Flags;
+  std::uint32_t AligmentOrReserved;
+  std::uint8_t NameLength;
+  EnumFlags<NameType> NameTypes;
+  char16_t Name[1]; // UTF-16LE, NameLength code units.
+};
+
+// https://flatcap.org/linux-ntfs/ntfs/concepts/index_header.html
+struct NtfsIndexHeader {
+  enum class Flag : std::uint8_t {
+    None = 0,
+    HasChildren = 1, // Some entries point into the index allocation.
+  };
+
+  std::uint32_t EntriesOffset; // Offsets are from the start of this header.
+  std::uint32_t IndexLength;
+  std::uint32_t AllocatedSize;
+  EnumFlags<Flag> Flags;
+  std::uint8_t Pad_[3];
+};
+
+// https://flatcap.org/linux-ntfs/ntfs/attributes/index_root.html
+struct NtfsIndexRoot {
+  NtfsAttributeType Type;
+  std::uint32_t CollationRule;
+  std::uint32_t BytesPerIndexRecord;
+  std::uint8_t ClustersPerIndexRecord;
+  std::uint8_t Pad_[3];
+  NtfsIndexHeader Header;
+};
+
+// https://flatcap.org/linux-ntfs/ntfs/concepts/index_record.html
+struct NtfsIndexRecord {
+  // Magic int 'INDX', or 'XDNI' in little endian.
+  static constexpr std::uint32_t kMagic = 0x58444e49;
+  std::uint32_t Type;
+  std::uint16_t UsaOffset;
+  std::uint16_t UsaCount;
+  std::uint64_t Lsn;
+  std::uint64_t Vcn;
+  NtfsIndexHeader Header;
+};
+
+// https://flatcap.org/linux-ntfs/ntfs/concepts/index_entry.html
+struct NtfsIndexEntry {
+  enum class Flag : std::uint16_t {
+    None = 0,
+    HasSubnode = 1,
+    Last = 2, // Carries no key, only the subnode for keys past the others.
+  };
+
+  std::uint64_t FileReference;
+  std::uint16_t Length;
+  std::uint16_t KeyLength;
+  EnumFlags<Flag> Flags;
+  std::uint16_t Pad_;
+  // The key, a $FILE_NAME value for $I30, follows. With Flag::HasSubnode
+  // the entry's last 8 bytes are the vcn of the child node.
+};
+
+template <typename Destination, typename Source>
+Destination const* offset_cast(Source const* s, std::size_t offset) {
+  return reinterpret_cast<Destination const*>(
+      reinterpret_cast<std::byte const*>(s) + offset);
+}
+
+template <typename Destination, typename Source>
+Destination* offset_cast(Source* s, std::size_t offset) {
+  return reinterpret_cast<Destination*>(reinterpret_cast<std::byte*>(s) + offset);
+}
+
+inline NtfsResidentAttributeHeader const* to_resident(
+    NtfsAttributeHeader const* attr) {
+  if(attr->Nonresident) {
+    return nullptr;
+  }
+  return reinterpret_cast<NtfsResidentAttributeHeader const*>(attr);
+}
+
+inline NtfsNonResidentAttributeHeader const* to_nonresident(
+    NtfsAttributeHeader const* attr) {
+  if(!attr->Nonresident) {
+    return nullptr;
+  }
+  return reinterpret_cast<NtfsNonResidentAttributeHeader const*>(attr);
+}
+
+// Size of the fixed part of an attribute value. Variable length values end in
+// a one element array that isn't part of it.
+template <typename T>
+constexpr std::size_t attribute_value_size() {
+  return sizeof(T);
+}
+
+template <>
+constexpr std::size_t attribute_value_size<NtfsFilenameAttribute>() {
+  return offsetof(NtfsFilenameAttribute, Name);
+}
+
+template <typename T>
+T const* attribute_cast(NtfsResidentAttributeHeader const* attr) {
+  if(!attr || attr->ValueLength < attribute_value_size<T>()) {
+    return nullptr;
+  }
+
+  return offset_cast<T>(attr, attr->ValueOffset);
+}
+
+class AttributeList {
+ public:
+  AttributeList(NtfsFileRecord const& file)
+      : record_(&file)
+      , current_(offset_cast<NtfsAttributeHeader>(&file, file.AttributesOffset)) {
+  }
+
+  NtfsAttributeHeader const* next() {
+    if(current_->Length > 0 && current_->Length < record_->BytesInUse) {
+      current_ = offset_cast<NtfsAttributeHeader>(current_, current_->Length);
+    }
+    else if(current_->Nonresident) {
+      current_ = offset_cast<NtfsAttributeHeader>(
+          current_, sizeof(NtfsNonResidentAttributeHeader));
+    }
+
+    if(current_->Type == NtfsAttributeType::Terminator) {
+      current_ = nullptr;
+    }
+
+    return current();
+  }
+
+  NtfsAttributeHeader const* current() const {
+    return current_;
+  }
+
+ private:
+  NtfsFileRecord const* record_;
+  NtfsAttributeHeader const* current_;
+};
+
+inline bool fix_file_record(NtfsFileRecord* file) {
+  std::uint16_t* usa = reinterpret_cast<std::uint16_t*>(
+      reinterpret_cast<std::byte*>(file) + file->UsaOffset);
+  std::uint16_t* sector = reinterpret_cast<std::uint16_t*>(file);
+
+  if(file->UsaCount > 4) {
+    return false;
+  }
+  for(std::uint32_t i = 1; i < file->UsaCount; i++) {
+    sector[255] = usa[i];
+    sector += 256;
+  }
+
+  return true;
+}
+
+inline std::time_t to_time_t(std::int64_t t) {
+#if !defined(BOOST_MSVC) || BOOST_MSVC > 1300 // > VC++ 7.0
+  if(t == 0) {
+    return {};
+  }
+  t -= 116444736000000000LL;
+#else
+  t -= 116444736000000000;
+#endif
+  t /= 10000000;
+  if(t < 0) {
+    t = 0;
+  }
+  return static_cast<std::time_t>(t);
+}
+
+inline NtfsAttributeHeader const* find_attribute(
+    NtfsFileRecord const* file, NtfsAttributeType type) {
+  auto attribute = offset_cast<NtfsAttributeHeader>(file, file->AttributesOffset);
+  int stop = std::min<int>(8, file->NextAttributeNumber);
+  for(int i = 0; i < stop; ++i) {
+    if(attribute->Type == type) {
+      return attribute;
+    }
+
+    if(attribute->Type < NtfsAttributeType::FirstAttribute) {
+      break;
+    }
+
+    if(attribute->Type > NtfsAttributeType::LastAttribute) {
+      break;
+    }
+
+    if(attribute->Length > 0 && attribute->Length < file->BytesInUse) {
+      attribute = offset_cast<NtfsAttributeHeader>(attribute, attribute->Length);
+    }
+    else if(attribute->Nonresident) {
+      attribute = offset_cast<NtfsAttributeHeader>(
+          attribute, sizeof(NtfsNonResidentAttributeHeader));
+    }
+  }
+  return nullptr;
+}
+
+inline NtfsFileRecord const* file_record_from_buffer(std::byte* data) {
+  auto file = reinterpret_cast<NtfsFileRecord*>(data);
+  fix_file_record(file);
+  return file;
+}
+
+// The header lives in the first sector, ahead of any fixup, so it can be
+// looked at before deciding whether the record is worth fixing.
+inline bool record_in_use(std::byte const* data) {
+  return reinterpret_cast<NtfsFileRecord const*>(data)->Flags &
+         NtfsFileRecord::Flag::InUse;
+}
+
+// Decodes and validates an attribute's run list. Throws if it's malformed
+// or strays outside a volume of volume_clusters (0 skips that check).
+std::vector<DataRun> decode_runs(
+    NtfsNonResidentAttributeHeader const* attrib,
+    std::uint64_t volume_clusters);
+
+// Fills f from record, reusing f's name buffer, and returns false without
+// touching f if the record has no name.
+bool file_record_to_mft_file(NtfsFileRecord const& record, MftFile& f);
+
+} // namespace fsdb
+
+#endif // FSDB_NTFSFORMAT_HPP
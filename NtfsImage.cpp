@@ -0,0 +1,479 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "NtfsImage.hpp"
+#include "NtfsBuilder.hpp"
+#include "NtfsFormat.hpp"
+
+#include <algorithm>
+#include <boost/throw_exception.hpp>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+namespace fsdb {
+namespace {
+
+constexpr std::size_t kRecordSize = 1024;
+constexpr std::size_t kSectorSize = 512;
+// $MFTMirr holds copies of this many records.
+constexpr std::size_t kMirrorRecords = 4;
+constexpr std::uint64_t kFirstUserRecord = 16;
+constexpr std::uint64_t kRootRecord = 5;
+// The first four records are mirrored here, after the boot sector.
+constexpr std::uint64_t kMftMirrorLcn = 2;
+constexpr std::uint64_t kMftStartLcn = 16;
+// Free clusters left after each metadata fragment.
+constexpr std::uint64_t kFragmentGap = 64;
+constexpr std::uint32_t kMaxDataRuns = 64;
+// Long names leave room for less data in the record.
+constexpr std::uint32_t kMaxLongNameRuns = 8;
+constexpr std::uint64_t kMaxResidentSize = 256;
+constexpr std::uint64_t kMaxLongNameResidentSize = 64;
+// $INDEX_ROOT values stay within this, which leaves room in any directory's
+// record; larger directories move their entries out to INDX blocks.
+constexpr std::size_t kIndexRootSize = 256;
+constexpr std::uint32_t kIndexBlockSize = 4096;
+// 2020-01-01 and one day, in NT time.
+constexpr std::int64_t kBaseTime = 132223104000000000;
+constexpr std::int64_t kTicksPerDay = 864000000000;
+
+char16_t const* const kSystemNames[] = {
+    u"$MFT",    u"$MFTMirr", u"$LogFile", u"$Volume", u"$AttrDef", u".",
+    u"$Bitmap", u"$Boot",    u"$BadClus", u"$Secure", u"$UpCase",  u"$Extend"};
+
+// Produces the records of a volume in id order, allocating clusters for
+// their data and directory indexes as it goes.
+class VolumeGenerator {
+ public:
+  // An index's INDX blocks, to be written at a cluster.
+  struct IndexBlocks {
+    std::uint64_t lcn;
+    std::vector<std::byte> data;
+  };
+
+  // Directories' records come before their children's, so unless
+  // indexes is false the volume is generated once ahead to find out what
+  // each directory holds.
+  explicit VolumeGenerator(ImageOptions const& options, bool indexes = true)
+      : options_(options)
+      , rng_(options.seed)
+      , cluster_size_(options.cluster_size) {
+    options_.max_data_runs =
+        std::clamp<std::uint32_t>(options_.max_data_runs, 1, kMaxDataRuns);
+    if(cluster_size_ < kSectorSize || cluster_size_ > 64 * 1024 ||
+       (cluster_size_ & (cluster_size_ - 1)) != 0) {
+      BOOST_THROW_EXCEPTION(std::runtime_error(
+          "Cluster size must be a power of two from 512 to 64 KiB."));
+    }
+
+    // The MFT grows a cluster at a time, or a record when those are larger.
+    std::uint64_t unit = std::max<std::uint64_t>(cluster_size_, kRecordSize);
+    auto units = std::max(
+        (options.records * kRecordSize + unit - 1) / unit,
+        (kFirstUserRecord * kRecordSize + unit - 1) / unit);
+    records_ = units * unit / kRecordSize;
+    auto clusters = units * unit / cluster_size_;
+
+    auto fragments = std::clamp<std::uint64_t>(options.mft_fragments, 1, clusters);
+    next_lcn_ = kMftStartLcn;
+    std::uint64_t placed = 0;
+    for(std::uint64_t f = 0; f < fragments; ++f) {
+      auto length = clusters / fragments;
+      // An odd number of clusters leaves a record split across this run and
+      // the next when records span clusters.
+      if(cluster_size_ < kRecordSize && length % 2 == 0 && length > 1) {
+        --length;
+      }
+      if(f + 1 == fragments) {
+        length = clusters - placed;
+      }
+      placed += length;
+      mft_runs_.push_back({0, next_lcn_, length});
+      next_lcn_ += length + kFragmentGap;
+    }
+
+    // $BITMAP sizes are kept to whole 8 byte words.
+    bitmap_.resize(((records_ + 63) / 64) * 8);
+    auto bitmap_clusters =
+        (bitmap_.size() + cluster_size_ - 1) / cluster_size_;
+    bitmap_runs_.push_back({0, next_lcn_, bitmap_clusters});
+    next_lcn_ += bitmap_clusters + kFragmentGap;
+    directories_.push_back(kRootRecord);
+
+    if(indexes) {
+      VolumeGenerator scan(options, false);
+      for(std::uint64_t i = 0; i < records_; ++i) {
+        auto spec = scan.next_spec();
+        if(spec.in_use) {
+          add_index_entries(spec, children_[spec.parent]);
+        }
+      }
+    }
+  }
+
+  std::uint64_t records() const {
+    return records_;
+  }
+
+  std::uint32_t cluster_size() const {
+    return cluster_size_;
+  }
+
+  std::vector<DataRun> const& mft_runs() const {
+    return mft_runs_;
+  }
+
+  std::vector<DataRun> const& bitmap_runs() const {
+    return bitmap_runs_;
+  }
+
+  std::vector<std::uint8_t> const& bitmap() const {
+    return bitmap_;
+  }
+
+  // Clusters allocated so far, which covers the volume once every record
+  // has been generated.
+  std::uint64_t clusters() const {
+    return next_lcn_;
+  }
+
+  std::uint32_t serial_number() {
+    return static_cast<std::uint32_t>(rng_());
+  }
+
+  // Writes the next record into dest. A directory's index blocks are left
+  // in index_blocks() until the next call.
+  void next(std::byte* dest) {
+    index_blocks_.clear();
+    auto spec = next_spec();
+    if(spec.directory && spec.in_use) {
+      add_index(spec);
+    }
+    build_file_record(spec, dest, kRecordSize);
+    if(spec.in_use) {
+      bitmap_[spec.id / 8] |= std::uint8_t(1u << (spec.id % 8));
+    }
+  }
+
+  std::vector<IndexBlocks> const& index_blocks() const {
+    return index_blocks_;
+  }
+
+ private:
+  RecordSpec next_spec() {
+    auto id = next_id_++;
+    RecordSpec spec;
+    spec.id = static_cast<std::uint32_t>(id);
+    spec.time = kBaseTime;
+    spec.parent = kRootRecord;
+    spec.bytes_per_cluster = cluster_size_;
+    if(id < kFirstUserRecord) {
+      system_record(spec);
+    }
+    else {
+      user_record(spec);
+    }
+    return spec;
+  }
+
+  // Gives a directory its $I30 index, allocating clusters for the blocks
+  // that don't fit in the record.
+  void add_index(RecordSpec& spec) {
+    auto it = children_.find(spec.id);
+    std::vector<IndexEntrySpec> entries;
+    if(it != children_.end()) {
+      entries = std::move(it->second);
+      children_.erase(it);
+    }
+    // Blocks smaller than a cluster are addressed in sectors.
+    std::uint32_t bytes_per_vcn =
+        kIndexBlockSize < cluster_size_ ? kSectorSize : cluster_size_;
+    auto index = build_index(
+        std::move(entries), kIndexRootSize, kIndexBlockSize, bytes_per_vcn);
+    spec.index_root = std::move(index.root);
+    if(index.blocks.empty()) {
+      return;
+    }
+
+    auto clusters = (index.blocks.size() + cluster_size_ - 1) / cluster_size_;
+    spec.index_runs.push_back({0, next_lcn_, clusters});
+    spec.index_size = index.blocks.size();
+    spec.index_blocks = index.blocks.size() / kIndexBlockSize;
+    index_blocks_.push_back({next_lcn_, std::move(index.blocks)});
+    next_lcn_ += clusters + 1;
+  }
+
+  bool percent(int p) {
+    return static_cast<int>(rng_() % 100) < p;
+  }
+
+  void system_record(RecordSpec& spec) {
+    if(spec.id >= std::size(kSystemNames)) {
+      // Reserved for future system files.
+      spec.in_use = false;
+      return;
+    }
+
+    spec.name = kSystemNames[spec.id];
+    spec.directory = spec.id == kRootRecord;
+    if(spec.id == 0) {
+      spec.runs = mft_runs_;
+      spec.size = records_ * kRecordSize;
+      spec.bitmap_runs = bitmap_runs_;
+      spec.bitmap_size = bitmap_.size();
+    }
+    else if(spec.id == 1) {
+      spec.size = kMirrorRecords * kRecordSize;
+      spec.runs.push_back(
+          {0, kMftMirrorLcn,
+           (spec.size + cluster_size_ - 1) / cluster_size_});
+    }
+  }
+
+  void user_record(RecordSpec& spec) {
+    spec.sequence = static_cast<std::uint16_t>(1 + rng_() % 4);
+    lsn_ += 1 + rng_() % 64;
+    spec.lsn = lsn_;
+    spec.time = kBaseTime + static_cast<std::int64_t>(
+                                rng_() % (5 * 365 * kTicksPerDay));
+    spec.parent = directories_[rng_() % directories_.size()];
+    spec.directory = percent(options_.directory_percent);
+
+    bool unicode = percent(options_.unicode_percent);
+    // Directories keep room in the record for their index root.
+    bool long_name =
+        percent(options_.long_name_percent) && !spec.directory;
+    spec.name = make_name(unicode, long_name);
+    if(unicode || spec.name.size() > 12) {
+      spec.dos_name = make_dos_name(spec.name);
+    }
+    spec.attribute_list =
+        !long_name && percent(options_.attribute_list_percent);
+
+    // Deleted records keep their contents; only the flag, the bitmap and
+    // the bumped sequence number say they're gone.
+    if(percent(options_.deleted_percent)) {
+      spec.in_use = false;
+      ++spec.sequence;
+    }
+    else if(spec.directory) {
+      directories_.push_back(spec.id);
+    }
+
+    if(spec.directory) {
+      return;
+    }
+    if(percent(50)) {
+      spec.size = rng_() % (long_name ? kMaxLongNameResidentSize
+                                       : kMaxResidentSize);
+      return;
+    }
+
+    auto max_runs = long_name
+                        ? std::min(options_.max_data_runs, kMaxLongNameRuns)
+                        : options_.max_data_runs;
+    auto runs = 1 + rng_() % max_runs;
+    for(std::uint32_t r = 0; r < runs; ++r) {
+      // Leave a small gap so adjacent runs don't merge.
+      auto lcn = next_lcn_ + 1 + rng_() % 8;
+      auto length = 1 + rng_() % 16;
+      spec.runs.push_back({0, lcn, length});
+      spec.size += length * cluster_size_;
+      next_lcn_ = lcn + length;
+    }
+    spec.size -= rng_() % cluster_size_;
+  }
+
+  std::u16string make_name(bool unicode, bool long_name) {
+    std::size_t length = long_name ? 128 + rng_() % 128 : 1 + rng_() % 24;
+    std::u16string name;
+    while(name.size() < length) {
+      if(!unicode) {
+        static constexpr char kChars[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+        name += char16_t(kChars[rng_() % (sizeof(kChars) - 1)]);
+        continue;
+      }
+
+      switch(rng_() % 4) {
+        case 0: // Greek
+          name += char16_t(0x3b1 + rng_() % 25);
+          break;
+        case 1: // Cyrillic
+          name += char16_t(0x430 + rng_() % 32);
+          break;
+        case 2: // CJK
+          name += char16_t(0x4e00 + rng_() % 0x5000);
+          break;
+        default:
+          // An emoji, as a surrogate pair, when it fits.
+          if(name.size() + 2 <= length) {
+            auto c = 0x1f600 + rng_() % 80 - 0x10000;
+            name += char16_t(0xd800 + (c >> 10));
+            name += char16_t(0xdc00 + (c & 0x3ff));
+          }
+          else {
+            name += u'_';
+          }
+          break;
+      }
+    }
+    return name;
+  }
+
+  // An 8.3 alias in the style Windows generates.
+  static std::u16string make_dos_name(std::u16string const& name) {
+    std::u16string alias;
+    for(auto c : name) {
+      if(alias.size() == 6) {
+        break;
+      }
+      if(c >= u'a' && c <= u'z') {
+        alias += char16_t(c - u'a' + u'A');
+      }
+      else if((c >= u'0' && c <= u'9') || c == u'_') {
+        alias += c;
+      }
+    }
+    if(alias.empty()) {
+      alias = u"FILE";
+    }
+    return alias + u"~1";
+  }
+
+  ImageOptions options_;
+  std::mt19937_64 rng_;
+  std::uint32_t cluster_size_;
+  std::uint64_t records_ = 0;
+  std::uint64_t next_id_ = 0;
+  std::uint64_t next_lcn_ = 0;
+  std::uint64_t lsn_ = 0;
+  std::vector<DataRun> mft_runs_;
+  std::vector<DataRun> bitmap_runs_;
+  std::vector<std::uint8_t> bitmap_;
+  std::vector<std::uint64_t> directories_;
+  // The entries of each directory's index, until its record is written.
+  std::unordered_map<std::uint64_t, std::vector<IndexEntrySpec>> children_;
+  std::vector<IndexBlocks> index_blocks_;
+};
+
+void check_stream(std::ostream const& out) {
+  if(!out) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to write NTFS image."));
+  }
+}
+
+// Writes the blocks of the index just generated, returning to the current
+// position afterwards.
+void write_index_blocks(VolumeGenerator const& volume, std::ostream& out) {
+  if(volume.index_blocks().empty()) {
+    return;
+  }
+  auto position = out.tellp();
+  for(auto&& blocks : volume.index_blocks()) {
+    out.seekp(blocks.lcn * volume.cluster_size());
+    out.write(
+        reinterpret_cast<char const*>(blocks.data.data()), blocks.data.size());
+  }
+  out.seekp(position);
+}
+
+} // namespace
+
+void write_mft_region(ImageOptions const& options, std::ostream& out) {
+  // Index blocks live outside the MFT, so they're left out along with
+  // everything else.
+  VolumeGenerator volume(options, false);
+  std::vector<std::byte> record(kRecordSize);
+  for(std::uint64_t i = 0; i < volume.records(); ++i) {
+    volume.next(record.data());
+    out.write(reinterpret_cast<char const*>(record.data()), record.size());
+  }
+  check_stream(out);
+}
+
+void write_image(ImageOptions const& options, std::string const& path) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if(!out) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("Failed to create image " + path + "."));
+  }
+
+  VolumeGenerator volume(options);
+  auto cluster_size = volume.cluster_size();
+  // Records are cut into clusters as they come, so one can start in one
+  // cluster, or one run, and finish in the next.
+  std::vector<std::byte> cluster(cluster_size);
+  std::vector<std::byte> record(kRecordSize);
+  std::size_t record_used = kRecordSize;
+  std::vector<std::byte> mirror;
+  for(auto&& run : volume.mft_runs()) {
+    out.seekp(run.lcn * cluster_size);
+    for(std::uint64_t c = 0; c < run.clusters; ++c) {
+      for(std::size_t filled = 0; filled < cluster_size;) {
+        if(record_used == kRecordSize) {
+          volume.next(record.data());
+          write_index_blocks(volume, out);
+          record_used = 0;
+          if(mirror.size() < kMirrorRecords * kRecordSize) {
+            mirror.insert(mirror.end(), record.begin(), record.end());
+          }
+        }
+        auto n = std::min(cluster_size - filled, kRecordSize - record_used);
+        std::memcpy(&cluster[filled], &record[record_used], n);
+        filled += n;
+        record_used += n;
+      }
+      out.write(reinterpret_cast<char const*>(cluster.data()), cluster.size());
+    }
+  }
+
+  out.seekp(kMftMirrorLcn * cluster_size);
+  out.write(reinterpret_cast<char const*>(mirror.data()), mirror.size());
+  out.seekp(volume.bitmap_runs().front().lcn * cluster_size);
+  out.write(
+      reinterpret_cast<char const*>(volume.bitmap().data()),
+      volume.bitmap().size());
+
+  // The last sector of the volume holds the backup boot sector, outside
+  // the sectors the boot sector counts.
+  auto clusters = volume.clusters() + kFragmentGap;
+  BootBlock boot = {};
+  std::uint8_t const jump[] = {0xeb, 0x52, 0x90};
+  std::memcpy(boot.Jump, jump, sizeof(jump));
+  std::memcpy(boot.Format, "NTFS    ", sizeof(boot.Format));
+  boot.BytesPerSector = kSectorSize;
+  boot.SectorsPerCluster = static_cast<std::uint8_t>(cluster_size / kSectorSize);
+  boot.MediaType = 0xf8;
+  boot.TotalSectors = clusters * boot.SectorsPerCluster - 1;
+  boot.MftStartLcn = volume.mft_runs().front().lcn;
+  boot.Mft2StartLcn = kMftMirrorLcn;
+  // Negative values are log2 of the size in bytes.
+  boot.ClustersPerFileRecord = 0x100 - 10;
+  boot.ClustersPerIndexBlock =
+      kIndexBlockSize >= cluster_size ? kIndexBlockSize / cluster_size
+                                      : 0x100 - 12;
+  boot.VolumeSerialNumber = volume.serial_number();
+  boot.BootSignature = 0xaa55;
+  out.seekp(0);
+  out.write(reinterpret_cast<char const*>(&boot), sizeof(boot));
+  out.seekp(boot.TotalSectors * kSectorSize);
+  out.write(reinterpret_cast<char const*>(&boot), sizeof(boot));
+  check_stream(out);
+}
+
+} // namespace fsdb
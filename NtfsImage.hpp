@@ -0,0 +1,56 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_NTFSIMAGE_HPP
+#define FSDB_NTFSIMAGE_HPP
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+namespace fsdb {
+
+// Shapes a synthetic volume. The same options and seed always produce the
+// same bytes.
+struct ImageOptions {
+  std::uint32_t seed = 1;
+  // Total MFT records, system files included.
+  std::uint64_t records = 100000;
+  // Bytes per cluster: a power of two from 512 to 64 KiB. Below the 1 KiB
+  // record size records span clusters, and the $MFT's runs are cut mid
+  // record so records also straddle fragments.
+  std::uint32_t cluster_size = 4096;
+  // Number of runs the $MFT itself is split across.
+  std::uint32_t mft_fragments = 1;
+  // Non-resident $DATA has between 1 and this many runs.
+  std::uint32_t max_data_runs = 1;
+  // Percentages of user records, each chosen independently.
+  int deleted_percent = 0;
+  int directory_percent = 10;
+  int unicode_percent = 0;
+  int long_name_percent = 0;
+  int attribute_list_percent = 0;
+};
+
+// Writes the MFT's records alone, as a copy of $MFT's $DATA would hold them.
+void write_mft_region(ImageOptions const& options, std::ostream& out);
+
+// Writes a volume image holding a boot sector, the fragmented $MFT, its
+// $BITMAP and each directory's $I30 index blocks. File data clusters are
+// allocated but never written, so the image is sparse where the file system
+// allows it.
+void write_image(ImageOptions const& options, std::string const& path);
+
+} // namespace fsdb
+
+#endif // FSDB_NTFSIMAGE_HPP
@@ -0,0 +1,77 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_PARALLELFOR_HPP
+#define FSDB_PARALLELFOR_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fsdb {
+
+// The threads to use when asked for threads; zero means one per core.
+inline std::size_t thread_count(std::size_t threads) {
+  return threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Runs work(i, worker) for every i in [0, count) on up to threads threads,
+// the caller among them. Indices come off a shared counter; worker numbers
+// the thread running them, from zero, so each can keep its own state. The
+// first exception stops the rest and is rethrown once every thread is done.
+template <typename Work>
+void parallel_for_workers(std::size_t count, std::size_t threads, Work&& work) {
+  std::atomic<std::size_t> next{0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto worker = [&](std::size_t w) {
+    try {
+      for(std::size_t i; (i = next++) < count;) {
+        work(i, w);
+      }
+    }
+    catch(...) {
+      std::lock_guard<std::mutex> lk(error_mutex);
+      error = std::current_exception();
+      next = count;
+    }
+  };
+
+  threads = std::min(thread_count(threads), count);
+  std::vector<std::thread> pool;
+  for(std::size_t w = 1; w < threads; ++w) {
+    pool.emplace_back(worker, w);
+  }
+  worker(0);
+  for(auto&& t : pool) {
+    t.join();
+  }
+  if(error) {
+    std::rethrow_exception(error);
+  }
+}
+
+// As above, for work(i) that doesn't mind which thread runs it.
+template <typename Work>
+void parallel_for(std::size_t count, std::size_t threads, Work&& work) {
+  parallel_for_workers(
+      count, threads, [&](std::size_t i, std::size_t) { work(i); });
+}
+
+} // namespace fsdb
+
+#endif // FSDB_PARALLELFOR_HPP
@@ -0,0 +1,192 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_PARALLELMERGE_HPP
+#define FSDB_PARALLELMERGE_HPP
+
+#include "ParallelFor.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fsdb {
+
+// Hands out ids a block at a time, so threads touch the shared counter once
+// per block rather than once per id.
+class IdBlockAllocator {
+ public:
+  static constexpr std::uint64_t kDefaultBlockSize = 4096;
+
+  explicit IdBlockAllocator(
+      std::uint64_t first = 0, std::uint64_t block_size = kDefaultBlockSize)
+      : first_(first)
+      , block_size_(block_size)
+      , next_(first) {
+  }
+
+  // Returns the first id of a new block.
+  std::uint64_t reserve() {
+    return next_.fetch_add(block_size_, std::memory_order_relaxed);
+  }
+
+  std::uint64_t first() const {
+    return first_;
+  }
+
+  std::uint64_t block_size() const {
+    return block_size_;
+  }
+
+  // One past the last id reserved, used or not.
+  std::uint64_t end() const {
+    return next_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  std::uint64_t first_;
+  std::uint64_t block_size_;
+  std::atomic<std::uint64_t> next_;
+};
+
+// One thread's ids. Each block is used up in order before the next is
+// reserved, so the owner's n'th result has id
+// blocks()[n / block_size] + n % block_size.
+class IdBlock {
+ public:
+  explicit IdBlock(IdBlockAllocator& allocator)
+      : allocator_(&allocator) {
+  }
+
+  std::uint64_t next() {
+    if(next_ == end_) {
+      next_ = allocator_->reserve();
+      end_ = next_ + allocator_->block_size();
+      blocks_.push_back(next_);
+    }
+    return next_++;
+  }
+
+  std::vector<std::uint64_t> const& blocks() const {
+    return blocks_;
+  }
+
+ private:
+  IdBlockAllocator* allocator_;
+  std::uint64_t next_ = 0;
+  std::uint64_t end_ = 0;
+  std::vector<std::uint64_t> blocks_;
+};
+
+// Maps ids from an IdBlockAllocator to indices in a merged table. Ids below
+// the allocator's first are reserved and map to themselves.
+class IdRemap {
+ public:
+  explicit IdRemap(IdBlockAllocator const& allocator)
+      : first_(allocator.first())
+      , block_size_(allocator.block_size())
+      , starts_((allocator.end() - first_) / block_size_) {
+  }
+
+  // Records that the owner of ids stored its results in order from index.
+  void add(IdBlock const& ids, std::uint64_t index) {
+    for(auto&& block : ids.blocks()) {
+      starts_[(block - first_) / block_size_] = index;
+      index += block_size_;
+    }
+  }
+
+  std::uint64_t operator()(std::uint64_t id) const {
+    if(id < first_) {
+      return id;
+    }
+    id -= first_;
+    return starts_[id / block_size_] + id % block_size_;
+  }
+
+ private:
+  std::uint64_t first_;
+  std::uint64_t block_size_;
+  std::vector<std::uint64_t> starts_;
+};
+
+// Joins per-thread results into one contiguous table in two passes. A
+// prefix sum over the part sizes gives every part its offset, then the
+// elements are moved into place in parallel.
+template <typename T>
+class ParallelMerge {
+ public:
+  explicit ParallelMerge(std::vector<std::vector<T>*> parts)
+      : parts_(std::move(parts))
+      , offsets_(parts_.size() + 1) {
+    for(std::size_t i = 0; i < parts_.size(); ++i) {
+      offsets_[i + 1] = offsets_[i] + parts_[i]->size();
+    }
+  }
+
+  // Total elements across the parts.
+  std::size_t size() const {
+    return offsets_.back();
+  }
+
+  // Where part starts, relative to the end of the table it's merged into.
+  std::size_t offset(std::size_t part) const {
+    return offsets_[part];
+  }
+
+  // Appends every part to dest and empties the parts. fix(element, part,
+  // index) runs on each element once it has landed at dest[index]. Threads
+  // take equal slices of the output, not whole parts, so one large part
+  // doesn't serialise the merge.
+  template <typename Fix>
+  void move_into(std::vector<T>& dest, std::size_t threads, Fix const& fix) {
+    auto base = dest.size();
+    dest.resize(base + size());
+    auto slices =
+        std::clamp<std::size_t>(size() / kMinSlice, 1, thread_count(threads));
+
+    auto move_slice = [&](std::size_t begin, std::size_t end) {
+      std::size_t part =
+          std::upper_bound(offsets_.begin(), offsets_.end(), begin) -
+          offsets_.begin() - 1;
+      for(auto i = begin; i < end; ++i) {
+        while(i >= offsets_[part + 1]) {
+          ++part;
+        }
+        auto&& slot = dest[base + i];
+        slot = std::move((*parts_[part])[i - offsets_[part]]);
+        fix(slot, part, base + i);
+      }
+    };
+
+    parallel_for(slices, slices, [&](std::size_t t) {
+      move_slice(size() * t / slices, size() * (t + 1) / slices);
+    });
+
+    for(auto&& part : parts_) {
+      *part = {};
+    }
+  }
+
+ private:
+  // Slices smaller than this aren't worth a thread.
+  static constexpr std::size_t kMinSlice = 1 << 14;
+
+  std::vector<std::vector<T>*> parts_;
+  std::vector<std::size_t> offsets_;
+};
+
+} // namespace fsdb
+
+#endif // FSDB_PARALLELMERGE_HPP
@@ -0,0 +1,275 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "Preorder.hpp"
+#include "FileTable.hpp"
+#include "MftParser.hpp"
+#include "ParallelFor.hpp"
+
+#include <algorithm>
+#include <boost/throw_exception.hpp>
+#include <stdexcept>
+#include <utility>
+
+namespace fsdb {
+namespace {
+// Rows handed to a thread at a time.
+constexpr std::size_t kChunkRows = 16 * 1024;
+
+// Runs work(i) for i in [first, last), a chunk at a time on up to threads
+// threads. Ranges of a chunk or less stay on the calling thread.
+template <typename Work>
+void parallel_range(
+    std::size_t first, std::size_t last, std::size_t threads, Work&& work) {
+  auto chunks = (last - first + kChunkRows - 1) / kChunkRows;
+  parallel_for(chunks, threads, [&](std::size_t c) {
+    auto end = std::min(last, first + (c + 1) * kChunkRows);
+    for(auto i = first + c * kChunkRows; i < end; ++i) {
+      work(i);
+    }
+  });
+}
+
+void check_rows(std::size_t rows) {
+  if(rows >= kNoParentRow) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Too many files to order."));
+  }
+}
+
+// Turns parent ids into parent rows.
+template <typename Id, typename Parent>
+std::vector<std::uint32_t> parent_rows(
+    std::size_t rows, Id&& id, Parent&& parent, std::size_t threads) {
+  check_rows(rows);
+  std::vector<std::uint32_t> parents(rows);
+  std::uint64_t max_id = 0;
+  for(std::size_t r = 0; r < rows; ++r) {
+    max_id = std::max(max_id, id(r));
+  }
+
+  // Record numbers are dense enough to index directly; anything else is
+  // looked up in a sorted copy.
+  if(max_id < 2 * rows + kChunkRows) {
+    std::vector<std::uint32_t> row_of(max_id + 1, kNoParentRow);
+    for(auto r = rows; r-- > 0;) {
+      row_of[id(r)] = static_cast<std::uint32_t>(r);
+    }
+    parallel_range(0, rows, threads, [&](std::size_t r) {
+      auto p = parent(r);
+      parents[r] = p <= max_id ? row_of[p] : kNoParentRow;
+    });
+    return parents;
+  }
+
+  std::vector<std::pair<std::uint64_t, std::uint32_t>> by_id(rows);
+  for(std::uint32_t r = 0; r < rows; ++r) {
+    by_id[r] = {id(r), r};
+  }
+  if(!std::is_sorted(by_id.begin(), by_id.end())) {
+    std::sort(by_id.begin(), by_id.end());
+  }
+  parallel_range(0, rows, threads, [&](std::size_t r) {
+    auto p = parent(r);
+    auto it = std::lower_bound(
+        by_id.begin(), by_id.end(), std::make_pair(p, std::uint32_t(0)));
+    parents[r] =
+        it != by_id.end() && it->first == p ? it->second : kNoParentRow;
+  });
+  return parents;
+}
+} // namespace
+
+Preorder preorder(
+    std::vector<std::uint32_t> const& parent_rows, std::size_t threads) {
+  auto rows = parent_rows.size();
+  check_rows(rows);
+  threads = thread_count(threads);
+
+  std::vector<std::uint32_t> parent(rows);
+  std::vector<std::uint8_t> root(rows);
+  parallel_range(0, rows, threads, [&](std::size_t r) {
+    auto p = parent_rows[r];
+    root[r] = p >= rows || p == r;
+    parent[r] = root[r] ? kNoParentRow : p;
+  });
+
+  // Children laid out by parent, each parent's in row order.
+  std::vector<std::uint32_t> child_begin(rows + 1, 0);
+  for(std::size_t r = 0; r < rows; ++r) {
+    if(!root[r]) {
+      ++child_begin[parent[r] + 1];
+    }
+  }
+  for(std::size_t r = 0; r < rows; ++r) {
+    child_begin[r + 1] += child_begin[r];
+  }
+  std::vector<std::uint32_t> children(child_begin.back());
+  {
+    auto fill = child_begin;
+    for(std::uint32_t r = 0; r < rows; ++r) {
+      if(!root[r]) {
+        children[fill[parent[r]]++] = r;
+      }
+    }
+  }
+  // Rows made roots to break a cycle still sit in their parent's children
+  // and are skipped there.
+  auto for_children = [&](std::uint32_t r, auto&& visit) {
+    for(auto i = child_begin[r]; i < child_begin[r + 1]; ++i) {
+      if(!root[children[i]]) {
+        visit(children[i]);
+      }
+    }
+  };
+
+  // Breadth first, recording where each level starts.
+  std::vector<std::uint32_t> bfs;
+  std::vector<std::size_t> levels;
+  auto walk = [&] {
+    bfs.clear();
+    bfs.reserve(rows);
+    levels.clear();
+    for(std::uint32_t r = 0; r < rows; ++r) {
+      if(root[r]) {
+        bfs.push_back(r);
+      }
+    }
+    for(std::size_t begin = 0; begin < bfs.size();) {
+      levels.push_back(begin);
+      auto end = bfs.size();
+      for(auto i = begin; i < end; ++i) {
+        for_children(bfs[i], [&](std::uint32_t c) { bfs.push_back(c); });
+      }
+      begin = end;
+    }
+    levels.push_back(bfs.size());
+  };
+  walk();
+
+  // Anything not reached hangs off a cycle. Follow each such row up until
+  // the walk comes back on itself and cut the cycle there.
+  if(bfs.size() < rows) {
+    constexpr std::uint32_t kDone = kNoParentRow;
+    std::vector<std::uint32_t> mark(rows, 0);
+    for(auto r : bfs) {
+      mark[r] = kDone;
+    }
+    for(std::uint32_t u = 0; u < rows; ++u) {
+      auto x = u;
+      while(mark[x] == 0) {
+        mark[x] = u + 1;
+        x = parent[x];
+      }
+      if(mark[x] == u + 1) {
+        root[x] = 1;
+        parent[x] = kNoParentRow;
+      }
+      for(auto y = u; y != kNoParentRow && mark[y] == u + 1; y = parent[y]) {
+        mark[y] = kDone;
+      }
+    }
+    walk();
+  }
+
+  // Subtree sizes from the deepest level up, then positions from the roots
+  // down: a row's first child follows it, and each later child follows
+  // the subtree before it.
+  std::vector<std::uint32_t> sizes(rows);
+  for(auto level = levels.size() - 1; level-- > 0;) {
+    parallel_range(levels[level], levels[level + 1], threads, [&](std::size_t i) {
+      std::uint32_t size = 1;
+      for_children(bfs[i], [&](std::uint32_t c) { size += sizes[c]; });
+      sizes[bfs[i]] = size;
+    });
+  }
+
+  Preorder result;
+  result.positions.resize(rows);
+  auto& positions = result.positions;
+  std::uint32_t next = 0;
+  auto roots = levels.size() > 1 ? levels[1] : 0;
+  for(std::size_t i = 0; i < roots; ++i) {
+    positions[bfs[i]] = next;
+    next += sizes[bfs[i]];
+  }
+  for(std::size_t level = 0; level + 1 < levels.size(); ++level) {
+    parallel_range(levels[level], levels[level + 1], threads, [&](std::size_t i) {
+      auto position = positions[bfs[i]] + 1;
+      for_children(bfs[i], [&](std::uint32_t c) {
+        positions[c] = position;
+        position += sizes[c];
+      });
+    });
+  }
+
+  result.order.resize(rows);
+  result.ends.resize(rows);
+  result.parents.resize(rows);
+  parallel_range(0, rows, threads, [&](std::size_t r) {
+    auto p = positions[r];
+    result.order[p] = static_cast<std::uint32_t>(r);
+    result.ends[p] = p + sizes[r];
+    result.parents[p] = root[r] ? kNoParentRow : positions[parent[r]];
+  });
+  return result;
+}
+
+Preorder preorder(FileTable const& table, std::size_t threads) {
+  threads = thread_count(threads);
+  return preorder(
+      parent_rows(
+          table.size(), [&](std::size_t r) { return table.ids()[r]; },
+          [&](std::size_t r) { return table.parents()[r]; }, threads),
+      threads);
+}
+
+Preorder preorder(std::vector<MftFile> const& files, std::size_t threads) {
+  threads = thread_count(threads);
+  return preorder(
+      parent_rows(
+          files.size(), [&](std::size_t r) { return files[r].id; },
+          [&](std::size_t r) { return files[r].parent; }, threads),
+      threads);
+}
+
+FileTable reorder(
+    FileTable const& table, std::vector<std::uint32_t> const& order) {
+  FileTable result;
+  result.reserve(order.size(), table.names().size());
+  MftFile f;
+  for(auto r : order) {
+    f.id = table.ids()[r];
+    f.parent = table.parents()[r];
+    f.created = table.created()[r];
+    f.accessed = table.accessed()[r];
+    f.modified = table.modified()[r];
+    f.size = table.sizes()[r];
+    f.name = table.name(r);
+    f.directory = table.directories()[r] != 0;
+    f.sequence = table.sequences()[r];
+    f.lsn = table.lsns()[r];
+    result.append(f);
+  }
+  return result;
+}
+
+std::vector<MftFile> reorder(
+    std::vector<MftFile> files, std::vector<std::uint32_t> const& order) {
+  std::vector<MftFile> result(order.size());
+  parallel_range(0, order.size(), thread_count(0), [&](std::size_t i) {
+    result[i] = std::move(files[order[i]]);
+  });
+  return result;
+}
+
+} // namespace fsdb
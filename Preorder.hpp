@@ -0,0 +1,66 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_PREORDER_HPP
+#define FSDB_PREORDER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace fsdb {
+
+class FileTable;
+struct MftFile;
+
+// Marks a row or position with no parent.
+constexpr std::uint32_t kNoParentRow = static_cast<std::uint32_t>(-1);
+
+// A forest laid out depth first, each directory ahead of everything below
+// it. Whatever is below position i sits at (i, ends[i]), so "is x under y"
+// is two comparisons and a subtree is a contiguous slice.
+struct Preorder {
+  // order[i] is the row placed at position i.
+  std::vector<std::uint32_t> order;
+  // One past the last position below each position.
+  std::vector<std::uint32_t> ends;
+  // The position of each position's parent, kNoParentRow for roots.
+  std::vector<std::uint32_t> parents;
+  // Where each row was placed; the inverse of order.
+  std::vector<std::uint32_t> positions;
+
+  // True if position is ancestor or below it.
+  bool contains(std::uint32_t ancestor, std::uint32_t position) const {
+    return ancestor <= position && position < ends[ancestor];
+  }
+};
+
+// Lays out rows given the row of each one's parent. Rows that are their own
+// parent, or whose parent is kNoParentRow, are roots. A parent cycle is
+// broken at one of its rows, which becomes a root. Roots and siblings keep
+// their row order. The tree is processed a level at a time with each level
+// split across threads; threads == 0 uses one per core.
+Preorder preorder(
+    std::vector<std::uint32_t> const& parent_rows, std::size_t threads = 0);
+// As above for files that name their parent by id.
+Preorder preorder(FileTable const& table, std::size_t threads = 0);
+Preorder preorder(std::vector<MftFile> const& files, std::size_t threads = 0);
+
+// The rows of table or files rewritten in the given order.
+FileTable reorder(FileTable const& table, std::vector<std::uint32_t> const& order);
+std::vector<MftFile> reorder(
+    std::vector<MftFile> files, std::vector<std::uint32_t> const& order);
+
+} // namespace fsdb
+
+#endif // FSDB_PREORDER_HPP
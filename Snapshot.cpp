@@ -0,0 +1,752 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "Snapshot.hpp"
+#include "FileTable.hpp"
+#include "ParallelFor.hpp"
+
+#include <algorithm>
+#include <boost/throw_exception.hpp>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string_view>
+
+namespace fsdb {
+namespace {
+constexpr char kMagic[8] = {'F', 'S', 'D', 'B', 'S', 'N', 'A', 'P'};
+// Version 2 added sorted indexes after the blocks. Version 1 files are
+// still read.
+constexpr std::uint32_t kVersion = 2;
+// Magic, version, rows per block, rows and block count.
+constexpr std::size_t kHeaderSize = 8 + 4 + 4 + 8 + 8;
+// The file ends with the offsets of the index and block directories, so the
+// snapshot can be written in one pass to a stream. Version 1 has only the
+// block directory's.
+constexpr std::size_t kTrailerSize = 8 + 8;
+constexpr std::size_t kV1TrailerSize = 8;
+// Offset, size, first and last parent.
+constexpr std::size_t kDirectoryEntrySize = 4 * 8;
+// Offset, size, smallest and largest key.
+constexpr std::size_t kIndexEntrySize = 4 * 8;
+// Every this many rows a name is stored whole, so decoding one only has to
+// start from the restart before it.
+constexpr std::size_t kRestartInterval = 16;
+// Blocks handed to the encoding threads per round, per thread.
+constexpr std::size_t kBlocksPerThread = 8;
+
+enum Column {
+  kId,
+  kParent,
+  kSize,
+  kCreated,
+  kAccessed,
+  kModified,
+  kLsn,
+  kSequence,
+  kDirectory,
+  kColumns
+};
+
+enum class Coding : std::uint8_t {
+  // Offsets from the block's smallest value.
+  Frame = 0,
+  // Zigzagged differences from the previous row.
+  Delta = 1,
+};
+
+[[noreturn]] void corrupt() {
+  BOOST_THROW_EXCEPTION(std::runtime_error("Corrupt snapshot."));
+}
+
+void put_fixed(std::string& out, std::uint64_t value, int bytes) {
+  for(int i = 0; i < bytes; ++i) {
+    out.push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+void put_varint(std::string& out, std::uint64_t value) {
+  while(value >= 0x80) {
+    out.push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+// Up to 8 bytes at offset, zero filled past the end.
+std::uint64_t load(std::byte const* data, std::size_t size, std::size_t offset) {
+  std::uint64_t value = 0;
+  if(offset < size) {
+    std::memcpy(&value, data + offset, std::min<std::size_t>(8, size - offset));
+  }
+  return value;
+}
+
+// Walks forward through encoded bytes, throwing rather than running off
+// the end.
+class Cursor {
+ public:
+  Cursor(std::byte const* data, std::size_t size)
+      : p_(data)
+      , end_(data + size) {
+  }
+
+  std::uint64_t fixed(int bytes) {
+    auto p = take(bytes);
+    std::uint64_t value = 0;
+    for(int i = 0; i < bytes; ++i) {
+      value |= std::uint64_t(p[i]) << (8 * i);
+    }
+    return value;
+  }
+
+  std::uint64_t varint() {
+    std::uint64_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+      if(p_ == end_) {
+        corrupt();
+      }
+      auto b = std::uint8_t(*p_++);
+      value |= std::uint64_t(b & 0x7f) << shift;
+      if(!(b & 0x80)) {
+        return value;
+      }
+    }
+    corrupt();
+  }
+
+  std::byte const* take(std::size_t size) {
+    if(std::size_t(end_ - p_) < size) {
+      corrupt();
+    }
+    auto p = p_;
+    p_ += size;
+    return p;
+  }
+
+ private:
+  std::byte const* p_;
+  std::byte const* end_;
+};
+
+int bit_width(std::uint64_t value) {
+  int width = 0;
+  for(; value; value >>= 1) {
+    ++width;
+  }
+  return width;
+}
+
+std::uint64_t zigzag(std::uint64_t delta) {
+  return (delta << 1) ^ std::uint64_t(std::int64_t(delta) >> 63);
+}
+
+std::uint64_t unzigzag(std::uint64_t value) {
+  return (value >> 1) ^ (0 - (value & 1));
+}
+
+std::size_t packed_size(std::size_t count, int width) {
+  return (count * width + 7) / 8;
+}
+
+// Appends values width bits each, least significant bit first.
+void pack(std::vector<std::uint64_t> const& values, int width, std::string& out) {
+  if(width == 0) {
+    return;
+  }
+  std::uint64_t word = 0;
+  int filled = 0;
+  for(auto v : values) {
+    word |= v << filled;
+    if(filled + width >= 64) {
+      put_fixed(out, word, 8);
+      word = filled ? v >> (64 - filled) : 0;
+      filled += width - 64;
+    }
+    else {
+      filled += width;
+    }
+  }
+  put_fixed(out, word, (filled + 7) / 8);
+}
+
+std::uint64_t unpack(
+    std::byte const* data, std::size_t size, std::size_t i, int width) {
+  if(width == 0) {
+    return 0;
+  }
+  auto bit = i * width;
+  int shift = bit & 7;
+  auto value = load(data, size, bit >> 3) >> shift;
+  if(shift + width > 64) {
+    value |= load(data, size, (bit >> 3) + 8) << (64 - shift);
+  }
+  return width == 64 ? value : value & ((std::uint64_t(1) << width) - 1);
+}
+
+// Packs one column of a block with whichever coding comes out smaller.
+void encode_column(
+    std::vector<std::uint64_t> const& values,
+    std::vector<std::uint64_t>& scratch, std::string& out) {
+  auto [lo, hi] = std::minmax_element(values.begin(), values.end());
+  int frame_width = bit_width(*hi - *lo);
+  std::uint64_t deltas = 0;
+  scratch.clear();
+  for(std::size_t i = 1; i < values.size(); ++i) {
+    scratch.push_back(zigzag(values[i] - values[i - 1]));
+    deltas |= scratch.back();
+  }
+  int delta_width = bit_width(deltas);
+  if(delta_width < frame_width) {
+    out.push_back(static_cast<char>(Coding::Delta));
+    out.push_back(static_cast<char>(delta_width));
+    put_varint(out, values[0]);
+    pack(scratch, delta_width, out);
+    return;
+  }
+
+  auto base = *lo;
+  scratch.clear();
+  for(auto v : values) {
+    scratch.push_back(v - base);
+  }
+  out.push_back(static_cast<char>(Coding::Frame));
+  out.push_back(static_cast<char>(frame_width));
+  put_varint(out, base);
+  pack(scratch, frame_width, out);
+}
+
+// A packed column inside a block.
+struct ColumnView {
+  Coding coding = Coding::Frame;
+  int width = 0;
+  std::uint64_t base = 0;
+  std::byte const* data = nullptr;
+  std::size_t size = 0;
+
+  // Frame coded values are found directly, delta coded ones are summed up
+  // to i.
+  std::uint64_t at(std::size_t i) const {
+    if(coding == Coding::Frame) {
+      return base + unpack(data, size, i, width);
+    }
+    auto value = base;
+    for(std::size_t j = 0; j < i; ++j) {
+      value += unzigzag(unpack(data, size, j, width));
+    }
+    return value;
+  }
+
+  void decode(std::size_t rows, std::uint64_t* out) const {
+    if(coding == Coding::Frame) {
+      for(std::size_t i = 0; i < rows; ++i) {
+        out[i] = base + unpack(data, size, i, width);
+      }
+      return;
+    }
+    auto value = base;
+    for(std::size_t i = 0; i < rows; ++i) {
+      out[i] = value;
+      value += unzigzag(unpack(data, size, i, width));
+    }
+  }
+};
+
+// The parts of an encoded block: a row count, the packed columns, the front
+// coded names and the offsets of their restarts.
+struct BlockView {
+  std::size_t rows = 0;
+  ColumnView columns[kColumns];
+  std::byte const* names = nullptr;
+  std::size_t names_size = 0;
+  std::byte const* restarts = nullptr;
+
+  BlockView(std::byte const* data, std::size_t size, std::size_t expected_rows) {
+    Cursor in(data, size);
+    rows = in.varint();
+    if(rows != expected_rows) {
+      corrupt();
+    }
+    for(auto&& c : columns) {
+      c.coding = static_cast<Coding>(in.fixed(1));
+      c.width = static_cast<int>(in.fixed(1));
+      if((c.coding != Coding::Frame && c.coding != Coding::Delta) ||
+         c.width > 64) {
+        corrupt();
+      }
+      c.base = in.varint();
+      auto count = c.coding == Coding::Frame ? rows : rows - 1;
+      c.size = packed_size(count, c.width);
+      c.data = in.take(c.size);
+    }
+    names_size = in.varint();
+    names = in.take(names_size);
+    restarts = in.take(4 * restart_count());
+  }
+
+  std::size_t restart_count() const {
+    return (rows + kRestartInterval - 1) / kRestartInterval;
+  }
+
+  // Decodes names first to last, handing each to visit.
+  template <typename Visit>
+  void decode_names(std::size_t first, std::size_t last, Visit&& visit) const {
+    auto r = first / kRestartInterval;
+    auto offset = load(restarts, 4 * restart_count(), 4 * r) & 0xffffffff;
+    if(offset > names_size) {
+      corrupt();
+    }
+    Cursor in(names + offset, names_size - offset);
+    std::string name;
+    for(auto i = r * kRestartInterval; i <= last; ++i) {
+      auto shared = in.varint();
+      auto suffix = in.varint();
+      if(shared > name.size()) {
+        corrupt();
+      }
+      name.resize(shared);
+      name.append(reinterpret_cast<char const*>(in.take(suffix)), suffix);
+      if(i >= first) {
+        visit(i, name);
+      }
+    }
+  }
+};
+
+void encode_block(
+    FileTable const& table, std::uint32_t const* order, std::size_t rows,
+    std::string& out) {
+  std::vector<std::uint64_t> values(rows);
+  std::vector<std::uint64_t> scratch;
+  put_varint(out, rows);
+  auto column = [&](auto const& source) {
+    for(std::size_t i = 0; i < rows; ++i) {
+      values[i] = static_cast<std::uint64_t>(source[order[i]]);
+    }
+    encode_column(values, scratch, out);
+  };
+  column(table.ids());
+  column(table.parents());
+  column(table.sizes());
+  column(table.created());
+  column(table.accessed());
+  column(table.modified());
+  column(table.lsns());
+  column(table.sequences());
+  column(table.directories());
+
+  std::string names;
+  std::string restarts;
+  std::string_view previous;
+  for(std::size_t i = 0; i < rows; ++i) {
+    auto name = table.name(order[i]);
+    std::size_t shared = 0;
+    if(i % kRestartInterval == 0) {
+      put_fixed(restarts, names.size(), 4);
+    }
+    else {
+      auto limit = std::min(name.size(), previous.size());
+      while(shared < limit && name[shared] == previous[shared]) {
+        ++shared;
+      }
+    }
+    put_varint(names, shared);
+    put_varint(names, name.size() - shared);
+    names.append(name.substr(shared));
+    previous = name;
+  }
+  put_varint(out, names.size());
+  out += names;
+  out += restarts;
+}
+
+// A block of index entries: a count, then the keys and ids packed as
+// columns.
+void encode_index_block(
+    std::vector<SortedIndex::Entry> const& entries, std::string& out) {
+  std::vector<std::uint64_t> values(entries.size());
+  std::vector<std::uint64_t> scratch;
+  put_varint(out, entries.size());
+  for(std::size_t i = 0; i < entries.size(); ++i) {
+    values[i] = entries[i].key;
+  }
+  encode_column(values, scratch, out);
+  for(std::size_t i = 0; i < entries.size(); ++i) {
+    values[i] = entries[i].id;
+  }
+  encode_column(values, scratch, out);
+}
+
+std::vector<SortedIndex::Entry> decode_index_block(
+    std::byte const* data, std::size_t size) {
+  Cursor in(data, size);
+  auto count = in.varint();
+  if(count == 0 || count > size * 8) {
+    corrupt();
+  }
+  ColumnView columns[2];
+  for(auto&& c : columns) {
+    c.coding = static_cast<Coding>(in.fixed(1));
+    c.width = static_cast<int>(in.fixed(1));
+    if((c.coding != Coding::Frame && c.coding != Coding::Delta) ||
+       c.width > 64) {
+      corrupt();
+    }
+    c.base = in.varint();
+    c.size = packed_size(c.coding == Coding::Frame ? count : count - 1, c.width);
+    c.data = in.take(c.size);
+  }
+  std::vector<std::uint64_t> keys(count);
+  std::vector<std::uint64_t> ids(count);
+  columns[0].decode(count, keys.data());
+  columns[1].decode(count, ids.data());
+  std::vector<SortedIndex::Entry> entries(count);
+  for(std::size_t i = 0; i < count; ++i) {
+    entries[i] = {keys[i], ids[i]};
+  }
+  return entries;
+}
+} // namespace
+
+void write_snapshot(
+    FileTable const& table, std::ostream& out, SnapshotOptions const& options) {
+  auto rows = table.size();
+  if(rows > UINT32_MAX) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Too many rows to snapshot."));
+  }
+  auto threads = thread_count(options.threads);
+  std::uint32_t block_rows = std::max<std::uint32_t>(1, options.block_rows);
+
+  // Sort runs in parallel, then merge them pairwise.
+  auto const& parents = table.parents();
+  auto const& ids = table.ids();
+  auto before = [&](std::uint32_t a, std::uint32_t b) {
+    if(parents[a] != parents[b]) {
+      return parents[a] < parents[b];
+    }
+    auto na = table.name(a);
+    auto nb = table.name(b);
+    return na != nb ? na < nb : ids[a] < ids[b];
+  };
+  std::vector<std::uint32_t> order(rows);
+  for(std::uint32_t i = 0; i < rows; ++i) {
+    order[i] = i;
+  }
+  std::size_t run = std::max<std::size_t>(1, (rows + threads - 1) / threads);
+  parallel_for((rows + run - 1) / run, threads, [&](std::size_t r) {
+    std::sort(
+        order.begin() + r * run,
+        order.begin() + std::min(rows, (r + 1) * run), before);
+  });
+  for(; run < rows; run *= 2) {
+    parallel_for((rows + 2 * run - 1) / (2 * run), threads, [&](std::size_t r) {
+      auto first = r * 2 * run;
+      auto middle = std::min(rows, first + run);
+      auto last = std::min(rows, first + 2 * run);
+      std::inplace_merge(
+          order.begin() + first, order.begin() + middle, order.begin() + last,
+          before);
+    });
+  }
+
+  std::string header(kMagic, sizeof(kMagic));
+  auto block_count = (rows + block_rows - 1) / block_rows;
+  put_fixed(header, kVersion, 4);
+  put_fixed(header, block_rows, 4);
+  put_fixed(header, rows, 8);
+  put_fixed(header, block_count, 8);
+  out.write(header.data(), header.size());
+
+  // Blocks are encoded a round at a time and written in order, so memory
+  // stays bounded however large the table.
+  std::string directory;
+  std::uint64_t offset = kHeaderSize;
+  std::vector<std::string> encoded(threads * kBlocksPerThread);
+  for(std::size_t first = 0; first < block_count; first += encoded.size()) {
+    auto count = std::min(encoded.size(), block_count - first);
+    parallel_for(count, threads, [&](std::size_t i) {
+      auto begin = (first + i) * block_rows;
+      encoded[i].clear();
+      encode_block(
+          table, order.data() + begin,
+          std::min<std::size_t>(block_rows, rows - begin), encoded[i]);
+    });
+    for(std::size_t i = 0; i < count; ++i) {
+      auto begin = (first + i) * block_rows;
+      auto end = std::min<std::size_t>(begin + block_rows, rows);
+      put_fixed(directory, offset, 8);
+      put_fixed(directory, encoded[i].size(), 8);
+      put_fixed(directory, parents[order[begin]], 8);
+      put_fixed(directory, parents[order[end - 1]], 8);
+      out.write(encoded[i].data(), encoded[i].size());
+      offset += encoded[i].size();
+    }
+  }
+
+  // Index blocks follow the row blocks, encoded the same way a round at a
+  // time.
+  std::string index_directory;
+  put_fixed(index_directory, options.indexes.size(), 4);
+  for(auto const* index : options.indexes) {
+    auto const& blocks = index->blocks();
+    put_fixed(index_directory, static_cast<std::uint8_t>(index->column()), 1);
+    put_fixed(index_directory, index->size(), 8);
+    put_fixed(index_directory, blocks.size(), 8);
+    for(std::size_t first = 0; first < blocks.size(); first += encoded.size()) {
+      auto count = std::min(encoded.size(), blocks.size() - first);
+      parallel_for(count, threads, [&](std::size_t i) {
+        encoded[i].clear();
+        encode_index_block(blocks[first + i], encoded[i]);
+      });
+      for(std::size_t i = 0; i < count; ++i) {
+        auto const& block = blocks[first + i];
+        put_fixed(index_directory, offset, 8);
+        put_fixed(index_directory, encoded[i].size(), 8);
+        put_fixed(index_directory, block.front().key, 8);
+        put_fixed(index_directory, block.back().key, 8);
+        out.write(encoded[i].data(), encoded[i].size());
+        offset += encoded[i].size();
+      }
+    }
+  }
+
+  auto directory_offset = offset;
+  out.write(directory.data(), directory.size());
+  offset += directory.size();
+  out.write(index_directory.data(), index_directory.size());
+  std::string trailer;
+  put_fixed(trailer, offset, 8);
+  put_fixed(trailer, directory_offset, 8);
+  out.write(trailer.data(), trailer.size());
+  if(!out) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to write snapshot."));
+  }
+}
+
+void write_snapshot(
+    FileTable const& table, std::string const& path,
+    SnapshotOptions const& options) {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if(!out) {
+    BOOST_THROW_EXCEPTION(std::runtime_error("Failed to create " + path));
+  }
+  write_snapshot(table, out, options);
+}
+
+bool is_snapshot(std::string const& path) {
+  char magic[sizeof(kMagic)] = {};
+  std::ifstream in(path, std::ios::binary);
+  in.read(magic, sizeof(magic));
+  return in && std::memcmp(magic, kMagic, sizeof(kMagic)) == 0;
+}
+
+SnapshotReader::SnapshotReader(std::string const& path) {
+  source_ = open_block_source(path, BlockSourceMode::Mapped);
+  size_ = std::filesystem::file_size(path);
+  if(size_ < kHeaderSize + kV1TrailerSize) {
+    corrupt();
+  }
+  region_ = source_->map(0, size_);
+  if(region_) {
+    data_ = region_.data();
+  }
+  else {
+    buffer_.resize(size_);
+    source_->read(0, buffer_.data(), size_);
+    data_ = buffer_.data();
+  }
+
+  Cursor header(data_, kHeaderSize);
+  if(std::memcmp(header.take(sizeof(kMagic)), kMagic, sizeof(kMagic)) != 0) {
+    BOOST_THROW_EXCEPTION(std::runtime_error(path + " isn't a snapshot."));
+  }
+  auto version = header.fixed(4);
+  if(version != 1 && version != kVersion) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error(path + " is an unsupported snapshot version."));
+  }
+  block_rows_ = static_cast<std::uint32_t>(header.fixed(4));
+  rows_ = header.fixed(8);
+  auto block_count = header.fixed(8);
+  auto trailer = version == 1 ? kV1TrailerSize : kTrailerSize;
+  if(size_ < kHeaderSize + trailer) {
+    corrupt();
+  }
+  auto directory = load(data_, size_, size_ - 8);
+  auto directory_end =
+      version == 1 ? size_ - trailer : load(data_, size_, size_ - trailer);
+  if(block_rows_ == 0 ||
+     block_count != (rows_ + block_rows_ - 1) / block_rows_ ||
+     directory_end > size_ - trailer || directory > directory_end ||
+     (directory_end - directory) / kDirectoryEntrySize != block_count) {
+    corrupt();
+  }
+
+  Cursor in(data_ + directory, directory_end - directory);
+  blocks_.resize(block_count);
+  for(auto&& b : blocks_) {
+    b.offset = in.fixed(8);
+    b.size = in.fixed(8);
+    b.first_parent = in.fixed(8);
+    b.last_parent = in.fixed(8);
+    if(b.offset > directory || b.size > directory - b.offset) {
+      corrupt();
+    }
+  }
+  if(version == 1) {
+    return;
+  }
+
+  Cursor index_in(data_ + directory_end, size_ - trailer - directory_end);
+  indexes_.resize(index_in.fixed(4));
+  for(auto&& index : indexes_) {
+    index.column = static_cast<IndexedColumn>(index_in.fixed(1));
+    index.entries = index_in.fixed(8);
+    auto count = index_in.fixed(8);
+    if(count > (size_ - directory_end) / kIndexEntrySize) {
+      corrupt();
+    }
+    index.blocks.resize(count);
+    for(auto&& b : index.blocks) {
+      b.offset = index_in.fixed(8);
+      b.size = index_in.fixed(8);
+      b.min = index_in.fixed(8);
+      b.max = index_in.fixed(8);
+      if(b.offset > directory || b.size > directory - b.offset) {
+        corrupt();
+      }
+    }
+  }
+}
+
+bool SnapshotReader::has_index(IndexedColumn column) const {
+  return std::any_of(indexes_.begin(), indexes_.end(), [&](Index const& i) {
+    return i.column == column;
+  });
+}
+
+SortedIndex SnapshotReader::read_index(
+    IndexedColumn column, std::size_t threads) const {
+  auto it = std::find_if(indexes_.begin(), indexes_.end(), [&](Index const& i) {
+    return i.column == column;
+  });
+  if(it == indexes_.end()) {
+    BOOST_THROW_EXCEPTION(
+        std::runtime_error("Snapshot has no index on that column."));
+  }
+  std::vector<std::vector<SortedIndex::Entry>> blocks(it->blocks.size());
+  parallel_for(blocks.size(), thread_count(threads), [&](std::size_t b) {
+    auto const& entry = it->blocks[b];
+    blocks[b] = decode_index_block(data_ + entry.offset, entry.size);
+    if(blocks[b].front().key != entry.min || blocks[b].back().key != entry.max) {
+      corrupt();
+    }
+  });
+  SortedIndex index(column, std::move(blocks));
+  if(index.size() != it->entries) {
+    corrupt();
+  }
+  return index;
+}
+
+void SnapshotReader::decode_block(std::size_t block, MftFile* dest) const {
+  auto const& b = blocks_.at(block);
+  auto rows = std::min<std::uint64_t>(block_rows_, rows_ - block_begin(block));
+  BlockView view(data_ + b.offset, b.size, rows);
+  std::vector<std::uint64_t> values(rows);
+  auto column = [&](Column c, auto member) {
+    view.columns[c].decode(rows, values.data());
+    for(std::size_t i = 0; i < rows; ++i) {
+      dest[i].*member = static_cast<
+          std::remove_reference_t<decltype(dest[i].*member)>>(values[i]);
+    }
+  };
+  column(kId, &MftFile::id);
+  column(kParent, &MftFile::parent);
+  column(kSize, &MftFile::size);
+  column(kCreated, &MftFile::created);
+  column(kAccessed, &MftFile::accessed);
+  column(kModified, &MftFile::modified);
+  column(kLsn, &MftFile::lsn);
+  column(kSequence, &MftFile::sequence);
+  column(kDirectory, &MftFile::directory);
+  if(rows) {
+    view.decode_names(0, rows - 1, [&](std::size_t i, std::string const& name) {
+      dest[i].name = name;
+    });
+  }
+}
+
+void SnapshotReader::read_block(
+    std::size_t block, std::vector<MftFile>& dest) const {
+  auto rows = std::min<std::uint64_t>(block_rows_, rows_ - block_begin(block));
+  auto first = dest.size();
+  dest.resize(first + rows);
+  decode_block(block, dest.data() + first);
+}
+
+MftFile SnapshotReader::row(std::uint64_t row) const {
+  if(row >= rows_) {
+    BOOST_THROW_EXCEPTION(std::out_of_range("Snapshot row out of range."));
+  }
+  auto block = row / block_rows_;
+  auto i = row % block_rows_;
+  auto const& b = blocks_[block];
+  BlockView view(
+      data_ + b.offset, b.size,
+      std::min<std::uint64_t>(block_rows_, rows_ - block_begin(block)));
+  MftFile f;
+  f.id = view.columns[kId].at(i);
+  f.parent = view.columns[kParent].at(i);
+  f.size = view.columns[kSize].at(i);
+  f.created = static_cast<std::time_t>(view.columns[kCreated].at(i));
+  f.accessed = static_cast<std::time_t>(view.columns[kAccessed].at(i));
+  f.modified = static_cast<std::time_t>(view.columns[kModified].at(i));
+  f.lsn = view.columns[kLsn].at(i);
+  f.sequence = static_cast<std::uint16_t>(view.columns[kSequence].at(i));
+  f.directory = view.columns[kDirectory].at(i) != 0;
+  view.decode_names(i, i, [&](std::size_t, std::string const& name) {
+    f.name = name;
+  });
+  return f;
+}
+
+std::vector<MftFile> SnapshotReader::children(std::uint64_t id) const {
+  // Blocks are in parent order, so the children's blocks are adjacent.
+  auto it = std::lower_bound(
+      blocks_.begin(), blocks_.end(), id,
+      [](Block const& b, std::uint64_t id) { return b.last_parent < id; });
+  std::vector<MftFile> files;
+  std::vector<MftFile> block;
+  for(; it != blocks_.end() && it->first_parent <= id; ++it) {
+    block.clear();
+    read_block(it - blocks_.begin(), block);
+    for(auto&& f : block) {
+      if(f.parent == id) {
+        files.push_back(std::move(f));
+      }
+    }
+  }
+  return files;
+}
+
+std::vector<MftFile> SnapshotReader::read_all(std::size_t threads) const {
+  std::vector<MftFile> files(rows_);
+  parallel_for(blocks_.size(), thread_count(threads), [&](std::size_t b) {
+    decode_block(b, files.data() + block_begin(b));
+  });
+  return files;
+}
+
+} // namespace fsdb
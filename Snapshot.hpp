@@ -0,0 +1,130 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_SNAPSHOT_HPP
+#define FSDB_SNAPSHOT_HPP
+
+#include "BlockSource.hpp"
+#include "MftParser.hpp"
+#include "SortedIndex.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fsdb {
+
+class FileTable;
+
+struct SnapshotOptions {
+  // Rows per block. Blocks are compressed and decoded independently.
+  std::uint32_t block_rows = 4096;
+  // Threads encoding blocks; zero uses one per core.
+  std::size_t threads = 0;
+  // Sorted indexes stored after the rows, to be read back with the
+  // snapshot rather than rebuilt.
+  std::vector<SortedIndex const*> indexes;
+};
+
+// Writes a file table as a compressed snapshot. Rows are stored sorted by
+// parent and then name, so siblings sit together: names are front coded
+// against the previous one with a full name every 16 rows to restart from,
+// and each numeric column is bit packed per block as either offsets from the
+// block's minimum or zigzagged deltas from the previous row, whichever is
+// smaller. Parents come out as runs of zero deltas.
+void write_snapshot(
+    FileTable const& table, std::ostream& out,
+    SnapshotOptions const& options = {});
+void write_snapshot(
+    FileTable const& table, std::string const& path,
+    SnapshotOptions const& options = {});
+
+// True if path starts like a snapshot.
+bool is_snapshot(std::string const& path);
+
+// A snapshot mapped into memory, decoded a block or a row at a time on
+// demand. Rows come back in snapshot order, by parent and then name. All
+// members are safe to call from several threads at once.
+class SnapshotReader {
+ public:
+  explicit SnapshotReader(std::string const& path);
+
+  std::uint64_t rows() const {
+    return rows_;
+  }
+
+  std::size_t block_count() const {
+    return blocks_.size();
+  }
+
+  // The first row held by block.
+  std::uint64_t block_begin(std::size_t block) const {
+    return std::uint64_t(block) * block_rows_;
+  }
+
+  // Decodes one block, appending its rows to dest.
+  void read_block(std::size_t block, std::vector<MftFile>& dest) const;
+  // Decodes a single row without decoding the rest of its block.
+  MftFile row(std::uint64_t row) const;
+  // Every file whose parent is id, decoding only the blocks holding them.
+  std::vector<MftFile> children(std::uint64_t id) const;
+  // Decodes every block on a pool of threads. threads == 0 uses one per
+  // core.
+  std::vector<MftFile> read_all(std::size_t threads = 0) const;
+
+  // True if the snapshot was written with an index on column.
+  bool has_index(IndexedColumn column) const;
+  // Decodes a stored index; throws if there isn't one on column.
+  SortedIndex read_index(IndexedColumn column, std::size_t threads = 0) const;
+
+ private:
+  struct Block {
+    std::uint64_t offset;
+    std::uint64_t size;
+    // Parents of the block's first and last rows.
+    std::uint64_t first_parent;
+    std::uint64_t last_parent;
+  };
+
+  struct IndexBlock {
+    std::uint64_t offset;
+    std::uint64_t size;
+    std::uint64_t min;
+    std::uint64_t max;
+  };
+
+  struct Index {
+    IndexedColumn column;
+    std::uint64_t entries;
+    std::vector<IndexBlock> blocks;
+  };
+
+  void decode_block(std::size_t block, MftFile* dest) const;
+
+  std::unique_ptr<BlockSource> source_;
+  MappedRegion region_;
+  // Holds the file when it couldn't be mapped.
+  AlignedBuffer buffer_;
+  std::byte const* data_ = nullptr;
+  std::size_t size_ = 0;
+  std::uint32_t block_rows_ = 0;
+  std::uint64_t rows_ = 0;
+  std::vector<Block> blocks_;
+  std::vector<Index> indexes_;
+};
+
+} // namespace fsdb
+
+#endif // FSDB_SNAPSHOT_HPP
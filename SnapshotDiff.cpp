@@ -0,0 +1,476 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "SnapshotDiff.hpp"
+#include "ParallelFor.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace fsdb {
+namespace {
+constexpr std::uint32_t kNone = static_cast<std::uint32_t>(-1);
+// Sort key standing in for the parent of roots, which puts them last and
+// keeps a root that is its own parent out of its own children.
+constexpr std::uint64_t kNoParent = static_cast<std::uint64_t>(-1);
+
+std::uint64_t mix(std::uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111eb;
+  return h ^ (h >> 31);
+}
+
+std::uint64_t hash_name(std::string const& name) {
+  std::uint64_t h = 0xcbf29ce484222325;
+  for(unsigned char c : name) {
+    h = (h ^ c) * 0x100000001b3;
+  }
+  return h;
+}
+
+bool same_attributes(MftFile const& a, MftFile const& b) {
+  return a.size == b.size && a.created == b.created &&
+         a.modified == b.modified;
+}
+
+// The rows below a directory: a contiguous range, or a list for the roots.
+struct Children {
+  std::uint32_t const* list;
+  std::uint32_t first;
+  std::size_t size;
+
+  std::uint32_t operator[](std::size_t i) const {
+    return list ? list[i] : first + static_cast<std::uint32_t>(i);
+  }
+};
+
+// One side of the diff, in parent then name order so each directory's
+// children are a contiguous range sorted by name.
+class Tree {
+ public:
+  Tree(std::vector<MftFile> files, DiffMatch match)
+      : files_(std::move(files)) {
+    auto key = [&](MftFile const& f) {
+      return f.parent == f.id ? kNoParent : f.parent;
+    };
+    auto before = [&](MftFile const& a, MftFile const& b) {
+      auto ka = key(a);
+      auto kb = key(b);
+      if(ka != kb) {
+        return ka < kb;
+      }
+      return a.name != b.name ? a.name < b.name : a.id < b.id;
+    };
+    if(!std::is_sorted(files_.begin(), files_.end(), before)) {
+      std::sort(files_.begin(), files_.end(), before);
+    }
+
+    auto rows = static_cast<std::uint32_t>(files_.size());
+    by_id_.reserve(rows);
+    for(std::uint32_t i = 0; i < rows; ++i) {
+      by_id_.emplace_back(files_[i].id, i);
+    }
+    std::sort(by_id_.begin(), by_id_.end());
+
+    child_begin_.assign(rows, 0);
+    child_end_.assign(rows, 0);
+    for(std::uint32_t begin = 0, end; begin < rows; begin = end) {
+      auto parent = key(files_[begin]);
+      for(end = begin + 1; end < rows && key(files_[end]) == parent; ++end) {
+      }
+      auto p = parent == kNoParent ? kNone : find(parent);
+      if(p == kNone) {
+        for(auto r = begin; r < end; ++r) {
+          roots_.push_back(r);
+        }
+      }
+      else {
+        child_begin_[p] = begin;
+        child_end_[p] = end;
+      }
+    }
+    std::sort(roots_.begin(), roots_.end(), [&](auto a, auto b) {
+      auto const& fa = files_[a];
+      auto const& fb = files_[b];
+      return fa.name != fb.name ? fa.name < fb.name : fa.id < fb.id;
+    });
+
+    // Each directory's digest covers everything below it but not itself,
+    // so a renamed directory with unchanged contents is still skipped.
+    // Children come after their parents breadth first, so walking that
+    // order backwards finishes every child before its parent.
+    std::vector<std::uint32_t> order = roots_;
+    order.reserve(rows);
+    for(std::size_t next = 0; next < order.size(); ++next) {
+      auto r = order[next];
+      for(auto c = child_begin_[r]; c < child_end_[r]; ++c) {
+        order.push_back(c);
+      }
+    }
+    digests_.assign(rows, 0);
+    for(auto it = order.rbegin(); it != order.rend(); ++it) {
+      std::uint64_t digest = 0;
+      for(auto c = child_begin_[*it]; c < child_end_[*it]; ++c) {
+        auto const& f = files_[c];
+        auto h = hash_name(f.name) ^ mix(f.size) ^ mix(f.created + 1) ^
+                 mix(f.modified + 2) ^ mix(f.directory + 3);
+        if(match == DiffMatch::Id) {
+          h ^= mix(f.id + 4) ^ mix(f.sequence + 5);
+        }
+        digest = mix(digest + mix(h + digests_[c]));
+      }
+      digests_[*it] = digest;
+    }
+  }
+
+  MftFile const& file(std::uint32_t row) const {
+    return files_[row];
+  }
+
+  std::uint64_t digest(std::uint32_t row) const {
+    return digests_[row];
+  }
+
+  // The rows below row, or the roots for kNone, in name order.
+  Children children(std::uint32_t row) const {
+    if(row == kNone) {
+      return {roots_.data(), 0, roots_.size()};
+    }
+    return {nullptr, child_begin_[row], child_end_[row] - child_begin_[row]};
+  }
+
+  // The row holding the same file as f, or kNone.
+  std::uint32_t find_same(MftFile const& f) const {
+    auto row = find(f.id);
+    if(row == kNone || files_[row].sequence != f.sequence ||
+       files_[row].directory != f.directory) {
+      return kNone;
+    }
+    return row;
+  }
+
+ private:
+  std::uint32_t find(std::uint64_t id) const {
+    auto it = std::lower_bound(
+        by_id_.begin(), by_id_.end(), std::make_pair(id, std::uint32_t(0)));
+    return it != by_id_.end() && it->first == id ? it->second : kNone;
+  }
+
+  std::vector<MftFile> files_;
+  std::vector<std::pair<std::uint64_t, std::uint32_t>> by_id_;
+  std::vector<std::uint32_t> child_begin_;
+  std::vector<std::uint32_t> child_end_;
+  std::vector<std::uint32_t> roots_;
+  std::vector<std::uint64_t> digests_;
+};
+
+// Something left to compare: a directory in both trees (or the roots, with
+// both rows kNone), or a subtree only in one of them.
+struct Task {
+  enum Kind { Pair, Added, Removed } kind;
+  std::uint32_t before;
+  std::uint32_t after;
+};
+
+class Differ {
+ public:
+  Differ(
+      Tree const& before, Tree const& after, ChangeSink const& sink,
+      DiffOptions const& options)
+      : before_(before)
+      , after_(after)
+      , sink_(sink)
+      , options_(options) {
+  }
+
+  DiffStats run() {
+    queue_.push_back({Task::Pair, kNone, kNone});
+    // Each work() runs until the queue drains, so one per thread.
+    auto threads = thread_count(options_.threads);
+    parallel_for(threads, threads, [this](std::size_t) { work(); });
+    if(error_) {
+      std::rethrow_exception(error_);
+    }
+    return stats_;
+  }
+
+ private:
+  // Per thread state.
+  struct Worker {
+    std::vector<FileChange> changes;
+    std::vector<Task> tasks;
+    DiffStats stats;
+  };
+
+  void work() {
+    Worker w;
+    std::unique_lock<std::mutex> lk(queue_mutex_);
+    while(true) {
+      // Done once nothing is queued and nobody holds a task that might
+      // queue more.
+      queue_changed_.wait(
+          lk, [&] { return !queue_.empty() || !busy_ || error_; });
+      if(queue_.empty() || error_) {
+        break;
+      }
+      auto task = queue_.back();
+      queue_.pop_back();
+      ++busy_;
+      lk.unlock();
+      try {
+        process(task, w);
+      }
+      catch(...) {
+        lk.lock();
+        fail(std::current_exception());
+        --busy_;
+        break;
+      }
+      lk.lock();
+      queue_.insert(queue_.end(), w.tasks.begin(), w.tasks.end());
+      w.tasks.clear();
+      --busy_;
+      queue_changed_.notify_all();
+    }
+    bool failed = error_ != nullptr;
+    lk.unlock();
+    if(!failed) {
+      try {
+        flush(w);
+      }
+      catch(...) {
+        lk.lock();
+        fail(std::current_exception());
+        lk.unlock();
+      }
+    }
+
+    std::lock_guard<std::mutex> stats_lk(sink_mutex_);
+    stats_.added += w.stats.added;
+    stats_.removed += w.stats.removed;
+    stats_.modified += w.stats.modified;
+    stats_.moved += w.stats.moved;
+    stats_.compared += w.stats.compared;
+    stats_.skipped += w.stats.skipped;
+  }
+
+  // Called with queue_mutex_ held.
+  void fail(std::exception_ptr error) {
+    if(!error_) {
+      error_ = error;
+    }
+    queue_.clear();
+    queue_changed_.notify_all();
+  }
+
+  void process(Task const& task, Worker& w) {
+    if(task.kind == Task::Added) {
+      auto children = after_.children(task.after);
+      for(std::size_t i = 0; i < children.size; ++i) {
+        only_after(children[i], w);
+      }
+      return;
+    }
+    if(task.kind == Task::Removed) {
+      auto children = before_.children(task.before);
+      for(std::size_t i = 0; i < children.size; ++i) {
+        only_before(children[i], w);
+      }
+      return;
+    }
+
+    // Both sides' children are sorted by name and then id, so one merge
+    // pairs them up. Matching by id also compares ids, so siblings sharing
+    // a name pair up with themselves.
+    ++w.stats.compared;
+    auto old_children = before_.children(task.before);
+    auto new_children = after_.children(task.after);
+    auto order = [&](MftFile const& a, MftFile const& b) {
+      if(a.name != b.name) {
+        return a.name < b.name ? -1 : 1;
+      }
+      if(options_.match == DiffMatch::Path || a.id == b.id) {
+        return 0;
+      }
+      return a.id < b.id ? -1 : 1;
+    };
+    std::size_t i = 0;
+    std::size_t j = 0;
+    while(i < old_children.size || j < new_children.size) {
+      int c = i == old_children.size   ? 1
+              : j == new_children.size ? -1
+                                       : order(
+                                             before_.file(old_children[i]),
+                                             after_.file(new_children[j]));
+      if(c < 0) {
+        only_before(old_children[i++], w);
+      }
+      else if(c > 0) {
+        only_after(new_children[j++], w);
+      }
+      else {
+        matched(old_children[i++], new_children[j++], w);
+      }
+    }
+  }
+
+  void matched(std::uint32_t a, std::uint32_t b, Worker& w) {
+    auto const& old_file = before_.file(a);
+    auto const& new_file = after_.file(b);
+    if(old_file.directory != new_file.directory) {
+      removed(a, w);
+      added(b, w);
+      return;
+    }
+    if(options_.match == DiffMatch::Id &&
+       old_file.sequence != new_file.sequence) {
+      only_before(a, w);
+      only_after(b, w);
+      return;
+    }
+    if(!same_attributes(old_file, new_file)) {
+      emit(ChangeKind::Modified, &old_file, &new_file, w);
+    }
+    descend(a, b, w);
+  }
+
+  // A file in the new tree with no counterpart at the same path.
+  void only_after(std::uint32_t b, Worker& w) {
+    if(options_.match == DiffMatch::Id) {
+      auto a = before_.find_same(after_.file(b));
+      if(a != kNone) {
+        emit(ChangeKind::Moved, &before_.file(a), &after_.file(b), w);
+        descend(a, b, w);
+        return;
+      }
+    }
+    added(b, w);
+  }
+
+  // A file in the old tree with no counterpart at the same path. Files that
+  // moved are reported from the new tree's side.
+  void only_before(std::uint32_t a, Worker& w) {
+    if(options_.match == DiffMatch::Id &&
+       after_.find_same(before_.file(a)) != kNone) {
+      return;
+    }
+    removed(a, w);
+  }
+
+  void added(std::uint32_t b, Worker& w) {
+    emit(ChangeKind::Added, nullptr, &after_.file(b), w);
+    if(after_.children(b).size) {
+      w.tasks.push_back({Task::Added, kNone, b});
+    }
+  }
+
+  void removed(std::uint32_t a, Worker& w) {
+    emit(ChangeKind::Removed, &before_.file(a), nullptr, w);
+    if(before_.children(a).size) {
+      w.tasks.push_back({Task::Removed, a, kNone});
+    }
+  }
+
+  // Anything with children is walked, directory or not, so scans that
+  // hang files off files lose nothing.
+  void descend(std::uint32_t a, std::uint32_t b, Worker& w) {
+    if(!before_.children(a).size && !after_.children(b).size) {
+      return;
+    }
+    if(before_.digest(a) == after_.digest(b)) {
+      ++w.stats.skipped;
+      return;
+    }
+    w.tasks.push_back({Task::Pair, a, b});
+  }
+
+  void emit(
+      ChangeKind kind, MftFile const* before, MftFile const* after,
+      Worker& w) {
+    switch(kind) {
+      case ChangeKind::Added:
+        ++w.stats.added;
+        break;
+      case ChangeKind::Removed:
+        ++w.stats.removed;
+        break;
+      case ChangeKind::Modified:
+        ++w.stats.modified;
+        break;
+      case ChangeKind::Moved:
+        ++w.stats.moved;
+        break;
+    }
+    w.changes.push_back({kind, before ? *before : MftFile(),
+                         after ? *after : MftFile()});
+    if(w.changes.size() >= options_.batch_size) {
+      flush(w);
+    }
+  }
+
+  void flush(Worker& w) {
+    if(w.changes.empty()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lk(sink_mutex_);
+      sink_(w.changes);
+    }
+    w.changes.clear();
+  }
+
+  Tree const& before_;
+  Tree const& after_;
+  ChangeSink const& sink_;
+  DiffOptions options_;
+  std::mutex queue_mutex_;
+  std::condition_variable queue_changed_;
+  std::vector<Task> queue_;
+  // Threads holding a task, which may yet queue more.
+  std::size_t busy_ = 0;
+  std::exception_ptr error_;
+  std::mutex sink_mutex_;
+  DiffStats stats_;
+};
+} // namespace
+
+DiffStats diff_snapshots(
+    std::vector<MftFile> before, std::vector<MftFile> after,
+    ChangeSink const& sink, DiffOptions const& options) {
+  // Both sides are indexed at once.
+  std::exception_ptr error;
+  std::unique_ptr<Tree> old_tree;
+  std::thread indexer([&] {
+    try {
+      old_tree = std::make_unique<Tree>(std::move(before), options.match);
+    }
+    catch(...) {
+      error = std::current_exception();
+    }
+  });
+  Tree new_tree(std::move(after), options.match);
+  indexer.join();
+  if(error) {
+    std::rethrow_exception(error);
+  }
+  return Differ(*old_tree, new_tree, sink, options).run();
+}
+
+} // namespace fsdb
@@ -0,0 +1,83 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_SNAPSHOTDIFF_HPP
+#define FSDB_SNAPSHOTDIFF_HPP
+
+#include "MftParser.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace fsdb {
+
+enum class DiffMatch {
+  // Files are the same file if their ids (MFT record and sequence number,
+  // or st_ino) match, wherever they are. Renames and moves are detected.
+  Id,
+  // Files are the same file if they have the same path. For sources whose
+  // ids aren't stable between scans; a move shows up as a remove and an add.
+  Path,
+};
+
+enum class ChangeKind {
+  Added,
+  Removed,
+  // Same place, different size or times.
+  Modified,
+  // Different parent or name, and possibly modified as well.
+  Moved,
+};
+
+struct FileChange {
+  ChangeKind kind;
+  // Empty for Added and Removed respectively.
+  MftFile before;
+  MftFile after;
+};
+
+// Receives batches of changes, one call at a time, in no particular order.
+using ChangeSink = std::function<void(std::vector<FileChange> const&)>;
+
+struct DiffOptions {
+  DiffMatch match = DiffMatch::Id;
+  // Threads comparing directories; zero uses one per core.
+  std::size_t threads = 0;
+  // Changes buffered per thread before being handed to the sink.
+  std::size_t batch_size = 4096;
+};
+
+struct DiffStats {
+  std::uint64_t added = 0;
+  std::uint64_t removed = 0;
+  std::uint64_t modified = 0;
+  std::uint64_t moved = 0;
+  // Directory pairs compared child by child, and those skipped because
+  // their subtrees' digests matched.
+  std::uint64_t compared = 0;
+  std::uint64_t skipped = 0;
+};
+
+// Streams the changes between two scans of the same tree to sink. Each
+// directory gets a digest of its whole subtree; the trees are walked from
+// their roots in parallel, merging each pair of directories' children by
+// name and skipping subtrees whose digests match. Files whose parent isn't
+// in the scan are treated as roots.
+DiffStats diff_snapshots(
+    std::vector<MftFile> before, std::vector<MftFile> after,
+    ChangeSink const& sink, DiffOptions const& options = {});
+
+} // namespace fsdb
+
+#endif // FSDB_SNAPSHOTDIFF_HPP
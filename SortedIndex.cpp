@@ -0,0 +1,208 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "SortedIndex.hpp"
+#include "FileTable.hpp"
+#include "MftParser.hpp"
+#include "Preorder.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace fsdb {
+namespace {
+constexpr std::uint32_t kNone = static_cast<std::uint32_t>(-1);
+
+// The row holding id in a table sorted by id, or kNone.
+std::uint32_t find_sorted(FileTable const& table, std::uint64_t id) {
+  auto const& ids = table.ids();
+  auto it = std::lower_bound(ids.begin(), ids.end(), id);
+  return it != ids.end() && *it == id ? std::uint32_t(it - ids.begin())
+                                      : kNone;
+}
+} // namespace
+
+SubtreeIntervals::SubtreeIntervals(FileTable const& table) {
+  auto tree = preorder(table);
+  auto rows = static_cast<std::uint32_t>(table.size());
+  std::vector<std::pair<std::uint64_t, std::uint32_t>> by_id(rows);
+  for(std::uint32_t r = 0; r < rows; ++r) {
+    by_id[r] = {table.ids()[r], r};
+  }
+  std::sort(by_id.begin(), by_id.end());
+  ids_.reserve(rows);
+  intervals_.reserve(rows);
+  for(auto&& [id, r] : by_id) {
+    auto p = tree.positions[r];
+    ids_.push_back(id);
+    intervals_.push_back({p, tree.ends[p]});
+  }
+}
+
+SubtreeIntervals::Interval SubtreeIntervals::interval(std::uint64_t id) const {
+  auto it = std::lower_bound(ids_.begin(), ids_.end(), id);
+  if(it == ids_.end() || *it != id) {
+    return {};
+  }
+  return intervals_[it - ids_.begin()];
+}
+
+SortedIndex::SortedIndex(IndexedColumn column)
+    : column_(column) {
+}
+
+SortedIndex::SortedIndex(IndexedColumn column, FileTable const& table)
+    : column_(column) {
+  std::vector<Entry> entries(table.size());
+  for(std::size_t r = 0; r < table.size(); ++r) {
+    entries[r] = {key(column, table, r), table.ids()[r]};
+  }
+  std::sort(entries.begin(), entries.end());
+  for(std::size_t first = 0; first < entries.size(); first += kBlockEntries) {
+    blocks_.emplace_back(
+        entries.begin() + first,
+        entries.begin() + std::min(entries.size(), first + kBlockEntries));
+    min_.push_back(blocks_.back().front().key);
+    max_.push_back(blocks_.back().back().key);
+  }
+  size_ = entries.size();
+}
+
+SortedIndex::SortedIndex(
+    IndexedColumn column, std::vector<std::vector<Entry>> blocks)
+    : column_(column) {
+  for(auto&& b : blocks) {
+    if(b.empty()) {
+      continue;
+    }
+    size_ += b.size();
+    min_.push_back(b.front().key);
+    max_.push_back(b.back().key);
+    blocks_.push_back(std::move(b));
+  }
+}
+
+std::uint64_t SortedIndex::time_key(std::time_t time) {
+  return static_cast<std::uint64_t>(time) ^ (std::uint64_t(1) << 63);
+}
+
+std::uint64_t SortedIndex::key(
+    IndexedColumn column, FileTable const& table, std::size_t row) {
+  return column == IndexedColumn::Modified ? time_key(table.modified()[row])
+                                           : table.sizes()[row];
+}
+
+void SortedIndex::range(
+    std::uint64_t low, std::uint64_t high,
+    std::function<bool(Entry const&)> const& visit) const {
+  // Blocks are in key order, so their largest keys are too.
+  auto b = std::lower_bound(max_.begin(), max_.end(), low) - max_.begin();
+  for(; b < std::ptrdiff_t(blocks_.size()) && min_[b] <= high; ++b) {
+    auto const& block = blocks_[b];
+    auto first = block.begin();
+    auto last = block.end();
+    // Only the blocks at either end need their keys checked.
+    if(min_[b] < low) {
+      first = std::lower_bound(first, last, Entry{low, 0});
+    }
+    if(max_[b] > high) {
+      last = std::upper_bound(first, last, Entry{high, ~std::uint64_t(0)});
+    }
+    for(; first != last; ++first) {
+      if(!visit(*first)) {
+        return;
+      }
+    }
+  }
+}
+
+void SortedIndex::update(
+    MftChanges const& changes, FileTable const& before,
+    FileTable const& after) {
+  for(auto const* ids :
+      {&changes.deleted, &changes.modified, &changes.recreated}) {
+    for(auto id : *ids) {
+      auto r = find_sorted(before, id);
+      if(r != kNone) {
+        erase({key(column_, before, r), id});
+      }
+    }
+  }
+  for(auto const* ids :
+      {&changes.added, &changes.modified, &changes.recreated}) {
+    for(auto id : *ids) {
+      auto r = find_sorted(after, id);
+      if(r != kNone) {
+        insert({key(column_, after, r), id});
+      }
+    }
+  }
+}
+
+std::size_t SortedIndex::block_for(Entry const& entry) const {
+  return std::lower_bound(
+             blocks_.begin(), blocks_.end(), entry,
+             [](std::vector<Entry> const& block, Entry const& e) {
+               return block.back() < e;
+             }) -
+         blocks_.begin();
+}
+
+void SortedIndex::insert(Entry entry) {
+  if(blocks_.empty()) {
+    blocks_.emplace_back();
+    min_.push_back(0);
+    max_.push_back(0);
+  }
+  auto b = std::min(block_for(entry), blocks_.size() - 1);
+  auto& block = blocks_[b];
+  block.insert(std::upper_bound(block.begin(), block.end(), entry), entry);
+  ++size_;
+  if(block.size() >= 2 * kBlockEntries) {
+    std::vector<Entry> upper(block.begin() + kBlockEntries, block.end());
+    block.resize(kBlockEntries);
+    blocks_.insert(blocks_.begin() + b + 1, std::move(upper));
+    min_.insert(min_.begin() + b + 1, 0);
+    max_.insert(max_.begin() + b + 1, 0);
+    summarise(b + 1);
+  }
+  summarise(b);
+}
+
+void SortedIndex::erase(Entry entry) {
+  auto b = block_for(entry);
+  if(b == blocks_.size()) {
+    return;
+  }
+  auto& block = blocks_[b];
+  auto it = std::lower_bound(block.begin(), block.end(), entry);
+  if(it == block.end() || it->key != entry.key || it->id != entry.id) {
+    return;
+  }
+  block.erase(it);
+  --size_;
+  if(block.empty()) {
+    blocks_.erase(blocks_.begin() + b);
+    min_.erase(min_.begin() + b);
+    max_.erase(max_.begin() + b);
+    return;
+  }
+  summarise(b);
+}
+
+void SortedIndex::summarise(std::size_t block) {
+  min_[block] = blocks_[block].front().key;
+  max_[block] = blocks_[block].back().key;
+}
+
+} // namespace fsdb
@@ -0,0 +1,131 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_SORTEDINDEX_HPP
+#define FSDB_SORTEDINDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <vector>
+
+namespace fsdb {
+
+class FileTable;
+struct MftChanges;
+
+enum class IndexedColumn : std::uint8_t {
+  Modified = 1,
+  Size = 2,
+};
+
+// The preorder() positions of a table's files, looked up by id, leaving
+// the table as it is. Everything below a file falls within its interval, so
+// "is X under Y" is two comparisons. Files whose parent isn't in the table
+// are roots.
+class SubtreeIntervals {
+ public:
+  struct Interval {
+    std::uint32_t begin = 0;
+    std::uint32_t end = 0;
+
+    bool contains(Interval other) const {
+      return other.begin < other.end && begin <= other.begin &&
+             other.begin < end;
+    }
+  };
+
+  explicit SubtreeIntervals(FileTable const& table);
+
+  // Empty for ids that aren't in the table.
+  Interval interval(std::uint64_t id) const;
+
+ private:
+  // Sorted by id, with each id's interval alongside.
+  std::vector<std::uint64_t> ids_;
+  std::vector<Interval> intervals_;
+};
+
+// A table's file ids sorted by one column. Entries are kept in blocks with
+// each block's smallest and largest value summarised apart, so a range
+// query binary searches the summaries and only checks values in the blocks
+// at either end. Edits touch only the blocks they land in.
+class SortedIndex {
+ public:
+  struct Entry {
+    std::uint64_t key;
+    std::uint64_t id;
+
+    bool operator<(Entry const& other) const {
+      return key != other.key ? key < other.key : id < other.id;
+    }
+  };
+
+  // Blocks are split when they reach twice this.
+  static constexpr std::size_t kBlockEntries = 1024;
+
+  explicit SortedIndex(IndexedColumn column);
+  SortedIndex(IndexedColumn column, FileTable const& table);
+  // Takes blocks already in order, as a snapshot stores them.
+  SortedIndex(IndexedColumn column, std::vector<std::vector<Entry>> blocks);
+
+  IndexedColumn column() const {
+    return column_;
+  }
+
+  std::size_t size() const {
+    return size_;
+  }
+
+  std::vector<std::vector<Entry>> const& blocks() const {
+    return blocks_;
+  }
+
+  // Keys are unsigned; times are offset so they sort the same way.
+  static std::uint64_t time_key(std::time_t time);
+  static std::uint64_t key(
+      IndexedColumn column, FileTable const& table, std::size_t row);
+
+  // Visits entries with keys in [low, high] in key order until visit
+  // returns false.
+  void range(
+      std::uint64_t low, std::uint64_t high,
+      std::function<bool(Entry const&)> const& visit) const;
+
+  // Applies a refresh. before and after must be in id order, as MftReader
+  // produces them: deleted, modified and recreated files are found by
+  // their old value and modified, recreated and added ones inserted with
+  // their new one.
+  void update(
+      MftChanges const& changes, FileTable const& before,
+      FileTable const& after);
+
+ private:
+  void insert(Entry entry);
+  void erase(Entry entry);
+  // The block entry belongs in: the first whose last entry isn't before it.
+  std::size_t block_for(Entry const& entry) const;
+  void summarise(std::size_t block);
+
+  IndexedColumn column_;
+  std::vector<std::vector<Entry>> blocks_;
+  // Smallest and largest key in each block.
+  std::vector<std::uint64_t> min_;
+  std::vector<std::uint64_t> max_;
+  std::size_t size_ = 0;
+};
+
+} // namespace fsdb
+
+#endif // FSDB_SORTEDINDEX_HPP
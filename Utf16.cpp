@@ -0,0 +1,117 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "Utf16.hpp"
+
+#include <cstdint>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FSDB_UTF16_SSE2 1
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define FSDB_UTF16_NEON 1
+#endif
+
+namespace fsdb {
+namespace {
+
+#if defined(FSDB_UTF16_NEON)
+// The largest lane. Only AArch64 reduces across a vector in one
+// instruction; 32 bit NEON folds pairs instead.
+std::uint16_t max_lane(uint16x8_t v) {
+#if defined(__aarch64__) || defined(_M_ARM64)
+  return vmaxvq_u16(v);
+#else
+  auto m = vpmax_u16(vget_low_u16(v), vget_high_u16(v));
+  m = vpmax_u16(m, m);
+  m = vpmax_u16(m, m);
+  return vget_lane_u16(m, 0);
+#endif
+}
+#endif
+
+// Converts the longest all-ASCII prefix of [src, src + length) a vector at a
+// time and returns how many code units were consumed.
+std::size_t ascii_prefix(char16_t const* src, std::size_t length, char* dest) {
+  std::size_t i = 0;
+#if defined(FSDB_UTF16_SSE2)
+  __m128i const non_ascii = _mm_set1_epi16(static_cast<short>(0xff80));
+  __m128i const zero = _mm_setzero_si128();
+  for(; i + 16 <= length; i += 16) {
+    auto a = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i));
+    auto b = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + i + 8));
+    auto high = _mm_and_si128(_mm_or_si128(a, b), non_ascii);
+    if(_mm_movemask_epi8(_mm_cmpeq_epi16(high, zero)) != 0xffff) {
+      break;
+    }
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i*>(dest + i), _mm_packus_epi16(a, b));
+  }
+#elif defined(FSDB_UTF16_NEON)
+  for(; i + 8 <= length; i += 8) {
+    auto v = vld1q_u16(reinterpret_cast<std::uint16_t const*>(src + i));
+    if(max_lane(v) >= 0x80) {
+      break;
+    }
+    vst1_u8(reinterpret_cast<std::uint8_t*>(dest + i), vmovn_u16(v));
+  }
+#endif
+  for(; i < length && src[i] < 0x80; ++i) {
+    dest[i] = static_cast<char>(src[i]);
+  }
+  return i;
+}
+
+} // namespace
+
+std::size_t utf16_to_utf8(char16_t const* src, std::size_t length, char* dest) {
+  char* out = dest;
+  std::size_t i = 0;
+  while(i < length) {
+    auto ascii = ascii_prefix(src + i, length - i, out);
+    i += ascii;
+    out += ascii;
+
+    // Scalar until the next ASCII code unit.
+    for(; i < length && src[i] >= 0x80; ++i) {
+      std::uint32_t c = src[i];
+      if(c < 0x800) {
+        *out++ = static_cast<char>(0xc0 | (c >> 6));
+        *out++ = static_cast<char>(0x80 | (c & 0x3f));
+        continue;
+      }
+
+      if(c >= 0xd800 && c <= 0xdfff) {
+        if(c <= 0xdbff && i + 1 < length && src[i + 1] >= 0xdc00 &&
+           src[i + 1] <= 0xdfff) {
+          c = 0x10000 + ((c - 0xd800) << 10) + (src[i + 1] - 0xdc00);
+          ++i;
+          *out++ = static_cast<char>(0xf0 | (c >> 18));
+          *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+          *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+          *out++ = static_cast<char>(0x80 | (c & 0x3f));
+          continue;
+        }
+        c = 0xfffd;
+      }
+
+      *out++ = static_cast<char>(0xe0 | (c >> 12));
+      *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+      *out++ = static_cast<char>(0x80 | (c & 0x3f));
+    }
+  }
+  return out - dest;
+}
+
+} // namespace fsdb
@@ -0,0 +1,33 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#ifndef FSDB_UTF16_HPP
+#define FSDB_UTF16_HPP
+
+#include <cstddef>
+
+namespace fsdb {
+
+// Worst case UTF-8 size of length UTF-16 code units.
+constexpr std::size_t utf8_capacity(std::size_t length) {
+  return length * 3;
+}
+
+// Transcodes UTF-16LE to UTF-8, returning the number of bytes written. dest
+// must have room for utf8_capacity(length) bytes. Runs of ASCII are
+// converted 16 code units at a time; unpaired surrogates become U+FFFD.
+std::size_t utf16_to_utf8(char16_t const* src, std::size_t length, char* dest);
+
+} // namespace fsdb
+
+#endif // FSDB_UTF16_HPP
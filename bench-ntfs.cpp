@@ -0,0 +1,299 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "NtfsBuilder.hpp"
+#include "NtfsFormat.hpp"
+#include "NtfsImage.hpp"
+
+#include <benchmark/benchmark.h>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+constexpr std::size_t kRecordSize = 1024;
+constexpr std::size_t kRecordCount = 4096;
+
+// A seeded mix of record shapes: resident and fragmented non-resident data,
+// directories, DOS aliases and attribute lists. unicode_percent of names
+// are outside ASCII.
+std::vector<fsdb::RecordSpec> make_specs(int unicode_percent) {
+  std::mt19937 rng(1);
+  auto percent = [&](int p) {
+    return static_cast<int>(rng() % 100) < p;
+  };
+
+  std::vector<fsdb::RecordSpec> specs(kRecordCount);
+  for(std::size_t i = 0; i < specs.size(); ++i) {
+    auto&& spec = specs[i];
+    spec.id = static_cast<std::uint32_t>(i + 16);
+    spec.parent = 5 + rng() % (i + 1);
+    spec.time = 132000000000000000 + rng();
+    spec.directory = percent(10);
+    spec.attribute_list = percent(5);
+
+    auto length = 8 + rng() % 33;
+    bool unicode = percent(unicode_percent);
+    for(std::size_t c = 0; c < length; ++c) {
+      spec.name += unicode ? char16_t(0x3b1 + rng() % 24)
+                           : char16_t('a' + rng() % 26);
+    }
+    if(percent(30)) {
+      spec.dos_name = u"FILE~1.TXT";
+    }
+
+    if(spec.directory) {
+      continue;
+    }
+    if(percent(50)) {
+      spec.size = rng() % 400;
+      continue;
+    }
+
+    std::uint64_t lcn = 1000 + rng() % 100000;
+    auto runs = 1 + rng() % 8;
+    for(std::size_t r = 0; r < runs; ++r) {
+      auto clusters = 1 + rng() % 64;
+      spec.runs.push_back({0, lcn, clusters});
+      spec.size += clusters * fsdb::kSyntheticClusterSize;
+      lcn += clusters + rng() % 1000;
+    }
+  }
+  return specs;
+}
+
+// Records as they come off the disk, fixups still to be undone.
+std::vector<std::byte> make_records(int unicode_percent) {
+  auto specs = make_specs(unicode_percent);
+  std::vector<std::byte> records(specs.size() * kRecordSize);
+  for(std::size_t i = 0; i < specs.size(); ++i) {
+    fsdb::build_file_record(specs[i], &records[i * kRecordSize], kRecordSize);
+  }
+  return records;
+}
+
+// The same, fixed up, for the benchmarks that start after that step.
+std::vector<std::byte> const& fixed_records(int unicode_percent = 10) {
+  static std::vector<std::byte> const ascii_mix = [] {
+    auto records = make_records(10);
+    for(std::size_t i = 0; i < records.size(); i += kRecordSize) {
+      fsdb::file_record_from_buffer(&records[i]);
+    }
+    return records;
+  }();
+  static std::vector<std::byte> const unicode = [] {
+    auto records = make_records(100);
+    for(std::size_t i = 0; i < records.size(); i += kRecordSize) {
+      fsdb::file_record_from_buffer(&records[i]);
+    }
+    return records;
+  }();
+  return unicode_percent == 100 ? unicode : ascii_mix;
+}
+
+fsdb::NtfsFileRecord const& record_at(
+    std::vector<std::byte> const& records, std::size_t i) {
+  return *reinterpret_cast<fsdb::NtfsFileRecord const*>(
+      &records[i * kRecordSize]);
+}
+
+void set_throughput(benchmark::State& state, std::size_t records) {
+  state.SetItemsProcessed(state.iterations() * records);
+  state.SetBytesProcessed(state.iterations() * records * kRecordSize);
+}
+
+void BM_FixFileRecord(benchmark::State& state) {
+  // Fixing up is idempotent, so the same buffers serve every iteration.
+  auto records = make_records(10);
+  for(auto _ : state) {
+    for(std::size_t i = 0; i < records.size(); i += kRecordSize) {
+      auto file = reinterpret_cast<fsdb::NtfsFileRecord*>(&records[i]);
+      benchmark::DoNotOptimize(fsdb::fix_file_record(file));
+    }
+    benchmark::ClobberMemory();
+  }
+  set_throughput(state, kRecordCount);
+}
+BENCHMARK(BM_FixFileRecord);
+
+void BM_FindAttribute(benchmark::State& state) {
+  auto&& records = fixed_records();
+  for(auto _ : state) {
+    for(std::size_t i = 0; i < kRecordCount; ++i) {
+      benchmark::DoNotOptimize(fsdb::find_attribute(
+          &record_at(records, i), fsdb::NtfsAttributeType::Data));
+    }
+  }
+  set_throughput(state, kRecordCount);
+}
+BENCHMARK(BM_FindAttribute);
+
+void BM_AttributeList(benchmark::State& state) {
+  auto&& records = fixed_records();
+  for(auto _ : state) {
+    std::size_t attributes = 0;
+    for(std::size_t i = 0; i < kRecordCount; ++i) {
+      for(fsdb::AttributeList list(record_at(records, i)); list.current();
+          list.next()) {
+        ++attributes;
+      }
+    }
+    benchmark::DoNotOptimize(attributes);
+  }
+  set_throughput(state, kRecordCount);
+}
+BENCHMARK(BM_AttributeList);
+
+void BM_DecodeRuns(benchmark::State& state) {
+  // One record whose $DATA has state.range(0) fragments.
+  fsdb::RecordSpec spec;
+  spec.name = u"fragmented.bin";
+  std::uint64_t lcn = 5000;
+  for(std::int64_t r = 0; r < state.range(0); ++r) {
+    spec.runs.push_back({0, lcn, 3});
+    spec.size += 3 * fsdb::kSyntheticClusterSize;
+    lcn = r % 2 ? lcn + 700 : lcn - 300;
+  }
+  std::vector<std::byte> record(kRecordSize);
+  fsdb::build_file_record(spec, record.data(), record.size());
+  auto file = fsdb::file_record_from_buffer(record.data());
+  auto data = fsdb::to_nonresident(
+      fsdb::find_attribute(file, fsdb::NtfsAttributeType::Data));
+  for(auto _ : state) {
+    benchmark::DoNotOptimize(fsdb::decode_runs(data, 0));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_DecodeRuns)->Arg(1)->Arg(8)->Arg(64);
+
+void BM_ToTimeT(benchmark::State& state) {
+  std::mt19937_64 rng(1);
+  std::vector<std::int64_t> times(kRecordCount);
+  for(auto&& t : times) {
+    t = 132000000000000000 + static_cast<std::int64_t>(rng() >> 8);
+  }
+  for(auto _ : state) {
+    for(auto t : times) {
+      benchmark::DoNotOptimize(fsdb::to_time_t(t));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * times.size());
+}
+BENCHMARK(BM_ToTimeT);
+
+void BM_FileRecordToMftFile(benchmark::State& state) {
+  auto&& records = fixed_records(static_cast<int>(state.range(0)));
+  fsdb::MftFile f;
+  for(auto _ : state) {
+    for(std::size_t i = 0; i < kRecordCount; ++i) {
+      benchmark::DoNotOptimize(
+          fsdb::file_record_to_mft_file(record_at(records, i), f));
+    }
+  }
+  set_throughput(state, kRecordCount);
+}
+// Argument: percentage of names outside ASCII.
+BENCHMARK(BM_FileRecordToMftFile)->Arg(10)->Arg(100);
+
+fsdb::ImageOptions image_options(std::uint32_t cluster_size) {
+  fsdb::ImageOptions options;
+  options.records = 1 << 17;
+  options.cluster_size = cluster_size;
+  options.mft_fragments = 8;
+  options.max_data_runs = 8;
+  options.deleted_percent = 10;
+  options.unicode_percent = 20;
+  options.long_name_percent = 2;
+  options.attribute_list_percent = 5;
+  return options;
+}
+
+// A generated volume shared by the whole-MFT benchmarks, removed on exit.
+class Image {
+ public:
+  explicit Image(std::uint32_t cluster_size = 4096)
+      : path_((std::filesystem::temp_directory_path() /
+               ("bench-ntfs-" + std::to_string(cluster_size) + ".img"))
+                  .string()) {
+    fsdb::write_image(image_options(cluster_size), path_);
+  }
+
+  ~Image() {
+    std::remove(path_.c_str());
+  }
+
+  std::string const& path() const {
+    return path_;
+  }
+
+ private:
+  std::string path_;
+};
+
+// Reads the whole MFT through the page cache, so this tracks decode
+// throughput rather than the disk. Argument: threads, 0 for MftReader.
+void BM_ReadImage(benchmark::State& state) {
+  static Image const image;
+  fsdb::MftParser parser;
+  parser.open(image.path(), fsdb::BlockSourceMode::Buffered);
+  for(auto _ : state) {
+    if(state.range(0) == 0) {
+      benchmark::DoNotOptimize(parser.read_all());
+    }
+    else {
+      benchmark::DoNotOptimize(parser.read_all_parallel(state.range(0)));
+    }
+  }
+  set_throughput(state, parser.count());
+}
+BENCHMARK(BM_ReadImage)->Arg(0)->Arg(1)->Arg(4)->UseRealTime();
+
+// Reads 512 byte clusters, where records span clusters and $MFT fragments,
+// through MftReader's read queue. Argument: clusters per read; odd counts
+// end mid record unless the reader rounds them up. Fails if the files
+// found differ from read_all_parallel's.
+void BM_ReadSmallClusters(benchmark::State& state) {
+  static Image const image(512);
+  fsdb::MftParser parser;
+  parser.open(image.path(), fsdb::BlockSourceMode::Buffered);
+  auto expected = parser.read_all_parallel(1).size();
+  fsdb::MftReadOptions options;
+  options.clusters_per_read = static_cast<std::uint32_t>(state.range(0));
+  for(auto _ : state) {
+    fsdb::MftReader reader(parser, options);
+    std::vector<fsdb::MftFile> files;
+    files.reserve(expected);
+    while(reader.read(files) == fsdb::OpStatus::NotFinished) {
+      files.reserve(files.size() * 2);
+    }
+    if(files.size() != expected) {
+      state.SkipWithError("MftReader and read_all_parallel disagree");
+      break;
+    }
+  }
+  set_throughput(state, parser.count());
+}
+BENCHMARK(BM_ReadSmallClusters)
+    ->Arg(1)
+    ->Arg(3)
+    ->Arg(7)
+    ->Arg(1024)
+    ->UseRealTime();
+
+} // namespace
+
+BENCHMARK_MAIN();
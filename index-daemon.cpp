@@ -0,0 +1,90 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "IndexServer.hpp"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <pthread.h>
+#include <thread>
+
+// Keeps a volume's file table resident and answers queries about it on a
+// Unix domain socket, rescanning for changes in the background.
+int main(int argc, char** argv) {
+  fsdb::IndexServerOptions options;
+  std::string socket_path;
+  std::string volume;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--refresh=", 10) == 0) {
+      options.refresh_interval = std::chrono::milliseconds(
+          static_cast<long>(std::atof(argv[i] + 10) * 1000));
+    }
+    else if(std::strcmp(argv[i], "--mmap") == 0) {
+      options.mode = fsdb::BlockSourceMode::Mapped;
+    }
+    else if(socket_path.empty()) {
+      socket_path = argv[i];
+    }
+    else {
+      volume = argv[i];
+    }
+  }
+
+  if(volume.empty()) {
+    std::cerr << "usage: index-daemon [--refresh=SECONDS] [--mmap] <socket> "
+                 "<ntfs image or device>"
+              << std::endl;
+    return 1;
+  }
+
+  // Signals are taken on a thread of their own so stopping can lock.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+  options.on_refresh = [](fsdb::MftChanges const& changes) {
+    if(changes.decoded) {
+      std::cout << "index-daemon: refreshed, decoded " << changes.decoded
+                << ": " << changes.added.size() << " added, "
+                << changes.modified.size() << " modified, "
+                << changes.recreated.size() << " recreated, "
+                << changes.deleted.size() << " deleted." << std::endl;
+    }
+  };
+  options.on_error = [](std::exception const& e) {
+    std::cerr << "index-daemon: refresh failed: " << e.what() << std::endl;
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  fsdb::IndexServer server(volume, options);
+  server.listen(socket_path);
+  std::cout << "index-daemon: indexed " << server.index()->table().size()
+            << " files in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << "ms, serving on " << socket_path << "." << std::endl;
+
+  std::thread([&] {
+    int signal = 0;
+    sigwait(&signals, &signal);
+    server.stop();
+  }).detach();
+  server.run();
+  return 0;
+}
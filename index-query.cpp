@@ -0,0 +1,142 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "IndexProtocol.hpp"
+#include <algorithm>
+#include <boost/timer/timer.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace {
+void print_file(fsdb::MftFile const& f) {
+  std::cout << f.id << (f.directory ? " d " : " - ") << f.size << " "
+            << f.modified << " " << f.parent << " " << f.name << "\n";
+}
+
+// A Range query from "LOW:HIGH"; times may be negative.
+fsdb::Query range(fsdb::IndexedColumn column, char const* bounds) {
+  fsdb::Query q;
+  q.op = fsdb::QueryOp::Range;
+  q.column = column;
+  char* end = nullptr;
+  if(column == fsdb::IndexedColumn::Modified) {
+    q.low = std::strtoll(bounds, &end, 10);
+    q.high = *end == ':' ? std::strtoll(end + 1, nullptr, 10) : q.low;
+  }
+  else {
+    q.low = std::strtoull(bounds, &end, 10);
+    q.high = *end == ':' ? std::strtoull(end + 1, nullptr, 10) : q.low;
+  }
+  return q;
+}
+} // namespace
+
+// Sends one batch of queries to index-daemon and prints the answers.
+int main(int argc, char** argv) {
+  boost::timer::auto_cpu_timer t;
+  std::vector<fsdb::Query> queries;
+  std::uint32_t limit = 100;
+  std::uint64_t under = fsdb::kAnySubtree;
+  std::string socket_path;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--stat=", 7) == 0) {
+      queries.emplace_back();
+      queries.back().op = fsdb::QueryOp::Stat;
+      queries.back().id = std::strtoull(argv[i] + 7, nullptr, 10);
+    }
+    else if(std::strncmp(argv[i], "--size=", 7) == 0) {
+      queries.emplace_back();
+      queries.back().op = fsdb::QueryOp::SubtreeSize;
+      queries.back().id = std::strtoull(argv[i] + 7, nullptr, 10);
+    }
+    else if(std::strncmp(argv[i], "--search=", 9) == 0) {
+      queries.emplace_back();
+      queries.back().op = fsdb::QueryOp::Search;
+      queries.back().pattern = argv[i] + 9;
+    }
+    else if(std::strncmp(argv[i], "--modified=", 11) == 0) {
+      queries.push_back(range(fsdb::IndexedColumn::Modified, argv[i] + 11));
+    }
+    else if(std::strncmp(argv[i], "--bytes=", 8) == 0) {
+      queries.push_back(range(fsdb::IndexedColumn::Size, argv[i] + 8));
+    }
+    else if(std::strncmp(argv[i], "--under=", 8) == 0) {
+      under = std::strtoull(argv[i] + 8, nullptr, 10);
+    }
+    else if(std::strncmp(argv[i], "--limit=", 8) == 0) {
+      limit = std::max(0, std::atoi(argv[i] + 8));
+    }
+    else {
+      socket_path = argv[i];
+    }
+  }
+
+  if(socket_path.empty() || queries.empty()) {
+    std::cerr << "usage: index-query [--stat=ID]... [--size=ID]... "
+                 "[--search=TEXT]... [--modified=LOW:HIGH]... "
+                 "[--bytes=LOW:HIGH]... [--under=ID] [--limit=N] <socket>"
+              << std::endl;
+    return 1;
+  }
+
+  for(auto&& q : queries) {
+    q.limit = limit;
+    if(q.op == fsdb::QueryOp::Range) {
+      q.id = under;
+    }
+  }
+
+  fsdb::IndexClient client(socket_path);
+  auto start = std::chrono::steady_clock::now();
+  auto results = client.query(queries);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  for(std::size_t i = 0; i < results.size(); ++i) {
+    auto const& r = results[i];
+    if(r.status != fsdb::QueryStatus::Ok) {
+      std::cout << "query " << i << ": "
+                << (r.status == fsdb::QueryStatus::NotFound ? "not found"
+                                                            : "bad request")
+                << "\n";
+      continue;
+    }
+    switch(r.op) {
+      case fsdb::QueryOp::Stat:
+        print_file(r.files[0]);
+        break;
+      case fsdb::QueryOp::SubtreeSize:
+        std::cout << queries[i].id << ": " << r.bytes << " bytes in "
+                  << r.count << " files\n";
+        break;
+      case fsdb::QueryOp::Search:
+        for(auto&& f : r.files) {
+          print_file(f);
+        }
+        std::cout << "'" << queries[i].pattern << "': " << r.files.size()
+                  << " matches\n";
+        break;
+      case fsdb::QueryOp::Range:
+        for(auto&& f : r.files) {
+          print_file(f);
+        }
+        std::cout << "query " << i << ": " << r.files.size() << " in range\n";
+        break;
+    }
+  }
+  std::cout << "index-query answered " << results.size() << " queries in "
+            << std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+                   .count()
+            << "us." << std::endl;
+  return 0;
+}
@@ -0,0 +1,88 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "NtfsImage.hpp"
+#include <algorithm>
+#include <boost/timer/timer.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Writes a synthetic NTFS volume, or just its MFT, for exercising the
+// parser away from a real disk. Output is fully determined by the options.
+int main(int argc, char** argv) {
+  boost::timer::auto_cpu_timer t;
+  fsdb::ImageOptions options;
+  bool mft_only = false;
+  std::string path;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--seed=", 7) == 0) {
+      options.seed = std::strtoul(argv[i] + 7, nullptr, 10);
+    }
+    else if(std::strncmp(argv[i], "--records=", 10) == 0) {
+      options.records = std::strtoull(argv[i] + 10, nullptr, 10);
+    }
+    else if(std::strncmp(argv[i], "--cluster-size=", 15) == 0) {
+      options.cluster_size = std::strtoul(argv[i] + 15, nullptr, 10);
+    }
+    else if(std::strncmp(argv[i], "--mft-fragments=", 16) == 0) {
+      options.mft_fragments = std::max(1, std::atoi(argv[i] + 16));
+    }
+    else if(std::strncmp(argv[i], "--data-runs=", 12) == 0) {
+      options.max_data_runs = std::max(1, std::atoi(argv[i] + 12));
+    }
+    else if(std::strncmp(argv[i], "--deleted=", 10) == 0) {
+      options.deleted_percent = std::atoi(argv[i] + 10);
+    }
+    else if(std::strncmp(argv[i], "--directories=", 14) == 0) {
+      options.directory_percent = std::atoi(argv[i] + 14);
+    }
+    else if(std::strncmp(argv[i], "--unicode=", 10) == 0) {
+      options.unicode_percent = std::atoi(argv[i] + 10);
+    }
+    else if(std::strncmp(argv[i], "--long-names=", 13) == 0) {
+      options.long_name_percent = std::atoi(argv[i] + 13);
+    }
+    else if(std::strncmp(argv[i], "--attribute-lists=", 18) == 0) {
+      options.attribute_list_percent = std::atoi(argv[i] + 18);
+    }
+    else if(std::strcmp(argv[i], "--mft-only") == 0) {
+      mft_only = true;
+    }
+    else {
+      path = argv[i];
+    }
+  }
+
+  if(path.empty()) {
+    std::cerr << "usage: make-ntfs-image [--seed=N] [--records=N] "
+                 "[--cluster-size=BYTES] [--mft-fragments=N] "
+                 "[--data-runs=N] [--deleted=PCT] "
+                 "[--directories=PCT] [--unicode=PCT] [--long-names=PCT] "
+                 "[--attribute-lists=PCT] [--mft-only] <output>\n";
+    return 1;
+  }
+
+  if(mft_only) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    fsdb::write_mft_region(options, out);
+  }
+  else {
+    fsdb::write_image(options, path);
+  }
+  std::cout << "make-ntfs-image wrote " << options.records << " records to "
+            << path << ".\n";
+  return 0;
+}
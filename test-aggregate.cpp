@@ -0,0 +1,117 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "Aggregate.hpp"
+#include "FileTable.hpp"
+#include "MftParser.hpp"
+#include "Snapshot.hpp"
+#include <algorithm>
+#include <boost/timer/timer.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+
+// Prints a capacity report over a scan: totals by extension, size, age or
+// subtree.
+int main(int argc, char** argv) {
+  boost::timer::auto_cpu_timer t;
+  fsdb::AggregateOptions options;
+  std::size_t copies = 1;
+  std::size_t top = 20;
+  std::string volume;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--threads=", 10) == 0) {
+      options.threads = std::max(1, std::atoi(argv[i] + 10));
+    }
+    else if(std::strcmp(argv[i], "--by=extension") == 0) {
+      options.group_by = fsdb::GroupBy::Extension;
+    }
+    else if(std::strcmp(argv[i], "--by=size") == 0) {
+      options.group_by = fsdb::GroupBy::SizeBucket;
+    }
+    else if(std::strcmp(argv[i], "--by=age") == 0) {
+      options.group_by = fsdb::GroupBy::AgeBucket;
+    }
+    else if(std::strcmp(argv[i], "--by=subtree") == 0) {
+      options.group_by = fsdb::GroupBy::Subtree;
+    }
+    else if(std::strncmp(argv[i], "--depth=", 8) == 0) {
+      options.depth = std::max(0, std::atoi(argv[i] + 8));
+    }
+    else if(std::strcmp(argv[i], "--directories") == 0) {
+      options.directories = true;
+    }
+    else if(std::strncmp(argv[i], "--copies=", 9) == 0) {
+      copies = std::max(1, std::atoi(argv[i] + 9));
+    }
+    else if(std::strncmp(argv[i], "--top=", 6) == 0) {
+      top = std::max(1, std::atoi(argv[i] + 6));
+    }
+    else {
+      volume = argv[i];
+    }
+  }
+
+  if(volume.empty()) {
+    std::cerr << "usage: test-aggregate [--threads=N] "
+                 "[--by=extension|size|age|subtree] [--depth=N] "
+                 "[--directories] [--copies=N] [--top=N] "
+                 "<ntfs image, device or snapshot>"
+              << std::endl;
+    return 1;
+  }
+
+  std::vector<fsdb::MftFile> files;
+  if(fsdb::is_snapshot(volume)) {
+    files = fsdb::SnapshotReader(volume).read_all(options.threads);
+  }
+  else {
+    fsdb::MftParser parser;
+    parser.open(volume);
+    files = parser.read_all();
+  }
+
+  // Copies stand in for a larger volume. Each gets its own id range so
+  // their trees stay apart.
+  std::uint64_t id_range = 0;
+  for(auto&& f : files) {
+    id_range = std::max({id_range, f.id + 1, f.parent + 1});
+  }
+  fsdb::FileTable table;
+  table.reserve(files.size() * copies);
+  for(std::size_t c = 0; c < copies; ++c) {
+    for(auto f : files) {
+      f.id += c * id_range;
+      f.parent += c * id_range;
+      table.append(f);
+    }
+  }
+  files = {};
+
+  auto start = std::chrono::steady_clock::now();
+  auto groups = fsdb::aggregate(table, options);
+  auto elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start);
+
+  for(std::size_t g = 0; g < std::min(top, groups.size()); ++g) {
+    std::cout << std::setw(12) << groups[g].files << std::setw(20)
+              << groups[g].bytes << "  "
+              << (groups[g].key.empty() ? "(none)" : groups[g].key) << "\n";
+  }
+  std::cout << "test-aggregate: " << groups.size() << " groups over "
+            << table.size() << " rows in " << elapsed.count() << "s."
+            << std::endl;
+  return 0;
+}
@@ -11,85 +11,327 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#define BOOST_THREAD_VERSION 5
+
+#ifdef FSTEST_STD_FILESYSTEM
+#include <filesystem>
+#else
 #include <boost/filesystem.hpp>
+#endif
 #include <boost/nowide/convert.hpp>
+#include <boost/thread/executors/basic_thread_pool.hpp>
+#include <boost/thread/sync_queue.hpp>
 #include <boost/timer/timer.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <iostream>
+#include <mutex>
 #include <vector>
 
-int main() {
-  boost::timer::auto_cpu_timer t;
-  struct File {
-    std::size_t parent;
-    std::time_t created;
-    std::time_t accessed;
-    std::time_t modified;
-    std::time_t updated;
-    uint64_t size;
-    std::string name;
-    bool directory;
-  };
-  std::vector<File> files;
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
 
-  File root_file;
-  root_file.parent = 0;
-  root_file.name = ".";
-  files.push_back(root_file);
+#ifdef FSTEST_STD_FILESYSTEM
+namespace fs = std::filesystem;
+using error_code = std::error_code;
+char const* const kProgramName = "test-std_filesystem";
+#else
+namespace fs = boost::filesystem;
+using error_code = boost::system::error_code;
+char const* const kProgramName = "test-boost_filesystem";
+#endif
+
+struct File {
+  std::size_t parent;
+  std::time_t created;
+  std::time_t accessed;
+  std::time_t modified;
+  std::time_t updated;
+  uint64_t size;
+  std::string name;
+  bool directory;
+};
+
+// The leaf name straight out of the entry's native path, without building
+// the temporary path that filename() returns.
+void assign_name(fs::directory_entry const& e, std::string& name) {
+  auto const& native = e.path().native();
+#ifdef _WIN32
+  auto pos = native.find_last_of(L"\\/");
+  name = boost::nowide::narrow(native.c_str() + pos + 1);
+#else
+  auto pos = native.find_last_of('/');
+  name.assign(native, pos + 1, std::string::npos);
+#endif
+}
+
+// One metadata fetch per entry, and the only syscall for it: the type either
+// comes from the directory read (see file_type) or from this same lstat.
+bool fetch_metadata(fs::directory_entry const& e, File& file) {
+#ifndef _WIN32
+  struct stat s;
+  if(::lstat(e.path().c_str(), &s) == -1 ||
+     !(S_ISDIR(s.st_mode) || S_ISREG(s.st_mode))) {
+    return false;
+  }
+  file.directory = S_ISDIR(s.st_mode);
+  file.modified = s.st_mtim.tv_sec;
+  file.size = file.directory ? 0 : s.st_size;
+  return true;
+#elif defined(FSTEST_STD_FILESYSTEM)
+  // MSVC fills these from the FindNextFile data, so they're free.
+  error_code ec;
+  auto lwt = e.last_write_time(ec);
+  if(ec) {
+    return false;
+  }
+  // file_clock counts 100ns ticks since 1601.
+  file.modified = static_cast<std::time_t>(
+      (lwt.time_since_epoch().count() - 116444736000000000LL) / 10000000);
+  file.size = file.directory ? 0 : e.file_size(ec);
+  return !ec;
+#else
+  error_code ec;
+  file.modified = fs::last_write_time(e.path(), ec);
+  if(ec) {
+    return false;
+  }
+  file.size = file.directory ? 0 : fs::file_size(e.path(), ec);
+  return !ec;
+#endif
+}
+
+// Sets directory from the type cached by the directory read, and returns
+// false for anything but a directory or regular file. Symlinks aren't
+// followed, same as the other backends.
+bool file_type(fs::directory_entry const& e, bool& directory) {
+  error_code ec;
+#ifdef FSTEST_STD_FILESYSTEM
+  // libstdc++ doesn't cache symlink_status(), which would be an lstat per
+  // entry, but answers these from the entry's d_type.
+  if(e.is_symlink(ec) || ec) {
+    return false;
+  }
+  directory = e.is_directory(ec);
+  return !ec && (directory || (e.is_regular_file(ec) && !ec));
+#elif !defined(_WIN32)
+  // Boost doesn't keep the type from readdir, so asking would be an lstat
+  // of its own. The one in fetch_metadata settles it instead.
+  return true;
+#else
+  auto st = e.symlink_status(ec);
+  if(ec) {
+    return false;
+  }
+  directory = fs::is_directory(st);
+  return directory || fs::is_regular_file(st);
+#endif
+}
+
+// Fills in a File from an entry if it's something we record. Uses the cached
+// type so non-directory, non-regular entries never cost a syscall.
+bool make_file(fs::directory_entry const& e, std::size_t parent, File& file) {
+  if(!file_type(e, file.directory) || !fetch_metadata(e, file)) {
+    return false;
+  }
+  file.parent = parent;
+  assign_name(e, file.name);
+  return true;
+}
+
+std::size_t run_serial(std::string const& root, std::vector<File>& files) {
   std::vector<std::size_t> directory_stack;
   directory_stack.push_back(0);
   std::size_t total_size = 0;
-  std::size_t last_trace_size = 0;
-  using namespace boost::filesystem;
-  recursive_directory_iterator i(
-      root_file.name, directory_options::skip_permission_denied |
-                          directory_options::pop_on_error);
-  for(; i != recursive_directory_iterator(); ++i) {
+#ifdef FSTEST_STD_FILESYSTEM
+  auto options = fs::directory_options::skip_permission_denied;
+#else
+  auto options = fs::directory_options::skip_permission_denied |
+                 fs::directory_options::pop_on_error;
+#endif
+  fs::recursive_directory_iterator i(root, options);
+  for(; i != fs::recursive_directory_iterator(); ++i) {
     try {
-      boost::system::error_code ec;
-      auto stat = i->status(ec);
-      if(ec) {
+      auto depth = i.depth();
+      directory_stack.resize(depth + 1);
+      File file = {};
+      bool recorded = make_file(*i, directory_stack.back(), file);
+      // Only recorded directories have something to hang children off.
+      // Saying so up front also spares the iterator a status call per file.
+      if(!recorded || !file.directory) {
+        i.disable_recursion_pending();
+      }
+      if(!recorded) {
         continue;
       }
 
-      auto depth = i.depth();
-      directory_stack.resize(depth + 1);
-      if(is_directory(stat)) {
-        auto parent = directory_stack.back();
-        auto lwt = last_write_time(i->path(), ec);
-        File file;
-        file.directory = true;
-        file.name = i->path().filename().string();
-        file.parent = parent;
-        file.modified = lwt;
+      total_size += file.size;
+      if(file.directory) {
         directory_stack.push_back(files.size());
-        files.push_back(file);
       }
-      else if(is_regular_file(stat)) {
-        auto parent = directory_stack.back();
-        auto lwt = last_write_time(i->path(), ec);
-        if(ec) {
-          continue;
+      files.push_back(std::move(file));
+    }
+    catch(...) {
+    }
+  }
+  return total_size;
+}
+
+// Parallel mode: one directory_iterator per directory, with directories
+// handed out to a pool of workers. Each worker appends to its own chunk and
+// parent links are kept as (chunk, index) references until the final merge.
+class ParallelWalker {
+ public:
+  explicit ParallelWalker(std::size_t threads)
+      : threads_(threads)
+      , chunks_(threads) {
+  }
+
+  std::size_t run(std::string const& root, std::vector<File>& files) {
+    push({root, kRootRef});
+    boost::executors::basic_thread_pool pool(threads_);
+    for(std::size_t i = 0; i < threads_; ++i) {
+      pool.submit([this, i] { process_queue(chunks_[i], i); });
+    }
+
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      done_.wait(lk, [this] { return outstanding_ == 0; });
+    }
+    queue_.close();
+    pool.close();
+    pool.join();
+    return merge(files);
+  }
+
+ private:
+  // Parent references pack the owning chunk in the top bits.
+  static constexpr int kChunkShift = 48;
+  static constexpr std::size_t kRootRef = ~std::size_t(0);
+
+  struct Chunk {
+    std::vector<File> files;
+    std::size_t total_size = 0;
+  };
+
+  struct Task {
+    fs::path path;
+    std::size_t parent;
+  };
+
+  void push(Task t) {
+    ++outstanding_;
+    queue_.push(std::move(t));
+  }
+
+  void process_queue(Chunk& chunk, std::size_t chunk_index) {
+    try {
+      while(true) {
+        Task task;
+        auto st = queue_.wait_pull(task);
+        if(st == boost::concurrent::queue_op_status::closed) {
+          return;
         }
-        auto size = file_size(i->path(), ec);
-        if(ec) {
-          continue;
+        process_directory(chunk, chunk_index, task);
+        if(--outstanding_ == 0) {
+          std::lock_guard<std::mutex> lk(mutex_);
+          done_.notify_all();
         }
-        File file;
-        file.directory = false;
-        file.name = i->path().filename().string();
-        file.parent = parent;
-        file.size = size;
-        total_size += file.size;
-        file.modified = lwt;
-        directory_stack.push_back(files.size());
-        files.push_back(file);
       }
     }
     catch(...) {
+      std::terminate();
+    }
+  }
+
+  void process_directory(
+      Chunk& chunk, std::size_t chunk_index, Task const& task) {
+    error_code ec;
+    fs::directory_iterator i(task.path, ec);
+    for(; !ec && i != fs::directory_iterator(); i.increment(ec)) {
+      File file = {};
+      if(!make_file(*i, task.parent, file)) {
+        continue;
+      }
+
+      chunk.total_size += file.size;
+      if(file.directory) {
+        std::size_t ref = (chunk_index << kChunkShift) | chunk.files.size();
+        push({i->path(), ref});
+      }
+      chunk.files.push_back(std::move(file));
+    }
+  }
+
+  std::size_t merge(std::vector<File>& files) {
+    std::vector<std::size_t> offsets(chunks_.size());
+    std::size_t total_files = files.size();
+    std::size_t total_size = 0;
+    for(std::size_t i = 0; i < chunks_.size(); ++i) {
+      offsets[i] = total_files;
+      total_files += chunks_[i].files.size();
+      total_size += chunks_[i].total_size;
+    }
+
+    auto resolve = [&offsets](std::size_t ref) -> std::size_t {
+      if(ref == kRootRef) {
+        return 0;
+      }
+      auto local = ref & ((std::size_t(1) << kChunkShift) - 1);
+      return offsets[ref >> kChunkShift] + local;
+    };
+
+    files.reserve(total_files);
+    for(auto&& c : chunks_) {
+      for(auto&& f : c.files) {
+        f.parent = resolve(f.parent);
+        files.push_back(std::move(f));
+      }
+    }
+    return total_size;
+  }
+
+  std::size_t threads_;
+  std::deque<Chunk> chunks_;
+  std::mutex mutex_;
+  std::condition_variable done_;
+  boost::concurrent::sync_queue<Task> queue_;
+  std::atomic<std::size_t> outstanding_{0};
+};
+
+int main(int argc, char** argv) {
+  boost::timer::auto_cpu_timer t;
+  std::string root = ".";
+  std::size_t threads = 1;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = std::max(1, std::atoi(argv[i] + 10));
+    }
+    else {
+      root = argv[i];
     }
   }
 
-  std::cout << "test-boost_filesystem found " << files.size()
+  std::vector<File> files;
+  File root_file = {};
+  root_file.parent = 0;
+  root_file.name = root;
+  root_file.directory = true;
+  files.push_back(root_file);
+
+  std::size_t total_size = 0;
+  if(threads > 1) {
+    total_size = ParallelWalker(threads).run(root, files);
+  }
+  else {
+    total_size = run_serial(root, files);
+  }
+
+  std::cout << kProgramName << " found " << files.size()
             << " files totalling " << total_size / 1024 << " KiB." << std::endl;
   return 0;
 }
@@ -0,0 +1,317 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "MftParser.hpp"
+#include "Snapshot.hpp"
+#include "SnapshotDiff.hpp"
+#include <algorithm>
+#include <boost/timer/timer.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <random>
+#include <set>
+#include <unordered_map>
+
+namespace {
+// Records below this are NTFS system files.
+constexpr std::uint64_t kFirstUserRecord = 16;
+constexpr std::uint64_t kNoParent = static_cast<std::uint64_t>(-1);
+
+std::vector<fsdb::MftFile> load(std::string const& path, std::size_t threads) {
+  if(fsdb::is_snapshot(path)) {
+    return fsdb::SnapshotReader(path).read_all(threads);
+  }
+  fsdb::MftParser parser;
+  parser.open(path);
+  return parser.read_all();
+}
+
+// Applies count random renames, moves, resizes, deletions and creations.
+std::vector<fsdb::MftFile> mutate(
+    std::vector<fsdb::MftFile> files, std::size_t count) {
+  std::mt19937_64 random(1);
+  std::vector<std::uint64_t> directories;
+  std::set<std::uint64_t> parents;
+  std::uint64_t next_id = 0;
+  for(auto&& f : files) {
+    if(f.directory) {
+      directories.push_back(f.id);
+    }
+    parents.insert(f.parent);
+    next_id = std::max(next_id, f.id + 1);
+  }
+  if(directories.empty() || files.empty()) {
+    return files;
+  }
+
+  std::set<std::size_t> touched;
+  std::vector<std::size_t> deleted;
+  for(std::size_t n = 0; n < count; ++n) {
+    auto i = random() % files.size();
+    auto& f = files[i];
+    if(f.id < kFirstUserRecord || !touched.insert(i).second) {
+      continue;
+    }
+    // Only leaves are moved or deleted, as a file system would.
+    bool leaf = !f.directory && !parents.count(f.id);
+    switch(random() % 5) {
+      case 0:
+        f.name += "~";
+        break;
+      case 1:
+        if(leaf) {
+          f.parent = directories[random() % directories.size()];
+        }
+        break;
+      case 2:
+        f.size += 1;
+        f.modified += 1;
+        break;
+      case 3:
+        if(leaf) {
+          deleted.push_back(i);
+        }
+        break;
+      case 4: {
+        fsdb::MftFile added;
+        added.id = next_id++;
+        added.parent = directories[random() % directories.size()];
+        added.name = "added-" + std::to_string(added.id);
+        added.size = n;
+        files.push_back(added);
+        break;
+      }
+    }
+  }
+  std::sort(deleted.rbegin(), deleted.rend());
+  for(auto i : deleted) {
+    files.erase(files.begin() + i);
+  }
+  return files;
+}
+
+using IdMap = std::unordered_map<std::uint64_t, fsdb::MftFile const*>;
+
+// The parent f hangs off, or kNoParent for a root as the diff sees it.
+std::uint64_t parent_of(fsdb::MftFile const& f, IdMap const& by_id) {
+  auto it = by_id.find(f.parent);
+  return it == by_id.end() || it->second == &f ? kNoParent : f.parent;
+}
+
+// Each file's place among its siblings of the same name, by id. The merge
+// pairs up siblings sharing a name in that order when matching by path.
+std::unordered_map<std::uint64_t, std::size_t> name_ranks(
+    std::vector<fsdb::MftFile> const& files, IdMap const& by_id) {
+  std::map<std::pair<std::uint64_t, std::string>, std::vector<std::uint64_t>>
+      siblings;
+  for(auto&& f : files) {
+    siblings[{parent_of(f, by_id), f.name}].push_back(f.id);
+  }
+  std::unordered_map<std::uint64_t, std::size_t> ranks;
+  for(auto&& s : siblings) {
+    std::sort(s.second.begin(), s.second.end());
+    for(std::size_t i = 0; i < s.second.size(); ++i) {
+      ranks[s.second[i]] = i;
+    }
+  }
+  return ranks;
+}
+
+// The names from the root down to f, each with its rank so duplicate names
+// stay apart. Names can't hold a NUL or a slash, so neither is ambiguous.
+std::string path_of(
+    fsdb::MftFile const& f, IdMap const& by_id,
+    std::unordered_map<std::uint64_t, std::size_t> const& ranks) {
+  auto component = [&](fsdb::MftFile const& p) {
+    return p.name + '\0' + std::to_string(ranks.at(p.id));
+  };
+  std::string path = component(f);
+  auto const* p = &f;
+  for(int depth = 0; depth < 1024; ++depth) {
+    auto parent = parent_of(*p, by_id);
+    if(parent == kNoParent) {
+      break;
+    }
+    p = by_id.at(parent);
+    path = component(*p) + "/" + path;
+  }
+  return path;
+}
+
+// The same diff by brute force: a hash join on id, or on full path. Empty
+// if keys aren't unique, since a join can't pair those up.
+std::map<fsdb::ChangeKind, std::uint64_t> reference_diff(
+    std::vector<fsdb::MftFile> const& before,
+    std::vector<fsdb::MftFile> const& after, fsdb::DiffMatch match) {
+  bool by_id = match == fsdb::DiffMatch::Id;
+  IdMap old_ids;
+  IdMap new_ids;
+  for(auto&& f : before) {
+    old_ids[f.id] = &f;
+  }
+  for(auto&& f : after) {
+    new_ids[f.id] = &f;
+  }
+  std::unordered_map<std::uint64_t, std::size_t> old_ranks;
+  std::unordered_map<std::uint64_t, std::size_t> new_ranks;
+  if(!by_id) {
+    old_ranks = name_ranks(before, old_ids);
+    new_ranks = name_ranks(after, new_ids);
+  }
+  auto key = [&](fsdb::MftFile const& f, IdMap const& ids,
+                 auto const& ranks) {
+    return by_id ? std::to_string(f.id) : path_of(f, ids, ranks);
+  };
+  std::unordered_map<std::string, fsdb::MftFile const*> old_keys;
+  for(auto&& f : before) {
+    if(!old_keys.emplace(key(f, old_ids, old_ranks), &f).second) {
+      return {};
+    }
+  }
+
+  // Matching by path pays no attention to ids, so nothing moves.
+  std::map<fsdb::ChangeKind, std::uint64_t> counts;
+  std::size_t matched = 0;
+  for(auto&& f : after) {
+    auto it = old_keys.find(key(f, new_ids, new_ranks));
+    auto const* old = it == old_keys.end() ? nullptr : it->second;
+    if(!old || old->directory != f.directory ||
+       (by_id && old->sequence != f.sequence)) {
+      ++counts[fsdb::ChangeKind::Added];
+      continue;
+    }
+    ++matched;
+    if(by_id && (old->parent != f.parent || old->name != f.name)) {
+      ++counts[fsdb::ChangeKind::Moved];
+    }
+    else if(
+        old->size != f.size || old->created != f.created ||
+        old->modified != f.modified) {
+      ++counts[fsdb::ChangeKind::Modified];
+    }
+  }
+  counts[fsdb::ChangeKind::Removed] = before.size() - matched;
+  return counts;
+}
+
+char const* kind_name(fsdb::ChangeKind kind) {
+  switch(kind) {
+    case fsdb::ChangeKind::Added:
+      return "+";
+    case fsdb::ChangeKind::Removed:
+      return "-";
+    case fsdb::ChangeKind::Modified:
+      return "M";
+    case fsdb::ChangeKind::Moved:
+      return "R";
+  }
+  return "?";
+}
+} // namespace
+
+// Diffs two scans, each a snapshot or an NTFS image, or one scan against a
+// randomly edited copy of itself.
+int main(int argc, char** argv) {
+  boost::timer::auto_cpu_timer t;
+  fsdb::DiffOptions options;
+  bool print = false;
+  bool check = false;
+  std::size_t mutations = 0;
+  std::vector<std::string> inputs;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--threads=", 10) == 0) {
+      options.threads = std::max(1, std::atoi(argv[i] + 10));
+    }
+    else if(std::strcmp(argv[i], "--by-path") == 0) {
+      options.match = fsdb::DiffMatch::Path;
+    }
+    else if(std::strcmp(argv[i], "--print") == 0) {
+      print = true;
+    }
+    else if(std::strcmp(argv[i], "--check") == 0) {
+      check = true;
+    }
+    else if(std::strncmp(argv[i], "--mutate=", 9) == 0) {
+      mutations = std::strtoull(argv[i] + 9, nullptr, 10);
+    }
+    else {
+      inputs.push_back(argv[i]);
+    }
+  }
+
+  if(inputs.empty() || inputs.size() > 2 ||
+     (inputs.size() == 1) == (mutations == 0)) {
+    std::cerr << "usage: test-diff [--threads=N] [--by-path] [--print] "
+                 "[--check] (<before> <after> | --mutate=N <scan>)"
+              << std::endl;
+    return 1;
+  }
+
+  auto before = load(inputs[0], options.threads);
+  auto after = inputs.size() == 2 ? load(inputs[1], options.threads)
+                                  : mutate(before, mutations);
+  std::map<fsdb::ChangeKind, std::uint64_t> expected;
+  if(check) {
+    expected = reference_diff(before, after, options.match);
+    if(expected.empty()) {
+      std::cout << "test-diff: keys aren't unique, not checking."
+                << std::endl;
+      check = false;
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto stats = fsdb::diff_snapshots(
+      std::move(before), std::move(after),
+      [&](std::vector<fsdb::FileChange> const& changes) {
+        if(!print) {
+          return;
+        }
+        for(auto&& c : changes) {
+          auto const& f =
+              c.kind == fsdb::ChangeKind::Removed ? c.before : c.after;
+          std::cout << kind_name(c.kind) << " " << f.id << " " << f.name;
+          if(c.kind == fsdb::ChangeKind::Moved) {
+            std::cout << " (was " << c.before.parent << "/" << c.before.name
+                      << ")";
+          }
+          std::cout << "\n";
+        }
+      },
+      options);
+  auto elapsed = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start);
+  std::cout << "test-diff: " << stats.added << " added, " << stats.removed
+            << " removed, " << stats.modified << " modified, " << stats.moved
+            << " moved; compared " << stats.compared << " directories, skipped "
+            << stats.skipped << " in " << elapsed.count() << "s." << std::endl;
+
+  if(check) {
+    bool same = expected[fsdb::ChangeKind::Added] == stats.added &&
+                expected[fsdb::ChangeKind::Removed] == stats.removed &&
+                expected[fsdb::ChangeKind::Modified] == stats.modified &&
+                expected[fsdb::ChangeKind::Moved] == stats.moved;
+    if(!same) {
+      std::cout << "test-diff: reference found "
+                << expected[fsdb::ChangeKind::Added] << " added, "
+                << expected[fsdb::ChangeKind::Removed] << " removed, "
+                << expected[fsdb::ChangeKind::Modified] << " modified, "
+                << expected[fsdb::ChangeKind::Moved] << " moved." << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
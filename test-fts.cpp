@@ -11,76 +11,529 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#define BOOST_THREAD_VERSION 5
+
+#include "ConcurrencyController.hpp"
+#include "ExtentMap.hpp"
+#include "IoThrottle.hpp"
+#include "ParallelMerge.hpp"
+#include "Preorder.hpp"
+
 #include <array>
+#include <boost/thread/executors/basic_thread_pool.hpp>
+#include <boost/thread/sync_queue.hpp>
 #include <boost/timer/timer.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <cstdlib>
 #include <ctime>
+#include <deque>
 #include <err.h>
 #include <fts.h>
 #include <iostream>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <string>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 #include <vector>
 
-int main() {
-  boost::timer::auto_cpu_timer t;
-  struct File {
-    std::size_t parent;
-    std::time_t created;
-    std::time_t accessed;
-    std::time_t modified;
-    std::time_t updated;
-    uint64_t size;
-    std::string name;
-    bool directory;
-  };
-  std::vector<File> files;
+struct File {
+  std::size_t parent;
+  std::time_t created;
+  std::time_t accessed;
+  std::time_t modified;
+  std::time_t updated;
+  uint64_t size;
+  std::string name;
+  bool directory;
+};
+
+struct Options {
+  std::string root = "./";
+  std::size_t threads = 1;
+  // When set, the number of active workers adapts between min_threads and
+  // max_threads, starting from threads.
+  std::size_t min_threads = 1;
+  std::size_t max_threads = 0;
+  bool stat_files = true;
+  bool plan_reads = false;
+  // Renumber the walk's output depth first once it's done.
+  bool preorder = false;
+  // Paces every fts_read in background mode.
+  fsdb::IoThrottle* throttle = nullptr;
+};
+
+int fts_options(Options const& options) {
+  // Directories are still stat'ed internally by fts to descend into them,
+  // but with NOSTAT fts_statp is never filled in, so this is only usable
+  // when no metadata is wanted at all.
+  int flags = FTS_PHYSICAL | FTS_NOCHDIR;
+  if(!options.stat_files) {
+    flags |= FTS_NOSTAT;
+  }
+  return flags;
+}
+
+File make_file(FTSENT const* p, std::size_t parent, Options const& options) {
+  File file = {};
+  file.parent = parent;
+  file.name.assign(p->fts_name, p->fts_name + p->fts_namelen);
+  file.directory = p->fts_info == FTS_D;
+  if(!options.stat_files) {
+    return file;
+  }
+  if(p->fts_info == FTS_D || p->fts_info == FTS_F) {
+    file.modified = p->fts_statp->st_mtim.tv_sec;
+  }
+  if(p->fts_info == FTS_F) {
+    file.size = p->fts_statp->st_size;
+  }
+  return file;
+}
 
-  File root_file;
+// fts_read, paced by the throttle if there is one.
+FTSENT* read_entry(FTS* ftsp, Options const& options) {
+  if(!options.throttle) {
+    return fts_read(ftsp);
+  }
+  options.throttle->before_operation();
+  auto start = std::chrono::steady_clock::now();
+  auto p = fts_read(ftsp);
+  options.throttle->completed(std::chrono::steady_clock::now() - start);
+  return p;
+}
+
+bool is_recorded(FTSENT const* p) {
+  return p->fts_info == FTS_D || p->fts_info == FTS_F ||
+         p->fts_info == FTS_NSOK;
+}
+
+std::size_t run_serial(Options const& options, std::vector<File>& files) {
+  File root_file = {};
   root_file.parent = 0;
-  root_file.name = "./";
+  root_file.name = options.root;
+  root_file.directory = true;
   files.push_back(root_file);
   std::vector<std::size_t> directory_stack;
   directory_stack.push_back(0);
   std::size_t total_size = 0;
 
-  int fts_options = FTS_PHYSICAL | FTS_NOCHDIR;
   std::array<char*, 2> roots = {root_file.name.data()};
   FTS* ftsp = nullptr;
-  if((ftsp = fts_open(roots.data(), fts_options, nullptr)) == nullptr) {
+  if((ftsp = fts_open(roots.data(), fts_options(options), nullptr)) == nullptr) {
     abort();
   }
 
   FTSENT* p = nullptr;
-  while((p = fts_read(ftsp)) != nullptr) {
-    auto depth = p->fts_level;
-    directory_stack.resize(depth + 1);
-    if(p->fts_info == FTS_D) {
-      auto parent = directory_stack.back();
-      File file;
-      file.directory = true;
-      file.name.assign(p->fts_name, p->fts_name + p->fts_namelen);
-      file.parent = parent;
-      file.modified = p->fts_statp->st_mtim.tv_sec;
-      directory_stack.push_back(files.size());
-      files.push_back(file);
-    }
-    else if(p->fts_info == FTS_F) {
-      auto parent = directory_stack.back();
-      File file;
-      file.directory = false;
-      file.name.assign(p->fts_name, p->fts_name + p->fts_namelen);
-      file.parent = parent;
-      file.size = file.modified = p->fts_statp->st_size;
-      total_size += file.size;
-      file.modified = p->fts_statp->st_mtim.tv_sec;
+  while((p = read_entry(ftsp, options)) != nullptr) {
+    // Level 0 is the root itself, which was recorded above.
+    if(p->fts_level == 0 || !is_recorded(p)) {
+      continue;
+    }
+
+    directory_stack.resize(p->fts_level);
+    File file = make_file(p, directory_stack.back(), options);
+    total_size += file.size;
+    if(file.directory) {
       directory_stack.push_back(files.size());
-      files.push_back(file);
     }
+    files.push_back(std::move(file));
   }
 
   fts_close(ftsp);
+  return total_size;
+}
+
+// Parallel mode. The top of the tree is expanded on the calling thread until
+// there are enough subtrees to keep the workers busy, then every subtree is
+// walked by its own fts stream. Each stream writes to its own chunk with
+// chunk-local parent indices, and the chunks are stitched together at the end.
+class ParallelFts {
+ public:
+  explicit ParallelFts(Options const& options)
+      : options_(options) {
+  }
+
+  std::size_t run(std::vector<File>& files) {
+    auto workers = options_.threads;
+    std::thread monitor;
+    if(options_.max_threads) {
+      fsdb::ConcurrencyOptions concurrency;
+      concurrency.min_workers = options_.min_threads;
+      concurrency.max_workers = options_.max_threads;
+      concurrency.initial_workers = options_.threads;
+      controller_.emplace(concurrency);
+      workers = options_.max_threads;
+      monitor = std::thread([this] { controller_->run(); });
+    }
+
+    Chunk& root_chunk = new_chunk(kNoParent, kNoParent);
+    File root_file = {};
+    root_file.parent = 0;
+    root_file.name = options_.root;
+    root_file.directory = true;
+    root_chunk.files.push_back(root_file);
+
+    seed(root_chunk, workers);
+
+    boost::executors::basic_thread_pool pool(workers);
+    for(std::size_t i = 0; i < workers; ++i) {
+      pool.submit([this, i] { process_queue(i); });
+    }
+
+    {
+      std::unique_lock<std::mutex> lk(mutex_);
+      done_.wait(lk, [this] { return outstanding_ == 0; });
+    }
+    queue_.close();
+    if(controller_) {
+      controller_->stop();
+    }
+    pool.close();
+    pool.join();
+    if(controller_) {
+      monitor.join();
+      controller_->report(std::cout);
+    }
+
+    return merge(files);
+  }
+
+ private:
+  static constexpr std::size_t kNoParent =
+      std::numeric_limits<std::size_t>::max();
+  // Stop expanding the top of the tree once there are this many subtrees
+  // per worker, or once we're this deep.
+  static constexpr std::size_t kSubtreesPerThread = 8;
+  static constexpr int kMaxSplitDepth = 4;
+  // Only directories this shallow in a worker's stream are worth handing to
+  // an idle worker; anything deeper is likely to be small.
+  static constexpr int kMaxDonateLevel = 2;
+  // Entries a worker reads between reports to the concurrency controller.
+  static constexpr std::size_t kReportInterval = 256;
+
+  struct Chunk {
+    std::vector<File> files;
+    // Where this chunk's root directory lives: chunk index and local index.
+    // Entries directly below the root have parent == kNoParent.
+    std::size_t parent_chunk;
+    std::size_t parent;
+    std::size_t index;
+    std::size_t total_size = 0;
+  };
+
+  struct Task {
+    std::string path;
+    std::size_t chunk;
+    std::size_t parent;
+  };
+
+  Chunk& new_chunk(std::size_t parent_chunk, std::size_t parent) {
+    std::lock_guard<std::mutex> lk(mutex_);
+    chunks_.push_back({{}, parent_chunk, parent, chunks_.size()});
+    return chunks_.back();
+  }
+
+  // Breadth first expansion of the top levels into chunk 0. Fanout at the
+  // root is often low (a handful of top level directories), so keep going
+  // down until there is enough parallelism.
+  void seed(Chunk& root_chunk, std::size_t workers) {
+    std::vector<Task> frontier = {{options_.root, 0, 0}};
+    auto target = workers * kSubtreesPerThread;
+    for(int depth = 0; depth < kMaxSplitDepth && frontier.size() < target;
+        ++depth) {
+      std::vector<Task> next;
+      for(auto&& dir : frontier) {
+        expand(root_chunk, dir, next);
+      }
+      if(next.empty()) {
+        frontier.clear();
+        break;
+      }
+      frontier = std::move(next);
+    }
+
+    for(auto&& t : frontier) {
+      push(std::move(t));
+    }
+  }
+
+  void expand(Chunk& root_chunk, Task const& dir, std::vector<Task>& next) {
+    std::string path = dir.path;
+    std::array<char*, 2> roots = {path.data()};
+    FTS* ftsp = fts_open(roots.data(), fts_options(options_), nullptr);
+    if(!ftsp) {
+      return;
+    }
+
+    FTSENT* p = nullptr;
+    while((p = read_entry(ftsp, options_)) != nullptr) {
+      if(p->fts_level != 1 || !is_recorded(p)) {
+        continue;
+      }
+
+      File file = make_file(p, dir.parent, options_);
+      root_chunk.total_size += file.size;
+      if(file.directory) {
+        fts_set(ftsp, p, FTS_SKIP);
+        next.push_back({p->fts_path, 0, root_chunk.files.size()});
+      }
+      root_chunk.files.push_back(std::move(file));
+    }
+    fts_close(ftsp);
+  }
+
+  void push(Task t) {
+    ++outstanding_;
+    queue_.push(std::move(t));
+  }
+
+  void process_queue(std::size_t worker) {
+    try {
+      while(true) {
+        // Workers beyond the active count park between tasks.
+        if(controller_ && !controller_->wait_for_slot(worker)) {
+          return;
+        }
+        Task task;
+        ++idle_;
+        auto st = queue_.wait_pull(task);
+        --idle_;
+        if(st == boost::concurrent::queue_op_status::closed) {
+          return;
+        }
+        walk(task);
+        if(--outstanding_ == 0) {
+          std::lock_guard<std::mutex> lk(mutex_);
+          done_.notify_all();
+        }
+      }
+    }
+    catch(...) {
+      std::terminate();
+    }
+  }
+
+  void walk(Task const& task) {
+    Chunk& chunk = new_chunk(task.chunk, task.parent);
+    std::string path = task.path;
+    std::array<char*, 2> roots = {path.data()};
+    FTS* ftsp = fts_open(roots.data(), fts_options(options_), nullptr);
+    if(!ftsp) {
+      return;
+    }
+
+    std::vector<std::size_t> directory_stack;
+    std::size_t operations = 0;
+    std::chrono::nanoseconds latency{0};
+    auto read = [&] {
+      if(!controller_) {
+        return read_entry(ftsp, options_);
+      }
+      auto start = std::chrono::steady_clock::now();
+      auto entry = read_entry(ftsp, options_);
+      latency += std::chrono::steady_clock::now() - start;
+      if(++operations == kReportInterval || !entry) {
+        controller_->record(operations, latency);
+        operations = 0;
+        latency = {};
+      }
+      return entry;
+    };
+
+    FTSENT* p = nullptr;
+    while((p = read()) != nullptr) {
+      if(p->fts_level == 0 || !is_recorded(p)) {
+        continue;
+      }
+
+      directory_stack.resize(p->fts_level - 1);
+      auto parent = directory_stack.empty() ? kNoParent : directory_stack.back();
+      File file = make_file(p, parent, options_);
+      chunk.total_size += file.size;
+      if(file.directory) {
+        // Rebalance: if someone is starving, give them this subtree rather
+        // than walking it ourselves.
+        if(p->fts_level <= kMaxDonateLevel && idle_ > 0 && queue_.empty()) {
+          fts_set(ftsp, p, FTS_SKIP);
+          push({p->fts_path, chunk.index, chunk.files.size()});
+        }
+        else {
+          directory_stack.push_back(chunk.files.size());
+        }
+      }
+      chunk.files.push_back(std::move(file));
+    }
+    fts_close(ftsp);
+  }
+
+  std::size_t merge(std::vector<File>& files) {
+    std::vector<std::vector<File>*> parts;
+    std::size_t total_size = 0;
+    for(auto&& c : chunks_) {
+      parts.push_back(&c.files);
+      total_size += c.total_size;
+    }
+
+    fsdb::ParallelMerge<File> merge(std::move(parts));
+    auto base = files.size();
+    merge.move_into(
+        files, options_.threads, [&](File& f, std::size_t part, std::size_t) {
+          Chunk const& c = chunks_[part];
+          if(f.parent != kNoParent) {
+            f.parent += base + merge.offset(part);
+          }
+          else if(c.parent_chunk != kNoParent) {
+            f.parent = base + merge.offset(c.parent_chunk) + c.parent;
+          }
+          else {
+            f.parent = 0;
+          }
+        });
+    return total_size;
+  }
+
+  Options const& options_;
+  std::mutex mutex_;
+  std::condition_variable done_;
+  std::deque<Chunk> chunks_;
+  boost::concurrent::sync_queue<Task> queue_;
+  std::atomic<std::size_t> outstanding_{0};
+  std::atomic<std::size_t> idle_{0};
+  std::optional<fsdb::ConcurrencyController> controller_;
+};
+
+std::string full_path(std::vector<File> const& files, std::size_t i) {
+  std::string path = files[i].name;
+  while(i != 0) {
+    i = files[i].parent;
+    path = files[i].name + "/" + path;
+  }
+  return path;
+}
+
+// Rewrites files depth first, parents as new indices, and checks that each
+// directory's range holds exactly what the parent links put below it.
+void renumber(std::vector<File>& files, std::size_t threads) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::uint32_t> parents(files.size());
+  for(std::size_t i = 0; i < files.size(); ++i) {
+    parents[i] = static_cast<std::uint32_t>(files[i].parent);
+  }
+  auto tree = fsdb::preorder(parents, threads);
+  std::vector<File> ordered(files.size());
+  for(std::size_t p = 0; p < files.size(); ++p) {
+    ordered[p] = std::move(files[tree.order[p]]);
+    ordered[p].parent = tree.parents[p] == fsdb::kNoParentRow
+                            ? 0
+                            : std::size_t(tree.parents[p]);
+  }
+  files = std::move(ordered);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  std::size_t misplaced = 0;
+  for(std::size_t p = 1; p < files.size(); ++p) {
+    auto parent = files[p].parent;
+    misplaced += parent >= p || tree.ends[p] > tree.ends[parent];
+  }
+  std::cout << "preorder: " << elapsed.count() << "s, root subtree "
+            << (files.empty() ? 0 : tree.ends[0]) << " of " << files.size()
+            << " files, " << misplaced << " misplaced." << std::endl;
+}
+
+// Maps every regular file with FIEMAP and compares reading them in walk
+// order against reading them in physical order.
+void report_read_plan(std::vector<File> const& files) {
+  boost::timer::auto_cpu_timer t("read plan: %ws wall\n");
+  std::vector<fsdb::FileExtents> extents;
+  for(std::size_t i = 1; i < files.size(); ++i) {
+    if(!files[i].directory) {
+      extents.push_back({i, fsdb::fiemap_extents(full_path(files, i).c_str())});
+    }
+  }
+
+  std::vector<std::size_t> walk_order(extents.size());
+  std::iota(walk_order.begin(), walk_order.end(), std::size_t(0));
+  auto planned = fsdb::plan_read_order(extents);
+  std::cout << "read plan over " << extents.size() << " files: seek distance "
+            << fsdb::seek_distance(extents, walk_order) / (1024 * 1024)
+            << " MiB in walk order, "
+            << fsdb::seek_distance(extents, planned) / (1024 * 1024)
+            << " MiB planned." << std::endl;
+}
+
+int main(int argc, char** argv) {
+  boost::timer::auto_cpu_timer t;
+  Options options;
+  bool background = false;
+  fsdb::ThrottleOptions throttle_options;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strcmp(argv[i], "--no-stat") == 0) {
+      options.stat_files = false;
+    }
+    else if(std::strcmp(argv[i], "--plan-reads") == 0) {
+      options.plan_reads = true;
+    }
+    else if(std::strcmp(argv[i], "--preorder") == 0) {
+      options.preorder = true;
+    }
+    else if(std::strcmp(argv[i], "--background") == 0) {
+      background = true;
+    }
+    else if(std::strncmp(argv[i], "--max-ops=", 10) == 0) {
+      throttle_options.operations_per_second = std::atof(argv[i] + 10);
+    }
+    else if(std::strncmp(argv[i], "--threads=", 10) == 0) {
+      options.threads = std::max(1, std::atoi(argv[i] + 10));
+    }
+    else if(std::strncmp(argv[i], "--min-threads=", 14) == 0) {
+      options.min_threads = std::max(1, std::atoi(argv[i] + 14));
+    }
+    else if(std::strncmp(argv[i], "--max-threads=", 14) == 0) {
+      options.max_threads = std::max(1, std::atoi(argv[i] + 14));
+    }
+    else {
+      options.root = argv[i];
+    }
+  }
+
+  // Background scans give way to other work and pace their fts_reads. The
+  // priority is inherited by the walker threads created below.
+  std::optional<fsdb::IoThrottle> throttle;
+  if(background) {
+    if(!fsdb::enter_background_priority()) {
+      std::cerr << "test-fts: couldn't lower priority." << std::endl;
+    }
+    throttle.emplace(throttle_options);
+    options.throttle = &*throttle;
+  }
+
+  std::vector<File> files;
+  std::size_t total_size = 0;
+  if(options.threads > 1 || options.max_threads) {
+    total_size = ParallelFts(options).run(files);
+  }
+  else {
+    total_size = run_serial(options, files);
+  }
 
   std::cout << "test-fts found " << files.size() << " files totalling "
             << total_size / 1024 << " KiB." << std::endl;
+  if(throttle) {
+    throttle->report(std::cout);
+  }
+  if(options.preorder) {
+    renumber(files, options.threads);
+  }
+  if(options.plan_reads) {
+    report_read_plan(files);
+  }
   return 0;
 }
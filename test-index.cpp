@@ -0,0 +1,259 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "IndexServer.hpp"
+#include "NtfsImage.hpp"
+#include <algorithm>
+#include <boost/timer/timer.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <unordered_map>
+
+namespace {
+// The record number of the volume's root directory.
+constexpr std::uint64_t kRootRecord = 5;
+
+int failures = 0;
+
+void check(bool ok, char const* what) {
+  if(!ok) {
+    std::cerr << "test-index: FAILED: " << what << std::endl;
+    ++failures;
+  }
+}
+
+bool same_file(fsdb::MftFile const& a, fsdb::MftFile const& b) {
+  return a.id == b.id && a.parent == b.parent && a.size == b.size &&
+         a.created == b.created && a.accessed == b.accessed &&
+         a.modified == b.modified && a.name == b.name &&
+         a.directory == b.directory && a.sequence == b.sequence &&
+         a.lsn == b.lsn;
+}
+
+// Checks the daemon's answers against a direct scan of the image.
+void check_answers(fsdb::IndexClient& client, std::string const& image) {
+  fsdb::MftParser parser;
+  parser.open(image);
+  auto files = parser.read_all();
+
+  std::vector<fsdb::Query> queries;
+  std::vector<fsdb::MftFile const*> expected;
+  for(std::size_t i = 0; i < files.size(); i += 97) {
+    queries.emplace_back();
+    queries.back().id = files[i].id;
+    expected.push_back(&files[i]);
+  }
+  auto results = client.query(queries);
+  for(std::size_t i = 0; i < results.size(); ++i) {
+    check(
+        results[i].status == fsdb::QueryStatus::Ok &&
+            same_file(results[i].files.at(0), *expected[i]),
+        "stat matches the scan");
+  }
+
+  fsdb::Query missing;
+  missing.id = files.back().id + 1;
+  check(
+      client.query({missing})[0].status == fsdb::QueryStatus::NotFound,
+      "stat of a missing id");
+
+  // Everything whose parent chain reaches the root, the root included.
+  std::unordered_map<std::uint64_t, fsdb::MftFile const*> by_id;
+  for(auto&& f : files) {
+    by_id[f.id] = &f;
+  }
+  auto under_root = [&](fsdb::MftFile const& f) {
+    auto const* p = &f;
+    for(int depth = 0; p && p->id != kRootRecord && depth < 1024; ++depth) {
+      auto it = by_id.find(p->parent);
+      p = it == by_id.end() || it->second == p ? nullptr : it->second;
+    }
+    return p && p->id == kRootRecord;
+  };
+  std::uint64_t bytes = 0;
+  std::uint64_t count = 0;
+  for(auto&& f : files) {
+    if(under_root(f)) {
+      bytes += f.size;
+      ++count;
+    }
+  }
+  fsdb::Query size;
+  size.op = fsdb::QueryOp::SubtreeSize;
+  size.id = kRootRecord;
+  auto total = client.query({size})[0];
+  check(
+      total.status == fsdb::QueryStatus::Ok && total.bytes == bytes &&
+          total.count == count,
+      "subtree size of the root");
+
+  fsdb::Query search;
+  search.op = fsdb::QueryOp::Search;
+  search.pattern = files[files.size() / 2].name;
+  auto found = client.query({search})[0];
+  check(
+      std::any_of(
+          found.files.begin(), found.files.end(),
+          [&](fsdb::MftFile const& f) {
+            return f.id == files[files.size() / 2].id;
+          }),
+      "search finds the name");
+  check(
+      std::all_of(
+          found.files.begin(), found.files.end(),
+          [&](fsdb::MftFile const& f) {
+            return f.name.find(search.pattern) != std::string::npos;
+          }),
+      "search only returns matches");
+  search.limit = 1;
+  search.pattern = "a";
+  check(client.query({search})[0].files.size() == 1, "search limit");
+
+  // Ranges over the middle of each column, everywhere and below the root,
+  // against a filter over every file.
+  std::vector<std::uint64_t> sizes;
+  std::vector<std::time_t> times;
+  for(auto&& f : files) {
+    sizes.push_back(f.size);
+    times.push_back(f.modified);
+  }
+  std::sort(sizes.begin(), sizes.end());
+  std::sort(times.begin(), times.end());
+  for(auto column : {fsdb::IndexedColumn::Modified, fsdb::IndexedColumn::Size}) {
+    auto modified = column == fsdb::IndexedColumn::Modified;
+    fsdb::Query range;
+    range.op = fsdb::QueryOp::Range;
+    range.column = column;
+    range.low = modified ? times[times.size() / 4] : sizes[sizes.size() / 4];
+    range.high = modified ? times[times.size() / 2] : sizes[sizes.size() / 2];
+    for(auto subtree : {fsdb::kAnySubtree, kRootRecord}) {
+      range.id = subtree;
+      std::vector<std::uint64_t> want;
+      for(auto&& f : files) {
+        bool in = modified ? f.modified >= std::time_t(range.low) &&
+                                 f.modified <= std::time_t(range.high)
+                           : f.size >= range.low && f.size <= range.high;
+        if(in && (subtree == fsdb::kAnySubtree || under_root(f))) {
+          want.push_back(f.id);
+        }
+      }
+      auto got = client.query({range})[0];
+      std::vector<std::uint64_t> ids;
+      bool ordered = true;
+      for(std::size_t i = 0; i < got.files.size(); ++i) {
+        ids.push_back(got.files[i].id);
+        if(i > 0) {
+          auto const& a = got.files[i - 1];
+          auto const& b = got.files[i];
+          ordered &= modified ? a.modified <= b.modified : a.size <= b.size;
+        }
+      }
+      std::sort(ids.begin(), ids.end());
+      std::sort(want.begin(), want.end());
+      check(
+          got.status == fsdb::QueryStatus::Ok && ids == want && !want.empty(),
+          "range matches a filter");
+      check(ordered, "range comes back in column order");
+    }
+    range.limit = 3;
+    check(client.query({range})[0].files.size() == 3, "range limit");
+  }
+}
+} // namespace
+
+// Serves a synthetic image from an in-process index daemon, checks its
+// answers against direct scans before and after a refresh and reports
+// round trip latency.
+int main(int argc, char** argv) {
+  boost::timer::auto_cpu_timer t;
+  fsdb::ImageOptions image_options;
+  image_options.records = 100000;
+  image_options.deleted_percent = 10;
+  image_options.unicode_percent = 10;
+  std::size_t batches = 10000;
+  std::size_t batch_size = 16;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--records=", 10) == 0) {
+      image_options.records = std::strtoull(argv[i] + 10, nullptr, 10);
+    }
+    else if(std::strncmp(argv[i], "--batches=", 10) == 0) {
+      batches = std::max(1, std::atoi(argv[i] + 10));
+    }
+    else if(std::strncmp(argv[i], "--batch-size=", 13) == 0) {
+      batch_size = std::max(1, std::atoi(argv[i] + 13));
+    }
+    else {
+      std::cerr << "usage: test-index [--records=N] [--batches=N] "
+                   "[--batch-size=N]"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  auto temp = std::filesystem::temp_directory_path();
+  auto image = (temp / "test-index.img").string();
+  auto socket_path = (temp / "test-index.sock").string();
+  fsdb::write_image(image_options, image);
+
+  fsdb::IndexServerOptions options;
+  options.refresh_interval = {};
+  fsdb::IndexServer server(image, options);
+  server.listen(socket_path);
+  std::thread serving([&] { server.run(); });
+
+  {
+    fsdb::IndexClient client(socket_path);
+    check_answers(client, image);
+
+    // Batches of stats on random ids, the lookup an interactive tool makes
+    // most.
+    auto const& ids = server.index()->table().ids();
+    std::mt19937_64 random(1);
+    std::vector<fsdb::Query> queries(batch_size);
+    auto start = std::chrono::steady_clock::now();
+    for(std::size_t b = 0; b < batches; ++b) {
+      for(auto&& q : queries) {
+        q.id = ids[random() % ids.size()];
+      }
+      client.query(queries);
+    }
+    auto elapsed = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now() - start);
+    std::cout << "test-index: " << batches << " batches of " << batch_size
+              << " stats, " << elapsed.count() / batches << "us per batch."
+              << std::endl;
+
+    // A different volume in the same place must show up after a refresh.
+    image_options.seed += 1;
+    fsdb::write_image(image_options, image);
+    auto changes = server.refresh();
+    check(changes.decoded > 0, "refresh decodes the changed records");
+    check_answers(client, image);
+  }
+
+  server.stop();
+  serving.join();
+  std::remove(image.c_str());
+  if(failures) {
+    std::cout << "test-index: " << failures << " checks failed." << std::endl;
+    return 1;
+  }
+  std::cout << "test-index: all checks passed." << std::endl;
+  return 0;
+}
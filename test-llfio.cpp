@@ -15,9 +15,15 @@
 #include <boost/nowide/convert.hpp>
 #include <boost/timer/timer.hpp>
 #include <chrono>
+#include <deque>
 #include <iostream>
 #include <vector>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
 namespace llfio = LLFIO_V2_NAMESPACE;
 namespace fs = llfio::filesystem;
 
@@ -38,7 +44,85 @@ using native_string = std::wstring;
 using native_string = std::string;
 #endif
 
-int main() {
+// Directory entry buffers are large and grow to fit the biggest directory
+// seen, so keep them around for the lifetime of the thread rather than
+// reallocating per directory.
+class EntryBufferPool {
+ public:
+  std::vector<llfio::directory_entry>& acquire() {
+    if(free_.empty()) {
+      buffers_.emplace_back(kInitialEntries);
+      return buffers_.back();
+    }
+
+    auto& b = *free_.back();
+    free_.pop_back();
+    return b;
+  }
+
+  void release(std::vector<llfio::directory_entry>& buffer) {
+    free_.push_back(&buffer);
+  }
+
+  static void grow(std::vector<llfio::directory_entry>& buffer) {
+    buffer.resize(buffer.size() + buffer.size() / 2);
+  }
+
+  static EntryBufferPool& this_thread() {
+    thread_local EntryBufferPool pool;
+    return pool;
+  }
+
+ private:
+  static constexpr std::size_t kInitialEntries = 64 * 1024;
+  // std::deque so handed out references survive further acquires.
+  std::deque<std::vector<llfio::directory_entry>> buffers_;
+  std::vector<std::vector<llfio::directory_entry>*> free_;
+};
+
+// directory_handle::read() only fills .metadata(), so fetch whatever is
+// missing. On POSIX this is a single fstatat() relative to the already open
+// directory instead of opening a handle per entry.
+class MetadataFetcher {
+ public:
+  bool fill(
+      llfio::directory_handle const& d,
+      llfio::directory_entry& e,
+      llfio::stat_t::want have,
+      llfio::stat_t::want want) {
+    if((have & want) == want) {
+      return true;
+    }
+#ifndef _WIN32
+    name_.assign(
+        reinterpret_cast<char const*>(e.leafname._raw_data()),
+        e.leafname.native_size());
+    struct stat s;
+    if(::fstatat(
+           d.native_handle().fd, name_.c_str(), &s, AT_SYMLINK_NOFOLLOW) ==
+       -1) {
+      return false;
+    }
+    e.stat.st_size = s.st_size;
+    e.stat.st_mtim = std::chrono::system_clock::from_time_t(s.st_mtim.tv_sec) +
+                     std::chrono::duration_cast<std::chrono::system_clock::duration>(
+                         std::chrono::nanoseconds(s.st_mtim.tv_nsec));
+    return true;
+#else
+    auto h = llfio::file_handle::file(
+        d, e.leafname, llfio::file_handle::mode::attr_read);
+    if(!h) {
+      return false;
+    }
+    return !!e.stat.fill(h.value(), want);
+#endif
+  }
+
+ private:
+  std::string name_;
+};
+
+int main(int argc, char** argv) {
   boost::timer::auto_cpu_timer t;
   struct File {
     std::size_t parent;
@@ -61,95 +145,91 @@ int main() {
 
   File root_file;
   root_file.parent = 0;
-  root_file.name = "C:/";
-  root_file.name.push_back(llfio::path_view::preferred_separator);
+#ifdef _WIN32
+  root_file.name = argc > 1 ? argv[1] : "C:";
+#else
+  root_file.name = argc > 1 ? argv[1] : ".";
+#endif
+  if(root_file.name.back() != '/' &&
+     root_file.name.back() != llfio::path_view::preferred_separator) {
+    root_file.name.push_back(llfio::path_view::preferred_separator);
+  }
   files.push_back(root_file);
 
   native_string current_path;
   current_path.assign(root_file.name.begin(), root_file.name.end());
 
-  std::vector<llfio::directory_entry> entry_buffer;
+  EntryBufferPool& pool = EntryBufferPool::this_thread();
+  MetadataFetcher fetcher;
   llfio::directory_handle::buffers_type handle_buffer;
-  // Good enough for the test.
-  entry_buffer.resize(64 * 1024);
   std::size_t current = 0;
   std::size_t total_size = 0;
-  std::size_t last_trace_size = 0;
   while(true) {
     llfio::result<llfio::directory_handle> result =
         llfio::directory({}, current_path);
-    if(result.has_value()) {
+    if(result.has_value() && !result.value().is_symlink()) {
       llfio::directory_handle d = std::move(result).value();
-      if(d.is_symlink()) {
-        continue;
-      }
+      std::vector<llfio::directory_entry>& entry_buffer = pool.acquire();
+      while(true) {
+        handle_buffer = entry_buffer;
+        llfio::result<llfio::directory_handle::buffers_type> listing =
+            d.read(std::move(handle_buffer));
+        if(!listing.has_value()) {
+          handle_buffer = {};
+          break;
+        }
 
-      handle_buffer = entry_buffer;
-      llfio::result<llfio::directory_handle::buffers_type> listing =
-          d.read(std::move(handle_buffer));
-      if(listing.has_value()) {
         handle_buffer = std::move(listing).value();
-        if(!handle_buffer.done()) {
-          entry_buffer.resize(entry_buffer.size() + entry_buffer.size() / 2);
-          continue;
+        if(handle_buffer.done()) {
+          break;
         }
 
-        for(llfio::directory_entry& e : handle_buffer) {
-          if(visit(e.leafname, [](auto sv) {
-               return sv[0] == '.' && sv.length() <= 2;
-             })) {
+        EntryBufferPool::grow(entry_buffer);
+      }
+
+      auto have = handle_buffer.metadata();
+      for(llfio::directory_entry& e : handle_buffer) {
+        if(visit(e.leafname, [](auto sv) {
+             return sv[0] == '.' && sv.length() <= 2;
+           })) {
+          continue;
+        }
+        if(e.stat.st_type == fs::file_type::directory) {
+          auto id = files.size();
+          if(!fetcher.fill(d, e, have, llfio::stat_t::want::mtim)) {
             continue;
           }
-          if(e.stat.st_type == fs::file_type::directory) {
-            auto id = files.size();
-            // directory_handle::read() only fills .metadata(), so to be
-            // portable fetch any missing
-            if(!(handle_buffer.metadata() & llfio::stat_t::want::mtim)) {
-              // Fetch missing metadata
-              auto h = llfio::file_handle::file(
-                           d, e.leafname, llfio::file_handle::mode::attr_read)
-                           .value();
-              e.stat.fill(h, llfio::stat_t::want::mtim).value();
-            }
-            File f;
-            f.parent = current;
-            f.name = convert_string(
-                e.leafname._raw_data(), e.leafname.native_size());
-            f.directory = true;
-            f.modified = std::chrono::system_clock::to_time_t(e.stat.st_mtim);
-            files.push_back(f);
-            directory_stack.push_back(
-                {id, current_path.size(),
-                 native_string(
-                     (native_string::value_type const*)e.leafname._raw_data(),
-                     e.leafname.native_size())});
-          }
-          else if(e.stat.st_type == fs::file_type::regular) {
-            // directory_handle::read() only fills .metadata(), so to be
-            // portable fetch any missing
-            if(!(handle_buffer.metadata() &
-                 (llfio::stat_t::want::mtim | llfio::stat_t::want::size))) {
-              // Fetch missing metadata
-              auto h = llfio::file_handle::file(
-                           d, e.leafname, llfio::file_handle::mode::attr_read)
-                           .value();
-              e.stat
-                  .fill(
-                      h, llfio::stat_t::want::mtim | llfio::stat_t::want::size)
-                  .value();
-            }
-            File f;
-            f.parent = current;
-            f.name = convert_string(
-                e.leafname._raw_data(), e.leafname.native_size());
-            f.size = e.stat.st_size;
-            total_size += f.size;
-            f.modified = std::chrono::system_clock::to_time_t(e.stat.st_mtim);
-            f.directory = false;
-            files.push_back(f);
+          File f;
+          f.parent = current;
+          f.name =
+              convert_string(e.leafname._raw_data(), e.leafname.native_size());
+          f.directory = true;
+          f.modified = std::chrono::system_clock::to_time_t(e.stat.st_mtim);
+          files.push_back(f);
+          directory_stack.push_back(
+              {id, current_path.size(),
+               native_string(
+                   (native_string::value_type const*)e.leafname._raw_data(),
+                   e.leafname.native_size())});
+        }
+        else if(e.stat.st_type == fs::file_type::regular) {
+          if(!fetcher.fill(
+                 d, e, have,
+                 llfio::stat_t::want::mtim | llfio::stat_t::want::size)) {
+            continue;
           }
+          File f;
+          f.parent = current;
+          f.name =
+              convert_string(e.leafname._raw_data(), e.leafname.native_size());
+          f.size = e.stat.st_size;
+          total_size += f.size;
+          f.modified = std::chrono::system_clock::to_time_t(e.stat.st_mtim);
+          f.directory = false;
+          files.push_back(f);
         }
       }
+      pool.release(entry_buffer);
     }
 
     if(directory_stack.empty()) {
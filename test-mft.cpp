@@ -11,52 +11,321 @@
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 // See the License for the specific language governing permissions and
 // limitations under the License.
+#include "FileTable.hpp"
+#include "IoThrottle.hpp"
 #include "MftParser.hpp"
+#include "Preorder.hpp"
 #include <algorithm>
 #include <boost/timer/timer.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
 
-int main() {
+namespace {
+// The record number of the volume's root directory.
+constexpr std::uint64_t kRootRecord = 5;
+
+// Every position must sit inside its parent's range, and the roots' ranges
+// must tile the whole table.
+bool valid_preorder(fsdb::Preorder const& tree) {
+  std::uint32_t covered = 0;
+  for(std::uint32_t p = 0; p < tree.ends.size(); ++p) {
+    auto parent = tree.parents[p];
+    if(tree.ends[p] <= p || tree.ends[p] > tree.ends.size()) {
+      return false;
+    }
+    if(parent == fsdb::kNoParentRow) {
+      if(p != covered) {
+        return false;
+      }
+      covered = tree.ends[p];
+    }
+    else if(parent >= p || tree.ends[p] > tree.ends[parent]) {
+      return false;
+    }
+  }
+  return covered == tree.ends.size();
+}
+
+// Whether a listing holds the same files as the children, or with subtree
+// everything below, that a full scan finds under directory.
+bool listing_matches_scan(
+    fsdb::MftParser const& parser, std::uint64_t directory, bool subtree,
+    std::vector<fsdb::MftFile> const& listed) {
+  std::unordered_map<std::uint64_t, std::vector<std::uint64_t>> children;
+  for(auto&& f : parser.read_all()) {
+    if(f.parent != f.id) {
+      children[f.parent].push_back(f.id);
+    }
+  }
+  std::vector<std::uint64_t> expected;
+  std::vector<std::uint64_t> pending = {directory};
+  while(!pending.empty()) {
+    auto d = pending.back();
+    pending.pop_back();
+    for(auto id : children[d]) {
+      expected.push_back(id);
+      if(subtree) {
+        pending.push_back(id);
+      }
+    }
+  }
+
+  // A directory's index lists the directory itself only as the root's ".".
+  std::vector<std::uint64_t> found;
+  for(auto&& f : listed) {
+    if(f.id != directory) {
+      found.push_back(f.id);
+    }
+  }
+  std::sort(expected.begin(), expected.end());
+  std::sort(found.begin(), found.end());
+  return expected == found;
+}
+} // namespace
+
+int main(int argc, char** argv) {
   boost::timer::auto_cpu_timer t;
+#ifdef _WIN32
+  std::string volume = "\\\\?\\c:";
+#else
+  std::string volume;
+#endif
+  std::size_t threads = 0;
+  fsdb::MftReadOptions options;
+  auto mode = fsdb::BlockSourceMode::Direct;
+  std::vector<std::uint64_t> resolve;
+  std::vector<std::uint64_t> extents;
+  bool incremental = false;
+  std::optional<std::uint64_t> list;
+  bool subtree = false;
+  bool check = false;
+  bool background = false;
+  bool depth_first = false;
+  fsdb::ThrottleOptions throttle_options;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = std::max(1, std::atoi(argv[i] + 10));
+    }
+    else if(std::strncmp(argv[i], "--read-clusters=", 16) == 0) {
+      options.clusters_per_read = std::max(1, std::atoi(argv[i] + 16));
+    }
+    else if(std::strncmp(argv[i], "--queue-depth=", 14) == 0) {
+      options.queue_depth = std::max(1, std::atoi(argv[i] + 14));
+    }
+    else if(std::strncmp(argv[i], "--resolve=", 10) == 0) {
+      resolve.push_back(std::strtoull(argv[i] + 10, nullptr, 10));
+    }
+    else if(std::strncmp(argv[i], "--extents=", 10) == 0) {
+      extents.push_back(std::strtoull(argv[i] + 10, nullptr, 10));
+    }
+    else if(std::strncmp(argv[i], "--list=", 7) == 0) {
+      list = std::strtoull(argv[i] + 7, nullptr, 10);
+    }
+    else if(std::strncmp(argv[i], "--subtree=", 10) == 0) {
+      list = std::strtoull(argv[i] + 10, nullptr, 10);
+      subtree = true;
+    }
+    else if(std::strcmp(argv[i], "--check") == 0) {
+      check = true;
+    }
+    else if(std::strcmp(argv[i], "--incremental") == 0) {
+      incremental = true;
+    }
+    else if(std::strcmp(argv[i], "--mmap") == 0) {
+      mode = fsdb::BlockSourceMode::Mapped;
+    }
+    else if(std::strcmp(argv[i], "--preorder") == 0) {
+      depth_first = true;
+    }
+    else if(std::strcmp(argv[i], "--background") == 0) {
+      background = true;
+    }
+    else if(std::strncmp(argv[i], "--max-ops=", 10) == 0) {
+      throttle_options.operations_per_second = std::atof(argv[i] + 10);
+    }
+    else if(std::strncmp(argv[i], "--max-read-rate=", 16) == 0) {
+      throttle_options.bytes_per_second = std::atof(argv[i] + 16);
+    }
+    else {
+      volume = argv[i];
+    }
+  }
+
+  if(volume.empty()) {
+    std::cerr << "usage: test-mft [--threads=N] [--read-clusters=N] "
+                 "[--queue-depth=N] [--mmap] [--resolve=ID]... [--incremental] "
+                 "[--list=ID | --subtree=ID] [--check] [--extents=ID]... "
+                 "[--preorder] [--background] [--max-ops=N] "
+                 "[--max-read-rate=BYTES] "
+                 "<ntfs image or device>"
+              << std::endl;
+    return 1;
+  }
+
+  // Background scans pace every read and give way to other I/O.
+  std::optional<fsdb::IoThrottle> throttle;
   fsdb::MftParser parser;
-  parser.open(L"\\\\?\\c:");
-  int count = 1;
-  fsdb::MftReader reader(parser);
-  std::vector<fsdb::MftFile> files;
-  std::vector<fsdb::MftFile> temp_files;
-  temp_files.reserve(10 * 1024);
-  while(reader.read(temp_files) == fsdb::OpStatus::NotFinished) {
+  if(background) {
+    if(!fsdb::enter_background_priority()) {
+      std::cerr << "test-mft: couldn't lower priority." << std::endl;
+    }
+    throttle.emplace(throttle_options);
+    parser.open(std::make_unique<fsdb::ThrottledBlockSource>(
+        fsdb::open_block_source(volume, mode), *throttle));
+  }
+  else {
+    parser.open(volume, mode);
+  }
+  if(!resolve.empty()) {
+    // Walk each record's parents up to the root, one lookup per level.
+    for(auto&& f : parser.read_records(resolve)) {
+      std::string path = f.name;
+      auto parent = f.parent;
+      for(int depth = 0; parent != kRootRecord && depth < 256; ++depth) {
+        auto p = parser.read_record(parent);
+        if(!p) {
+          path = "<orphan>/" + path;
+          break;
+        }
+        path = p->name + "/" + path;
+        parent = p->parent;
+      }
+      std::cout << f.id << ": /" << path << std::endl;
+    }
+    return 0;
+  }
+
+  if(!extents.empty()) {
+    // Print each file's extents in the order they'd best be read.
+    auto files = parser.read_extents(extents);
+    for(auto i : fsdb::plan_read_order(files)) {
+      std::cout << files[i].id << ":";
+      for(auto&& e : files[i].extents) {
+        std::cout << " " << e.logical << "@" << e.physical << "+" << e.length;
+      }
+      std::cout << "\n";
+    }
+    std::cout << "seek distance " << fsdb::seek_distance(
+                                         files, fsdb::plan_read_order(files))
+              << " bytes." << std::endl;
+    return 0;
+  }
+
+  if(list) {
+    // Only the directories' own index blocks are read.
+    std::vector<fsdb::MftFile> files;
+    try {
+      files =
+          subtree ? parser.list_subtree(*list) : parser.list_directory(*list);
+    }
+    catch(std::exception const& e) {
+      std::cerr << "test-mft: couldn't list " << *list << ": " << e.what()
+                << std::endl;
+      return 1;
+    }
+    for(auto&& f : files) {
+      std::cout << f.id << (f.directory ? " d " : " - ") << f.name << "\n";
+    }
+    std::cout << "test-mft listed " << files.size() << " files." << std::endl;
+    if(check && !listing_matches_scan(parser, *list, subtree, files)) {
+      std::cerr << "test-mft: listing differs from a full scan." << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if(incremental) {
+    // Index once, then time a refresh against that index.
+    auto index = parser.read_all();
+    boost::timer::auto_cpu_timer refresh_timer("refresh: %ws wall\n");
+    auto changes = fsdb::MftReader(parser, options).read_changes(index);
+    std::cout << "test-mft refreshed " << changes.files.size()
+              << " files, decoded " << changes.decoded << ": "
+              << changes.added.size() << " added, " << changes.modified.size()
+              << " modified, " << changes.recreated.size() << " recreated, "
+              << changes.deleted.size() << " deleted." << std::endl;
+    return 0;
+  }
+
+  int count = 0;
+  fsdb::FileTable files;
+  files.reserve(parser.count());
+  auto append = [&](fsdb::MftFileSpan batch) {
     ++count;
-    std::copy(temp_files.begin(), temp_files.end(), std::back_inserter(files));
-    temp_files.clear();
+    for(auto&& f : batch) {
+      files.append(f);
+    }
+  };
+  if(threads) {
+    parser.read_all_parallel(append, threads);
+  }
+  else {
+    fsdb::MftReader(parser, options).read(append, 10 * 1024);
   }
 
-  //auto files = parser.read_all();
   parser.close();
 
-  auto total_count = files.size();
+  if(depth_first) {
+    // Renumber the table depth first, after which a subtree is a slice.
+    auto start = std::chrono::steady_clock::now();
+    auto tree = fsdb::preorder(files, threads);
+    files = fsdb::reorder(files, tree.order);
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    if(!valid_preorder(tree)) {
+      std::cerr << "test-mft: preorder ranges are inconsistent." << std::endl;
+      return 1;
+    }
+    auto const& ids = files.ids();
+    std::size_t root = std::find(ids.begin(), ids.end(), kRootRecord) -
+                       ids.begin();
+    std::size_t end = root < ids.size() ? tree.ends[root] : root;
+    std::uint64_t bytes = 0;
+    for(auto p = root; p < end; ++p) {
+      bytes += files.sizes()[p];
+    }
+    std::cout << "preorder: " << elapsed.count() << "s, root subtree "
+              << end - root << " files, " << bytes / 1024 << " KiB."
+              << std::endl;
+  }
 
-  auto total_size = std::accumulate(
-      files.begin(), files.end(), std::size_t(0), [](std::size_t v, auto&& f) {
-        if(f.name == "$BadClus") {
-          return v;
-        }
+  auto total_count = files.size();
 
-        return v + f.size;
-      });
+  std::size_t total_size = 0;
+  for(std::size_t i = 0; i < files.size(); ++i) {
+    if(files.name(i) != "$BadClus") {
+      total_size += files.sizes()[i];
+    }
+  }
 
   std::cout << "test-mft found " << total_count << " files totalling "
             << total_size / 1024 << " KiB."
-            << " in " << count << " reads." << std::endl;
+            << " in " << count << " batches." << std::endl;
+  if(!threads) {
+    std::cout << "read size " << options.clusters_per_read
+              << " clusters, queue depth " << options.queue_depth << std::endl;
+  }
+  if(throttle) {
+    throttle->report(std::cout);
+  }
 
+  std::vector<std::size_t> order(files.size());
+  std::iota(order.begin(), order.end(), std::size_t(0));
+  auto top = order.begin() + std::min<std::size_t>(24, order.size());
   std::partial_sort(
-      files.begin(), files.begin() + 24, files.begin() + files.size(),
-      [](auto&& a, auto&& b) { return a.size > b.size; });
+      order.begin(), top, order.end(), [&](std::size_t a, std::size_t b) {
+        return files.sizes()[a] > files.sizes()[b];
+      });
 
-  std::transform(
-      files.begin(), files.begin() + 24,
-      std::ostream_iterator<std::string>(std::cout, "\n"),
-      [](auto&& f) { return f.name + ", " + std::to_string(f.size); });
+  std::for_each(order.begin(), top, [&](std::size_t i) {
+    std::cout << files.name(i) << ", " << files.sizes()[i] << "\n";
+  });
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,189 @@
+// Copyright (c) 2020 Google Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+#include "FileTable.hpp"
+#include "MftParser.hpp"
+#include "Snapshot.hpp"
+#include <algorithm>
+#include <boost/timer/timer.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <random>
+
+namespace {
+// The record number of the volume's root directory.
+constexpr std::uint64_t kRootRecord = 5;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+} // namespace
+
+// Scans a volume, writes its table as a compressed snapshot, reads it back
+// and reports the size and decode speed.
+int main(int argc, char** argv) {
+  boost::timer::auto_cpu_timer t;
+  fsdb::SnapshotOptions options;
+  std::size_t threads = 0;
+  bool indexes = false;
+  std::string save;
+  std::string volume;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--threads=", 10) == 0) {
+      threads = std::max(1, std::atoi(argv[i] + 10));
+      options.threads = threads;
+    }
+    else if(std::strncmp(argv[i], "--block-rows=", 13) == 0) {
+      options.block_rows = std::max(1, std::atoi(argv[i] + 13));
+    }
+    else if(std::strcmp(argv[i], "--indexes") == 0) {
+      indexes = true;
+    }
+    else if(std::strncmp(argv[i], "--save=", 7) == 0) {
+      save = argv[i] + 7;
+    }
+    else {
+      volume = argv[i];
+    }
+  }
+
+  if(volume.empty()) {
+    std::cerr << "usage: test-snapshot [--threads=N] [--block-rows=N] "
+                 "[--indexes] [--save=PATH] <ntfs image or device>"
+              << std::endl;
+    return 1;
+  }
+
+  fsdb::MftParser parser;
+  parser.open(volume);
+  fsdb::FileTable table;
+  table.reserve(parser.count());
+  fsdb::MftReader(parser).read(table);
+  parser.close();
+
+  // Sorted indexes to store alongside the rows.
+  std::vector<fsdb::SortedIndex> sorted_indexes;
+  if(indexes) {
+    auto start = std::chrono::steady_clock::now();
+    sorted_indexes.emplace_back(fsdb::IndexedColumn::Modified, table);
+    sorted_indexes.emplace_back(fsdb::IndexedColumn::Size, table);
+    for(auto&& index : sorted_indexes) {
+      options.indexes.push_back(&index);
+    }
+    std::cout << "test-snapshot: built indexes in " << seconds_since(start)
+              << "s." << std::endl;
+  }
+
+  // What the table holds in memory, columns and names.
+  auto raw = table.size() * (8 * 8 + sizeof(std::uint16_t) + 1) +
+             table.names().size();
+  auto path = save.empty() ? (std::filesystem::temp_directory_path() /
+                              "test-snapshot.snap")
+                                 .string()
+                           : save;
+  auto start = std::chrono::steady_clock::now();
+  fsdb::write_snapshot(table, path, options);
+  auto encode = seconds_since(start);
+  auto compressed = std::filesystem::file_size(path);
+  std::cout << "test-snapshot: " << table.size() << " files, " << raw
+            << " bytes raw, " << compressed << " bytes compressed ("
+            << double(raw) / compressed << "x), encoded in " << encode << "s."
+            << std::endl;
+
+  fsdb::SnapshotReader snapshot(path);
+  start = std::chrono::steady_clock::now();
+  auto files = snapshot.read_all(threads);
+  std::cout << "test-snapshot: decoded " << snapshot.block_count()
+            << " blocks in " << seconds_since(start) << "s." << std::endl;
+
+  // Everything must come back, in parent then name order.
+  int failures = 0;
+  auto sorted = std::is_sorted(
+      files.begin(), files.end(),
+      [](fsdb::MftFile const& a, fsdb::MftFile const& b) {
+        return a.parent != b.parent ? a.parent < b.parent : a.name < b.name;
+      });
+  if(!sorted) {
+    std::cerr << "test-snapshot: rows out of order." << std::endl;
+    ++failures;
+  }
+  std::sort(
+      files.begin(), files.end(),
+      [](fsdb::MftFile const& a, fsdb::MftFile const& b) {
+        return a.id < b.id;
+      });
+  bool same = files.size() == table.size();
+  for(std::size_t i = 0; same && i < files.size(); ++i) {
+    auto const& f = files[i];
+    same = f.id == table.ids()[i] && f.parent == table.parents()[i] &&
+           f.size == table.sizes()[i] && f.created == table.created()[i] &&
+           f.accessed == table.accessed()[i] &&
+           f.modified == table.modified()[i] && f.lsn == table.lsns()[i] &&
+           f.sequence == table.sequences()[i] &&
+           f.directory == (table.directories()[i] != 0) &&
+           f.name == table.name(i);
+  }
+  if(!same) {
+    std::cerr << "test-snapshot: decoded rows don't match the scan."
+              << std::endl;
+    ++failures;
+  }
+
+  // Stored indexes must come back entry for entry.
+  for(auto&& index : sorted_indexes) {
+    start = std::chrono::steady_clock::now();
+    auto stored = snapshot.read_index(index.column(), threads);
+    auto elapsed = seconds_since(start);
+    auto flatten = [](fsdb::SortedIndex const& index) {
+      std::vector<std::pair<std::uint64_t, std::uint64_t>> entries;
+      for(auto&& block : index.blocks()) {
+        for(auto&& e : block) {
+          entries.emplace_back(e.key, e.id);
+        }
+      }
+      return entries;
+    };
+    if(flatten(stored) != flatten(index)) {
+      std::cerr << "test-snapshot: stored index doesn't match." << std::endl;
+      ++failures;
+    }
+    std::cout << "test-snapshot: read " << stored.size() << " entry index in "
+              << elapsed << "s." << std::endl;
+  }
+
+  // Single rows and single directories, without decoding the rest.
+  if(snapshot.rows()) {
+    std::mt19937_64 random(1);
+    std::size_t lookups = 100000;
+    start = std::chrono::steady_clock::now();
+    std::size_t bytes = 0;
+    for(std::size_t i = 0; i < lookups; ++i) {
+      bytes += snapshot.row(random() % snapshot.rows()).name.size();
+    }
+    std::cout << "test-snapshot: " << seconds_since(start) * 1e6 / lookups
+              << "us per random row." << std::endl;
+    auto root = snapshot.children(kRootRecord);
+    std::cout << "test-snapshot: root has " << root.size() << " children."
+              << std::endl;
+  }
+
+  if(save.empty()) {
+    std::remove(path.c_str());
+  }
+  return failures ? 1 : 0;
+}
@@ -17,6 +17,9 @@
 
 #include <windows.h>
 
+#include "ConcurrencyController.hpp"
+#include "ParallelMerge.hpp"
+
 #include <boost/nowide/convert.hpp>
 #include <boost/timer/timer.hpp>
 
@@ -25,10 +28,14 @@
 #include <boost/thread/sync_queue.hpp>
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <mutex>
-#include <numeric>
+#include <optional>
+#include <thread>
 #include <vector>
 
 struct File {
@@ -60,28 +67,40 @@ class Win32DirectoryCollector {
     std::vector<ChildDirectory> children;
   };
 
+  // Directory ids 0 and 1 are the placeholder and the root.
+  static constexpr uint64_t kRootId = 1;
+
   struct SharedData {
-    std::atomic<uint64_t> file_id{0};
-    std::atomic<uint64_t> directory_id{1};
+    fsdb::IdBlockAllocator file_ids{0};
+    fsdb::IdBlockAllocator directory_ids{kRootId + 1};
     std::atomic<uint64_t> outstanding{0};
     std::condition_variable done;
     boost::concurrent::sync_queue<Directory> work_queue;
+    // Set when the number of active workers adapts to the device.
+    fsdb::ConcurrencyController* controller = nullptr;
   };
 
   explicit Win32DirectoryCollector(SharedData& shared)
-      : shared_(&shared) {
+      : shared_(&shared)
+      , file_ids_(shared.file_ids)
+      , directory_ids_(shared.directory_ids) {
   }
 
   void process_directory(std::wstring path) {
-    process_directory(std::move(path), shared_->directory_id++);
+    process_directory(std::move(path), kRootId);
     std::mutex m;
     std::unique_lock<std::mutex> lk(m);
     shared_->done.wait(lk, [this] { return shared_->outstanding == 0; });
   }
 
-  void process_queue() {
+  void process_queue(std::size_t worker) {
     try {
       while(true) {
+        // Workers beyond the active count park between directories.
+        if(shared_->controller &&
+           !shared_->controller->wait_for_slot(worker)) {
+          return;
+        }
         Directory dir;
         try {
           boost::concurrent::queue_op_status st =
@@ -102,14 +121,18 @@ class Win32DirectoryCollector {
     }
   };
 
-  std::vector<File> const& files() const {
+  std::vector<File>& files() {
     return files_;
   }
 
-  std::vector<File> const& directories() const {
+  std::vector<File>& directories() {
     return directories_;
   }
 
+  fsdb::IdBlock const& directory_ids() const {
+    return directory_ids_;
+  }
+
  private:
   void process_directories(
       std::wstring path, std::vector<ChildDirectory> children) {
@@ -124,6 +147,8 @@ class Win32DirectoryCollector {
   }
 
   void process_directory(std::wstring path, uint64_t parent_id) {
+    auto start = std::chrono::steady_clock::now();
+    std::size_t entries = 0;
     WIN32_FIND_DATAW wfd;
     path += L"*";
     HANDLE find_handle = FindFirstFileExW(
@@ -141,7 +166,7 @@ class Win32DirectoryCollector {
         if(wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
           File f;
           f.parent = parent_id;
-          f.id = shared_->directory_id++;
+          f.id = directory_ids_.next();
           f.name = boost::nowide::narrow(wfd.cFileName);
           f.size = (static_cast<std::uint64_t>(wfd.nFileSizeHigh) << 32) |
                    wfd.nFileSizeLow;
@@ -152,7 +177,7 @@ class Win32DirectoryCollector {
         else {
           File f;
           f.parent = parent_id;
-          f.id = shared_->file_id++;
+          f.id = file_ids_.next();
           f.name = boost::nowide::narrow(wfd.cFileName);
           f.size = (static_cast<std::uint64_t>(wfd.nFileSizeHigh) << 32) |
                    wfd.nFileSizeLow;
@@ -161,6 +186,7 @@ class Win32DirectoryCollector {
         }
       }
 
+      ++entries;
       if(!FindNextFileW(find_handle, &wfd)) {
         break;
       }
@@ -177,19 +203,42 @@ class Win32DirectoryCollector {
       }
     }
 
+    if(shared_->controller) {
+      shared_->controller->record(
+          entries, std::chrono::steady_clock::now() - start);
+    }
+
     path.pop_back();
     shared_->outstanding++;
     shared_->work_queue.push({std::move(path), std::move(children)});
   }
 
   SharedData* shared_;
+  fsdb::IdBlock file_ids_;
+  fsdb::IdBlock directory_ids_;
   std::vector<File> files_;
   std::vector<File> directories_;
   std::wstring current_path_;
 };
 
-int main() {
+int main(int argc, char** argv) {
   boost::timer::auto_cpu_timer t;
+  std::size_t workers = boost::thread::hardware_concurrency();
+  // When set, the number of active workers adapts between min_threads and
+  // max_threads.
+  std::size_t min_threads = 1;
+  std::size_t max_threads = 0;
+  for(int i = 1; i < argc; ++i) {
+    if(std::strncmp(argv[i], "--threads=", 10) == 0) {
+      workers = std::max(1, std::atoi(argv[i] + 10));
+    }
+    else if(std::strncmp(argv[i], "--min-threads=", 14) == 0) {
+      min_threads = std::max(1, std::atoi(argv[i] + 14));
+    }
+    else if(std::strncmp(argv[i], "--max-threads=", 14) == 0) {
+      max_threads = std::max(1, std::atoi(argv[i] + 14));
+    }
+  }
 
   // std::vector<DirectoryNode> directory_stack;
   // boost::sync_queue<std::wstring> work;
@@ -204,51 +253,84 @@ int main() {
   directories.push_back(root_file);
 
   Win32DirectoryCollector::SharedData shared;
+  std::optional<fsdb::ConcurrencyController> controller;
+  std::thread monitor;
+  if(max_threads) {
+    fsdb::ConcurrencyOptions concurrency;
+    concurrency.min_workers = min_threads;
+    concurrency.max_workers = max_threads;
+    concurrency.initial_workers = workers;
+    controller.emplace(concurrency);
+    shared.controller = &*controller;
+    workers = max_threads;
+    monitor = std::thread([&controller] { controller->run(); });
+  }
+
   Win32DirectoryCollector thread_collector(shared);
   std::vector<Win32DirectoryCollector> collector_refs(
-      boost::thread::hardware_concurrency(), Win32DirectoryCollector(shared));
-  boost::executors::basic_thread_pool pool;
-  boost::barrier wait(boost::thread::hardware_concurrency() + 1);
-  for(std::size_t i = 0; i < boost::thread::hardware_concurrency(); ++i) {
+      workers, Win32DirectoryCollector(shared));
+  boost::executors::basic_thread_pool pool(workers);
+  boost::barrier wait(workers + 1);
+  for(std::size_t i = 0; i < workers; ++i) {
     pool.submit([&collector_refs, i, &wait] {
       wait.wait();
-      collector_refs[i].process_queue();
+      collector_refs[i].process_queue(i);
     });
   }
 
   wait.wait();
   thread_collector.process_directory(L"\\\\?\\C:\\");
   shared.work_queue.close();
+  if(controller) {
+    controller->stop();
+  }
   pool.close();
   pool.join();
+  if(controller) {
+    monitor.join();
+    controller->report(std::cout);
+  }
 
-  directories.insert(directories.end(), thread_collector.directories().begin(), thread_collector.directories().end());
-  std::vector<File> files = thread_collector.files();
-  auto total_files = std::accumulate(
-      collector_refs.begin(), collector_refs.end(), files.size(),
-      [](std::size_t val, Win32DirectoryCollector const& tc) {
-        return tc.files().size() + val;
-      });
+  // Ids were handed out in blocks, so they have gaps. Merge every
+  // collector's results into contiguous tables and renumber as we go.
+  std::vector<Win32DirectoryCollector*> collectors = {&thread_collector};
+  for(auto&& tc : collector_refs) {
+    collectors.push_back(&tc);
+  }
 
-  auto total_directories = std::accumulate(
-      collector_refs.begin(), collector_refs.end(), directories.size(),
-      [](std::size_t val, Win32DirectoryCollector const& tc) {
-        return tc.directories().size() + val;
-      });
+  std::vector<std::vector<File>*> file_parts;
+  std::vector<std::vector<File>*> directory_parts;
+  for(auto&& tc : collectors) {
+    file_parts.push_back(&tc->files());
+    directory_parts.push_back(&tc->directories());
+  }
+  fsdb::ParallelMerge<File> file_merge(std::move(file_parts));
+  fsdb::ParallelMerge<File> directory_merge(std::move(directory_parts));
+
+  // Files are never referred to by id, so only directory ids need a map.
+  fsdb::IdRemap directory_index(shared.directory_ids);
+  for(std::size_t i = 0; i < collectors.size(); ++i) {
+    directory_index.add(
+        collectors[i]->directory_ids(),
+        directories.size() + directory_merge.offset(i));
+  }
 
-  files.resize(total_files);
-  directories.resize(total_directories);
+  auto threads = boost::thread::hardware_concurrency();
+  std::vector<File> files;
+  file_merge.move_into(
+      files, threads, [&](File& f, std::size_t, std::size_t index) {
+        f.id = index;
+        f.parent = directory_index(f.parent);
+      });
+  directory_merge.move_into(
+      directories, threads, [&](File& d, std::size_t, std::size_t index) {
+        d.id = index;
+        d.parent = directory_index(d.parent);
+      });
 
   std::size_t total_size = 0;
-  for(auto&& tc : collector_refs) {
-    for(auto&& f : tc.files()) {
-      total_size += f.size;
-      files[f.id] = std::move(f);
-    }
-
-    for(auto&& d : tc.directories()) {
-      directories[d.id] = std::move(d);
-    }
+  for(auto&& f : files) {
+    total_size += f.size;
   }
 
   std::cout << "test-win32-threaded found " << files.size()